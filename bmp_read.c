@@ -27,15 +27,17 @@
 
 static bool bmp_match_cookie(const uint8_t* buf, int nbytes);
 static im_read* bmp_read_create(im_in *in, ImErr *err);
-static im_img* iread_bmp_image(im_in* in, kvstore *kv, ImErr* err);
+static bool bmp_get_img(im_read* rdr);
+static void bmp_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride);
+static void bmp_read_finish(im_read* rdr);
 
 i_read_handler i_bmp_read_handler = {
     IM_FILETYPE_BMP,
     bmp_match_cookie,
     bmp_read_create,
-    i_generic_read_img,
-    i_generic_read_rows,
-    i_generic_read_finish
+    bmp_get_img,
+    bmp_read_rows,
+    bmp_read_finish
 };
 
 static bool bmp_match_cookie(const uint8_t* buf, int nbytes)
@@ -44,11 +46,6 @@ static bool bmp_match_cookie(const uint8_t* buf, int nbytes)
     return buf[0] == 'B' && buf[1] == 'M';
 }
 
-static im_read* bmp_read_create(im_in *in, ImErr *err)
-{
-    return i_new_generic_reader(iread_bmp_image, &i_bmp_read_handler, in ,err);
-}
-
 typedef struct bmp_state {
     uint8_t fileheader[BMP_FILE_HEADER_SIZE];
 
@@ -66,75 +63,214 @@ typedef struct bmp_state {
     size_t imagesize;   // size of image data (for compressed fmts only)
     int ncolours;
     uint32_t mask[4];   // r,g,b,a
+    // For 16 and 32bit images: how far to shift each masked-out channel
+    // down, and a table to scale the result up to 0..255.
+    uint32_t shift[4];
+    uint8_t scale[4][256];
 
     // buffer to stash src palette data
     uint8_t rawcolours[256*4];
 
-    // a buffer to load/decode a single line of the image
+    // Buffer to load uncompressed image data into, many rows at a time.
+    // Bottom-up images are read a chunk at a time from the end of the
+    // file backward, so rows always come out top-down.
     size_t srclinesize;    // including padding
     uint8_t* linebuf;
+    unsigned int chunk_rows;    // number of rows linebuf can hold
+    unsigned int rows_buffered; // rows left in linebuf
+    unsigned int rows_unread;   // rows not yet read from the file
+    uint8_t* nextrow;           // next row in linebuf
 } bmp_state;
 
+// Uncompressed image data is read in chunks of roughly this size.
+#define BMP_CHUNK_SIZE (64*1024)
+
+typedef struct bmp_reader {
+    im_read base;
+
+    bmp_state bmp;
+    // Decodes one row of uncompressed data.
+    void (*decode_row)(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+    // RLE images are decoded in full up front.
+    im_img* img;
+} bmp_reader;
+
 
 static bool read_file_header(bmp_state *bmp, im_in* in, ImErr* err);
 static bool read_bitmap_header(bmp_state *bmp, im_in* in, ImErr* err);
 static bool read_colour_table(bmp_state* bmp, im_in* in, ImErr* err);
-static im_img* read_image(bmp_state* bmp, im_in* in, ImErr* err);
-static bool cook_colour_table(bmp_state* bmp, im_img* img, ImErr* err);
-static bool read_img_16_BI_BITFIELDS( bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
-static bool read_img_24_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
-static bool read_img_32_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
-static bool read_img_32_BI_BITFIELDS( bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
-static bool read_img_packed_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
-static bool read_img_8_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
-static bool read_img_BI_RLE8( bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
-static bool read_img_BI_RLE4( bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
-
-static im_img* iread_bmp_image(im_in* in, kvstore *kv, ImErr* err)
-{
-    bmp_state bmp = {0};
-    im_img* img = NULL;
+static void cook_colour_table(bmp_state* bmp, im_read* rdr);
+static bool pick_decoder(bmp_reader* br);
+static uint8_t* next_src_row(bmp_state* bmp, im_in* in, ImErr* err);
+static void decode_row_copy(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+static void decode_row_packed(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+static void decode_row_565(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+static void decode_row_555(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+static void decode_row_8888(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+static void decode_row_x888(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+static void decode_row_16_BI_BITFIELDS(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+static void decode_row_32_BI_BITFIELDS(bmp_state* bmp, uint8_t* src, uint8_t* dest);
+static bool read_img_rle(bmp_state* bmp, im_in* in, im_img* img, ImErr* err);
+
 
-    if (!read_file_header(&bmp, in, err)) {
-        goto cleanup;
+static im_read* bmp_read_create(im_in *in, ImErr *err)
+{
+    bmp_reader* br = imalloc(sizeof(bmp_reader));
+    if (!br) {
+        *err = IM_ERR_NOMEM;
+        return NULL;
     }
+    i_read_init(&br->base);
+    br->base.handler = &i_bmp_read_handler;
+    br->base.in = in;
+
+    memset(&br->bmp, 0, sizeof(bmp_state));
+    br->decode_row = NULL;
+    br->img = NULL;
+    return (im_read*)br;
+}
+
 
-    if (!read_bitmap_header(&bmp, in, err)) {
-        goto cleanup;
+static bool bmp_get_img(im_read* rdr)
+{
+    bmp_reader* br = (bmp_reader*)rdr;
+    bmp_state* bmp = &br->bmp;
+    im_imginfo* info = &rdr->curr;
+
+    if (rdr->frame_num > 0) {
+        return false;   // BMPs only have the one image.
     }
 
+    if (!read_file_header(bmp, rdr->in, &rdr->err)) {
+        return false;
+    }
+    if (!read_bitmap_header(bmp, rdr->in, &rdr->err)) {
+        return false;
+    }
+    if (bmp->w <= 0) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
     // TODO: V3 has bit masks in colour table for bitcount>=16
-    if (!read_colour_table(&bmp, in, err)) {
-        goto cleanup;
+    if (!read_colour_table(bmp, rdr->in, &rdr->err)) {
+        return false;
+    }
+
+    info->w = bmp->w;
+    info->h = bmp->h;
+    info->x_offset = 0;
+    info->y_offset = 0;
+    if (bmp->bitcount < 16) {
+        info->fmt = IM_FMT_INDEX8;
+    } else if (bmp->bitcount == 24) {
+        info->fmt = IM_FMT_BGR;   // as stored in the file - no swizzling needed
+    } else if (bmp->mask[3]) {
+        info->fmt = IM_FMT_RGBA;
+    } else {
+        info->fmt = IM_FMT_RGB;
+    }
+    if (!i_read_check_size(rdr, (unsigned int)bmp->w, (unsigned int)bmp->h, im_fmt_bytesperpixel(info->fmt))) {
+        return false;
+    }
+    if (bmp->srclinesize > 0) {
+        bmp->linebuf = imalloc(bmp->srclinesize * bmp->chunk_rows);
+        if (!bmp->linebuf) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+    }
+
+    if (bmp->ncolours > 0) {
+        // Room for all 256 entries, as biClrUsed can be smaller than the
+        // range of the pixel values (extras are opaque black).
+        rdr->pal_data = irealloc(rdr->pal_data, 256 * 4);
+        if (!rdr->pal_data) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        cook_colour_table(bmp, rdr);
+    }
+    info->pal_num_colours = bmp->ncolours;
+
+    if (!pick_decoder(br)) {
+        return false;
     }
 
     // seek to image data
-    if (im_in_seek(in, bmp.image_offset, IM_SEEK_SET) != 0) {
-        *err = im_in_eof(in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
-        goto cleanup;
+    if (im_in_seek(rdr->in, bmp->image_offset, IM_SEEK_SET) != 0) {
+        rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+        return false;
     }
 
-    img = read_image(&bmp, in, err);
-    if (img == NULL) {
-        goto cleanup;
+    if (!br->decode_row) {
+        // RLE. Decode the whole thing now.
+        br->img = im_img_new(bmp->w, bmp->h, 1, IM_FMT_INDEX8);
+        if (!br->img) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        if (!read_img_rle(bmp, rdr->in, br->img, &rdr->err)) {
+            return false;
+        }
     }
+    return true;
+}
+
 
-cleanup:
-    if (bmp.linebuf) {
-        ifree(bmp.linebuf);
+static void bmp_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride)
+{
+    bmp_reader* br = (bmp_reader*)rdr;
+    bmp_state* bmp = &br->bmp;
+    uint8_t* dest = buf;
+    unsigned int i;
+
+    if (br->img) {
+        size_t bytes_per_row = im_fmt_bytesperpixel(br->img->format) * br->img->w;
+        for (i = 0; i < num_rows; ++i) {
+            memcpy(dest, im_img_row(br->img, rdr->rows_read + i), bytes_per_row);
+            dest += stride;
+        }
+        return;
+    }
+
+    // If the rows are laid out in the file exactly as the caller wants
+    // them, read them straight in.
+    if (br->decode_row == decode_row_copy && bmp->topdown &&
+        bmp->rows_buffered == 0 && stride == (int)bmp->srclinesize &&
+        bmp->srclinesize == (size_t)bmp->w * (bmp->bitcount / 8)) {
+        size_t nbytes = bmp->srclinesize * num_rows;
+        if (im_in_read(rdr->in, dest, nbytes) != nbytes) {
+            rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+            return;
+        }
+        bmp->rows_unread -= num_rows;
+        return;
+    }
+
+    for (i = 0; i < num_rows; ++i) {
+        uint8_t* src = next_src_row(bmp, rdr->in, &rdr->err);
+        if (!src) {
+            return;
+        }
+        br->decode_row(bmp, src, dest);
+        dest += stride;
+    }
+}
+
+
+static void bmp_read_finish(im_read* rdr)
+{
+    bmp_reader* br = (bmp_reader*)rdr;
+    if (br->bmp.linebuf) {
+        ifree(br->bmp.linebuf);
+        br->bmp.linebuf = NULL;
+    }
+    if (br->img) {
+        im_img_free(br->img);
+        br->img = NULL;
     }
-    return img;
 }
 
-/*
-typedef struct tagBITMAPFILEHEADER {
-  WORD  bfType;
-  DWORD bfSize;
-  WORD  bfReserved1;
-  WORD  bfReserved2;
-  DWORD bfOffBits;
-} BITMAPFILEHEADER, *PBITMAPFILEHEADER;
-*/
 
 static bool read_file_header(bmp_state *bmp, im_in* in, ImErr* err) {
     uint8_t buf[BMP_FILE_HEADER_SIZE];
@@ -248,15 +384,48 @@ static bool read_bitmap_header(bmp_state *bmp, im_in* in, ImErr* err)
             gmask = decode_u32le(&p);
             bmask = decode_u32le(&p);
             amask = decode_u32le(&p);
+        } else if (headersize >= DIB_BITMAPV2INFOHEADER_SIZE) {
+            rmask = decode_u32le(&p);
+            gmask = decode_u32le(&p);
+            bmask = decode_u32le(&p);
+        } else if (compression == BI_BITFIELDS) {
+            // Plain BITMAPINFOHEADER - the masks follow the header.
+            uint8_t maskbuf[12];
+            if(im_in_read(in, maskbuf, sizeof(maskbuf)) != sizeof(maskbuf)) {
+                *err = im_in_eof(in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+                return false;
+            }
+            p = maskbuf;
+            rmask = decode_u32le(&p);
+            gmask = decode_u32le(&p);
+            bmask = decode_u32le(&p);
         }
     }
 
+    // Uncompressed 16 and 32bit images use fixed masks (X555 and X888).
+    if (compression == BI_RGB && bitcount == 16) {
+        rmask = 0x7c00;
+        gmask = 0x03e0;
+        bmask = 0x001f;
+        amask = 0;
+    } else if (compression == BI_RGB && bitcount == 32) {
+        rmask = 0x00ff0000;
+        gmask = 0x0000ff00;
+        bmask = 0x000000ff;
+        amask = 0;
+    }
+
+    // A zero-size colour table means a full one.
+    if (ncolours == 0 && bitcount <= 8) {
+        ncolours = 1 << bitcount;
+    }
+
     // sanity checks
     if (planes != 1) {
         *err = IM_ERR_MALFORMED;
         return false;
     }
-    if (ncolours > 256) {
+    if (ncolours < 0 || ncolours > 256) {
         *err = IM_ERR_MALFORMED;
         return false;
     }
@@ -294,17 +463,26 @@ static bool read_bitmap_header(bmp_state *bmp, im_in* in, ImErr* err)
     bmp->mask[3] = amask;
 
 
+    bmp->linebuf = NULL;
     if (compression == BI_RGB || compression == BI_BITFIELDS) {
-        // alloc buf for reading (enough for a whole line)
-        bmp->srclinesize = ((bmp->w*bitcount)+7)/8;
+        // Work out the buffer for reading (enough for a chunk of lines).
+        // It's allocated once the size has passed the reader limits.
+        bmp->srclinesize = (((size_t)bmp->w*bitcount)+7)/8;
         bmp->srclinesize = ((bmp->srclinesize+3) / 4)*4;    // pad to 32bit
-        bmp->linebuf = imalloc(bmp->srclinesize);
-        if (!bmp->linebuf) {
-            *err = IM_ERR_NOMEM;
+        if (bmp->srclinesize == 0) {
+            *err = IM_ERR_MALFORMED;
             return false;
         }
+        bmp->chunk_rows = BMP_CHUNK_SIZE / bmp->srclinesize;
+        if (bmp->chunk_rows < 1) {
+            bmp->chunk_rows = 1;
+        }
+        if (bmp->h > 0 && bmp->chunk_rows > (unsigned int)bmp->h) {
+            bmp->chunk_rows = bmp->h;
+        }
+        bmp->rows_unread = bmp->h;
+        bmp->rows_buffered = 0;
     } else {
-        bmp->linebuf = NULL;
         bmp->srclinesize = 0;
     }
 
@@ -338,88 +516,10 @@ static bool read_colour_table(bmp_state* bmp, im_in* in, ImErr* err)
 }
 
 
-static im_img* read_image(bmp_state* bmp, im_in* in, ImErr* err)
-{
-    im_img* img=NULL;
-    ImFmt fmt;
-
-    if (bmp->bitcount<16) {
-        fmt = IM_FMT_INDEX8;
-    } else {
-        if ( bmp->mask[3] ) {
-            fmt = IM_FMT_RGBA;
-        } else {
-            fmt = IM_FMT_RGB;
-        }
-    }
-
-    img = im_img_new(bmp->w, bmp->h, 1, fmt);
-    if (!img) {
-        *err = IM_ERR_NOMEM;
-        goto bailout;
-    }
-
-    // parse the palette, if any
-    if (bmp->ncolours > 0) {
-        if (!cook_colour_table(bmp,img,err)) {
-            goto bailout;
-        }
-    }
-
-
-    if (bmp->bitcount==4 && bmp->compression==BI_RLE4 ) {
-        if (!read_img_BI_RLE4(bmp,in,img,err)) {
-            goto bailout;
-        }
-    } else if (bmp->bitcount<8 && bmp->compression==BI_RGB) {
-        if (!read_img_packed_BI_RGB(bmp,in,img,err)) {
-            goto bailout;
-        }
-    } else if (bmp->bitcount==8 && bmp->compression==BI_RGB) {
-        if (!read_img_8_BI_RGB(bmp,in,img,err)) {
-            goto bailout;
-        }
-    } else if (bmp->bitcount==8 && bmp->compression==BI_RLE8 ) {
-        if (!read_img_BI_RLE8(bmp,in,img,err)) {
-            goto bailout;
-        }
-    } else if (bmp->bitcount==16) {
-        if (!read_img_16_BI_BITFIELDS(bmp,in,img,err)) {
-            goto bailout;
-        }
-    } else if (bmp->bitcount==24) {
-        if (!read_img_24_BI_RGB(bmp,in,img,err)) {
-            goto bailout;
-        }
-    } else if (bmp->bitcount==32) {
-        if (bmp->compression==BI_RGB) {
-            if (!read_img_32_BI_RGB(bmp,in,img,err)) {
-                goto bailout;
-            }
-        } else if (bmp->compression==BI_BITFIELDS) {
-            if (!read_img_32_BI_BITFIELDS(bmp,in,img,err)) {
-                goto bailout;
-            }
-        } else {
-            *err = IM_ERR_UNSUPPORTED;
-            goto bailout;
-        }
-    } else {
-        *err = IM_ERR_UNSUPPORTED;
-        goto bailout;
-    }
-    return img;
-bailout:
-    if (img) {
-        im_img_free(img);
-    }
-    return NULL;
-}
 
-// load the colours from the bmp into an im_img palette
-static bool cook_colour_table(bmp_state* bmp, im_img* img, ImErr* err)
+// Convert the colours from the bmp into the reader's RGBA palette.
+static void cook_colour_table(bmp_state* bmp, im_read* rdr)
 {
-    uint8_t buf[256*4];
     const uint8_t* src;
     uint8_t* dest;
     size_t colsize;
@@ -432,43 +532,20 @@ static bool cook_colour_table(bmp_state* bmp, im_img* img, ImErr* err)
     }
 
     src = bmp->rawcolours;
-    dest = buf;
-    for (i=0; i<bmp->ncolours; ++i) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += colsize;
-    }
-    if (!im_img_pal_set(img, IM_FMT_RGB, bmp->ncolours, buf)) {
-        *err = IM_ERR_NOMEM;
-        return false;
-    }
-
-    return true;
-}
-
-
-// could be handled by read_img_packed_BI_RGB(), but a  special case seems reasonable
-// (this'll be quicker because it doesn't have to faff about with bitmasking)
-static bool read_img_8_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
-{
-    uint8_t* src;
-    uint8_t* dest;
-    int x,y;
-
-    assert(bmp->linebuf);
-    for (y=0; y<bmp->h; ++y) {
-        if (im_in_read(in,bmp->linebuf, bmp->srclinesize) != bmp->srclinesize) {
-            *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-            return false;
-        }
-        dest = im_img_row(img, bmp->topdown ? y : (bmp->h-1)-y);
-        src = bmp->linebuf;
-        for( x=0; x<bmp->w; ++x) {
-            *dest++ = *src++;
+    dest = rdr->pal_data;
+    for (i=0; i<256; ++i) {
+        if (i < bmp->ncolours) {
+            *dest++ = src[2];
+            *dest++ = src[1];
+            *dest++ = src[0];
+            src += colsize;
+        } else {
+            *dest++ = 0;
+            *dest++ = 0;
+            *dest++ = 0;
         }
+        *dest++ = 255;
     }
-    return true;
 }
 
 
@@ -477,7 +554,7 @@ static int calc_shift(uint32_t mask)
 {
     int i;
     for (i=0; i<32; ++i) {
-        if (mask & (1<<i)) {
+        if (mask & (1u<<i)) {
             return i;
         }
     }
@@ -485,149 +562,256 @@ static int calc_shift(uint32_t mask)
 }
 
 
-
-// handle 16bit, BI_BITFIELDS
-static bool read_img_16_BI_BITFIELDS( bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
+// Set up the shifts and scaling tables for a 16 or 32bit image.
+// Channels wider than 8 bits just have their low bits shifted away.
+static void setup_bitfields(bmp_state* bmp)
 {
-    uint8_t* src;
-    uint8_t* dest;
-    int x,y;
     int i;
-    uint32_t shift[4];
-    uint32_t div[4];
-
-    assert(bmp->linebuf);
-    // calc shift and divisor
     for (i=0; i<4; ++i) {
-        shift[i] = calc_shift(bmp->mask[i]);
-        div[i] = bmp->mask[i] >> shift[i];
+        uint32_t shift = calc_shift(bmp->mask[i]);
+        uint32_t v = bmp->mask[i] >> shift;
+        uint32_t bits = 0;
+        uint32_t max;
+        while (v) {
+            ++bits;
+            v >>= 1;
+        }
+        if (bits > 8) {
+            shift += bits - 8;
+            bits = 8;
+        }
+        bmp->shift[i] = shift;
+        max = (1u << bits) - 1;
+        memset(bmp->scale[i], 0, 256);
+        for (v=0; v<=max && max>0; ++v) {
+            bmp->scale[i][v] = (uint8_t)((v*255 + max/2) / max);
+        }
     }
+}
 
-    for (y=0; y<bmp->h; ++y) {
-        if (im_in_read(in,bmp->linebuf,bmp->srclinesize) != bmp->srclinesize) {
-            *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-            return false;
+
+// Choose the row decoder for the image (NULL for RLE).
+static bool pick_decoder(bmp_reader* br)
+{
+    bmp_state* bmp = &br->bmp;
+
+    br->decode_row = NULL;
+    if (bmp->compression == BI_RLE8 && bmp->bitcount == 8) {
+        return true;
+    }
+    if (bmp->compression == BI_RLE4 && bmp->bitcount == 4) {
+        return true;
+    }
+    if (bmp->compression == BI_RGB) {
+        switch (bmp->bitcount) {
+            case 1:
+            case 2:
+            case 4:
+                br->decode_row = decode_row_packed;
+                return true;
+            case 8:
+            case 24:
+                // Same layout as our INDEX8 and BGR.
+                br->decode_row = decode_row_copy;
+                return true;
+            default:
+                break;
         }
-        dest = im_img_row(img, bmp->topdown ? y : (bmp->h-1)-y);
-        src=bmp->linebuf;
-
-        if (bmp->mask[3]) {
-            // RGBA
-            for( x=0; x<bmp->w; ++x) {
-                uint32_t packed = (uint32_t)decode_u16le(&src);
-                for( i=0; i<4; ++i) {
-                    uint32_t v = (packed & bmp->mask[i]) >> shift[i];
-                    v = (255*v) / div[i];   // scale to 0..255
-                    *dest++ = (uint8_t)v;
-                }
+    }
+    if ((bmp->compression == BI_RGB || bmp->compression == BI_BITFIELDS) &&
+        (bmp->bitcount == 16 || bmp->bitcount == 32)) {
+        const uint32_t* m = bmp->mask;
+        setup_bitfields(bmp);
+        // Specialised versions for the common layouts.
+        if (bmp->bitcount == 16) {
+            if (m[0] == 0xf800 && m[1] == 0x07e0 && m[2] == 0x001f && m[3] == 0) {
+                br->decode_row = decode_row_565;
+            } else if (m[0] == 0x7c00 && m[1] == 0x03e0 && m[2] == 0x001f && m[3] == 0) {
+                br->decode_row = decode_row_555;
+            } else {
+                br->decode_row = decode_row_16_BI_BITFIELDS;
             }
         } else {
-            // RGB - no alpha
-            for( x=0; x<bmp->w; ++x) {
-                uint32_t packed = (uint32_t)decode_u16le(&src);
-                for( i=0; i<3; ++i) {
-                    uint32_t v = (packed & bmp->mask[i]) >> shift[i];
-                    v = (255*v) / div[i];   // scale to 0..255
-                    *dest++ = (uint8_t)v;
+            if (m[0] == 0x00ff0000 && m[1] == 0x0000ff00 && m[2] == 0x000000ff) {
+                if (m[3] == 0xff000000) {
+                    br->decode_row = decode_row_8888;
+                } else if (m[3] == 0) {
+                    br->decode_row = decode_row_x888;
+                } else {
+                    br->decode_row = decode_row_32_BI_BITFIELDS;
                 }
+            } else {
+                br->decode_row = decode_row_32_BI_BITFIELDS;
             }
         }
+        return true;
     }
 
-    return true;
+    br->base.err = IM_ERR_UNSUPPORTED;
+    return false;
 }
 
 
-
-
-// BI_RGB only - no fancy bitfield shenanigans needed
-static bool read_img_24_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
+// Fetch the next row of uncompressed image data (in top-down order),
+// reading in another chunk of rows if needed.
+static uint8_t* next_src_row(bmp_state* bmp, im_in* in, ImErr* err)
 {
-    uint8_t* src;
-    uint8_t* dest;
-    int x,y;
+    uint8_t* row;
 
-    for (y=0; y<bmp->h; ++y) {
-        if (im_in_read(in,bmp->linebuf,bmp->srclinesize) != bmp->srclinesize) {
+    assert(bmp->linebuf);
+    if (bmp->rows_buffered == 0) {
+        unsigned int n = bmp->chunk_rows;
+        size_t nbytes;
+        if (n > bmp->rows_unread) {
+            n = bmp->rows_unread;
+        }
+        if (n == 0) {
+            *err = IM_ERR_TOO_MANY_ROWS;
+            return NULL;
+        }
+        nbytes = bmp->srclinesize * n;
+        if (!bmp->topdown) {
+            // Bottom-up. The next rows we want are the ones just before
+            // the ones we've already read.
+            int64_t pos = (int64_t)bmp->image_offset + (int64_t)bmp->srclinesize * (bmp->rows_unread - n);
+            if (im_in_seek(in, pos, IM_SEEK_SET) != 0) {
+                *err = IM_ERR_FILE;
+                return NULL;
+            }
+        }
+        if (im_in_read(in, bmp->linebuf, nbytes) != nbytes) {
             *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-            return false;
+            return NULL;
         }
-        dest = im_img_row(img, bmp->topdown ? y : (bmp->h-1)-y);
-        src=bmp->linebuf;
-
-        // bgrbgrbgr...
-        for( x=0; x<bmp->w; ++x) {
-            *dest++ = src[2];
-            *dest++ = src[1];
-            *dest++ = src[0];
-            src += 3;
+        bmp->rows_unread -= n;
+        bmp->rows_buffered = n;
+        if (bmp->topdown) {
+            bmp->nextrow = bmp->linebuf;
+        } else {
+            bmp->nextrow = bmp->linebuf + bmp->srclinesize * (n-1);
         }
     }
-    return true;
+    row = bmp->nextrow;
+    if (bmp->topdown) {
+        bmp->nextrow += bmp->srclinesize;
+    } else {
+        bmp->nextrow -= bmp->srclinesize;
+    }
+    --bmp->rows_buffered;
+    return row;
 }
 
-static bool read_img_32_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
+
+// 8bit indexed and 24bit BGR are stored just as we want them.
+static void decode_row_copy(bmp_state* bmp, uint8_t* src, uint8_t* dest)
 {
-    // TODO
-    *err = IM_ERR_UNSUPPORTED;
-    return false;
+    memcpy(dest, src, (size_t)bmp->w * (bmp->bitcount / 8));
 }
 
-static bool read_img_32_BI_BITFIELDS( bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
+
+// 16bit, 5-6-5
+static void decode_row_565(bmp_state* bmp, uint8_t* src, uint8_t* dest)
 {
-    uint8_t* src;
-    uint8_t* dest;
-    int x,y;
-    int i;
-    uint32_t shift[4];
-    uint32_t div[4];
+    const uint8_t* r = bmp->scale[0];
+    const uint8_t* g = bmp->scale[1];
+    const uint8_t* b = bmp->scale[2];
+    int x;
+    for (x=0; x<bmp->w; ++x) {
+        unsigned int packed = src[0] | (src[1] << 8);
+        dest[0] = r[packed >> 11];
+        dest[1] = g[(packed >> 5) & 0x3f];
+        dest[2] = b[packed & 0x1f];
+        src += 2;
+        dest += 3;
+    }
+}
 
-    // calc shift and divisor
-    for (i=0; i<4; ++i) {
-        shift[i] = calc_shift(bmp->mask[i]);
-        div[i] = bmp->mask[i] >> shift[i];
+
+// 16bit, X-5-5-5
+static void decode_row_555(bmp_state* bmp, uint8_t* src, uint8_t* dest)
+{
+    const uint8_t* r = bmp->scale[0];
+    const uint8_t* g = bmp->scale[1];
+    const uint8_t* b = bmp->scale[2];
+    int x;
+    for (x=0; x<bmp->w; ++x) {
+        unsigned int packed = src[0] | (src[1] << 8);
+        dest[0] = r[(packed >> 10) & 0x1f];
+        dest[1] = g[(packed >> 5) & 0x1f];
+        dest[2] = b[packed & 0x1f];
+        src += 2;
+        dest += 3;
+    }
+}
+
+
+// 32bit, BGRA in memory
+static void decode_row_8888(bmp_state* bmp, uint8_t* src, uint8_t* dest)
+{
+    int x;
+    for (x=0; x<bmp->w; ++x) {
+        dest[0] = src[2];
+        dest[1] = src[1];
+        dest[2] = src[0];
+        dest[3] = src[3];
+        src += 4;
+        dest += 4;
     }
+}
 
-    //
-    for (y=0; y<bmp->h; ++y) {
-        if (im_in_read(in,bmp->linebuf,bmp->srclinesize) != bmp->srclinesize) {
-            *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-            return false;
+
+// 32bit, BGRX in memory
+static void decode_row_x888(bmp_state* bmp, uint8_t* src, uint8_t* dest)
+{
+    int x;
+    for (x=0; x<bmp->w; ++x) {
+        dest[0] = src[2];
+        dest[1] = src[1];
+        dest[2] = src[0];
+        src += 4;
+        dest += 3;
+    }
+}
+
+
+// handle 16bit, any other BI_BITFIELDS layout
+static void decode_row_16_BI_BITFIELDS(bmp_state* bmp, uint8_t* src, uint8_t* dest)
+{
+    int nchans = bmp->mask[3] ? 4 : 3;
+    int x;
+    int i;
+
+    for( x=0; x<bmp->w; ++x) {
+        uint32_t packed = (uint32_t)decode_u16le(&src);
+        for( i=0; i<nchans; ++i) {
+            uint32_t v = ((packed & bmp->mask[i]) >> bmp->shift[i]) & 0xff;
+            *dest++ = bmp->scale[i][v];
         }
-        dest = im_img_row(img, bmp->topdown ? y : (bmp->h-1)-y);
-        src = bmp->linebuf;
-
-        if (bmp->mask[3]) {
-            // RGBA
-            for( x=0; x<bmp->w; ++x) {
-                uint32_t packed = decode_u32le(&src);
-                for( i=0; i<4; ++i) {
-                    uint32_t v = (packed & bmp->mask[i]) >> shift[i];
-                    v = (255*v) / div[i];   // scale to 0..255
-                    *dest++ = (uint8_t)v;
-                }
-            }
-        } else {
-            // RGB - no alpha
-            for( x=0; x<bmp->w; ++x) {
-                uint32_t packed = decode_u32le(&src);
-                for( i=0; i<3; ++i) {
-                    uint32_t v = (packed & bmp->mask[i]) >> shift[i];
-                    v = (255*v) / div[i];   // scale to 0..255
-                    *dest++ = (uint8_t)v;
-                }
-            }
+    }
+}
+
+
+// handle 32bit, any other BI_BITFIELDS layout
+static void decode_row_32_BI_BITFIELDS(bmp_state* bmp, uint8_t* src, uint8_t* dest)
+{
+    int nchans = bmp->mask[3] ? 4 : 3;
+    int x;
+    int i;
+
+    for( x=0; x<bmp->w; ++x) {
+        uint32_t packed = decode_u32le(&src);
+        for( i=0; i<nchans; ++i) {
+            uint32_t v = ((packed & bmp->mask[i]) >> bmp->shift[i]) & 0xff;
+            *dest++ = bmp->scale[i][v];
         }
     }
-    return true;
 }
 
+
 // handle BI_RGB 1,2,4 bit-packed images
-static bool read_img_packed_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
+static void decode_row_packed(bmp_state* bmp, uint8_t* src, uint8_t* dest)
 {
-    uint8_t* src;
-    uint8_t* dest;
-    int x,y;
+    int x;
     uint8_t mask;
     int shift;
     int pixelsperbyte = 8/bmp->bitcount;
@@ -635,254 +819,213 @@ static bool read_img_packed_BI_RGB( bmp_state* bmp, im_in* in, im_img* img, ImEr
     switch( bmp->bitcount) {
         case 1: mask = 0x01; shift = 1; break;
         case 2: mask = 0x03; shift=2; break;
-        case 4: mask=0x0f; shift=4; break;
-        default:
-            *err = IM_ERR_MALFORMED;
-            return false;
+        default: mask=0x0f; shift=4; break;
     }
-    assert(bmp->linebuf);
-    for (y=0; y<bmp->h; ++y) {
-        if (im_in_read(in,bmp->linebuf,bmp->srclinesize) != bmp->srclinesize) {
-            *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-            return false;
-        }
-        dest = im_img_row(img, bmp->topdown ? y : (bmp->h-1)-y);
-        src = bmp->linebuf;
-        x=0;
-        while( x<bmp->w ) {
-            uint8_t packed = *src++;
-            int i;
-            for (i=pixelsperbyte-1; i>=0 && x<bmp->w; --i) {
-                *dest++ = packed>>(i*shift) & mask;
-                ++x;
-            }
+    x=0;
+    while( x<bmp->w ) {
+        uint8_t packed = *src++;
+        int i;
+        for (i=pixelsperbyte-1; i>=0 && x<bmp->w; --i) {
+            *dest++ = packed>>(i*shift) & mask;
+            ++x;
         }
     }
-    return true;
 }
 
 
 
 
-static bool read_img_BI_RLE8( bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
-{
+// Compressed data is read through a small window rather than all at once.
+typedef struct rle_window {
+    im_in* in;
     uint8_t* buf;
-    uint8_t* src;
-    uint8_t* dest;
-    uint8_t* end;
-    int x,y;
-    assert(bmp->imagesize);
-    *err = IM_ERR_NONE;
-
-    buf = imalloc(bmp->imagesize);
-    if (!buf) {
-        *err = IM_ERR_NOMEM;
-        return false;
+    uint8_t* p;         // next unconsumed byte
+    uint8_t* end;       // end of valid data in buf
+    size_t remaining;   // bytes still to be read from the file
+} rle_window;
+
+// Make sure at least n bytes are available at win->p.
+// Returns false if the data runs out (or on read error).
+static bool rle_need(rle_window* win, size_t n, ImErr* err)
+{
+    size_t have = win->end - win->p;
+    size_t want;
+    size_t got;
+    if (have >= n) {
+        return true;
     }
-
-    if (im_in_read(in,buf,bmp->imagesize) != bmp->imagesize) {
-        ifree(buf);
-        *err = im_in_eof(in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+    memmove(win->buf, win->p, have);
+    win->p = win->buf;
+    win->end = win->buf + have;
+    want = BMP_CHUNK_SIZE - have;
+    if (want > win->remaining) {
+        want = win->remaining;
+    }
+    got = im_in_read(win->in, win->end, want);
+    if (got < want && !im_in_eof(win->in)) {
+        *err = IM_ERR_FILE;
         return false;
     }
-
-    // cheesy hackery - clear the image first. Any skipped deltas or
-    // premature EOLs will thus be left as colour 0.
-    for (y=0; y<bmp->h; ++y) {
-        memset(im_img_row(img,y), 0, bmp->w);
+    win->end += got;
+    win->remaining -= want;     // if we hit EOF, there's no more anyway
+    if ((size_t)(win->end - win->p) < n) {
+        *err = IM_ERR_MALFORMED;
+        return false;
     }
+    return true;
+}
 
 
-    // now start decoding...
-    src = buf;
-    end = src + bmp->imagesize;
-    x=0;
-    y=0;
-    dest = im_img_pos(img, x, bmp->topdown ? y : (bmp->h-1)-y);
-    while(src < end) {
-        uint8_t n;
-        if (src+2 > end) {
-            goto borked;
-        }
-
-        n = *src++;
-        if (n==0) {
-            n = *src++;
-            if (n>2) {
-                int pad = n&1;
-                // copy next n bytes
-                if (src+n+pad > end) {
-                    goto borked;
-                }
-                if(x+n>bmp->w) {
-                    goto borked;
-                }
-                x+=n;
-                while( n>0) {
-                    *dest++ = *src++;
-                    --n;
-                }
-                // odd counts have a pad byte
-                src += pad;
-            } else {
-                switch (n) {
-                    case 0: // end of line
-                        x=0;
-                        ++y;
-                        break;
-                    case 1: // end of bitmap
-                        // TODO: ensure all src data is consumed?
-                        goto success;
-                    case 2: // delta
-                        x+=(int)(*src++);
-                        y+=(int)(*src++);
-                        break;
-                }
-                // update dest ptr
-                if(x>=bmp->w || y>=bmp->h) {
-                    goto borked;
-                }
-                dest = im_img_pos(img, x, bmp->topdown ? y : (bmp->h-1)-y);
-            }
-        } else {
-            uint8_t v = *src++;
-            // emit v n times
-            if (x+n>bmp->w) {
-                goto borked;
-            }
-            x+=n;
-            while (n>0) {
-                *dest++ = v;
-                --n;
-            }
-        }
+// Zero-fill the pixels skipped over when the decode position jumps from
+// (x,y) to (nx,ny) (via a delta, an early end-of-line or end-of-bitmap).
+// y/ny are in file order, and ny may be bmp->h (ie off the end).
+static void rle_skip(bmp_state* bmp, im_img* img, int x, int y, int nx, int ny)
+{
+    while (y < ny) {
+        uint8_t* row = im_img_row(img, bmp->topdown ? y : (bmp->h - 1) - y);
+        memset(row + x, 0, bmp->w - x);
+        x = 0;
+        ++y;
+    }
+    if (y < bmp->h && nx > x) {
+        uint8_t* row = im_img_row(img, bmp->topdown ? y : (bmp->h - 1) - y);
+        memset(row + x, 0, nx - x);
     }
-
-success:
-    ifree(buf);
-    return true;
-
-borked:
-    ifree(buf);
-    *err = IM_ERR_MALFORMED;
-    return false;
 }
 
 
-static bool read_img_BI_RLE4( bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
+// Decode a BI_RLE8 or BI_RLE4 image into img (INDEX8).
+static bool read_img_rle(bmp_state* bmp, im_in* in, im_img* img, ImErr* err)
 {
-    uint8_t* buf;
-    uint8_t* src;
+    bool rle4 = (bmp->compression == BI_RLE4);
+    rle_window win;
     uint8_t* dest;
-    uint8_t* end;
-    int x,y;
-    assert(bmp->imagesize);
-    *err = IM_ERR_NONE;
+    int x, y;
 
-    buf = imalloc(bmp->imagesize);
-    if (!buf) {
+    *err = IM_ERR_NONE;
+    win.in = in;
+    win.buf = imalloc(BMP_CHUNK_SIZE);
+    if (!win.buf) {
         *err = IM_ERR_NOMEM;
         return false;
     }
-
-    if (im_in_read(in,buf,bmp->imagesize) != bmp->imagesize) {
-        ifree(buf);
-        *err = im_in_eof(in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
-        return false;
-    }
-
-
-    // cheesy hackery - clear the image first. Any skipped deltas or
-    // premature EOLs will thus be left as colour 0.
-    for (y=0; y<bmp->h; ++y) {
-        memset(im_img_row(img,y), 0, bmp->w);
-    }
-
-
-    // now start decoding...
-    src = buf;
-    end = src + bmp->imagesize;
-    x=0;
-    y=0;
-    dest = im_img_pos(img, x, bmp->topdown ? y : (bmp->h-1)-y);
-    while(src < end) {
-        uint8_t n;
-        if (src+2 > end) {
-            goto borked;
+    win.p = win.buf;
+    win.end = win.buf;
+    // Size can be missing. If so, just go until EOB or EOF.
+    win.remaining = bmp->imagesize ? bmp->imagesize : SIZE_MAX;
+
+    x = 0;
+    y = 0;
+    dest = im_img_row(img, bmp->topdown ? 0 : bmp->h - 1);
+    while (true) {
+        unsigned int n;
+        uint8_t v;
+        if (win.p == win.end && !rle_need(&win, 1, err)) {
+            if (*err != IM_ERR_MALFORMED) {
+                goto bail;
+            }
+            // Ran out of data without an end-of-bitmap. Be lenient.
+            *err = IM_ERR_NONE;
+            break;
         }
-
-        n = *src++;
-        if (n==0) {
-            n = *src++;
-            if (n>2) {
-                int pad = ((n+1)/2)&1;
-                // copy next n pixels
-                if (src+(n+1)/2+pad > end) {
-                    goto borked;
-                }
-                if(x+n>bmp->w) {
-                    goto borked;
-                }
-                x+=n;
-                while( n>=2) {
-                    uint8_t c = *src++;
-                    *dest++ = c>>4;
-                    *dest++ = c & 0x0f;
-                    n-=2;
+        if (!rle_need(&win, 2, err)) {
+            goto bail;
+        }
+        n = *win.p++;
+        v = *win.p++;
+        if (n > 0) {
+            // Encoded run: n pixels of v.
+            if (y >= bmp->h || x + (int)n > bmp->w) {
+                goto borked;
+            }
+            if (!rle4) {
+                memset(dest, v, n);
+            } else if ((v >> 4) == (v & 0x0f)) {
+                memset(dest, v & 0x0f, n);
+            } else {
+                uint8_t hi = v >> 4;
+                uint8_t lo = v & 0x0f;
+                unsigned int i;
+                for (i = 0; i + 1 < n; i += 2) {
+                    dest[i] = hi;
+                    dest[i + 1] = lo;
                 }
-                while( n>0) {
-                    uint8_t c = *src++;
-                    *dest++ = c>>4;
-                    --n;
+                if (n & 1) {
+                    dest[n - 1] = hi;
                 }
-                // odd runs have a pad byte
-                src += pad;
+            }
+            dest += n;
+            x += n;
+        } else if (v > 2) {
+            // Absolute mode: v literal pixels, padded to 16 bits.
+            unsigned int nbytes = rle4 ? (v + 1) / 2 : v;
+            n = v;
+            if (y >= bmp->h || x + (int)n > bmp->w) {
+                goto borked;
+            }
+            if (!rle_need(&win, nbytes + (nbytes & 1), err)) {
+                goto bail;
+            }
+            if (!rle4) {
+                memcpy(dest, win.p, n);
             } else {
-                switch (n) {
-                    case 0: // end of line
-                        x=0;
-                        ++y;
-                        break;
-                    case 1: // end of bitmap
-                        // TODO: ensure all src data is consumed?
-                        goto success;
-                    case 2: // delta
-                        x+=(int)(*src++);
-                        y+=(int)(*src++);
-                        break;
+                const uint8_t* src = win.p;
+                unsigned int i;
+                for (i = 0; i + 1 < n; i += 2) {
+                    uint8_t c = *src++;
+                    dest[i] = c >> 4;
+                    dest[i + 1] = c & 0x0f;
                 }
-                // update dest ptr
-                if(x>=bmp->w || y>=bmp->h) {
-                    goto borked;
+                if (n & 1) {
+                    dest[n - 1] = *src >> 4;
                 }
-                dest = im_img_pos(img, x, bmp->topdown ? y : (bmp->h-1)-y);
             }
-        } else {
-            uint8_t v = *src++;
-            // emit v n times
-            if (x+n>bmp->w) {
+            win.p += nbytes + (nbytes & 1);
+            dest += n;
+            x += n;
+        } else if (v == 0) {
+            // End of line.
+            if (y >= bmp->h) {
                 goto borked;
             }
-            x+=n;
-            while (n>=2) {
-                *dest++ = v >> 4;
-                *dest++ = v & 0x0f;
-                n-=2;
+            rle_skip(bmp, img, x, y, 0, y + 1);
+            x = 0;
+            ++y;
+            if (y < bmp->h) {
+                dest = im_img_row(img, bmp->topdown ? y : (bmp->h - 1) - y);
+            }
+        } else if (v == 1) {
+            // End of bitmap.
+            // TODO: ensure all src data is consumed?
+            break;
+        } else {
+            // Delta.
+            int nx, ny;
+            if (!rle_need(&win, 2, err)) {
+                goto bail;
             }
-            while (n>0) {
-                *dest++ = v>>4;
-                --n;
+            nx = x + win.p[0];
+            ny = y + win.p[1];
+            win.p += 2;
+            if (nx >= bmp->w || ny >= bmp->h) {
+                goto borked;
             }
+            rle_skip(bmp, img, x, y, nx, ny);
+            x = nx;
+            y = ny;
+            dest = im_img_row(img, bmp->topdown ? y : (bmp->h - 1) - y) + x;
         }
     }
 
-success:
-    ifree(buf);
+    // Anything not yet reached is left as colour 0.
+    rle_skip(bmp, img, x, y, 0, bmp->h);
+    ifree(win.buf);
     return true;
 
 borked:
-    ifree(buf);
     *err = IM_ERR_MALFORMED;
+bail:
+    ifree(win.buf);
     return false;
 }
 
@@ -13,6 +13,7 @@ im_write* ibmp_new_writer(im_out* out, ImErr *err);
 static void ibmp_prep_img(im_write* writer);
 static void ibmp_emit_header(im_write* wr);
 static void ibmp_emit_rows(im_write *writer, unsigned int num_rows, const void *data, int stride);
+static void ibmp_post_img(im_write* wr);
 static void ibmp_finish(im_write* wr);
 
 static struct write_handler bmp_write_handler = {
@@ -20,16 +21,30 @@ static struct write_handler bmp_write_handler = {
     ibmp_prep_img,
     ibmp_emit_header,
     ibmp_emit_rows,
-    NULL,   // post_img()
+    ibmp_post_img,
     ibmp_finish
 };
 
-// no bmp-specific fields.
 typedef struct ibmp_writer {
     im_write writer;
+
+    int compression;    // BI_RGB, BI_RLE8 or BI_RLE4
+    int bitcount;
+
+    // RLE-compressed images have to be stored bottom-up, but the rows
+    // arrive top-down. So they're encoded as they come in, and collected
+    // in rle_data until the image is complete.
+    uint8_t* rle_data;
+    size_t rle_size;
+    size_t rle_cap;
+    size_t* rle_rows;   // offset of each row in rle_data (h+1 entries)
+    // Scratch space for picking the encoding of each row.
+    int* rle_scratch;
 } ibmp_writer;
 
 
+static bool write_headers(im_write* wr, size_t imageByteSize);
+static bool rle_encode_row(ibmp_writer* bw, unsigned int y, const uint8_t* pix);
 static bool write_file_header(size_t fileSize, size_t imageOffset, im_out* out, ImErr* err);
 static bool write_bitmapinfoheader(int w, int h,
     size_t imageByteSize,
@@ -58,18 +73,50 @@ im_write* ibmp_new_writer(im_out* out, ImErr* err)
     writer->handler = &bmp_write_handler;
     writer->out = out;
 
+    bmpwriter->compression = BI_RGB;
+    bmpwriter->bitcount = 0;
+    bmpwriter->rle_data = NULL;
+    bmpwriter->rle_size = 0;
+    bmpwriter->rle_cap = 0;
+    bmpwriter->rle_rows = NULL;
+    bmpwriter->rle_scratch = NULL;
+
     *err = IM_ERR_NONE;
     return writer;
 }
 
 
 
+// Rows are padded out to a multiple of 4 bytes.
+static size_t padded_row_size(im_write* wr)
+{
+    ibmp_writer* bw = (ibmp_writer*)wr;
+    size_t n = ((size_t)wr->w * bw->bitcount + 7) / 8;
+    return (n + 3) & ~(size_t)3;
+}
+
+
 static void ibmp_emit_rows(im_write* writer, unsigned int num_rows, const void *data, int stride)
 {
+    ibmp_writer* bw = (ibmp_writer*)writer;
     size_t bytes_per_row = im_fmt_bytesperpixel(writer->internal_fmt) * writer->w;
+    size_t padded = padded_row_size(writer);
+    static const uint8_t zeros[4] = {0};
+    unsigned int i;
 
     assert(writer->state == WRITESTATE_BODY);
-    if (stride == (int)bytes_per_row || num_rows == 1) {
+    if (bw->compression != BI_RGB) {
+        for (i = 0; i < num_rows; ++i) {
+            if (!rle_encode_row(bw, writer->rows_written + i, data)) {
+                writer->err = IM_ERR_NOMEM;
+                return;
+            }
+            data += stride;
+        }
+        return;
+    }
+
+    if ((stride == (int)bytes_per_row || num_rows == 1) && padded == bytes_per_row) {
         // Shortcut - no padding, can dump it all out in one go.
         size_t cnt = bytes_per_row * num_rows;
         if (im_out_write(writer->out, data, cnt) != cnt) 
@@ -79,10 +126,11 @@ static void ibmp_emit_rows(im_write* writer, unsigned int num_rows, const void *
         }
     } else {
         // Not contiguous, so have to go row-by-row.
-        unsigned int i;
         for (i = 0; i < num_rows; ++i) {
             size_t cnt = bytes_per_row;
-            if (im_out_write(writer->out, data, cnt) != cnt) 
+            size_t pad = padded - bytes_per_row;
+            if (im_out_write(writer->out, data, cnt) != cnt ||
+                im_out_write(writer->out, zeros, pad) != pad)
             {
                 writer->err = IM_ERR_FILE;
                 return;
@@ -92,8 +140,53 @@ static void ibmp_emit_rows(im_write* writer, unsigned int num_rows, const void *
     }
 }
 
+
+// Once all the rows are in, RLE images can be written out.
+static void ibmp_post_img(im_write* wr)
+{
+    ibmp_writer* bw = (ibmp_writer*)wr;
+    size_t imageByteSize;
+    unsigned int y;
+
+    if (bw->compression == BI_RGB) {
+        return;
+    }
+
+    // Each row gets an end-of-line marker, except the last one, which
+    // gets an end-of-bitmap instead.
+    imageByteSize = bw->rle_size + 2 * wr->h;
+    if (!write_headers(wr, imageByteSize)) {
+        return;
+    }
+    for (y = wr->h; y-- > 0; ) {
+        size_t start = bw->rle_rows[y];
+        size_t cnt = bw->rle_rows[y + 1] - start;
+        uint8_t marker[2] = {0, (y == 0) ? 1 : 0};
+        if (im_out_write(wr->out, bw->rle_data + start, cnt) != cnt ||
+            im_out_write(wr->out, marker, 2) != 2)
+        {
+            wr->err = IM_ERR_FILE;
+            return;
+        }
+    }
+}
+
+
 static void ibmp_finish(im_write* writer)
 {
+    ibmp_writer* bw = (ibmp_writer*)writer;
+    if (bw->rle_data) {
+        ifree(bw->rle_data);
+        bw->rle_data = NULL;
+    }
+    if (bw->rle_rows) {
+        ifree(bw->rle_rows);
+        bw->rle_rows = NULL;
+    }
+    if (bw->rle_scratch) {
+        ifree(bw->rle_scratch);
+        bw->rle_scratch = NULL;
+    }
 }
 
 static void ibmp_prep_img(im_write* writer)
@@ -107,40 +200,26 @@ static void ibmp_prep_img(im_write* writer)
 // Write out everything up to the start of the row data itself.
 static void ibmp_emit_header(im_write* wr)
 {
-    unsigned int w = wr->w;
-    unsigned int h = wr->h;
-    size_t paletteByteSize = wr->pal_num_colours * 4;
-    size_t imageOffset;
-    size_t imageByteSize;
-    size_t fileSize;
-    ImErr err;
-    int bitcount;
-    int compression;
-    uint32_t rmask, gmask, bmask, amask;
-    size_t dibheadersize = DIB_BITMAPINFOHEADER_SIZE;
+    ibmp_writer* bw = (ibmp_writer*)wr;
 
     // Figure out what format we're going to write out, and ask
     // that im_write_rows() gives us that.
+    bw->compression = BI_RGB;
     if (im_fmt_is_indexed(wr->fmt)) {
         // paletted
-        compression = BI_RGB;
-        bitcount = 8;
+        bw->bitcount = 8;
         i_write_set_internal_fmt(wr, IM_FMT_INDEX8);
+        if (wr->rle) {
+            bw->compression = (wr->pal_num_colours <= 16) ? BI_RLE4 : BI_RLE8;
+            bw->bitcount = (bw->compression == BI_RLE4) ? 4 : 8;
+        }
     } else if(im_fmt_has_rgb(wr->fmt)) {
         if (im_fmt_has_alpha(wr->fmt)) {
-            // use v4 header for alpha support
-            dibheadersize = DIB_BITMAPV4HEADER_SIZE;
-            compression = BI_BITFIELDS;
-            rmask = 0x00ff0000;
-            gmask = 0x0000ff00;
-            bmask = 0x000000ff;
-            amask = 0xff000000;
-            bitcount = 32;
+            bw->bitcount = 32;
             i_write_set_internal_fmt(wr, IM_FMT_BGRA);
         } else {
             // no alpha channel
-            compression = BI_RGB;
-            bitcount = 24;
+            bw->bitcount = 24;
             i_write_set_internal_fmt(wr, IM_FMT_BGR);
         }
     } else {
@@ -152,23 +231,60 @@ static void ibmp_emit_header(im_write* wr)
         return;
     }
 
-    imageByteSize = h * w * im_fmt_bytesperpixel(wr->internal_fmt);
+    if (bw->compression != BI_RGB) {
+        // Collect the encoded rows. The headers go out once we know how
+        // big the image data is.
+        bw->rle_size = 0;
+        bw->rle_rows = irealloc(bw->rle_rows, sizeof(size_t) * (wr->h + 1));
+        // cost, choice, start and 5 deques, see rle_encode_row()
+        bw->rle_scratch = irealloc(bw->rle_scratch, sizeof(int) * 8 * (wr->w + 1));
+        if (!bw->rle_rows || !bw->rle_scratch) {
+            wr->err = IM_ERR_NOMEM;
+        }
+        return;
+    }
+
+    write_headers(wr, padded_row_size(wr) * wr->h);
+}
+
+
+// Write out the file header, bitmap header and palette.
+static bool write_headers(im_write* wr, size_t imageByteSize)
+{
+    ibmp_writer* bw = (ibmp_writer*)wr;
+    unsigned int w = wr->w;
+    int h = (int)wr->h;
+    size_t paletteByteSize = wr->pal_num_colours * 4;
+    size_t imageOffset;
+    size_t fileSize;
+    ImErr err;
+    size_t dibheadersize = DIB_BITMAPINFOHEADER_SIZE;
+
+    if (bw->compression == BI_RGB) {
+        h = -h;     // -ve => we'll save as top-down
+    }
+    if (bw->bitcount == 32) {
+        // use v4 header for alpha support
+        dibheadersize = DIB_BITMAPV4HEADER_SIZE;
+    }
+
     imageOffset = BMP_FILE_HEADER_SIZE + dibheadersize + paletteByteSize;
     fileSize = imageOffset + imageByteSize;
     if(!write_file_header(fileSize, imageOffset, wr->out, &err)) {
         wr->err = err;
-        return;
+        return false;
     }
 
     if (dibheadersize == DIB_BITMAPV4HEADER_SIZE) {
-        if(!write_bitmapv4header(w, h, imageByteSize, compression, bitcount, wr->pal_num_colours, rmask, gmask, bmask, amask, wr->out, &err)) {
+        if(!write_bitmapv4header(w, h, imageByteSize, BI_BITFIELDS, bw->bitcount, wr->pal_num_colours,
+            0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, wr->out, &err)) {
             wr->err = err;
-            return;
+            return false;
         }
     } else {    // DIB_BITMAPINFOHEADER_SIZE
-        if(!write_bitmapinfoheader(w, h, imageByteSize, compression, bitcount, wr->pal_num_colours, wr->out, &err)) {
+        if(!write_bitmapinfoheader(w, h, imageByteSize, bw->compression, bw->bitcount, wr->pal_num_colours, wr->out, &err)) {
             wr->err = err;
-            return;
+            return false;
         }
     }
 
@@ -178,22 +294,220 @@ static void ibmp_emit_header(im_write* wr)
         im_convert_fn pal_cvt_fn = i_pick_convert_fn(IM_FMT_RGBA, IM_FMT_BGRA);
         if (!pal_cvt_fn) {
             wr->err = IM_ERR_NOCONV;
-            return;
+            return false;
         }
         size_t bufsize = im_fmt_bytesperpixel(IM_FMT_BGRA) * wr->pal_num_colours;
         uint8_t* buf = imalloc(bufsize);
         if (!buf) {
             wr->err = IM_ERR_NOMEM;
-            return;
+            return false;
         }
         pal_cvt_fn(wr->pal_data, buf, wr->pal_num_colours, 0, NULL);
         if (im_out_write(wr->out, buf, bufsize) != bufsize) {
             wr->err = IM_ERR_FILE;
         }
-        if (buf) {
-            ifree(buf);
+        ifree(buf);
+    }
+    return wr->err == IM_ERR_NONE;
+}
+
+
+// Sliding-window minimum, over positions in a row.
+struct minq {
+    int* idx;
+    int head;
+    int tail;
+};
+
+static inline void minq_push(struct minq* q, const int* key, int j)
+{
+    while (q->tail > q->head && key[q->idx[q->tail - 1]] >= key[j]) {
+        --q->tail;
+    }
+    q->idx[q->tail++] = j;
+}
+
+static inline void minq_expire(struct minq* q, int oldest)
+{
+    while (q->tail > q->head && q->idx[q->head] < oldest) {
+        ++q->head;
+    }
+}
+
+
+static bool rle_append(ibmp_writer* bw, const uint8_t* buf, size_t n)
+{
+    if (bw->rle_size + n > bw->rle_cap) {
+        size_t cap = bw->rle_cap ? bw->rle_cap * 2 : 4096;
+        while (cap < bw->rle_size + n) {
+            cap *= 2;
+        }
+        uint8_t* p = irealloc(bw->rle_data, cap);
+        if (!p) {
+            return false;
         }
+        bw->rle_data = p;
+        bw->rle_cap = cap;
     }
+    memcpy(bw->rle_data + bw->rle_size, buf, n);
+    bw->rle_size += n;
+    return true;
+}
+
+
+// Encode a row as RLE8 or RLE4 (without the end-of-line marker).
+//
+// The row is split into runs (a repeated pixel, or for RLE4 a repeated
+// pair) and absolute blocks, picking the split with the smallest output.
+// cost[i] is the cheapest encoding of the first i pixels, found by
+// looking back at the cheapest place for the final run or block to start:
+// - a run covers up to 255 pixels, costing 2 bytes.
+// - an absolute block covers 3-255 pixels, costing 2 bytes plus the data
+//   padded out to 16 bits, ie 2*ceil(n/P) where P is the number of pixels
+//   in 16 bits (2 for RLE8, 4 for RLE4).
+// Both lookbacks are sliding-window minimums, so it's all O(w).
+static bool rle_encode_row(ibmp_writer* bw, unsigned int y, const uint8_t* pix)
+{
+    int w = (int)bw->writer.w;
+    bool rle4 = (bw->compression == BI_RLE4);
+    int P = rle4 ? 4 : 2;
+    int* cost = bw->rle_scratch;
+    int* from = cost + (w + 1);     // where the last run/block starts
+    int* start = from + (w + 1);    // segment starts, for output
+    int* key = start + (w + 1);     // cost adjusted for absolute blocks
+    struct minq runq;
+    struct minq absq[4];
+    int run_start = 0;
+    int i, r, n;
+    uint8_t buf[2 + 128];
+
+    runq.idx = key + (w + 1);
+    runq.head = runq.tail = 0;
+    for (r = 0; r < P; ++r) {
+        // Each residue class only ever holds positions from that class.
+        absq[r].idx = runq.idx + (w + 1) + r * ((w + 1) / P + 1);
+        absq[r].head = absq[r].tail = 0;
+    }
+
+    bw->rle_rows[y] = bw->rle_size;
+
+    cost[0] = 0;
+    key[0] = 0;
+    for (i = 1; i <= w; ++i) {
+        int best;
+        int j;
+
+        // Track where the run ending at pixel i-1 began.
+        if (rle4) {
+            if (i - 1 >= 2 && pix[i - 1] != pix[i - 3]) {
+                run_start = i - 2;
+            }
+        } else {
+            if (i - 1 >= 1 && pix[i - 1] != pix[i - 2]) {
+                run_start = i - 1;
+            }
+        }
+
+        // Run, starting anywhere from run_start (up to 255 back).
+        minq_push(&runq, cost, i - 1);
+        minq_expire(&runq, (run_start > i - 255) ? run_start : i - 255);
+        j = runq.idx[runq.head];
+        best = cost[j] + 2;
+        from[i] = j;
+
+        // Absolute block, 3 to 255 pixels back.
+        // For j = r + P*q, cost is cost[j] - 2q + 2*ceil((i-r)/P) + 2,
+        // so track cost[j] - 2q for each residue r.
+        if (i >= 3) {
+            j = i - 3;
+            key[j] = cost[j] - 2 * (j / P);
+            minq_push(&absq[j % P], key, j);
+        }
+        for (r = 0; r < P; ++r) {
+            struct minq* q = &absq[r];
+            int c;
+            minq_expire(q, i - 255);
+            if (q->tail == q->head) {
+                continue;
+            }
+            j = q->idx[q->head];
+            c = key[j] + 2 * ((i - r + P - 1) / P) + 2;
+            if (c < best) {
+                best = c;
+                from[i] = -1 - j;   // -ve => absolute
+            }
+        }
+        cost[i] = best;
+    }
+
+    // Trace back the segments, then write them out in order.
+    n = 0;
+    for (i = w; i > 0; ) {
+        start[n++] = i;
+        i = (from[i] >= 0) ? from[i] : -1 - from[i];
+    }
+    i = 0;
+    while (n-- > 0) {
+        int end = start[n];
+        int j = (from[end] >= 0) ? from[end] : -1 - from[end];
+        int cnt = end - j;
+        size_t len;
+        assert(j == i);
+        if (from[end] >= 0) {
+            // Run.
+            buf[0] = (uint8_t)cnt;
+            if (rle4) {
+                buf[1] = (uint8_t)(((pix[j] & 0x0f) << 4) | (cnt > 1 ? (pix[j + 1] & 0x0f) : 0));
+            } else {
+                buf[1] = pix[j];
+            }
+            if (!rle_append(bw, buf, 2)) {
+                return false;
+            }
+        } else {
+            // Absolute block.
+            int k;
+            buf[0] = 0;
+            buf[1] = (uint8_t)cnt;
+            if (!rle_append(bw, buf, 2)) {
+                return false;
+            }
+            if (rle4) {
+                len = 0;
+                for (k = 0; k < cnt; k += 2) {
+                    uint8_t hi = pix[j + k] & 0x0f;
+                    uint8_t lo = (k + 1 < cnt) ? (pix[j + k + 1] & 0x0f) : 0;
+                    buf[len++] = (uint8_t)((hi << 4) | lo);
+                    if (len == sizeof(buf) - 1) {
+                        if (!rle_append(bw, buf, len)) {
+                            return false;
+                        }
+                        len = 0;
+                    }
+                }
+                // Keep to 16-bit boundaries.
+                if (((cnt + 1) / 2) & 1) {
+                    buf[len++] = 0;
+                }
+                if (!rle_append(bw, buf, len)) {
+                    return false;
+                }
+            } else {
+                if (!rle_append(bw, pix + j, cnt)) {
+                    return false;
+                }
+                if (cnt & 1) {
+                    buf[0] = 0;
+                    if (!rle_append(bw, buf, 1)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        i = end;
+    }
+    bw->rle_rows[y + 1] = bw->rle_size;
+    return true;
 }
 
 
@@ -239,9 +553,9 @@ static bool write_bitmapinfoheader(int w, int h,
     uint8_t* p = buf;
     encode_u32le(&p, DIB_BITMAPINFOHEADER_SIZE);
     encode_s32le(&p, w);
-    encode_s32le(&p, -h);               // -ve => we'll save as top-down
+    encode_s32le(&p, h);                // -ve => top-down
     encode_u16le(&p, 1);                // planes
-    encode_u16le(&p, bitcount);         // 8, 24, 32
+    encode_u16le(&p, bitcount);         // 4, 8, 24, 32
     encode_u32le(&p, compression);      // biCompression
     encode_u32le(&p, imageByteSize);    // biSizeImage (0 ok for uncompressed)
     encode_s32le(&p, 256);
@@ -271,9 +585,9 @@ static bool write_bitmapv4header( int w, int h,
     uint8_t* p = buf;
     encode_u32le(&p, DIB_BITMAPV4HEADER_SIZE);
     encode_s32le(&p, w);
-    encode_s32le(&p, -h);               // -ve => we'll save as top-down
+    encode_s32le(&p, h);                // -ve => top-down
     encode_u16le(&p, 1);                // planes
-    encode_u16le(&p, bitcount);         // 8, 24, 32
+    encode_u16le(&p, bitcount);         // 4, 8, 24, 32
     encode_u32le(&p, compression);      // biCompression
     encode_u32le(&p, imageByteSize);    // biSizeImage (0 ok for uncompressed)
     encode_s32le(&p, 256);
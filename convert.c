@@ -5,810 +5,410 @@
 #include <string.h>
 #include <assert.h>
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
-/*******************
- * INDEX8 -> whatever
- */
-
-static void cvt_u8INDEX_u8RGB(const uint8_t* src, uint8_t* dest, unsigned int w,  unsigned nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x = 0; x < w; ++x) {
-        unsigned int idx = ((int)*src) * 4;
-        ++src;
-        *dest++ = rgba[idx+0];
-        *dest++ = rgba[idx+1];
-        *dest++ = rgba[idx+2];
-    } 
-}
-
-
-static void cvt_u8INDEX_u8RGBA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x = 0; x < w; ++x) {
-        unsigned int idx = 4 * (int)(*src++);
-        *dest++ = rgba[idx+0];
-        *dest++ = rgba[idx+1];
-        *dest++ = rgba[idx+2];
-        *dest++ = rgba[idx+3];
-    }
-}
-
-static void cvt_u8INDEX_u8ARGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x = 0; x < w; ++x) {
-        unsigned int idx = ((int)*src) * 4;
-        ++src;
-        *dest++ = rgba[idx+1];
-        *dest++ = rgba[idx+2];
-        *dest++ = rgba[idx+3];
-        *dest++ = rgba[idx+0];
-    }
-}
-
-
-static void cvt_u8INDEX_u8BGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x = 0; x < w; ++x) {
-        unsigned int idx = ((int)*src) * 4;
-        ++src;
-        *dest++ = rgba[idx+2];
-        *dest++ = rgba[idx+1];
-        *dest++ = rgba[idx+0];
-    } 
-}
-
-static void cvt_u8INDEX_u8BGRA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x = 0; x < w; ++x) {
-        unsigned int idx = ((int)*src) * 4;
-        ++src;
-        *dest++ = rgba[idx+2];
-        *dest++ = rgba[idx+1];
-        *dest++ = rgba[idx+0];
-        *dest++ = rgba[idx+3];
-    } 
-}
-
-static void cvt_u8INDEX_u8ABGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x = 0; x < w; ++x) {
-        unsigned int idx = ((int)*src) * 4;
-        ++src;
-        *dest++ = rgba[idx+3];
-        *dest++ = rgba[idx+2];
-        *dest++ = rgba[idx+1];
-        *dest++ = rgba[idx+0];
-    } 
-}
-
-
-static void cvt_u8INDEX_u8ALPHA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x = 0; x < w; ++x) {
-        unsigned int idx = ((int)*src) * 4;
-        ++src;
-        *dest++ = rgba[idx+3];
-    }
-}
-
-
-/*******************
- * RGB -> whatever
- */
-static void cvt_u8RGB_u8RGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    memcpy(dest, src, w*3);
-}
-
-static void cvt_u8RGB_u8RGBA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[0];
-        *dest++ = src[1];
-        *dest++ = src[2];
-        *dest++ = 255;
-        src += 3;
-    } 
-}
-
-static void cvt_u8RGB_u8ARGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 255;
-        *dest++ = src[0];
-        *dest++ = src[1];
-        *dest++ = src[2];
-        src += 3;
-    } 
-}
-
-
-static void cvt_u8RGB_u8BGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 3;
-    } 
-}
-
-static void cvt_u8RGB_u8BGRA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        *dest++ = 255;
-        src += 3;
-    } 
-}
-
-static void cvt_u8RGB_u8ABGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 255;
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 3;
-    } 
-}
+// The kernels rely on everything being inlined with constant formats.
+#if defined(__GNUC__)
+#define CVT_INLINE inline __attribute__((always_inline))
+#else
+#define CVT_INLINE inline
+#endif
 
 
-static void cvt_u8RGB_u8ALPHA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    // this is just stupid :-)
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 255;
-    } 
-}
-
-/* RGBA -> whatever */
-
-static void cvt_u8RGBA_u8RGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[0];
-        *dest++ = src[1];
-        *dest++ = src[2];
-        src += 4;
-    } 
-}
-
-static void cvt_u8RGBA_u8RGBA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    memcpy(dest, src, w*4);
-}
-
-static void cvt_u8RGBA_u8ARGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        *dest++ = src[0];
-        *dest++ = src[1];
-        *dest++ = src[2];
-        src += 4;
-    } 
-}
-
-static void cvt_u8RGBA_u8BGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 4;
-    } 
-}
-
-static void cvt_u8RGBA_u8BGRA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        *dest++ = src[3];
-        src += 4;
-    } 
-}
-
-static void cvt_u8RGBA_u8ABGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 4;
-    } 
-}
-
-static void cvt_u8RGBA_u8ALPHA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        src += 4;
-    } 
-}
-
-/****************
- * ARGB -> whatever
+/*
+ * Pixel format conversion.
+ *
+ * Rather than hand-writing a function for every pair of formats, there's
+ * one generic kernel, cvt_px(), which uses the bit-encoded ImFmt details
+ * (see impy.h) to find its way around the pixels. It's instantiated for
+ * every source/dest pair (see the format lists below), with the formats as
+ * constants, so the compiler boils each instance down to a specialised
+ * loop.
+ *
+ * Notes:
+ * - Pad (X) channels are ignored on input. On output, they get whatever
+ *   the alpha would have been, so each XXXX dest format just uses the AAAA
+ *   version.
+ * - 16 -> 8 bit rounds the same way as libpng's png_set_scale_16().
+ * - Luminance from RGB uses Rec. 601 weights.
+ * - Premultiplying/unpremultiplying happens in the same pass, only when
+ *   going between premultiplied and straight alpha.
+ * - Can't convert _to_ INDEX8. That needs quantising (see quantise.c).
  */
 
-static void cvt_u8ARGB_u8RGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[1];
-        *dest++ = src[2];
-        *dest++ = src[3];
-        src += 4;
-    } 
-}
 
-static void cvt_u8ARGB_u8RGBA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[1];
-        *dest++ = src[2];
-        *dest++ = src[3];
-        *dest++ = src[0];
-        src += 4;
-    } 
-}
+// 16 bit -> 8 bit channel value.
+static inline uint32_t to8(uint32_t v)
+    { return (v * 255 + 32895) >> 16; }
 
-static void cvt_u8ARGB_u8ARGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[0];
-        *dest++ = src[1];
-        *dest++ = src[2];
-        *dest++ = src[3];
-        src += 4;
-    } 
-}
+// 8 bit -> 16 bit channel value.
+static inline uint32_t to16(uint32_t v)
+    { return v * 257; }
 
-static void cvt_u8ARGB_u8BGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        *dest++ = src[2];
-        *dest++ = src[1];
-        src += 4;
-    } 
-}
+static inline uint32_t luma8(uint32_t r, uint32_t g, uint32_t b)
+    { return (r * 77 + g * 150 + b * 29 + 128) >> 8; }
 
-static void cvt_u8ARGB_u8BGRA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 4;
-    } 
-}
+static inline uint32_t luma16(uint32_t r, uint32_t g, uint32_t b)
+    { return (r * 19595 + g * 38470 + b * 7471 + 32768) >> 16; }
 
-static void cvt_u8ARGB_u8ABGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
+// c * a / 255, rounded.
+static inline uint32_t premul8(uint32_t c, uint32_t a)
 {
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[0];
-        *dest++ = src[3];
-        *dest++ = src[2];
-        *dest++ = src[1];
-        src += 4;
-    } 
+    uint32_t t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
 }
 
-static void cvt_u8ARGB_u8ALPHA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
+// c * a / 65535, rounded.
+static inline uint32_t premul16(uint32_t c, uint32_t a)
 {
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[0];
-        src += 4;
-    } 
+    uint32_t t = c * a + 32768;
+    return (t + (t >> 16)) >> 16;
 }
 
-/*****************
- * BGR -> whatever
- */
+// 65536 * 255 / a, for unpremultiplying 8 bit values without a divide.
+#define RECIP1(a) ((a) ? ((255u << 16) + (a) / 2) / (a) : 0),
+#define RECIP4(a) RECIP1(a) RECIP1(a + 1) RECIP1(a + 2) RECIP1(a + 3)
+#define RECIP16(a) RECIP4(a) RECIP4(a + 4) RECIP4(a + 8) RECIP4(a + 12)
+#define RECIP64(a) RECIP16(a) RECIP16(a + 16) RECIP16(a + 32) RECIP16(a + 48)
+static const uint32_t unpremul_recip[256] = {
+    RECIP64(0) RECIP64(64) RECIP64(128) RECIP64(192)
+};
 
-static void cvt_u8BGR_u8RGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
+// c * 255 / a (clamped, for bad input where c > a).
+static inline uint32_t unpremul8(uint32_t c, uint32_t a)
 {
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 3;
-    } 
+    uint32_t v = (c * unpremul_recip[a] + 32768) >> 16;
+    return v > 255 ? 255 : v;
 }
 
-static void cvt_u8BGR_u8RGBA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
+// c * 65535 / a (clamped).
+static inline uint32_t unpremul16(uint32_t c, uint32_t a)
 {
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        *dest++ = 255;
-        src += 3;
-    } 
-}
-
-static void cvt_u8BGR_u8ARGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 255;
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 3;
-    } 
-}
-
-
-static void cvt_u8BGR_u8BGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    memcpy(dest,src,w*3);
-}
-
-static void cvt_u8BGR_u8BGRA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = *src++;
-        *dest++ = *src++;
-        *dest++ = *src++;
-        *dest++ = 255;
-    } 
-}
-
-static void cvt_u8BGR_u8ABGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 255;
-        *dest++ = *src++;
-        *dest++ = *src++;
-        *dest++ = *src++;
-    } 
-}
-
-
-static void cvt_u8BGR_u8ALPHA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    // this is just stupid :-)
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 255;
-    } 
+    uint32_t v;
+    if (a == 0) {
+        return 0;
+    }
+    v = (c * 65535 + a / 2) / a;
+    return v > 65535 ? 65535 : v;
 }
 
 
-/******************
- * BGRA -> whatever
- */
-
-static void cvt_u8BGRA_u8RGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 4;
-    } 
-}
-
-static void cvt_u8BGRA_u8RGBA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
+// Position (in channels) of R, G, B or A (chan = 0,1,2,3) within a pixel,
+// or -1 if fmt doesn't have it. For luminance, R, G and B are all the
+// luminance channel. Pad channels don't count as alpha.
+static CVT_INLINE int chan_pos(ImFmt fmt, int chan)
 {
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        *dest++ = src[3];
-        src += 4;
-    } 
+    if (chan == 3) {
+        if (!im_fmt_has_alpha(fmt)) {
+            return -1;
+        }
+        return (fmt & IM_FMTBIT_ALPHA_FIRST) ? 0 : (int)im_fmt_num_channels(fmt) - 1;
+    }
+    if (im_fmt_has_rgb(fmt)) {
+        if (fmt & IM_FMTBIT_BGR) {
+            chan = 2 - chan;
+        }
+        return ((fmt & IM_FMTBIT_ALPHA_FIRST) ? 1 : 0) + chan;
+    }
+    if (im_fmt_is_luminance(fmt)) {
+        return 0;
+    }
+    return -1;
 }
 
-static void cvt_u8BGRA_u8ARGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
+static CVT_INLINE uint32_t get_chan(const uint8_t* p, int pos, bool is16)
 {
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 4;
-    } 
+    if (is16) {
+        uint16_t v;
+        memcpy(&v, p + pos * 2, 2);
+        return v;
+    }
+    return p[pos];
 }
 
-
-static void cvt_u8BGRA_u8BGR( const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
+static CVT_INLINE void put_chan(uint8_t* p, int pos, bool is16, uint32_t v)
 {
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = *src++;
-        *dest++ = *src++;
-        *dest++ = *src++;
-        ++src;
-    } 
+    if (is16) {
+        uint16_t tmp = (uint16_t)v;
+        memcpy(p + pos * 2, &tmp, 2);
+    } else {
+        p[pos] = (uint8_t)v;
+    }
 }
 
-static void cvt_u8BGRA_u8BGRA( const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    memcpy(dest,src,w*4);
-}
 
-static void cvt_u8BGRA_u8ABGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        *dest++ = src[0];
-        *dest++ = src[1];
-        *dest++ = src[2];
-        src += 4;
-    } 
+#if defined(__SSSE3__)
+// 8 bit RGB-family formats (3 or 4 bytes per pixel) differ only in byte
+// order, so four pixels at a time can be done with a single shuffle.
+// Returns the number of pixels converted (the rest are left for the
+// caller).
+// Premultiplying is done here too, but unpremultiplying isn't.
+static CVT_INLINE bool can_shuffle(ImFmt srcFmt, ImFmt destFmt)
+{
+    return im_fmt_has_rgb(srcFmt) && !im_fmt_is_16bit(srcFmt) &&
+        im_fmt_has_rgb(destFmt) && !im_fmt_is_16bit(destFmt) &&
+        !(im_fmt_is_premultiplied(srcFmt) && !im_fmt_is_premultiplied(destFmt));
+}
+
+static CVT_INLINE unsigned int cvt_shuffle(const uint8_t* src, uint8_t* dest, unsigned int w, ImFmt srcFmt, ImFmt destFmt)
+{
+    const unsigned int sbpp = im_fmt_num_channels(srcFmt);
+    const unsigned int dbpp = im_fmt_num_channels(destFmt);
+    const bool premul = im_fmt_has_alpha(srcFmt) &&
+        !im_fmt_is_premultiplied(srcFmt) && im_fmt_is_premultiplied(destFmt);
+    const int da = chan_pos(destFmt, 3);
+    uint8_t mask[16];
+    uint8_t fill[16];
+    uint8_t amask[16];
+    uint8_t afill[16];
+    __m128i m, f, am, af;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    unsigned int x;
+    int i, chan;
+
+    // Build the shuffle mask (0x80 = zero), plus any opaque alpha to OR in.
+    memset(mask, 0x80, sizeof(mask));
+    memset(fill, 0, sizeof(fill));
+    for (chan = 0; chan < 4; ++chan) {
+        int d = chan_pos(destFmt, chan);
+        int s = chan_pos(srcFmt, chan);
+        if (d < 0) {
+            continue;
+        }
+        for (i = 0; i < 4; ++i) {
+            if (s >= 0) {
+                mask[i * dbpp + d] = (uint8_t)(i * sbpp + s);
+            } else {
+                fill[i * dbpp + d] = 255;
+            }
+        }
+    }
+    m = _mm_loadu_si128((const __m128i*)mask);
+    f = _mm_loadu_si128((const __m128i*)fill);
+
+    // For premultiplying: a shuffle to spread each pixel's alpha over its
+    // colour channels (and 255 over the alpha itself, to leave it as is).
+    memset(amask, 0x80, sizeof(amask));
+    memset(afill, 0, sizeof(afill));
+    if (premul) {
+        for (i = 0; i < 4; ++i) {
+            for (chan = 0; chan < (int)dbpp; ++chan) {
+                if (chan == da) {
+                    afill[i * dbpp + chan] = 255;
+                } else {
+                    amask[i * dbpp + chan] = (uint8_t)(i * dbpp + da);
+                }
+            }
+        }
+    }
+    am = _mm_loadu_si128((const __m128i*)amask);
+    af = _mm_loadu_si128((const __m128i*)afill);
+
+    // Loads and stores are 16 bytes wide, so stop while they still fit.
+    for (x = 0; (w - x) * sbpp >= 16 && (w - x) * dbpp >= 16; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)src);
+        v = _mm_or_si128(_mm_shuffle_epi8(v, m), f);
+        if (premul) {
+            // Same sums as premul8(), 8 channels at a time.
+            __m128i a = _mm_or_si128(_mm_shuffle_epi8(v, am), af);
+            __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpacklo_epi8(a, zero));
+            __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), _mm_unpackhi_epi8(a, zero));
+            lo = _mm_add_epi16(lo, round);
+            hi = _mm_add_epi16(hi, round);
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            v = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128((__m128i*)dest, v);
+        src += 4 * sbpp;
+        dest += 4 * dbpp;
+    }
+    return x;
+}
+#endif
+
+
+// The generic kernel.
+static CVT_INLINE void cvt_px(const uint8_t* restrict src, uint8_t* restrict dest, unsigned int w, const uint8_t* rgba, ImFmt srcFmt, ImFmt destFmt)
+{
+    const bool s16 = im_fmt_is_16bit(srcFmt);
+    const bool d16 = im_fmt_is_16bit(destFmt);
+    const size_t sbpp = im_fmt_bytesperpixel(srcFmt);
+    const size_t dbpp = im_fmt_bytesperpixel(destFmt);
+    const int sr = chan_pos(srcFmt, 0);
+    const int sg = chan_pos(srcFmt, 1);
+    const int sb = chan_pos(srcFmt, 2);
+    const int sa = chan_pos(srcFmt, 3);
+    const int dr = chan_pos(destFmt, 0);
+    const int dg = chan_pos(destFmt, 1);
+    const int db = chan_pos(destFmt, 2);
+    const int da = chan_pos(destFmt, 3);
+    const bool src_alpha = im_fmt_is_indexed(srcFmt) || im_fmt_has_alpha(srcFmt);
+    const bool premul = src_alpha &&
+        !im_fmt_is_premultiplied(srcFmt) && im_fmt_is_premultiplied(destFmt);
+    const bool unpremul =
+        im_fmt_is_premultiplied(srcFmt) && !im_fmt_is_premultiplied(destFmt);
+    unsigned int x = 0;
+
+#if defined(__SSSE3__)
+    if (can_shuffle(srcFmt, destFmt)) {
+        x = cvt_shuffle(src, dest, w, srcFmt, destFmt);
+        src += x * sbpp;
+        dest += x * dbpp;
+    }
+#endif
+
+    for (; x < w; ++x) {
+        uint32_t r, g, b, a;
+
+        // Read (at source depth).
+        if (im_fmt_is_indexed(srcFmt)) {
+            const uint8_t* c = rgba + 4 * src[0];
+            r = c[0];
+            g = c[1];
+            b = c[2];
+            a = c[3];
+        } else {
+            r = (sr >= 0) ? get_chan(src, sr, s16) : 0;
+            g = (sg >= 0) ? get_chan(src, sg, s16) : 0;
+            b = (sb >= 0) ? get_chan(src, sb, s16) : 0;
+            a = (sa >= 0) ? get_chan(src, sa, s16) : (s16 ? 0xffff : 0xff);
+        }
+        if (unpremul) {
+            if (s16) {
+                r = unpremul16(r, a);
+                g = unpremul16(g, a);
+                b = unpremul16(b, a);
+            } else {
+                r = unpremul8(r, a);
+                g = unpremul8(g, a);
+                b = unpremul8(b, a);
+            }
+        }
+
+        if (im_fmt_is_luminance(destFmt) && !im_fmt_is_luminance(srcFmt)) {
+            r = s16 ? luma16(r, g, b) : luma8(r, g, b);
+        }
+
+        // Write (at dest depth).
+        if (s16 && !d16) {
+            r = to8(r);
+            g = to8(g);
+            b = to8(b);
+            a = to8(a);
+        } else if (!s16 && d16) {
+            r = to16(r);
+            g = to16(g);
+            b = to16(b);
+            a = to16(a);
+        }
+        if (premul) {
+            if (d16) {
+                r = premul16(r, a);
+                g = premul16(g, a);
+                b = premul16(b, a);
+            } else {
+                r = premul8(r, a);
+                g = premul8(g, a);
+                b = premul8(b, a);
+            }
+        }
+        if (im_fmt_has_rgb(destFmt)) {
+            put_chan(dest, dr, d16, r);
+            put_chan(dest, dg, d16, g);
+            put_chan(dest, db, d16, b);
+        } else if (im_fmt_is_luminance(destFmt)) {
+            put_chan(dest, dr, d16, r);
+        }
+        if (da >= 0) {
+            put_chan(dest, da, d16, a);
+        }
+        src += sbpp;
+        dest += dbpp;
+    }
 }
 
 
-static void cvt_u8BGRA_u8ALPHA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    // this is just stupid :-)
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        src += 4;
-    } 
-}
-
-/****************
- * ABGR -> whatever
+/*
+ * The format lists.
+ * Every source format can be converted to every dest format.
  */
 
-static void cvt_u8ABGR_u8RGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        *dest++ = src[2];
-        *dest++ = src[1];
-        src += 4;
-    } 
-}
-
-static void cvt_u8ABGR_u8RGBA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[3];
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        src += 4;
-    } 
-}
-
-static void cvt_u8ABGR_u8ARGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[0];
-        *dest++ = src[3];
-        *dest++ = src[2];
-        *dest++ = src[1];
-        src += 4;
-    } 
-}
-
-static void cvt_u8ABGR_u8BGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[1];
-        *dest++ = src[2];
-        *dest++ = src[3];
-        src += 4;
-    } 
-}
-
-static void cvt_u8ABGR_u8BGRA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[1];
-        *dest++ = src[2];
-        *dest++ = src[3];
-        *dest++ = src[0];
-        src += 4;
-    } 
-}
-
-static void cvt_u8ABGR_u8ABGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[0];
-        *dest++ = src[1];
-        *dest++ = src[2];
-        *dest++ = src[3];
-        src += 4;
-    } 
-}
-
-static void cvt_u8ABGR_u8ALPHA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = src[0];
-        src += 4;
-    } 
-}
+#define SRC_FMTS(X) \
+    X(INDEX8) X(RGB) X(RGBA) X(RGBX) X(ARGB) X(XRGB) \
+    X(BGR) X(BGRA) X(BGRX) X(ABGR) X(XBGR) X(ALPHA) \
+    X(LUMINANCE) X(LUMINANCE_ALPHA) \
+    X(RGB16) X(RGBA16) X(LUMINANCE16) X(LUMINANCE_ALPHA16) \
+    X(RGBA_PREMUL) X(ARGB_PREMUL) X(BGRA_PREMUL) X(ABGR_PREMUL) \
+    X(RGBA16_PREMUL)
 
+// (no pad formats here - they use the alpha versions)
+#define DEST_FMTS(X, S) \
+    X(S, RGB) X(S, RGBA) X(S, ARGB) \
+    X(S, BGR) X(S, BGRA) X(S, ABGR) X(S, ALPHA) \
+    X(S, LUMINANCE) X(S, LUMINANCE_ALPHA) \
+    X(S, RGB16) X(S, RGBA16) X(S, LUMINANCE16) X(S, LUMINANCE_ALPHA16) \
+    X(S, RGBA_PREMUL) X(S, ARGB_PREMUL) X(S, BGRA_PREMUL) X(S, ABGR_PREMUL) \
+    X(S, RGBA16_PREMUL)
 
-/* ALPHA -> whatever */
 
-static void cvt_u8ALPHA_u8RGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    // silly.
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 0;
-        *dest++ = 0;
-        *dest++ = 0;
-   } 
-}
+// Define cvt_<src>_<dest>() for every pair.
+#define DEFINE_CVT(S, D) \
+    static void cvt_##S##_##D(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba) \
+        { cvt_px(src, dest, w, rgba, IM_FMT_##S, IM_FMT_##D); }
+#define DEFINE_CVTS_FROM(S) DEST_FMTS(DEFINE_CVT, S)
 
-static void cvt_u8ALPHA_u8RGBA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 0;
-        *dest++ = 0;
-        *dest++ = 0;
-        *dest++ = *src++;
-    } 
-}
+SRC_FMTS(DEFINE_CVTS_FROM)
 
-static void cvt_u8ALPHA_u8ARGB(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = *src++;
-        *dest++ = 0;
-        *dest++ = 0;
-        *dest++ = 0;
-    } 
-}
 
-static void cvt_u8ALPHA_u8BGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    // silly.
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 0;
-        *dest++ = 0;
-        *dest++ = 0;
-    } 
-}
+// Straight copies, for when the formats match.
+#define DEFINE_COPY(N) \
+    static void cvt_copy##N(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba) \
+        { memcpy(dest, src, (size_t)w * N); }
 
-static void cvt_u8ALPHA_u8BGRA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = 0;
-        *dest++ = 0;
-        *dest++ = 0;
-        *dest++ = *src++;
-    } 
-}
+DEFINE_COPY(1)
+DEFINE_COPY(2)
+DEFINE_COPY(3)
+DEFINE_COPY(4)
+DEFINE_COPY(6)
+DEFINE_COPY(8)
 
-static void cvt_u8ALPHA_u8ABGR(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
-{
-    unsigned int x;
-    for (x=0; x<w; ++x) {
-        *dest++ = *src++;
-        *dest++ = 0;
-        *dest++ = 0;
-        *dest++ = 0;
-    } 
-}
 
-static void cvt_u8ALPHA_u8ALPHA(const uint8_t* src, uint8_t* dest, unsigned int w, unsigned int nrgba, const uint8_t* rgba)
+im_convert_fn i_pick_convert_fn(ImFmt srcFmt, ImFmt destFmt)
 {
-    memcpy(dest,src,w*1);
-}
-
-
+    if (srcFmt == destFmt) {
+        switch (im_fmt_bytesperpixel(srcFmt)) {
+            case 1: return cvt_copy1;
+            case 2: return cvt_copy2;
+            case 3: return cvt_copy3;
+            case 4: return cvt_copy4;
+            case 6: return cvt_copy6;
+            case 8: return cvt_copy8;
+            default: return NULL;
+        }
+    }
 
-/*
- * Note: we treat any pad byte (X) the same as the alpha byte (A) to save
- * a few conversion functions.
- */
+    // Pad goes out as alpha.
+    if (im_fmt_has_pad(destFmt)) {
+        destFmt = (ImFmt)((destFmt & ~IM_FMTBIT_PAD) | IM_FMTBIT_ALPHA);
+    }
 
-im_convert_fn i_pick_convert_fn(ImFmt srcFmt, ImFmt destFmt)
-{
-    im_convert_fn fn = NULL;
+#define PICK_CVT(S, D) case IM_FMT_##D: return cvt_##S##_##D;
+#define PICK_CVTS_FROM(S) \
+        case IM_FMT_##S: \
+            switch (destFmt) { \
+                DEST_FMTS(PICK_CVT, S) \
+                default: return NULL; \
+            }
 
     switch (srcFmt) {
-        case IM_FMT_INDEX8:
-            switch (destFmt) {
-                case IM_FMT_RGB: fn = cvt_u8INDEX_u8RGB; break;
-                case IM_FMT_RGBA: fn = cvt_u8INDEX_u8RGBA; break;
-                case IM_FMT_RGBX: fn = cvt_u8INDEX_u8RGBA; break;
-                case IM_FMT_ARGB: fn = cvt_u8INDEX_u8ARGB; break;
-                case IM_FMT_XRGB: fn = cvt_u8INDEX_u8ARGB; break;
-                case IM_FMT_BGR: fn = cvt_u8INDEX_u8BGR; break;
-                case IM_FMT_BGRA: fn = cvt_u8INDEX_u8BGRA; break;
-                case IM_FMT_BGRX: fn = cvt_u8INDEX_u8BGRA; break;
-                case IM_FMT_ABGR: fn = cvt_u8INDEX_u8ABGR; break;
-                case IM_FMT_XBGR: fn = cvt_u8INDEX_u8ABGR; break;
-                case IM_FMT_INDEX8: break;   // TODO: just pick closest colours?
-                case IM_FMT_ALPHA: fn = cvt_u8INDEX_u8ALPHA; break;
-                case IM_FMT_LUMINANCE: break;  //TODO
-                default: break;
-            }
-            break;
-        case IM_FMT_RGB:
-            switch (destFmt) {
-                case IM_FMT_RGB: fn = cvt_u8RGB_u8RGB; break;
-                case IM_FMT_RGBA: fn = cvt_u8RGB_u8RGBA; break;
-                case IM_FMT_RGBX: fn = cvt_u8RGB_u8RGBA; break;
-                case IM_FMT_ARGB: fn = cvt_u8RGB_u8ARGB; break;
-                case IM_FMT_XRGB: fn = cvt_u8RGB_u8ARGB; break;
-                case IM_FMT_BGR: fn = cvt_u8RGB_u8BGR; break;
-                case IM_FMT_BGRA: fn = cvt_u8RGB_u8BGRA; break;
-                case IM_FMT_BGRX: fn = cvt_u8RGB_u8BGRA; break;
-                case IM_FMT_ABGR: fn = cvt_u8RGB_u8ABGR; break;
-                case IM_FMT_XBGR: fn = cvt_u8RGB_u8ABGR; break;
-                case IM_FMT_INDEX8: break;
-                case IM_FMT_ALPHA: fn = cvt_u8RGB_u8ALPHA; break;
-                case IM_FMT_LUMINANCE: break;  //TODO
-                default: break;
-            }
-            break;
-        case IM_FMT_RGBA:
-            switch (destFmt) {
-                case IM_FMT_RGB: fn = cvt_u8RGBA_u8RGB; break;
-                case IM_FMT_RGBA: fn = cvt_u8RGBA_u8RGBA; break;
-                case IM_FMT_RGBX: fn = cvt_u8RGBA_u8RGBA; break;
-                case IM_FMT_ARGB: fn = cvt_u8RGBA_u8ARGB; break;
-                case IM_FMT_XRGB: fn = cvt_u8RGBA_u8ARGB; break;
-                case IM_FMT_BGR: fn = cvt_u8RGBA_u8BGR; break;
-                case IM_FMT_BGRA: fn = cvt_u8RGBA_u8BGRA; break;
-                case IM_FMT_BGRX: fn = cvt_u8RGBA_u8BGRA; break;
-                case IM_FMT_ABGR: fn = cvt_u8RGBA_u8ABGR; break;
-                case IM_FMT_XBGR: fn = cvt_u8RGBA_u8ABGR; break;
-                case IM_FMT_INDEX8: break;
-                case IM_FMT_ALPHA: fn = cvt_u8RGBA_u8ALPHA; break;
-                case IM_FMT_LUMINANCE: break;  //TODO
-                default: break;
-            }
-            break;
-        case IM_FMT_ARGB:
-        case IM_FMT_XRGB:
-            switch (destFmt) {
-                case IM_FMT_RGB: fn = cvt_u8ARGB_u8RGB; break;
-                case IM_FMT_RGBA: fn = cvt_u8ARGB_u8RGBA; break;
-                case IM_FMT_RGBX: fn = cvt_u8ARGB_u8RGBA; break;
-                case IM_FMT_ARGB: fn = cvt_u8ARGB_u8ARGB; break;
-                case IM_FMT_XRGB: fn = cvt_u8ARGB_u8ARGB; break;
-                case IM_FMT_BGR: fn = cvt_u8ARGB_u8BGR; break;
-                case IM_FMT_BGRA: fn = cvt_u8ARGB_u8BGRA; break;
-                case IM_FMT_BGRX: fn = cvt_u8ARGB_u8BGRA; break;
-                case IM_FMT_ABGR: fn = cvt_u8ARGB_u8ABGR; break;
-                case IM_FMT_XBGR: fn = cvt_u8ARGB_u8ABGR; break;
-                case IM_FMT_INDEX8: break;
-                case IM_FMT_ALPHA: fn = cvt_u8ARGB_u8ALPHA; break;
-                case IM_FMT_LUMINANCE: break;  //TODO
-                default: break;
-            }
-            break;
-        case IM_FMT_BGR:
-            switch (destFmt) {
-                case IM_FMT_RGB: fn = cvt_u8BGR_u8RGB; break;
-                case IM_FMT_RGBA: fn = cvt_u8BGR_u8RGBA; break;
-                case IM_FMT_RGBX: fn = cvt_u8BGR_u8RGBA; break;
-                case IM_FMT_ARGB: fn = cvt_u8BGR_u8ARGB; break;
-                case IM_FMT_XRGB: fn = cvt_u8BGR_u8ARGB; break;
-                case IM_FMT_BGR: fn = cvt_u8BGR_u8BGR; break;
-                case IM_FMT_BGRA: fn = cvt_u8BGR_u8BGRA; break;
-                case IM_FMT_BGRX: fn = cvt_u8BGR_u8BGRA; break;
-                case IM_FMT_ABGR: fn = cvt_u8BGR_u8ABGR; break;
-                case IM_FMT_XBGR: fn = cvt_u8BGR_u8ABGR; break;
-                case IM_FMT_INDEX8: break;
-                case IM_FMT_ALPHA: fn = cvt_u8BGR_u8ALPHA; break;
-                case IM_FMT_LUMINANCE: break;  //TODO
-                default: break;
-            }
-            break;
-        case IM_FMT_BGRA:
-            switch (destFmt) {
-                case IM_FMT_RGB: fn = cvt_u8BGRA_u8RGB; break;
-                case IM_FMT_RGBA: fn = cvt_u8BGRA_u8RGBA; break;
-                case IM_FMT_RGBX: fn = cvt_u8BGRA_u8RGBA; break;
-                case IM_FMT_ARGB: fn = cvt_u8BGRA_u8ARGB; break;
-                case IM_FMT_XRGB: fn = cvt_u8BGRA_u8ARGB; break;
-                case IM_FMT_BGR: fn = cvt_u8BGRA_u8BGR; break;
-                case IM_FMT_BGRA: fn = cvt_u8BGRA_u8BGRA; break;
-                case IM_FMT_BGRX: fn = cvt_u8BGRA_u8BGRA; break;
-                case IM_FMT_ABGR: fn = cvt_u8BGRA_u8ABGR; break;
-                case IM_FMT_XBGR: fn = cvt_u8BGRA_u8ABGR; break;
-                case IM_FMT_INDEX8: break;
-                case IM_FMT_ALPHA: fn = cvt_u8BGRA_u8ALPHA; break;
-                case IM_FMT_LUMINANCE: break;  //TODO
-                default: break;
-            }
-            break;
-        case IM_FMT_ABGR:
-        case IM_FMT_XBGR:
-            switch (destFmt) {
-                case IM_FMT_RGB: fn = cvt_u8ABGR_u8RGB; break;
-                case IM_FMT_RGBA: fn = cvt_u8ABGR_u8RGBA; break;
-                case IM_FMT_RGBX: fn = cvt_u8ABGR_u8RGBA; break;
-                case IM_FMT_ARGB: fn = cvt_u8ABGR_u8ARGB; break;
-                case IM_FMT_XRGB: fn = cvt_u8ABGR_u8ARGB; break;
-                case IM_FMT_BGR: fn = cvt_u8ABGR_u8BGR; break;
-                case IM_FMT_BGRA: fn = cvt_u8ABGR_u8BGRA; break;
-                case IM_FMT_BGRX: fn = cvt_u8ABGR_u8BGRA; break;
-                case IM_FMT_ABGR: fn = cvt_u8ABGR_u8ABGR; break;
-                case IM_FMT_XBGR: fn = cvt_u8ABGR_u8ABGR; break;
-                case IM_FMT_INDEX8: break;
-                case IM_FMT_ALPHA: fn = cvt_u8ABGR_u8ALPHA; break;
-                case IM_FMT_LUMINANCE: break;  //TODO
-                default: break;
-            }
-            break;
-        case IM_FMT_ALPHA:
-            switch (destFmt) {
-                case IM_FMT_RGB: fn = cvt_u8ALPHA_u8RGB; break;
-                case IM_FMT_RGBA: fn = cvt_u8ALPHA_u8RGBA; break;
-                case IM_FMT_RGBX: fn = cvt_u8ALPHA_u8RGBA; break;
-                case IM_FMT_ARGB: fn = cvt_u8ALPHA_u8ARGB; break;
-                case IM_FMT_XRGB: fn = cvt_u8ALPHA_u8ARGB; break;
-                case IM_FMT_BGR: fn = cvt_u8ALPHA_u8BGR; break;
-                case IM_FMT_BGRA: fn = cvt_u8ALPHA_u8BGRA; break;
-                case IM_FMT_BGRX: fn = cvt_u8ALPHA_u8BGRA; break;
-                case IM_FMT_ABGR: fn = cvt_u8ALPHA_u8ABGR; break;
-                case IM_FMT_XBGR: fn = cvt_u8ALPHA_u8ABGR; break;
-                case IM_FMT_INDEX8: break;
-                case IM_FMT_ALPHA: fn = cvt_u8ALPHA_u8ALPHA; break;
-                case IM_FMT_LUMINANCE: break;  //TODO
-                default: break;
-            }
-            break;
+        SRC_FMTS(PICK_CVTS_FROM)
         default:
             break;
     }
-    return fn;
+    return NULL;
 }
 
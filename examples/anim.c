@@ -35,6 +35,11 @@ int main( int argc, char* argv[])
     if (err != IM_ERR_NONE) {
         fprintf(stderr, "anim.gif failed: ImErr: %d\n", err);
     }
+
+    err = test_anim(IM_FILETYPE_PNG, "/tmp/anim.png");
+    if (err != IM_ERR_NONE) {
+        fprintf(stderr, "anim.png failed: ImErr: %d\n", err);
+    }
 }
 
 ImErr test_anim(ImFiletype file_fmt, const char *filename)
@@ -21,6 +21,11 @@ int main( int argc, char* argv[])
         if (img.pal_num_colours > 0) {
             printf("Palette - %d colours\n", img.pal_num_colours);
         }
+        if (img.delay_ms > 0 || img.transparent_index >= 0) {
+            printf("delay: %ums disposal: %d transparent: %d loops: %d\n",
+                img.delay_ms, (int)img.disposal, img.transparent_index,
+                img.loop_count);
+        }
    
         // Discard the image data.
         {
@@ -0,0 +1,243 @@
+#include "impy.h"
+#include "private.h"
+
+#include <assert.h>
+#include <string.h>
+
+// GIF LZW encoder.
+//
+// Strings are tracked in an open-addressing hash table keyed on
+// (prefix code, pixel), and the compressed codes are packed into 255-byte
+// sub-blocks before being written out.
+//
+// Optionally lossy: when a string can't be extended by the next pixel,
+// other palette entries within a given distance are tried instead, trading
+// small colour errors for longer matches (and smaller files).
+
+#define LZW_MAX_CODE 4095
+#define HASH_EMPTY 0xffffffffu
+
+static inline uint32_t hash_key(uint32_t key)
+    { return (key * 2654435761u) >> (32 - GIF_LZW_HASH_BITS); }
+
+static void clear_table(gif_lzw* lzw);
+static int lookup(const gif_lzw* lzw, uint32_t key);
+static void insert(gif_lzw* lzw, uint32_t key, int code);
+static void output_code(gif_lzw* lzw, int code);
+static void flush_block(gif_lzw* lzw);
+static void build_near(gif_lzw* lzw, const uint8_t* pal, unsigned int ncolours, int trans, int lossy);
+
+
+// Start a new LZW image data stream.
+// The initial code size byte is assumed to have already been written out.
+// If lossy > 0, pal (RGBA, ncolours entries) is used to find substitute
+// colours within that distance. The transparent index (or -1) is never
+// substituted.
+void i_gif_lzw_start(gif_lzw* lzw, im_out* out, int min_code_size, int lossy, const uint8_t* pal, unsigned int ncolours, int trans)
+{
+    if (min_code_size < 2) {
+        min_code_size = 2;
+    }
+    lzw->out = out;
+    lzw->err = false;
+    lzw->min_code_size = min_code_size;
+    lzw->mask = (1 << min_code_size) - 1;
+    lzw->clear_code = 1 << min_code_size;
+    lzw->eof_code = lzw->clear_code + 1;
+    lzw->bitbuf = 0;
+    lzw->nbits = 0;
+    lzw->block_len = 0;
+    lzw->prefix = -1;
+    lzw->lossy = false;
+    if (lossy > 0 && pal && ncolours > 0) {
+        build_near(lzw, pal, ncolours, trans, lossy);
+        lzw->lossy = true;
+    }
+
+    clear_table(lzw);
+    output_code(lzw, lzw->clear_code);
+}
+
+
+// Compress n pixels.
+void i_gif_lzw_encode(gif_lzw* lzw, const uint8_t* pixels, size_t n)
+{
+    size_t i;
+    int prefix = lzw->prefix;
+
+    for (i = 0; i < n; ++i) {
+        int pixel = pixels[i] & lzw->mask;
+        uint32_t key;
+        int code;
+
+        if (prefix < 0) {
+            prefix = pixel;
+            continue;
+        }
+
+        key = ((uint32_t)prefix << 8) | (uint32_t)pixel;
+        code = lookup(lzw, key);
+        if (code < 0 && lzw->lossy) {
+            // Try any close-enough colours instead.
+            const uint8_t* cand = lzw->near[pixel];
+            unsigned int j;
+            for (j = 0; j < lzw->near_count[pixel]; ++j) {
+                code = lookup(lzw, ((uint32_t)prefix << 8) | cand[j]);
+                if (code >= 0) {
+                    break;
+                }
+            }
+        }
+        if (code >= 0) {
+            prefix = code;  // Extend the current string.
+            continue;
+        }
+
+        // No match - write out the current string and start a new one.
+        output_code(lzw, prefix);
+        if (lzw->next_code >= LZW_MAX_CODE) {
+            // Table full.
+            output_code(lzw, lzw->clear_code);
+            clear_table(lzw);
+        } else {
+            insert(lzw, key, lzw->next_code++);
+        }
+        prefix = pixel;
+    }
+    lzw->prefix = prefix;
+}
+
+
+// Finish off the stream (end code, remaining bits, block terminator).
+// Returns false if there were any write errors.
+bool i_gif_lzw_finish(gif_lzw* lzw)
+{
+    uint8_t terminator = 0;
+
+    if (lzw->prefix >= 0) {
+        output_code(lzw, lzw->prefix);
+    }
+    output_code(lzw, lzw->eof_code);
+    if (lzw->nbits > 0) {
+        lzw->block[1 + lzw->block_len++] = (uint8_t)lzw->bitbuf;
+        lzw->bitbuf = 0;
+        lzw->nbits = 0;
+        if (lzw->block_len == 255) {
+            flush_block(lzw);
+        }
+    }
+    flush_block(lzw);
+    if (im_out_write(lzw->out, &terminator, 1) != 1) {
+        lzw->err = true;
+    }
+    return !lzw->err;
+}
+
+
+static void clear_table(gif_lzw* lzw)
+{
+    memset(lzw->hash_keys, 0xff, sizeof(lzw->hash_keys));
+    lzw->next_code = lzw->eof_code + 1;
+    lzw->code_size = lzw->min_code_size + 1;
+}
+
+
+static int lookup(const gif_lzw* lzw, uint32_t key)
+{
+    uint32_t h = hash_key(key);
+    while (lzw->hash_keys[h] != HASH_EMPTY) {
+        if (lzw->hash_keys[h] == key) {
+            return lzw->hash_codes[h];
+        }
+        h = (h + 1) & (GIF_LZW_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
+
+static void insert(gif_lzw* lzw, uint32_t key, int code)
+{
+    uint32_t h = hash_key(key);
+    while (lzw->hash_keys[h] != HASH_EMPTY) {
+        h = (h + 1) & (GIF_LZW_HASH_SIZE - 1);
+    }
+    lzw->hash_keys[h] = key;
+    lzw->hash_codes[h] = (uint16_t)code;
+}
+
+
+// Pack a code into the bit buffer, LSB first.
+static void output_code(gif_lzw* lzw, int code)
+{
+    lzw->bitbuf |= (uint32_t)code << lzw->nbits;
+    lzw->nbits += lzw->code_size;
+    while (lzw->nbits >= 8) {
+        lzw->block[1 + lzw->block_len++] = (uint8_t)(lzw->bitbuf & 0xff);
+        lzw->bitbuf >>= 8;
+        lzw->nbits -= 8;
+        if (lzw->block_len == 255) {
+            flush_block(lzw);
+        }
+    }
+
+    // Grow the code size once the next code won't fit.
+    // (Codes above 4095 are special signals, and never bump the size).
+    if (lzw->next_code >= (1 << lzw->code_size) && code <= LZW_MAX_CODE &&
+        lzw->code_size < 12) {
+        ++lzw->code_size;
+    }
+}
+
+
+// Write out any pending data as a sub-block.
+static void flush_block(gif_lzw* lzw)
+{
+    if (lzw->block_len == 0) {
+        return;
+    }
+    lzw->block[0] = (uint8_t)lzw->block_len;
+    if (im_out_write(lzw->out, lzw->block, lzw->block_len + 1) != (size_t)lzw->block_len + 1) {
+        lzw->err = true;
+    }
+    lzw->block_len = 0;
+}
+
+
+// For each colour, list the other palette entries close enough to stand in
+// for it, nearest first.
+static void build_near(gif_lzw* lzw, const uint8_t* pal, unsigned int ncolours, int trans, int lossy)
+{
+    int limit = lossy * lossy;
+    unsigned int p, q;
+
+    memset(lzw->near_count, 0, sizeof(lzw->near_count));
+    for (p = 0; p < ncolours && p < 256; ++p) {
+        int dists[256];
+        unsigned int n = 0;
+        if ((int)p == trans) {
+            continue;
+        }
+        for (q = 0; q < ncolours && q < 256; ++q) {
+            const uint8_t* a = pal + p * 4;
+            const uint8_t* b = pal + q * 4;
+            int dr = a[0] - b[0];
+            int dg = a[1] - b[1];
+            int db = a[2] - b[2];
+            int d = dr * dr + dg * dg + db * db;
+            unsigned int k;
+            if (q == p || (int)q == trans || d > limit) {
+                continue;
+            }
+            // Insertion sort by distance.
+            for (k = n; k > 0 && dists[k - 1] > d; --k) {
+                dists[k] = dists[k - 1];
+                lzw->near[p][k] = lzw->near[p][k - 1];
+            }
+            dists[k] = d;
+            lzw->near[p][k] = (uint8_t)q;
+            ++n;
+        }
+        lzw->near_count[p] = (uint16_t)n;
+    }
+}
+
@@ -52,6 +52,16 @@ static ImErr translate_err( int gif_err_code )
     }
 }
 
+static ImDispose translate_disposal(int gif_disposal)
+{
+    switch (gif_disposal) {
+        case DISPOSE_DO_NOT: return IM_DISPOSE_NONE;
+        case DISPOSE_BACKGROUND: return IM_DISPOSE_BACKGROUND;
+        case DISPOSE_PREVIOUS: return IM_DISPOSE_PREVIOUS;
+        default: return IM_DISPOSE_UNSPECIFIED;
+    }
+}
+
 struct rect {
     int x,y,w,h;
 };
@@ -65,16 +75,15 @@ typedef struct gif_reader {
     bool gcb_valid;
     GraphicsControlBlock gcb;
 
-    // int loop_count; // from NETSCAPE block
+    int loop_count; // from NETSCAPE block (-1 if none)
     // TODO: stash any comment extension records we encounter
 
     // buffer to hold one line (only used for transparency decode)
     uint8_t *linebuf;
 
-    // Coalesce means compose the frames are rendered as go.
-    // Without coalesce, each frame will be returned exactly as it is stored
-    // in the file (all different sizes/offsets etc).
-    bool coalesce;
+    // Coalescing (rdr->coalesce) means the frames are composited as we
+    // go. Without it, each frame is returned exactly as it is stored in
+    // the file (all different sizes/offsets etc).
     im_img* accumulator;    // the latest decoded frame
     im_img* backup; // backup of accumulator, used for DISPOSE_BACKGROUND frames
     struct rect disposalrect;
@@ -111,8 +120,8 @@ static im_read* gif_read_create(im_in *in, ImErr *err)
     // gif-specific fields
     gr->gif = NULL;
     gr->gcb_valid = false;
+    gr->loop_count = -1;
     gr->linebuf = NULL;
-    gr->coalesce = true;
     gr->accumulator = NULL;
     gr->backup = NULL;
     gr->disposal = DISPOSAL_UNSPECIFIED;
@@ -134,6 +143,9 @@ static void read_file_header(im_read* rdr)
         rdr->err = translate_err(giferr);
         return;
     }
+    if (!i_read_check_size(rdr, (unsigned int)gr->gif->SWidth, (unsigned int)gr->gif->SHeight, 1)) {
+        return;
+    }
 
     // we need a buffer big enough to decode a line
     gr->linebuf = imalloc((size_t)gr->gif->SWidth);
@@ -143,7 +155,7 @@ static void read_file_header(im_read* rdr)
     }
 
     // if we're coalescing, then use an accumulator image big enough for the entire canvas
-    if (gr->coalesce) {
+    if (rdr->coalesce) {
         int w = (int)gr->gif->SWidth;
         int h = (int)gr->gif->SHeight;
         gr->accumulator = im_img_new(w, h, 1, IM_FMT_INDEX8);
@@ -226,6 +238,29 @@ static bool gif_read_img(im_read* rdr)
                     info->fmt = img->format;
                     info->pal_num_colours = img->pal_num_colours;
 
+                    // Animation details.
+                    info->loop_count = gr->loop_count;
+                    if (gr->gcb_valid) {
+                        info->delay_ms = (unsigned int)gr->gcb.DelayTime * 10;
+                        info->disposal = translate_disposal(gr->gcb.DisposalMode);
+                        info->transparent_index = gr->gcb.TransparentColor;
+                    } else {
+                        info->delay_ms = 0;
+                        info->disposal = IM_DISPOSE_UNSPECIFIED;
+                        info->transparent_index = -1;
+                    }
+                    if (rdr->coalesce) {
+                        // We deliver complete frames, with the disposal
+                        // already applied, so there's nothing for the
+                        // caller to dispose of or to see through to.
+                        // (Transparent pixels still have a zero alpha in
+                        // the palette.)
+                        info->disposal = IM_DISPOSE_NONE;
+                        info->transparent_index = -1;
+                    }
+                    // A GCB only applies to the image following it.
+                    gr->gcb_valid = false;
+
                     if (img->pal_num_colours>0) {
                         // Copy out palette, in RGBA format.
                         rdr->pal_data = irealloc(rdr->pal_data, img->pal_num_colours * im_fmt_bytesperpixel(IM_FMT_RGBA));
@@ -290,8 +325,15 @@ static void process_image(im_read* rdr)
         rdr->err = translate_err(gif->Error);
         return;
     }
+    if (rdr->coalesce) {
+        if (!i_read_check_size(rdr, (unsigned int)gif->SWidth, (unsigned int)gif->SHeight, 1)) {
+            return;
+        }
+    } else if (!i_read_check_size(rdr, (unsigned int)gif->Image.Width, (unsigned int)gif->Image.Height, 1)) {
+        return;
+    }
 
-    if (gr->coalesce) {
+    if (rdr->coalesce) {
         // We're combining frames into the accumulator image as we go along.
         int disposal = DISPOSAL_UNSPECIFIED;
         if (gr->gcb_valid) {
@@ -377,9 +419,9 @@ static void process_image(im_read* rdr)
             return;
         }
 
+        // Disposal and transparency are passed on from the GCB.
         img->x_offset = (int)gif->Image.Left;
         img->y_offset = (int)gif->Image.Top;
-        // TODO: record disposal details here
 
         if (gr->accumulator) {
             im_img_free(gr->accumulator);
@@ -483,6 +525,7 @@ static bool process_extension(im_read *rdr)
     GifFileType* gif = gr->gif;
     GifByteType* buf;
     int ext_code;
+    bool netscape = false;
 
     if (DGifGetExtension(gif, &ext_code, &buf) != GIF_OK) {
         return false;
@@ -498,7 +541,10 @@ static bool process_extension(im_read *rdr)
                 state->gcb.DisposalMode, state->gcb.DelayTime, state->gcb.TransparentColor );
                 */
     } else if (ext_code==APPLICATION_EXT_FUNC_CODE) {
-        // TODO: check for NETSCAPE block with loop count
+        // Check for NETSCAPE block with loop count (in the next sub-block).
+        if (buf[0] == 11 && memcmp(buf + 1, "NETSCAPE2.0", 11) == 0) {
+            netscape = true;
+        }
         /*
         printf("ext (0xff - application) %d bytes: '%c%c%c%c%c%c%c%c'\n",
              buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8]);
@@ -515,6 +561,9 @@ static bool process_extension(im_read *rdr)
             //printf("  endext\n");
             break;
         }
+        if (netscape && buf[0] >= 3 && buf[1] == 0x01) {
+            gr->loop_count = (int)buf[2] | ((int)buf[3] << 8);
+        }
         // TODO: collect comment blocks here
         //printf("  extnext (%d bytes)\n", buf[0]);
     }
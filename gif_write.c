@@ -17,19 +17,48 @@ typedef struct gif_writer {
     GifFileType *gif;
     ColorMapObject* global_cm;
     ColorMapObject* local_cm;
+    unsigned int screen_w;
+    unsigned int screen_h;
+
+    // Our own LZW encoder, which takes over from giflib for the image data.
+    gif_lzw lzw;
+
+    // Frame optimisation (IM_WRITE_OPT_OPTIMISE_FRAMES).
+    // The whole frame is collected in framebuf, then compared against
+    // canvas (what a viewer will be showing after the previous frame) so
+    // only the changed area needs to be written.
+    bool buffering;         // collecting the current frame in framebuf?
+    uint8_t* framebuf;
+    uint8_t* canvas;
+    bool canvas_valid;
+    int canvas_trans;       // transparent index when canvas was built
+    unsigned int canvas_pal_num_colours;
+    uint8_t canvas_pal[256*4];  // palette when canvas was built
 } gif_writer;
 
+struct rect {
+    unsigned int x, y, w, h;
+};
+
 
 static void pre_img(im_write* wr);
 static void emit_header(im_write* wr);
 static void emit_rows(im_write *wr, unsigned int num_rows, const void *data, int stride);
+static void post_img(im_write* wr);
 static void finish(im_write* wr);
 
+static void emit_frame_header(im_write* wr, int x, int y, unsigned int w, unsigned int h, int trans);
+static void emit_optimised_frame(im_write* wr);
+static bool find_changes(gif_writer* gw, int trans, struct rect* r, bool used[256]);
+static void update_canvas(gif_writer* gw);
+static int frame_trans(im_write* wr);
+
 
 static int calc_colour_res(int ncolours);
 static bool colormaps_equal(ColorMapObject const* a, ColorMapObject const* b);
 static ColorMapObject* cvt_palette(unsigned int num_colours, const uint8_t *src, int* trans);
 static ImErr translate_err(int gif_err_code);
+static int translate_disposal(ImDispose disposal);
 static int output_fn(GifFileType *gif, const GifByteType *buf, int size);
 
 static bool write_loops(GifFileType*gif, int loops);
@@ -40,7 +69,7 @@ static struct write_handler gif_write_handler = {
     pre_img,
     emit_header,
     emit_rows,
-    NULL,   // post_img()
+    post_img,
     finish
 };
 
@@ -59,6 +88,14 @@ im_write* igif_new_writer(im_out* out, ImErr* err)
     gw->gif = NULL;
     gw->global_cm = NULL;
     gw->local_cm = NULL;
+    gw->screen_w = 0;
+    gw->screen_h = 0;
+    gw->buffering = false;
+    gw->framebuf = NULL;
+    gw->canvas = NULL;
+    gw->canvas_valid = false;
+    gw->canvas_trans = NO_TRANSPARENT_COLOR;
+    gw->canvas_pal_num_colours = 0;
     return (im_write*)gw;
 }
 
@@ -66,8 +103,8 @@ im_write* igif_new_writer(im_out* out, ImErr* err)
 // im_set_palette() et al...
 static void pre_img(im_write* writer)
 {
-    // Only accept indexed data. We won't do quantisation on-the-fly, so this
-    // will fail if the user is planning to send us RGB or whatever.
+    // Only accept indexed data. Truecolour input will be quantised down
+    // by the generic write code.
     i_write_set_internal_fmt(writer, IM_FMT_INDEX8);
     if (writer->err != IM_ERR_NONE) {
         return;
@@ -103,6 +140,8 @@ static void emit_header(im_write* wr)
         // GIF89 - TODO: only if needed...
         EGifSetGifVersion(gw->gif, true);
 
+        gw->screen_w = wr->w;
+        gw->screen_h = wr->h;
         if (GIF_OK != EGifPutScreenDesc(gw->gif,
             wr->w,  // TODO: option to specify screen size in advance?
             wr->h,
@@ -115,18 +154,49 @@ static void emit_header(im_write* wr)
             return;
         }
 
-        // Assume endlessly-looping gif.
-        write_loops(gw->gif, 0);
+        // Loop count (defaults to 0 - endlessly-looping gif).
+        if (wr->loop_count >= 0) {
+            if (!write_loops(gw->gif, wr->loop_count)) {
+                wr->err = translate_err(gw->gif->Error);
+                return;
+            }
+        }
+    }
+
+    if (wr->optimise_frames) {
+        // Collect the whole frame first - post_img() will write it out.
+        size_t nbytes;
+        if (!i_size_img(wr->w, wr->h, 1, &nbytes)) {
+            wr->err = IM_ERR_NOMEM;
+            return;
+        }
+        gw->framebuf = irealloc(gw->framebuf, nbytes);
+        if (!gw->framebuf) {
+            wr->err = IM_ERR_NOMEM;
+            return;
+        }
+        gw->buffering = true;
+        return;
     }
 
     // Now, write out the frame!
+    emit_frame_header(wr, wr->x_offset, wr->y_offset, wr->w, wr->h, frame_trans(wr));
+    // We're not tracking what's on screen.
+    gw->canvas_valid = false;
+}
+
+
+// Emit the palette, GCB and image descriptor for a frame.
+static void emit_frame_header(im_write* wr, int x, int y, unsigned int w, unsigned int h, int trans)
+{
+    gif_writer* gw = (gif_writer*)wr;
 
     // Has the palette changed?
     if (gw->local_cm) {
         GifFreeMapObject(gw->local_cm);
     }
-    int trans = NO_TRANSPARENT_COLOR;
-    gw->local_cm = cvt_palette(wr->pal_num_colours, wr->pal_data, &trans);
+    int pal_trans = NO_TRANSPARENT_COLOR;
+    gw->local_cm = cvt_palette(wr->pal_num_colours, wr->pal_data, &pal_trans);
     if( gw->local_cm == NULL) {
         wr->err = IM_ERR_NO_PALETTE;
         return;
@@ -141,10 +211,15 @@ static void emit_header(im_write* wr)
     {
         uint8_t gcb_buf[4];
         GraphicsControlBlock gcb = {0};
-        gcb.DisposalMode = DISPOSAL_UNSPECIFIED;
+        // Delay is in 0.01sec units, and only 16 bits wide.
+        unsigned int delay = wr->delay_ms / 10 + (wr->delay_ms % 10 >= 5 ? 1 : 0);
+        if (delay > 65535) {
+            delay = 65535;
+        }
+        gcb.DisposalMode = translate_disposal(wr->disposal);
         gcb.UserInputFlag = false;
-        gcb.DelayTime = 10; // in 0.01sec units
-        gcb.TransparentColor = NO_TRANSPARENT_COLOR;    //trans;
+        gcb.DelayTime = (int)delay;
+        gcb.TransparentColor = trans;   // -1 = NO_TRANSPARENT_COLOR
 
         EGifGCBToExtension(&gcb, (GifByteType*)gcb_buf);
 
@@ -156,14 +231,22 @@ static void emit_header(im_write* wr)
 
     if (GIF_OK != EGifPutImageDesc(
         gw->gif,
-        wr->x_offset, wr->y_offset,
-        wr->w, wr->h,
+        x, y,
+        w, h,
         false,  // interlace
         gw->local_cm))        // can be null.
     {
         wr->err = translate_err(gw->gif->Error);
         return;
     }
+
+    // giflib has written out the LZW code size, based on the colormap
+    // in use. We take it from there.
+    {
+        ColorMapObject* cm = gw->local_cm ? gw->local_cm : gw->global_cm;
+        i_gif_lzw_start(&gw->lzw, wr->out, cm->BitsPerPixel,
+            wr->lossy, wr->pal_data, wr->pal_num_colours, trans);
+    }
 }
 
 
@@ -174,13 +257,244 @@ static void emit_rows(im_write *wr, unsigned int num_rows, const void *data, int
     uint8_t const* src = data;
 
     assert(wr->internal_fmt == IM_FMT_INDEX8);
+    if (gw->buffering) {
+        uint8_t* dest = gw->framebuf + (size_t)wr->rows_written * wr->w;
+        for (i = 0; i < num_rows; ++i) {
+            memcpy(dest, src, wr->w);
+            dest += wr->w;
+            src += stride;
+        }
+        return;
+    }
+
     for (i = 0; i < num_rows; ++i) {
-        if( GIF_OK !=EGifPutLine(gw->gif, (GifPixelType *)src, wr->w)) {
-            wr->err = translate_err(gw->gif->Error);
+        i_gif_lzw_encode(&gw->lzw, src, wr->w);
+        src += stride;
+    }
+}
+
+
+// called after last row written
+static void post_img(im_write* wr)
+{
+    gif_writer* gw = (gif_writer*)wr;
+    if (gw->buffering) {
+        gw->buffering = false;
+        emit_optimised_frame(wr);
+        return;
+    }
+    if (!i_gif_lzw_finish(&gw->lzw)) {
+        wr->err = IM_ERR_FILE;
+    }
+}
+
+
+// Is the canvas valid for comparing against the current frame?
+static bool canvas_usable(gif_writer* gw)
+{
+    im_write* wr = (im_write*)gw;
+    return gw->canvas_valid &&
+        gw->canvas_trans == frame_trans(wr) &&
+        gw->canvas_pal_num_colours == wr->pal_num_colours &&
+        memcmp(gw->canvas_pal, wr->pal_data, wr->pal_num_colours * 4) == 0;
+}
+
+// The transparent index for the current frame. If the caller hasn't set
+// one, a palette made by the quantiser can supply one for transparent pixels.
+static int frame_trans(im_write* wr)
+{
+    unsigned int i;
+    if (wr->transparent_index != NO_TRANSPARENT_COLOR || !wr->pal_generated) {
+        return wr->transparent_index;
+    }
+    for (i = 0; i < wr->pal_num_colours; ++i) {
+        if (wr->pal_data[i * 4 + 3] == 0) {
+            return (int)i;
+        }
+    }
+    return NO_TRANSPARENT_COLOR;
+}
+
+// Does a pixel need to be drawn to turn canvas colour c into colour v?
+// (Any pixel matching the transparent index leaves the canvas untouched).
+static inline bool needs_drawing(uint8_t v, uint8_t c, int trans)
+    { return v != c && (int)v != trans; }
+
+
+// Write out the frame collected in framebuf, cropped to the area which
+// differs from the canvas, and with unchanged pixels set transparent.
+static void emit_optimised_frame(im_write* wr)
+{
+    gif_writer* gw = (gif_writer*)wr;
+    struct rect r = {0, 0, wr->w, wr->h};
+    int frame_t = frame_trans(wr);
+    int trans = frame_t;
+    bool full_canvas;
+    bool optimise;
+    unsigned int x, y;
+
+    full_canvas = (wr->x_offset == 0 && wr->y_offset == 0 &&
+        wr->w == gw->screen_w && wr->h == gw->screen_h);
+
+    // Can only compare against the previous frame if we know what it left
+    // on screen. Frames which get cleared to background afterward are
+    // written out in full, so the whole area gets cleared.
+    optimise = full_canvas &&
+        canvas_usable(gw) &&
+        wr->disposal != IM_DISPOSE_BACKGROUND;
+
+    if (optimise) {
+        bool used[256] = {false};
+        if (!find_changes(gw, trans, &r, used)) {
+            // No change at all, but still need a frame to hold the delay.
+            r.x = 0;
+            r.y = 0;
+            r.w = 1;
+            r.h = 1;
+        }
+        // If there's no transparent colour already, pick an unused one.
+        if (trans == NO_TRANSPARENT_COLOR) {
+            unsigned int i;
+            for (i = 0; i < wr->pal_num_colours; ++i) {
+                if (!used[i]) {
+                    trans = (int)i;
+                    break;
+                }
+            }
+        }
+        // Blank out everything which doesn't need drawing, and track what
+        // will be left on screen for the next frame.
+        for (y = r.y; y < r.y + r.h; ++y) {
+            uint8_t* p = gw->framebuf + (size_t)y * wr->w + r.x;
+            uint8_t* c = gw->canvas + (size_t)y * wr->w + r.x;
+            for (x = 0; x < r.w; ++x) {
+                if (needs_drawing(p[x], c[x], frame_t)) {
+                    if (wr->disposal != IM_DISPOSE_PREVIOUS) {
+                        c[x] = p[x];
+                    }
+                } else if (trans != NO_TRANSPARENT_COLOR) {
+                    p[x] = (uint8_t)trans;
+                }
+            }
+        }
+    }
+
+    emit_frame_header(wr, wr->x_offset + r.x, wr->y_offset + r.y, r.w, r.h, trans);
+    if (wr->err != IM_ERR_NONE) {
+        return;
+    }
+    for (y = r.y; y < r.y + r.h; ++y) {
+        uint8_t* src = gw->framebuf + (size_t)y * wr->w + r.x;
+        i_gif_lzw_encode(&gw->lzw, src, r.w);
+    }
+    if (!i_gif_lzw_finish(&gw->lzw)) {
+        wr->err = IM_ERR_FILE;
+        return;
+    }
+
+    // If the canvas wasn't updated above, figure out what'll be on screen
+    // for the next frame.
+    if (!full_canvas) {
+        gw->canvas_valid = false;
+    } else if (!optimise) {
+        update_canvas(gw);
+    }
+}
+
+
+// Find the bounding box of pixels in framebuf which differ from the canvas.
+// Also flags which colours are used by those pixels.
+// Returns false if there are no differences.
+static bool find_changes(gif_writer* gw, int trans, struct rect* r, bool used[256])
+{
+    im_write* wr = (im_write*)gw;
+    unsigned int xmin = wr->w;
+    unsigned int xmax = 0;
+    unsigned int ymin = wr->h;
+    unsigned int ymax = 0;
+    unsigned int x, y;
+
+    for (y = 0; y < wr->h; ++y) {
+        const uint8_t* p = gw->framebuf + (size_t)y * wr->w;
+        const uint8_t* c = gw->canvas + (size_t)y * wr->w;
+        bool changed = false;
+        for (x = 0; x < wr->w; ++x) {
+            if (needs_drawing(p[x], c[x], trans)) {
+                used[p[x]] = true;
+                if (x < xmin) {
+                    xmin = x;
+                }
+                if (x > xmax) {
+                    xmax = x;
+                }
+                changed = true;
+            }
+        }
+        if (changed) {
+            if (y < ymin) {
+                ymin = y;
+            }
+            ymax = y;
+        }
+    }
+    if (ymin > ymax) {
+        return false;
+    }
+    r->x = xmin;
+    r->y = ymin;
+    r->w = (xmax - xmin) + 1;
+    r->h = (ymax - ymin) + 1;
+    return true;
+}
+
+
+// Update the canvas to reflect what'll be on screen once the current frame
+// (a full-canvas one, in framebuf) has been shown and disposed of.
+static void update_canvas(gif_writer* gw)
+{
+    im_write* wr = (im_write*)gw;
+    size_t n = (size_t)wr->w * wr->h;
+    int trans = frame_trans(wr);
+    size_t i;
+
+    if (!gw->canvas) {
+        gw->canvas = imalloc(n);
+        if (!gw->canvas) {
+            wr->err = IM_ERR_NOMEM;
             return;
         }
-        src += stride;
+        gw->canvas_valid = false;
+    }
+
+    if (wr->disposal == IM_DISPOSE_PREVIOUS) {
+        // The screen goes back to how it was.
+        return;
     }
+    if (wr->disposal == IM_DISPOSE_BACKGROUND) {
+        // Cleared. We can use the transparent index to mean "unknown", so
+        // any solid pixel will be redrawn.
+        if (trans == NO_TRANSPARENT_COLOR) {
+            gw->canvas_valid = false;
+        } else {
+            memset(gw->canvas, trans, n);
+            gw->canvas_valid = true;
+        }
+    } else if (!canvas_usable(gw)) {
+        // Start afresh. Any transparent pixels are left as "unknown".
+        memcpy(gw->canvas, gw->framebuf, n);
+        gw->canvas_valid = true;
+    } else {
+        // Draw the solid pixels over the canvas.
+        for (i = 0; i < n; ++i) {
+            if ((int)gw->framebuf[i] != trans) {
+                gw->canvas[i] = gw->framebuf[i];
+            }
+        }
+    }
+
+    gw->canvas_trans = trans;
+    gw->canvas_pal_num_colours = wr->pal_num_colours;
+    memcpy(gw->canvas_pal, wr->pal_data, wr->pal_num_colours * 4);
 }
 
 
@@ -211,14 +525,21 @@ static ColorMapObject* cvt_palette(unsigned int num_colours, const uint8_t *src,
     ColorMapObject* cm;
     GifColorType* dest;
     int i;
+    int size;
 
     if (num_colours == 0) {
         return NULL;
     }
-    cm = GifMakeMapObject(num_colours, NULL);
+    // GIF colormaps must be a power of two in size. Pad out with black.
+    size = 2;
+    while (size < num_colours) {
+        size *= 2;
+    }
+    cm = GifMakeMapObject(size, NULL);
     if (!cm) {
         return NULL;
     }
+    memset(cm->Colors, 0, sizeof(GifColorType) * size);
     *trans = NO_TRANSPARENT_COLOR;  // -1
 
     dest = cm->Colors;
@@ -246,6 +567,16 @@ static ImErr translate_err(int gif_err_code)
     }
 }
 
+static int translate_disposal(ImDispose disposal)
+{
+    switch (disposal) {
+        case IM_DISPOSE_NONE: return DISPOSE_DO_NOT;
+        case IM_DISPOSE_BACKGROUND: return DISPOSE_BACKGROUND;
+        case IM_DISPOSE_PREVIOUS: return DISPOSE_PREVIOUS;
+        default: return DISPOSAL_UNSPECIFIED;
+    }
+}
+
 static int calc_colour_res(int ncolours)
 {
     int i;
@@ -269,6 +600,14 @@ static void finish(im_write* wr)
         GifFreeMapObject(gw->local_cm);
         gw->local_cm = NULL;
     }
+    if (gw->framebuf) {
+        ifree(gw->framebuf);
+        gw->framebuf = NULL;
+    }
+    if (gw->canvas) {
+        ifree(gw->canvas);
+        gw->canvas = NULL;
+    }
 
     if (gw->gif) {
         int giferr;
@@ -1,14 +1,25 @@
 #include "impy.h"
 #include "private.h"
 
+#include <assert.h>
 #include <string.h>
 
 
-
-#if 0   // IFF disabled for now
-
+// IFF reader - ILBM and PBM images, and ANIM (ANIM5 deltas only).
+// ILBMs of up to 8 planes are read as IM_FMT_INDEX8, deep (24 and 32
+// plane) ones as IM_FMT_RGB and IM_FMT_RGBA.
+//
+// Format references:
+// http://www.fileformat.info/format/iff/egff.htm
+// https://wiki.amigaos.net/wiki/ILBM_IFF_Interleaved_Bitmap
+// https://wiki.amigaos.net/wiki/ANIM_IFF_CEL_Animations
+//
 // Good collection of anims to test with at:
 // http://www.randelshofer.ch/animations/
+//
+// The file is parsed a chunk at a time as frames are requested. Each chunk
+// we're interested in is read into memory in one go and decoded from
+// there.
 
 
 // mask values
@@ -21,6 +32,10 @@
 #define cmpNone	0
 #define cmpByteRun1	1
 
+// CAMG viewport modes
+#define camgEHB 0x0080  // extra halfbrite
+#define camgHAM 0x0800  // hold and modify
+
 typedef struct {
 	uint16_t w, h;	/* raster width & height in pixels	*/
     int16_t  x, y;	/* pixel position for this image	*/
@@ -58,622 +73,983 @@ typedef struct {
 } AnimHeader;
 
 
+// A block of the image: rows y0 to y1 and columns x0 to x1 (exclusive).
+// Columns are bytes within a plane (ie 8 pixels) for ILBM, pixels for PBM.
+typedef struct iff_rect {
+    int x0, y0, x1, y1;
+} iff_rect;
+
+// Maximum FORM nesting we'll follow.
+#define IFF_MAX_DEPTH 8
+
+typedef struct iff_form {
+    char kind[4];
+    uint32_t left;      // bytes left in the FORM (excluding any pad byte)
+    bool pad;
+} iff_form;
+
+typedef struct iff_reader {
+    im_read base;
+
+    // Currently-open FORMs.
+    iff_form forms[IFF_MAX_DEPTH];
+    int depth;
+    bool started;
+    bool done;
+    bool anim;          // inside a FORM ANIM?
 
-typedef struct frame {
-    int num;    // which frame number this one is (ie index in ctx->frames[])
-    char kind[4];   // ILBM or PBM
-    // ilbm/pbm fields
+    // Image layout, from the first BMHD. All frames share it.
     bool got_bmhd;
     BitMapHeader bmhd;
-    uint8_t* image_data;
-    uint8_t* mask_data;
-    uint8_t* cmap_data;
-    int cmap_len;
+    bool pbm;           // chunky (PBM) rather than planar (ILBM)
+    uint32_t camg;
+    uint8_t cmap[256*3];
+    int cmap_len;       // number of colours in cmap
 
+    // Per-frame.
     bool got_anhd;
     AnimHeader anhd;
+    bool got_frame;     // had a BODY or DLTA in the current FORM?
+
+    // Image data, in the same layout as the BODY (ie planar, with
+    // interleaved rows, for ILBM).
+    // ANIM deltas apply to the frame two back, so two buffers are kept and
+    // alternated between.
+    size_t plane_pitch; // bytes per row of one plane (or of PBM pixels)
+    size_t row_bytes;   // bytes per row, all planes (and mask)
+    uint8_t* frames[2];
+    int cur;            // which buffer holds the current frame
+    int nframes;        // number of frames decoded so far
+
+    // For ANIMs, the current frame is also kept in output form, and only
+    // the area which changes is converted for each new frame.
+    uint8_t* chunky;
+    size_t chunky_pitch;
+    iff_rect dirty;     // where the frame being built might have changed
+    iff_rect changed;   // where the last frame changed
+    bool pal_changed;   // colours changed since the last frame?
+
+    // Chunk data is read in here.
+    uint8_t* chunk;
+    size_t chunk_cap;
+} iff_reader;
 
-} frame;
 
-typedef struct context {
-//    char kind[4];       // "ILBM", "PBM ", "ANIM" (or "root")
-    int level;
-    frame** frames;
-    int nframes;
-    int capacity;
-    // a general-purpose buffer
-    uint8_t* buf;
-    size_t bufsize;
-} context;
+static inline bool chkcc( const void* a, const void* b) {
+    const char* aa = a;
+    const char* bb = b;
+    return (aa[0]==bb[0]) && (aa[1]==bb[1]) && (aa[2]==bb[2]) && (aa[3]==bb[3]);
+}
 
+static bool iff_match_cookie(const uint8_t* buf, int nbytes);
+static im_read* iff_read_create(im_in *in, ImErr *err);
+static bool iff_get_img(im_read* rdr);
+static void iff_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride);
+static void iff_read_finish(im_read* rdr);
+
+i_read_handler i_iff_read_handler = {
+    IM_FILETYPE_ILBM,
+    iff_match_cookie,
+    iff_read_create,
+    iff_get_img,
+    iff_read_rows,
+    iff_read_finish
+};
+
+static bool emit_frame(iff_reader* ir);
+static unsigned int frame_bpp(const iff_reader* ir);
+static void consume(iff_reader* ir, uint32_t n);
+static bool skip(iff_reader* ir, uint32_t n);
+static bool slurp(iff_reader* ir, uint32_t chunklen);
+static bool slurp_part(iff_reader* ir, uint32_t chunklen, uint32_t keep);
+static bool handle_FORM(iff_reader* ir, uint32_t chunklen);
+static bool handle_BMHD(iff_reader* ir, uint32_t chunklen);
+static bool handle_CAMG(iff_reader* ir, uint32_t chunklen);
+static bool handle_CMAP(iff_reader* ir, uint32_t chunklen);
+static bool handle_BODY(iff_reader* ir, uint32_t chunklen);
+static bool handle_ANHD(iff_reader* ir, uint32_t chunklen);
+static bool handle_DLTA(iff_reader* ir, uint32_t chunklen);
+static uint8_t* target_frame(iff_reader* ir, bool from_prev);
+static bool update_chunky(iff_reader* ir);
+static void convert_block(iff_reader* ir, const iff_rect* r, uint8_t* dest, int stride);
+static void unpack_byterun1(const uint8_t** srcp, const uint8_t* end, uint8_t* dest, size_t n);
+static bool decodeANIM5chunk(const uint8_t* src, size_t chunklen, uint8_t* dest,
+        int ncols, int nplanes, int height, size_t pitch, iff_rect* touched);
+static void planar_to_chunky(const uint8_t* src, size_t plane_pitch, int nplanes,
+        unsigned int w, uint8_t* dest, int dest_step);
 
-static context* ctx_new() {
-    context* ctx = imalloc(sizeof(context));
-    memset(ctx,0,sizeof(context));
-    return ctx;
-}
 
-static bool ctx_size_buffer(context* ctx, size_t newsize) {
-    if (newsize < ctx->bufsize) {
-        return true;    // big enough already
+static bool iff_match_cookie(const uint8_t* buf, int nbytes)
+{
+    assert(nbytes >= 12);
+    if (!chkcc(buf,"FORM") ) {
+        return false;
     }
-
-    if (ctx->buf) {
-        ifree(ctx->buf);
+    if (chkcc(buf+8,"ILBM")) {
+        return true;
     }
-    ctx->buf = imalloc(newsize);
-    if (!ctx->buf) {
-        ctx->bufsize = 0;
-        return false;
+    if (chkcc(buf+8,"PBM ")) {
+        return true;
     }
+    if (chkcc(buf+8,"ANIM")) {
+        return true;
+    }
+    return false;
+}
 
-    ctx->bufsize = newsize;
-    return true;
+
+static im_read* iff_read_create(im_in *in, ImErr *err)
+{
+    iff_reader* ir = imalloc(sizeof(iff_reader));
+    if (!ir) {
+        *err = IM_ERR_NOMEM;
+        return NULL;
+    }
+    // Lots of fields - start with everything zeroed.
+    memset(ir, 0, sizeof(iff_reader));
+    i_read_init(&ir->base);
+    ir->base.handler = &i_iff_read_handler;
+    ir->base.in = in;
+    return (im_read*)ir;
 }
 
-static frame* ctx_add_frame(context* ctx, const char* kind) 
+
+// Parse chunks until the next frame is complete.
+static bool iff_get_img(im_read* rdr)
 {
-    frame* f;
-    if (ctx->nframes == ctx->capacity) {
-        // need space to add new child
-        const int initial_cap = 8;
-        int newcap = ctx->frames ? ctx->capacity*2 : initial_cap;
-        frame** newdata = imalloc( sizeof(frame*) * newcap);
-        if (!newdata) {
-            return NULL;
+    iff_reader* ir = (iff_reader*)rdr;
+
+    while (true) {
+        uint8_t buf[8];
+        uint8_t* p;
+        uint32_t chunklen;
+        size_t n;
+        bool success;
+
+        // Close any finished FORMs. The end of an ILBM/PBM FORM completes
+        // a frame.
+        while (ir->depth > 0 && ir->forms[ir->depth - 1].left == 0) {
+            iff_form* f = &ir->forms[--ir->depth];
+            if (f->pad && !skip(ir, 1)) {
+                return false;
+            }
+            if ((chkcc(f->kind, "ILBM") || chkcc(f->kind, "PBM ")) && ir->got_frame) {
+                return emit_frame(ir);
+            }
         }
-        if (ctx->frames) {
-            memcpy(newdata, ctx->frames, sizeof(frame*)*ctx->nframes);
-            ifree(ctx->frames);
+        if (ir->done || (ir->started && ir->depth == 0)) {
+            return false;   // no more frames
         }
-        ctx->frames = newdata;
-        ctx->capacity = newcap;
-    }
 
-    // create and link in new frame
-    f = imalloc(sizeof(frame));
-    if (!f) {
-        return NULL;
+        n = im_in_read(rdr->in, buf, 8);
+        if (n != 8) {
+            if (!im_in_eof(rdr->in)) {
+                rdr->err = IM_ERR_FILE;
+                return false;
+            }
+            if (n != 0 || ir->nframes == 0) {
+                rdr->err = IM_ERR_MALFORMED;
+                return false;
+            }
+            // FUDGE for malformed files (eg Juggler.anim)
+            // we'll be lenient if file ends prematurely,
+            // but on a chunk boundary (and after the first frame).
+            ir->done = true;
+            ir->depth = 0;
+            if (ir->got_frame) {
+                return emit_frame(ir);
+            }
+            return false;
+        }
+        consume(ir, 8);
+        p = buf + 4;
+        chunklen = decode_u32be(&p);
+
+        if (!ir->started) {
+            if (!chkcc(buf, "FORM")) {
+                rdr->err = IM_ERR_MALFORMED;
+                return false;
+            }
+            ir->started = true;
+        } else if (chunklen > ir->forms[ir->depth - 1].left) {
+            rdr->err = IM_ERR_MALFORMED;
+            return false;
+        }
+
+        if (chkcc(buf,"FORM")) {
+            // FORM chunks have children
+            success = handle_FORM(ir, chunklen);
+            continue;
+        } else if (chkcc(buf,"BMHD")) {
+            success = handle_BMHD(ir, chunklen);
+        } else if (chkcc(buf,"CMAP")) {
+            success = handle_CMAP(ir, chunklen);
+        } else if (chkcc(buf,"CAMG")) {
+            success = handle_CAMG(ir, chunklen);
+        } else if (chkcc(buf,"BODY")) {
+            success = handle_BODY(ir, chunklen);
+        } else if (chkcc(buf,"ANHD")) {
+            success = handle_ANHD(ir, chunklen);
+        } else if (chkcc(buf,"DLTA")) {
+            success = handle_DLTA(ir, chunklen);
+        } else {
+            // unknown/unhandled chunk type. skip it.
+            success = skip(ir, chunklen + (chunklen & 1));
+        }
+        if (!success) {
+            return false;
+        }
     }
-    memset(f,0,sizeof(frame));
-    f->num = ctx->nframes;
-    memcpy( f->kind, kind, 4);
+}
 
-    ctx->frames[ctx->nframes] = f;
-    ++ctx->nframes;
 
-    return f;
+static void iff_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride)
+{
+    iff_reader* ir = (iff_reader*)rdr;
+    iff_rect r = {0, (int)rdr->rows_read, (int)ir->plane_pitch, (int)(rdr->rows_read + num_rows)};
+    const uint8_t* src;
+    uint8_t* dest = buf;
+    unsigned int i;
+
+    if (!ir->chunky) {
+        convert_block(ir, &r, dest, stride);
+        return;
+    }
+    // Anim - the frame is already converted.
+    src = ir->chunky + ir->chunky_pitch * rdr->rows_read;
+    for (i = 0; i < num_rows; ++i) {
+        memcpy(dest, src, ir->chunky_pitch);
+        src += ir->chunky_pitch;
+        dest += stride;
+    }
 }
 
-static void ctx_free(context* ctx)
+
+static void iff_read_finish(im_read* rdr)
 {
+    iff_reader* ir = (iff_reader*)rdr;
     int i;
-    if( ctx->frames) {
-        for( i=0; i<ctx->nframes; ++i) {
-            frame* f = ctx->frames[i];
-            if (f->image_data) {
-                ifree(f->image_data);
-            }
-            if (f->mask_data) {
-                ifree(f->mask_data);
-            }
-            if (f->cmap_data) {
-                ifree(f->cmap_data);
-            }
-            ifree(f);
+    for (i = 0; i < 2; ++i) {
+        if (ir->frames[i]) {
+            ifree(ir->frames[i]);
+            ir->frames[i] = NULL;
         }
-        ifree(ctx->frames);
     }
-    if( ctx->buf) {
-        ifree(ctx->buf);
+    if (ir->chunk) {
+        ifree(ir->chunk);
+        ir->chunk = NULL;
+    }
+    if (ir->chunky) {
+        ifree(ir->chunky);
+        ir->chunky = NULL;
     }
-    ifree(ctx);
 }
 
 
-static inline uint32_t padlen( uint32_t n) {
-    return (n&1) ? n+1 : n;
-}
-static inline bool chkcc( const void* a, const void* b) {
-    const char* aa = a;
-    const char* bb = b;
-    return (aa[0]==bb[0]) && (aa[1]==bb[1]) && (aa[2]==bb[2]) && (aa[3]==bb[3]);
+// A frame has been decoded - set up the image details for it.
+// Bytes per pixel of the frames we deliver: IM_FMT_INDEX8, or
+// IM_FMT_RGB/IM_FMT_RGBA for deep ILBMs.
+static unsigned int frame_bpp(const iff_reader* ir)
+{
+    if (!ir->pbm && ir->bmhd.nPlanes > 8) {
+        return ir->bmhd.nPlanes / 8;
+    }
+    return 1;
 }
 
-static bool is_iff(const uint8_t* buf, int nbytes);
-static bool match_iff_ext(const char* file_ext);
-static im_bundle* read_iff_bundle( im_in* rdr, ImErr* err );
-static bool handle_FORM( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err);
-static bool handle_BMHD( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err);
-static bool handle_CAMG( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err);
-static bool handle_CMAP( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err);
-static bool handle_BODY( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err);
-static bool handle_ANHD( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err);
-static bool handle_DLTA( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err);
-
-static int decodeLine( im_in* rdr, uint8_t* dest, int nbytes);
-static bool decodeANIM5chunk(const uint8_t* src, size_t chunklen, uint8_t* dest,
-        int ncols, int nplanes, int height);
-
-static im_img* frame_to_img(context* ctx, int frameidx, const uint8_t* cmap_data, size_t cmap_len, ImErr* err);
-static bool ctx_collect_bundle( context* ctx, im_bundle* out, ImErr* err);
+static bool emit_frame(iff_reader* ir)
+{
+    im_read* rdr = &ir->base;
+    im_imginfo* info = &rdr->curr;
+    BitMapHeader* bmhd = &ir->bmhd;
+    int ncolours;
+    int i;
+    uint8_t* dest;
 
-static const char* indent( int n );
-#if 0
-int dump_chunk( int nest, im_in *rdr );
-#endif
+    ir->got_frame = false;
+    // (Before update_chunky() does any work on it.)
+    if (!i_read_check_size(rdr, bmhd->w, bmhd->h, frame_bpp(ir))) {
+        return false;
+    }
 
-struct handler handle_iff = {is_iff, NULL, read_iff_bundle, match_iff_ext};
+    info->w = bmhd->w;
+    info->h = bmhd->h;
+    info->x_offset = 0;
+    info->y_offset = 0;
+    info->transparent_index = -1;
+    if (ir->anim) {
+        // Every frame we deliver is complete.
+        info->disposal = IM_DISPOSE_NONE;
+        info->loop_count = 0;
+        if (ir->got_anhd) {
+            // reltime is in jiffies (1/60th sec)
+            info->delay_ms = (ir->anhd.reltime * 1000) / 60;
+        }
+        if (!update_chunky(ir)) {
+            return false;
+        }
+    }
 
-static int parse_chunk( context* ctx, im_in* rdr, ImErr* err );
+    if (!ir->pbm && bmhd->nPlanes > 8) {
+        // Deep ILBM - truecolour, no palette.
+        info->fmt = (bmhd->nPlanes == 32) ? IM_FMT_RGBA : IM_FMT_RGB;
+        info->pal_num_colours = 0;
+        return true;
+    }
 
+    if (ir->camg & camgHAM) {
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
+    }
+    info->fmt = IM_FMT_INDEX8;
 
-static bool is_iff(const uint8_t* buf, int nbytes)
-{
-    if (!chkcc(buf,"FORM") ) {
+    // Palette, padded out to cover all the possible pixel values.
+    ncolours = ir->pbm ? 256 : (1 << bmhd->nPlanes);
+    rdr->pal_data = irealloc(rdr->pal_data, ncolours * 4);
+    if (!rdr->pal_data) {
+        rdr->err = IM_ERR_NOMEM;
         return false;
     }
-    if (chkcc(buf+8,"ILBM")) {
-        return true;
+    dest = rdr->pal_data;
+    for (i = 0; i < ncolours; ++i) {
+        if ((ir->camg & camgEHB) && i >= 32 && i < 64) {
+            // Extra halfbrite - top 32 colours are the bottom 32 at half
+            // brightness.
+            const uint8_t* c = rdr->pal_data + (i - 32) * 4;
+            dest[0] = c[0] >> 1;
+            dest[1] = c[1] >> 1;
+            dest[2] = c[2] >> 1;
+        } else if (i < ir->cmap_len) {
+            dest[0] = ir->cmap[i * 3 + 0];
+            dest[1] = ir->cmap[i * 3 + 1];
+            dest[2] = ir->cmap[i * 3 + 2];
+        } else {
+            dest[0] = dest[1] = dest[2] = 0;
+        }
+        dest[3] = 255;
+        dest += 4;
     }
-    if (chkcc(buf+8,"PBM ")) {
-        return true;
+    info->pal_num_colours = ncolours;
+
+    if (bmhd->masking == mskHasTransparentColor && bmhd->transparentColor < ncolours) {
+        info->transparent_index = bmhd->transparentColor;
     }
-    if (chkcc(buf+8,"ANIM")) {
-        return true;
+    return true;
+}
+
+
+// Account for n bytes read from the file.
+static void consume(iff_reader* ir, uint32_t n)
+{
+    int i;
+    for (i = 0; i < ir->depth; ++i) {
+        ir->forms[i].left = (ir->forms[i].left > n) ? ir->forms[i].left - n : 0;
     }
-    return false;
 }
 
-static bool match_iff_ext(const char* file_ext)
+
+static bool skip(iff_reader* ir, uint32_t n)
 {
-    if ((istricmp(file_ext,".iff")==0) ||
-        (istricmp(file_ext,".ilbm")==0) ||
-        (istricmp(file_ext,".lbm")==0) ||
-        (istricmp(file_ext,".pbm")==0)) {
-        return true;
+    if (im_in_seek(ir->base.in, n, IM_SEEK_CUR) != 0) {
+        ir->base.err = IM_ERR_FILE;
+        return false;
     }
+    consume(ir, n);
+    return true;
+}
 
-    return false;
+
+// Read a whole chunk into ir->chunk (and skip any pad byte).
+// Chunk lengths come straight from the file, so callers must make sure
+// chunklen is sensible before calling this.
+static bool slurp(iff_reader* ir, uint32_t chunklen)
+{
+    return slurp_part(ir, chunklen, chunklen);
+}
+
+// Read just the first `keep` bytes of a chunk into ir->chunk, and skip
+// the rest (and any pad byte).
+static bool slurp_part(iff_reader* ir, uint32_t chunklen, uint32_t keep)
+{
+    im_read* rdr = &ir->base;
+
+    if (keep > chunklen) {
+        keep = chunklen;
+    }
+    if (keep > ir->chunk_cap) {
+        uint8_t* p = irealloc(ir->chunk, keep);
+        if (!p) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        ir->chunk = p;
+        ir->chunk_cap = keep;
+    }
+    if (im_in_read(rdr->in, ir->chunk, keep) != keep) {
+        rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+        return false;
+    }
+    consume(ir, keep);
+    if (keep < chunklen && !skip(ir, chunklen - keep)) {
+        return false;
+    }
+    if (chunklen & 1) {
+        return skip(ir, 1);
+    }
+    return true;
 }
 
 
-static bool handle_FORM( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err)
+static bool handle_FORM(iff_reader* ir, uint32_t chunklen)
 {
+    im_read* rdr = &ir->base;
     char kind[4];
-    context* child = NULL;
-    int remaining = (int)chunklen;
+    iff_form* f;
 
-    if (remaining<4) {
-        *err = IM_ERR_MALFORMED;
+    if (chunklen < 4) {
+        rdr->err = IM_ERR_MALFORMED;
         return false;
     }
-
-    if (im_read(rdr, kind,4) != 4) {
-        *err = IM_ERR_MALFORMED;   // TODO: distingush between read error and eof
+    if (im_in_read(rdr->in, kind, 4) != 4) {
+        rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
         return false;
     }
-    remaining -= 4;
-
-    //printf("%sformtype=%c%c%c%c\n", indent(ctx->level), kind[0], kind[1], kind[2], kind[3]);
+    consume(ir, 4);
 
-    if (!chkcc(kind,"ILBM") && !chkcc(kind,"PBM ") && !chkcc(kind,"ANIM")) {
+    if ((!chkcc(kind,"ILBM") && !chkcc(kind,"PBM ") && !chkcc(kind,"ANIM")) ||
+        ir->depth == IFF_MAX_DEPTH) {
         // unsupported FORM type (eg 8SVX sound)- skip it
-        //printf("%s->skip\n", indent(ctx->level));
-        if(im_seek(rdr,remaining, SEEK_CUR) != 0 ) {
-            *err = IM_ERR_FILE;
-            return false;
-        }
-        return true;
+        return skip(ir, (chunklen - 4) + (chunklen & 1));
     }
 
-    // starting a new image/frame?
-    if (chkcc(kind,"ILBM") || chkcc(kind,"PBM ")) {
-        frame* f = ctx_add_frame(ctx,kind);
-        if (!f) {
-            *err = IM_ERR_NOMEM;
-            return false;
-        }
-    }
+    f = &ir->forms[ir->depth++];
+    memcpy(f->kind, kind, 4);
+    f->left = chunklen - 4;
+    f->pad = (chunklen & 1) != 0;
 
-    while (remaining>0) {
-        int n = parse_chunk(ctx,rdr,err);
-        if (n < 0) {
-            return false;
-        }
-        remaining -= n;
+    if (chkcc(kind, "ANIM")) {
+        ir->anim = true;
+    } else {
+        // starting a new image/frame
+        ir->got_anhd = false;
+        ir->got_frame = false;
     }
     return true;
 }
 
 
-static frame* ctx_curframe(context *ctx) {
-    if( ctx->frames && ctx->nframes>0) {
-        return ctx->frames[ctx->nframes-1];
-    } else {
-        return NULL;
+static bool handle_BMHD(iff_reader* ir, uint32_t chunklen)
+{
+    im_read* rdr = &ir->base;
+    BitMapHeader bmhd;
+    uint8_t* p;
+    bool pbm = chkcc(ir->forms[ir->depth - 1].kind, "PBM ");
+
+    if (chunklen != 20) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    if (!slurp(ir, chunklen)) {
+        return false;
+    }
+    p = ir->chunk;
+    bmhd.w = decode_u16be(&p);
+    bmhd.h = decode_u16be(&p);
+    bmhd.x = decode_s16be(&p);
+    bmhd.y = decode_s16be(&p);
+    bmhd.nPlanes = *p++;
+    bmhd.masking = *p++;
+    bmhd.compression = *p++;
+    bmhd.pad1 = *p++;
+    bmhd.transparentColor = decode_u16be(&p);
+    bmhd.xAspect = *p++;
+    bmhd.yAspect = *p++;
+    bmhd.pageWidth = decode_s16be(&p);
+    bmhd.pageHeight = decode_s16be(&p);
+
+    if (bmhd.compression != cmpNone && bmhd.compression != cmpByteRun1) {
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
     }
-}
 
-static bool handle_BMHD(context* ctx, im_in* rdr, uint32_t chunklen, ImErr *err )
-{
-    BitMapHeader* bmhd;
-    frame* f = ctx_curframe(ctx);
+    if (ir->got_bmhd) {
+        // Later frames can have their own BMHD, but we only cope if the
+        // layout stays the same.
+        if (bmhd.w != ir->bmhd.w || bmhd.h != ir->bmhd.h ||
+            bmhd.nPlanes != ir->bmhd.nPlanes ||
+            bmhd.masking != ir->bmhd.masking || pbm != ir->pbm) {
+            rdr->err = IM_ERR_UNSUPPORTED;
+            return false;
+        }
+        ir->bmhd = bmhd;
+        return true;
+    }
 
-    if( !f) {
-        *err = IM_ERR_MALFORMED;
+    if (bmhd.w == 0 || bmhd.h == 0) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    if (pbm ? (bmhd.nPlanes != 8) :
+        (bmhd.nPlanes < 1 || (bmhd.nPlanes > 8 && bmhd.nPlanes != 24 && bmhd.nPlanes != 32))) {
+        rdr->err = IM_ERR_UNSUPPORTED;
         return false;
     }
-    bmhd = &f->bmhd;
 
-    if (chunklen != 20) {
-        *err = IM_ERR_MALFORMED;
+    ir->bmhd = bmhd;
+    ir->pbm = pbm;
+    ir->got_bmhd = true;
+    if (!i_read_check_size(rdr, bmhd.w, bmhd.h, frame_bpp(ir))) {
         return false;
     }
-    bmhd->w = im_read_u16be(rdr);
-    bmhd->h = im_read_u16be(rdr);
-    bmhd->x = im_read_s16be(rdr);
-    bmhd->y = im_read_s16be(rdr);
-    bmhd->nPlanes = im_read_u8(rdr);
-    bmhd->masking = im_read_u8(rdr);
-    bmhd->compression = im_read_u8(rdr);
-    bmhd->pad1 = im_read_u8(rdr);
-    bmhd->transparentColor = im_read_u16be(rdr);
-    bmhd->xAspect = im_read_u8(rdr);
-    bmhd->yAspect = im_read_u8(rdr);
-    bmhd->pageWidth = im_read_s16be(rdr);
-    bmhd->pageHeight = im_read_s16be(rdr);
-
-    if(im_error(rdr)) {
-        *err = im_eof(rdr) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+    if (pbm) {
+        // rows are padded to even length
+        ir->plane_pitch = (bmhd.w + 1) & ~1;
+        ir->row_bytes = ir->plane_pitch;
+    } else {
+        // actual image data must be multiple of 16 pixels wide
+        ir->plane_pitch = ((bmhd.w + 15) / 16) * 2;
+        ir->row_bytes = ir->plane_pitch *
+            (bmhd.nPlanes + (bmhd.masking == mskHasMask ? 1 : 0));
+    }
+    ir->frames[0] = imalloc(ir->row_bytes * bmhd.h);
+    if (!ir->frames[0]) {
+        rdr->err = IM_ERR_NOMEM;
         return false;
     }
-    //printf("%s %dx%d planes: %d masking: %d compression: 0x%02x\n", indent(ctx->level), bmhd->w, bmhd->h, bmhd->nPlanes, bmhd->masking, bmhd->compression);
-    f->got_bmhd = true;
+    ir->cur = 0;
     return true;
 }
 
-static bool handle_CAMG(context* ctx, im_in* rdr, uint32_t chunklen, ImErr *err )
+
+static bool handle_CAMG(iff_reader* ir, uint32_t chunklen)
 {
-    uint8_t buf[4];
-    uint32_t mode;
-    if( chunklen!=4) {
-        *err = IM_ERR_MALFORMED;
+    uint8_t* p;
+    if (chunklen != 4) {
+        ir->base.err = IM_ERR_MALFORMED;
         return false;
     }
-    if (im_read(rdr,buf,4)!=4) {
-        *err = im_eof(rdr)?IM_ERR_MALFORMED:IM_ERR_FILE;
+    if (!slurp(ir, chunklen)) {
         return false;
     }
+    p = ir->chunk;
+    ir->camg = decode_u32be(&p);
+    ir->pal_changed = true;
+    return true;
+}
+
 
-    mode = buf[0] <<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
-/*
-    printf("mode: 0x%08x\n", mode);
-    if (mode & 0x800) {
-        printf("  ->HAM\n");
+static bool handle_CMAP(iff_reader* ir, uint32_t chunklen)
+{
+    uint32_t n;
+    // Only the first 256 colours are used.
+    if (!slurp_part(ir, chunklen, 256 * 3)) {
+        return false;
+    }
+    n = chunklen / 3;
+    if (n > 256) {
+        n = 256;
     }
-    */
+    memcpy(ir->cmap, ir->chunk, n * 3);
+    ir->cmap_len = (int)n;
+    ir->pal_changed = true;
     return true;
 }
 
-static bool handle_CMAP(context* ctx, im_in* rdr, uint32_t chunklen, ImErr *err )
+
+static bool handle_BODY(iff_reader* ir, uint32_t chunklen)
 {
-    uint8_t* data;
-    frame* f = ctx_curframe(ctx);
+    im_read* rdr = &ir->base;
+    const uint8_t* src;
+    const uint8_t* end;
+    uint8_t* dest;
+    int y;
 
-    if( !f) {
-        *err = IM_ERR_MALFORMED;
+    if (!ir->got_bmhd) {
+        rdr->err = IM_ERR_MALFORMED;   // got BODY before BMHD
         return false;
     }
-
-/*    if( !ctx->got_bmhd) {
-        // cmap without bmhd
-        *err = IM_ERR_MALFORMED;
+    // Don't let a bogus length make us allocate more than the image
+    // could possibly need.
+    {
+        uint64_t max = (uint64_t)ir->row_bytes;
+        if (ir->bmhd.compression == cmpByteRun1) {
+            // Worst case, one control byte for each 128 literal bytes.
+            max += (ir->row_bytes + 127) / 128;
+        }
+        if (chunklen > max * ir->bmhd.h) {
+            rdr->err = IM_ERR_MALFORMED;
+            return false;
+        }
     }
-    */
-    // for now, just stash the chunk verbatim
-    data = imalloc(chunklen);
-    if (!data) {
-        *err = IM_ERR_NOMEM;
+    if (!slurp(ir, chunklen)) {
         return false;
     }
-    if (im_read(rdr,data,chunklen)!=chunklen) {
-        ifree(data);
-        *err = IM_ERR_FILE;
+    dest = target_frame(ir, false);
+    if (!dest) {
         return false;
     }
 
-    if( f->cmap_data) {
-        ifree(f->cmap_data);
-    }
-
-    f->cmap_data = data;
-    f->cmap_len = chunklen;
+    src = ir->chunk;
+    end = src + chunklen;
+    for (y = 0; y < ir->bmhd.h; ++y) {
+        if (ir->bmhd.compression == cmpByteRun1) {
+            // the compression breaks at the end of each line
+            // but can run across planes (and the mask).
+            unpack_byterun1(&src, end, dest, ir->row_bytes);
+        } else {
+            size_t n = end - src;
+            if (n > ir->row_bytes) {
+                n = ir->row_bytes;
+            }
+            memcpy(dest, src, n);
+            memset(dest + n, 0, ir->row_bytes - n);
+            src += n;
+        }
+        dest += ir->row_bytes;
+    }
+    // Could all have changed.
+    ir->dirty.x0 = 0;
+    ir->dirty.y0 = 0;
+    ir->dirty.x1 = (int)ir->plane_pitch;
+    ir->dirty.y1 = ir->bmhd.h;
+    ir->got_frame = true;
     return true;
 }
 
 
-// TODO: FIX! Not reading right num of bytes!
-static bool handle_BODY(context* ctx, im_in* rdr, uint32_t chunklen, ImErr *err )
+static bool handle_ANHD(iff_reader* ir, uint32_t chunklen)
 {
-    int consumed = 0;
-    int words_per_line, bytes_per_line, data_size;
-    frame* f = ctx_curframe(ctx);
+    AnimHeader* anhd = &ir->anhd;
+    uint8_t* p;
 
-    if( !f) {
-        *err = IM_ERR_MALFORMED;
+    if (chunklen < 24) {
+        ir->base.err = IM_ERR_MALFORMED;
+        return false;
+    }
+    // (Ignore the reserved bytes after the fields we use.)
+    if (!slurp_part(ir, chunklen, 24)) {
         return false;
     }
+    memset(anhd, 0, sizeof(AnimHeader));
+    p = ir->chunk;
+    anhd->operation = *p++;
+    anhd->mask = *p++;
+    anhd->w = decode_u16be(&p);
+    anhd->h = decode_u16be(&p);
+    anhd->x = decode_s16be(&p);
+    anhd->y = decode_s16be(&p);
+    anhd->abstime = decode_u32be(&p);
+    anhd->reltime = decode_u32be(&p);
+    anhd->interleave = *p++;
+    anhd->pad0 = *p++;
+    anhd->bits = decode_u32be(&p);
+    ir->got_anhd = true;
+    return true;
+}
+
 
-    // we'll read in and uncompress any data, but for now
-    // we'll leave it in planar form, to make it easier to
-    // decode DLTA chunks.
+static bool handle_DLTA(iff_reader* ir, uint32_t chunklen)
+{
+    im_read* rdr = &ir->base;
+    uint8_t* dest;
+    uint64_t max;
 
-    if (!f->got_bmhd) {
-        *err = IM_ERR_MALFORMED;   // got BODY before BMHD
+    if (!ir->got_bmhd || !ir->got_anhd || ir->nframes == 0) {
+        rdr->err = IM_ERR_MALFORMED;
         return false;
     }
-
-    if (f->bmhd.masking !=0) {
-        //printf("MASKING=%d\n",f->bmhd.masking );
-        *err = IM_ERR_MALFORMED;   // got BODY before BMHD
+    if (ir->anhd.operation != 0x05 || ir->pbm || ir->bmhd.nPlanes > 8) {
+        // we currently only handle ANIM5 (which only has room for 8 planes)
+        rdr->err = IM_ERR_UNSUPPORTED;
         return false;
     }
-
-    switch (f->bmhd.compression) {
-        case cmpByteRun1: break;
-        case cmpNone: break;
-        default:
-            *err = IM_ERR_UNSUPPORTED;
-            return false;
+    // Worst case for ANIM5: the 16 plane pointers, then for each column
+    // of each plane, an op count, up to 255 three-byte ops, and at most
+    // one literal byte per row.
+    max = 16 * 4 + (uint64_t)ir->bmhd.nPlanes * ir->plane_pitch *
+        (1 + 255 * 3 + (uint64_t)ir->bmhd.h);
+    if (chunklen > max) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
     }
-
-    if (f->image_data) {
-        // already had a BODY chunk?
-        *err = IM_ERR_MALFORMED;
+    if (!slurp(ir, chunklen)) {
         return false;
     }
 
-    if (f->bmhd.nPlanes >32) {
-        *err = IM_ERR_MALFORMED;
+    // Usually the delta is from two frames back, which is what the
+    // other buffer already holds.
+    dest = target_frame(ir, ir->anhd.interleave == 1);
+    if (!dest) {
         return false;
     }
+    if (!decodeANIM5chunk(ir->chunk, chunklen, dest,
+        (int)ir->plane_pitch, ir->bmhd.nPlanes, ir->bmhd.h, ir->row_bytes,
+        &ir->dirty))
+    {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    ir->got_frame = true;
+    return true;
+}
 
-    // TODO: just slurp chunk into ctx->buf and decode from memory
 
-    // actual image data must be multiple of 16 pixels wide
-    words_per_line = (f->bmhd.w+15)/16;
-    bytes_per_line = f->bmhd.nPlanes * (words_per_line*2);
-    data_size = f->bmhd.h * bytes_per_line;
-    f->image_data = imalloc(data_size);
-    if( f->bmhd.compression == cmpNone) {
+// Pick the buffer the next frame will be decoded into, and make it current.
+// The first frame goes into frames[0]. After that, it's the other
+// buffer, which holds the frame before last (or a copy of the previous
+// frame, if from_prev is set).
+static uint8_t* target_frame(iff_reader* ir, bool from_prev)
+{
+    size_t size = ir->row_bytes * ir->bmhd.h;
+    int target;
 
-        int n = im_read(rdr,f->image_data, data_size);
-        if (n != data_size) {
-            // don't need to free image data - context will handle it
-            *err = IM_ERR_MALFORMED;
-            return false;
-        }
-        consumed += data_size;
-    } else if (f->bmhd.compression == cmpByteRun1) {
-        uint8_t* dest = f->image_data;
-        int y;
-        // the compression breaks at the end of each line
-        // but can run across planes.
-        // TODO: I think the mask is included in the run
-        for (y=0; y<f->bmhd.h; ++y) {
-            int n = decodeLine(rdr,dest,bytes_per_line);
-            if (n<0) {
-                *err = IM_ERR_MALFORMED;
-                return false;
-            }
-            consumed += n;
-            dest += bytes_per_line;
-        }
+    if (ir->nframes == 0) {
+        ir->nframes = 1;
+        ir->cur = 0;
+        return ir->frames[0];
     }
 
-
-    if( consumed<chunklen) {
-        //printf("%s*** warn: decode left %d bytes\n", indent(ctx->level), chunklen-consumed);
-        if (im_seek(rdr,chunklen-consumed, SEEK_CUR) != 0 ) {
-            return false;
+    target = ir->cur ^ 1;
+    if (!ir->frames[target]) {
+        // Second frame - both buffers start out with the first frame.
+        ir->frames[target] = imalloc(size);
+        if (!ir->frames[target]) {
+            ir->base.err = IM_ERR_NOMEM;
+            return NULL;
         }
+        from_prev = true;
     }
+    if (from_prev) {
+        memcpy(ir->frames[target], ir->frames[ir->cur], size);
+        ir->dirty = (iff_rect){0, 0, 0, 0};
+    } else {
+        // Holds the frame before last, so differs from the previous frame
+        // wherever that frame changed.
+        ir->dirty = ir->changed;
+    }
+    ir->cur = target;
+    ++ir->nframes;
+    return ir->frames[target];
+}
 
 
-
-    return true;
+static void rect_union(iff_rect* r, const iff_rect* other)
+{
+    if (other->x0 >= other->x1 || other->y0 >= other->y1) {
+        return;
+    }
+    if (r->x0 >= r->x1 || r->y0 >= r->y1) {
+        *r = *other;
+        return;
+    }
+    if (other->x0 < r->x0) r->x0 = other->x0;
+    if (other->y0 < r->y0) r->y0 = other->y0;
+    if (other->x1 > r->x1) r->x1 = other->x1;
+    if (other->y1 > r->y1) r->y1 = other->y1;
 }
 
 
-// decode a line of ILBM BODY compression
-// TODO: make this memory-based
-static int decodeLine( im_in* rdr, uint8_t* dest, int nbytes)
+// Grow r to include rows y0 to y1 (exclusive) of column x.
+static inline void rect_add(iff_rect* r, int x, int y0, int y1)
 {
-    int consumed = 0;
-    while (nbytes>0) {
-        uint8_t c = im_read_u8(rdr);
-        if(im_error(rdr)) {
-            return -1;
-        }
-        consumed++;
-        if( c==128) {
-            break;
-        }
-        if (c>128) {
-            int i;
-            int cnt = (257-c);
-            uint8_t v;
-            if (nbytes<cnt) {
-                return false;   // overrun
-            }
-            v = im_read_u8(rdr);
-            if(im_error(rdr)) {
-                return false;
-            }
-            consumed++;
-            for (i=0; i<cnt; ++i) {
-                *dest++ = v;
-            }
-            nbytes -= cnt;
-        } else {
-            int cnt = c+1;
-            if (nbytes<cnt) {
-                return -1;   // overrun
-            }
-            if (im_read( rdr, dest, cnt) != cnt) {
-                return -1;
-            }
-            consumed += cnt;
-            dest += cnt;
-            nbytes -= cnt;
-        }
+    if (y0 >= y1) {
+        return;
     }
-//    printf("%d bytes left empty\n",nbytes);
-    return consumed;
+    if (x < r->x0) r->x0 = x;
+    if (x + 1 > r->x1) r->x1 = x + 1;
+    if (y0 < r->y0) r->y0 = y0;
+    if (y1 > r->y1) r->y1 = y1;
 }
 
 
-
-static bool handle_ANHD( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err)
+// Shrink r down to the area where the current frame actually differs from
+// the previous one (ie the other buffer).
+static void find_changes(iff_reader* ir, iff_rect* r)
 {
-    frame* f = ctx_curframe(ctx);
-    AnimHeader* anhd;
+    const uint8_t* a = ir->frames[ir->cur];
+    const uint8_t* b = ir->frames[ir->cur ^ 1];
+    int nplanes = ir->pbm ? 1 : ir->bmhd.nPlanes;
+    iff_rect found = {r->x1, r->y1, 0, 0};
+    int y;
 
-    if( !f) {
-        *err = IM_ERR_MALFORMED;
-        return false;
+    for (y = r->y0; y < r->y1; ++y) {
+        size_t off = ir->row_bytes * y;
+        int p;
+        for (p = 0; p < nplanes; ++p) {
+            int x;
+            for (x = r->x0; x < r->x1; ++x) {
+                if (a[off + x] != b[off + x]) {
+                    rect_add(&found, x, y, y + 1);
+                }
+            }
+            off += ir->plane_pitch;
+        }
     }
-    anhd = &f->anhd;
-
-    anhd->operation = im_read_u8(rdr);
-    anhd->mask = im_read_u8(rdr);
-    anhd->w = im_read_u16be(rdr);
-    anhd->h = im_read_u16be(rdr);
-    anhd->x = im_read_s16be(rdr);
-    anhd->y = im_read_s16be(rdr);
-    anhd->abstime = im_read_u32be(rdr);
-    anhd->reltime = im_read_u32be(rdr);
-    anhd->interleave = im_read_u8(rdr);
-    anhd->pad0 = im_read_u8(rdr);
-    anhd->bits = im_read_u32be(rdr);
-    im_read(rdr,anhd->pad,16);
-
-    if(im_error(rdr)) {
-        *err = im_eof(rdr) ? IM_ERR_MALFORMED : IM_ERR_FILE;
-        return false;
+    if (found.x0 >= found.x1) {
+        found = (iff_rect){0, 0, 0, 0};
     }
-/*
-    printf("%s op: 0x%02x mask: 0x%02x %d,%d %dx%d reltime: %d interleave: 0x%02x, bits: 0x%08x\n",
-        indent(ctx->level),
-        anhd->operation,
-        anhd->mask,
-        anhd->x,
-        anhd->y,
-        anhd->w,
-        anhd->h,
-        anhd->reltime,
-        anhd->interleave,
-        anhd->bits);
-*/
-    f->got_anhd = true;    
-    return true;
+    *r = found;
 }
 
-static bool handle_DLTA( context* ctx, im_in* rdr, uint32_t chunklen, ImErr* err)
+
+// Bring the converted copy of the anim up to date with the current frame,
+// and report the area which changed.
+static bool update_chunky(iff_reader* ir)
 {
-    frame* first;
-    frame* cur;
-    frame* from;    //
-    int fromidx;
-    int wordswide;
-    int image_size;
-    int height;
-    int nplanes;
-    int num_cols;
-
-    if( !ctx_size_buffer(ctx,chunklen)) {
-        *err = IM_ERR_NOMEM;
-        return false;
+    im_read* rdr = &ir->base;
+    im_imginfo* info = &rdr->curr;
+    iff_rect d = ir->dirty;
+    int x0, x1;
+
+    if (!ir->chunky) {
+        // First frame - everything needs converting.
+        int bpp = (ir->pbm || ir->bmhd.nPlanes <= 8) ? 1 : ir->bmhd.nPlanes / 8;
+        ir->chunky_pitch = (size_t)ir->bmhd.w * bpp;
+        ir->chunky = imalloc(ir->chunky_pitch * ir->bmhd.h);
+        if (!ir->chunky) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        d.x0 = 0;
+        d.y0 = 0;
+        d.x1 = (int)ir->plane_pitch;
+        d.y1 = ir->bmhd.h;
+    } else if (d.x0 < d.x1 && d.y0 < d.y1) {
+        find_changes(ir, &d);
     }
 
-    if(im_read(rdr,ctx->buf,chunklen)!=chunklen) {
-        *err = im_eof(rdr) ? IM_ERR_MALFORMED: IM_ERR_FILE;
-        return false;
+    if (d.x0 < d.x1 && d.y0 < d.y1) {
+        convert_block(ir, &d, ir->chunky + ir->chunky_pitch * d.y0, (int)ir->chunky_pitch);
     }
+    ir->changed = d;
 
-    if (ctx->nframes < 1) {
-        *err = IM_ERR_MALFORMED;
-        return false;
+    // Report it (in pixels).
+    if (ir->pal_changed) {
+        x0 = 0;
+        x1 = ir->bmhd.w;
+        info->changed_y = 0;
+        info->changed_h = ir->bmhd.h;
+    } else {
+        int scale = ir->pbm ? 1 : 8;
+        x0 = d.x0 * scale;
+        x1 = d.x1 * scale;
+        if (x1 > ir->bmhd.w) {
+            x1 = ir->bmhd.w;
+        }
+        if (x0 > x1) {
+            x0 = x1;
+        }
+        info->changed_y = d.y0;
+        info->changed_h = (d.y1 > d.y0) ? d.y1 - d.y0 : 0;
     }
-
-    first = ctx->frames[0];
-    cur = ctx_curframe(ctx);
-    if (!first || !cur || !first->got_bmhd || !cur->got_anhd) {
-        *err = IM_ERR_MALFORMED;
-        return false;
+    info->changed_x = x0;
+    info->changed_w = x1 - x0;
+    if (info->changed_w == 0 || info->changed_h == 0) {
+        info->changed_x = info->changed_y = 0;
+        info->changed_w = info->changed_h = 0;
     }
+    rdr->changed_set = true;
+    ir->pal_changed = false;
+    return true;
+}
 
-    if (cur->anhd.operation != 0x05) {
-        // we currently only handle ANIM5
-        *err = IM_ERR_UNSUPPORTED;
-        return false;
-    }
 
+// Convert a block of the current frame into the output format.
+// dest points to the start of row r->y0.
+static void convert_block(iff_reader* ir, const iff_rect* r, uint8_t* dest, int stride)
+{
+    const uint8_t* src = ir->frames[ir->cur] + ir->row_bytes * r->y0;
+    int w = ir->bmhd.w;
+    int x0, x1;
+    int y;
 
-    // first, copy the frame we're deltaing from...
-    if (cur->anhd.interleave==0) {
-        fromidx = cur->num - 2;       // default is two frames back
+    if (ir->pbm) {
+        x0 = r->x0;
+        x1 = (r->x1 < w) ? r->x1 : w;
     } else {
-        fromidx = cur->num - cur->anhd.interleave;
+        x0 = r->x0 * 8;
+        x1 = (r->x1 * 8 < w) ? r->x1 * 8 : w;
     }
-    if (fromidx<0) {
-        fromidx = 0;
-//        *err = IM_ERR_MALFORMED;
- //       return false;
+    if (x0 >= x1) {
+        return;
     }
-    //printf("copy from frame %d\n",fromidx);
 
-    from = ctx->frames[fromidx];
-    if(!from->image_data) {
-        *err = IM_ERR_MALFORMED;
-        return false;
-    } 
-    wordswide = (first->bmhd.w +15)/16;
-    height = first->bmhd.h;
-    nplanes = first->bmhd.nPlanes;
-    image_size = (wordswide*2)*nplanes*height;
-    cur->image_data = imalloc(image_size);
-    if (!cur->image_data) {
-        *err = IM_ERR_NOMEM;
-        return false;
+    for (y = r->y0; y < r->y1; ++y) {
+        if (ir->pbm) {
+            memcpy(dest + x0, src + x0, x1 - x0);
+        } else if (ir->bmhd.nPlanes <= 8) {
+            planar_to_chunky(src + r->x0, ir->plane_pitch, ir->bmhd.nPlanes,
+                x1 - x0, dest + x0, 1);
+        } else {
+            // Deep ILBM - 8 planes for each of R, G, B (and A).
+            int nchans = ir->bmhd.nPlanes / 8;
+            int c;
+            for (c = 0; c < nchans; ++c) {
+                planar_to_chunky(src + r->x0 + c * 8 * ir->plane_pitch, ir->plane_pitch, 8,
+                    x1 - x0, dest + x0 * nchans + c, nchans);
+            }
+        }
+        src += ir->row_bytes;
+        dest += stride;
     }
-    memcpy(cur->image_data, from->image_data, image_size);
+}
 
-    // leave the colourmaps for now - handle later, during im_img generation.
 
-    // now decode the delta upon the image
-    num_cols = ((first->bmhd.w + 15)/16)*2;   // NOTE: always even number of cols
-    if (!decodeANIM5chunk(ctx->buf, chunklen,
-        cur->image_data,
-        num_cols,
-        first->bmhd.nPlanes,
-        first->bmhd.h))
-    {
-        *err = IM_ERR_MALFORMED;
-        return false;
+// Decode n bytes of ByteRun1 data.
+// We're lenient: overlong runs are clipped, and anything missing is left
+// as zero.
+static void unpack_byterun1(const uint8_t** srcp, const uint8_t* end, uint8_t* dest, size_t n)
+{
+    const uint8_t* src = *srcp;
+
+    while (n > 0 && src < end) {
+        uint8_t c = *src++;
+        if (c < 128) {
+            // copy the next c+1 bytes
+            size_t cnt = (size_t)c + 1;
+            size_t avail = end - src;
+            size_t m = cnt;
+            if (m > avail) {
+                m = avail;
+            }
+            if (m > n) {
+                m = n;
+            }
+            memcpy(dest, src, m);
+            dest += m;
+            n -= m;
+            src += (cnt < avail) ? cnt : avail;
+        } else if (c > 128) {
+            // repeat the next byte 257-c times
+            size_t cnt = 257 - c;
+            if (src == end) {
+                break;
+            }
+            if (cnt > n) {
+                cnt = n;
+            }
+            memset(dest, *src++, cnt);
+            dest += cnt;
+            n -= cnt;
+        }
+        // 128 is a no-op
     }
-    return true;
+    if (n > 0) {
+        memset(dest, 0, n);
+    }
+    *srcp = src;
 }
 
 
+// Apply an ANIM5 (byte vertical delta) chunk to the planar image in dest.
+// The area written to is added to `touched`.
 static bool decodeANIM5chunk(const uint8_t* src, size_t srclen, uint8_t* dest,
-        int ncols, int nplanes, int height)
+        int ncols, int nplanes, int height, size_t pitch, iff_rect* touched)
 {
     int plane;
     uint32_t pos;
     uint32_t start[8];
-    int pitch = ncols*nplanes;  // dest: bytes per line
+    iff_rect r = {ncols, height, 0, 0};
 
     // first, unpack the 8 src pointers (and ignore 8 unused ones)
     if (srclen<16*4) {
@@ -682,46 +1058,29 @@ static bool decodeANIM5chunk(const uint8_t* src, size_t srclen, uint8_t* dest,
 
     for (plane=0; plane<nplanes; ++plane) {
         const uint8_t* p = src + plane*4;
-        start[plane] = (p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3]; 
-        //printf("plane %d @ 0x%08x\n",plane,start[plane]);
-    }
-
-    // dump
-    /*
-    int j;
-    for( j=0; j<srclen; ++j) {
-        if( (j&7) == 0 ) {
-            printf("\n%08x: ",j);
-        }
-        printf("%02x ",src[j]);
+        start[plane] = ((uint32_t)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
     }
-    printf("\n");
-    */
 
     for (plane=0; plane<nplanes; ++plane) {
+        int col;
         pos = start[plane];
-        //printf("plane %d (pos %d)\n", plane,pos);
         if (!pos) {
             continue;
         }
 
-        int col;
-        int y;
-        uint8_t op;
         for (col=0; col<ncols; ++col) {
             uint8_t* out = dest + (ncols*plane) + col;
             int opcnt;
             int i;
+            int y;
             if (pos+1>srclen) {
-                //printf("expect more cols\n");
                 return false;
             }
             opcnt = (int)src[pos++];
 
-            //printf(" col %d/%d (%d ops)\n", col, ncols, opcnt);
             y=0;
             for (i=0; i<opcnt; ++i) {
-                //printf("  y=%d\n", y);
+                uint8_t op;
                 if (pos+1 > srclen) {
                     return false;
                 }
@@ -734,10 +1093,10 @@ static bool decodeANIM5chunk(const uint8_t* src, size_t srclen, uint8_t* dest,
                     }
                     cnt = src[pos++];
                     val = src[pos++];
-                    //printf("    rep %d %d\n", cnt,val);
                     if (y+cnt > height) {
                         return false;
                     }
+                    rect_add(&r, col, y, y + cnt);
                     while (cnt>0) {
                         *out = val;
                         out += pitch;
@@ -747,18 +1106,18 @@ static bool decodeANIM5chunk(const uint8_t* src, size_t srclen, uint8_t* dest,
                 } else if (op<128) {
                     // skip
                     int cnt = (int)op;
-                    //printf("    skip %d\n", cnt);
                     if (y+cnt > height) {
                         return false;
                     }
                     out += pitch*cnt;
                     y+=cnt;
-                } else if (op>=128) {
+                } else {
+                    // uniq
                     int cnt = (int)(op&0x7f);
-                    //printf("    uniq %d\n", cnt);
                     if (pos+cnt > srclen || y+cnt > height ) {
                         return false;
                     }
+                    rect_add(&r, col, y, y + cnt);
                     while (cnt>0) {
                         *out = src[pos++];
                         out += pitch;
@@ -769,334 +1128,62 @@ static bool decodeANIM5chunk(const uint8_t* src, size_t srclen, uint8_t* dest,
             }
         }
     }
-
-#if 0
-    // fetch
-    // <128 :skip
-    // 0, cnt, val : repeat val cnt times
-    // <=128 : copy (n & 0x7f) bytes
-
-#endif
+    rect_union(touched, &r);
     return true;
 }
 
 
-
-
-
-
-
-// process a single chunk and all it's children, returns num of bytes consumed (excluding any pad byte)
-static int parse_chunk( context* ctx, im_in* rdr, ImErr* err ) {
-    uint8_t buf[8];
-    uint32_t chunklen;
-    bool success;
-    int consumed = 0;
-
-    if(im_read(rdr, buf,8) != 8) {
-        // FUDGE for malformed files (eg Juggler.anim)
-        // we'll be lenient if file ends prematurely,
-        // but on a chunk boundary.
-        if (im_eof(rdr)) {
-            return chunklen;
-        }
-        *err = IM_ERR_FILE;
-        return -1;
-    }
-    consumed += 8;
-    chunklen = ((uint32_t)buf[4])<<24 |
-        ((uint32_t)buf[5])<<16 |
-        ((uint32_t)buf[6])<<8 |
-        ((uint32_t)buf[7]);
-
-    //printf("%s%c%c%c%c [%d bytes]\n", indent(ctx->level), buf[0], buf[1], buf[2], buf[3], chunklen );
-    if (chkcc(buf,"FORM")) {
-//        printf("%d: enter FORM\n", ctx->level);
-        ++ctx->level;
-        // FORM chunks have children
-        success = handle_FORM(ctx,rdr,chunklen, err);
-        --ctx->level;
-//        printf("%d: exit FORM (%d)\n", ctx->level, success?1:0);
-    } else if (chkcc(buf,"BMHD")) {
-        success = handle_BMHD(ctx,rdr,chunklen, err);
-    } else if (chkcc(buf,"CMAP")) {
-        success = handle_CMAP(ctx,rdr,chunklen, err);
-    } else if (chkcc(buf,"CAMG")) {
-        success = handle_CAMG(ctx,rdr,chunklen, err);
-    } else if (chkcc(buf,"BODY")) {
-        success = handle_BODY(ctx,rdr,chunklen, err);
-    } else if (chkcc(buf,"ANHD")) {
-        success = handle_ANHD(ctx,rdr,chunklen, err);
-    } else if (chkcc(buf,"DLTA")) {
-        success = handle_DLTA(ctx,rdr,chunklen, err);
-    } else {
-        // unknown/unhandled chunk type. skip it.
-        if (im_seek(rdr, chunklen, SEEK_CUR)!=0) {
-            *err = IM_ERR_FILE;
-            success = false;
-        } else {
-            success = true;
-        }
-    }
-
-    if (!success) {
-//        printf("parse_chunk(%c%c%c%c) failed\n", buf[0], buf[1], buf[2], buf[3]);
-        return -1;
-    }
-
-    consumed += chunklen;
-
-    if (chunklen&1) {
-        // read the pad byte
-        if (im_seek(rdr, 1, SEEK_CUR)!=0) {
-            *err = IM_ERR_MALFORMED;
-            return -1;
-        }
-        consumed += 1;
-    }
-
-    // +8 to account for chunk header
-    return (int)consumed;
-}
-
-
-static im_bundle* read_iff_bundle( im_in* rdr, ImErr* err )
+// Transpose an 8x8 bit matrix, stored a row per byte.
+static inline uint64_t transpose8x8(uint64_t x)
 {
-    /*
-    dump_chunk(0,rdr);
-    *err = (ImErr)69;
-    return false;
-    */
-
-    im_bundle* bundle = NULL;
-
-    context* ctx = ctx_new();
-    if (!ctx) {
-        *err = IM_ERR_NOMEM;
-        goto bailout;
-    }
-    if (parse_chunk(ctx,rdr,err)<0 ) {
-        goto bailout;
-    }
-
-    bundle = im_bundle_new();
-    if (!bundle)
-    {
-        *err = IM_ERR_NOMEM;
-        goto bailout;
-    }
-
-    if (!ctx_collect_bundle(ctx, bundle, err)) {
-        goto bailout;
-    }
-
-    ctx_free(ctx);
-    return bundle;
-
-bailout:
-    if (ctx) {
-        ctx_free(ctx);
-    }
-    if( bundle) {
-        im_bundle_free(bundle);
-    }
-
-    return NULL;
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x ^= t ^ (t << 28);
+    return x;
 }
 
 
-static bool ctx_collect_bundle( context* ctx, im_bundle* out, ImErr* err)
+// Convert one row of planar data (up to 8 planes) to a byte per pixel,
+// written every dest_step bytes.
+// Plane n holds bit n of each pixel. Any planes after nplanes (eg a mask)
+// are ignored.
+// Works 8 pixels at a time: one byte from each plane makes an 8x8 bit
+// matrix, and transposing it gives the 8 pixels.
+static void planar_to_chunky(const uint8_t* src, size_t plane_pitch, int nplanes,
+        unsigned int w, uint8_t* dest, int dest_step)
 {
-    int i;
-    uint8_t cmap_buf[3*256];
-    size_t cmap_len = 0;
-    im_img* img = NULL;
-    for (i=0; i<ctx->nframes; ++i) {
-        frame* f = ctx->frames[i];
-        //printf("add frame %d\n", i);
-
-        // track latest cmap as we go
-        if (f->cmap_data) {
-            if (f->cmap_len>sizeof(cmap_buf)) {
-                *err = IM_ERR_MALFORMED;
-            }
-            memcpy(cmap_buf, f->cmap_data, f->cmap_len);
-            if( f->cmap_len>cmap_len) {
-                cmap_len = f->cmap_len;
-            }
-        }
-
-        img = frame_to_img(ctx, i, cmap_buf, cmap_len, err);
-        if (img) {
-            SlotID id = {0};
-            id.frame = f->num;
-            if (!im_bundle_set(out,id,img)) {
-                *err = IM_ERR_NOMEM;
-                return false;
-            }
-        } else {
-            return false;
+    unsigned int x;
+    for (x = 0; x < w; x += 8) {
+        const uint8_t* s = src + x/8;
+        uint64_t bits = 0;
+        unsigned int n = (w - x < 8) ? (w - x) : 8;
+        unsigned int i;
+        int p;
+        for (p = 0; p < nplanes; ++p) {
+            bits |= (uint64_t)*s << (8 * p);
+            s += plane_pitch;
         }
-    }
-
-    return true;
-}
-
-static im_img* frame_to_img(context* ctx, int frameidx, const uint8_t* cmap_data, size_t cmap_len, ImErr* err)
-{
-    int y;
-    int plane_pitch;
-    frame* f;
-    frame* first;
-    BitMapHeader* bmhd;
-
-    f = ctx->frames[frameidx];
-    // need the BMHD chunk from the first frame
-    first = ctx->frames[0];
-
-    if( !first->got_bmhd || !f->image_data) {
-        *err = IM_ERR_MALFORMED;
-        return NULL;
-    }
-
-    bmhd = &first->bmhd;
-
-    // TODO:
-    if( bmhd->nPlanes>8) {
-        *err = IM_ERR_UNSUPPORTED;
-        return NULL;
-    }
-
-    // TODO: handle 24 and 32-plane images (IM_FMT_RGB and IM_FMT_RGBA)
-    im_img* img = im_img_new(bmhd->w, bmhd->h, 1, IM_FMT_INDEX8);
-    if( !img) {
-        *err = IM_ERR_NOMEM;
-        return NULL;
-    }
-
-    if (chkcc(f->kind,"ILBM")) {
-
-        int plane_pitch = 2*((bmhd->w+15)/16);
-        // convert planar data to 8bit indexed
-        // TODO: handle/skip mask plane!
-        for (y=0; y<bmhd->h; ++y) {
-            uint8_t* dest = im_img_row(img,y);
-            int x;
-            for( x=0; x<bmhd->w; ++x) {
-                const uint8_t* src = f->image_data + (y*plane_pitch*bmhd->nPlanes) + x/8;
-                int srcbit = 7 - (x&7);
-                int destbit;
-                uint8_t pix=0;
-                for(destbit = 0; destbit<bmhd->nPlanes; ++destbit) {
-                    pix |= (((*src) >> srcbit)&0x01)<<destbit;
-                    src += plane_pitch;
-                }
-                *dest = pix;
-                ++dest;
-            }
-        }
-    } else if (chkcc(f->kind,"PBM ")) {
-        const uint8_t* src = f->image_data;
-        for (y=0; y<bmhd->h; ++y) {
-            memcpy(im_img_row(img,y), src, bmhd->w);
-            src += bmhd->w;
-        }
-    }
-
-
-
-    // install palette (note: ignore any cmap data that might be in
-    // current frame - the caller has already handled it)
-    // TODO: pad out to at least 2^nPlanes entries
-    if (cmap_data) {
-        if( !im_img_pal_set(img, IM_FMT_RGB, cmap_len/3, cmap_data) ) {
-            *err = IM_ERR_NOMEM;
-            im_img_free(img);
-            return NULL;
-        }
-    }
-
-    return img;
-}
-
-
-#define MAXINDENT 16
-static const char* indent( int n ) {
-    static char buf[(MAXINDENT*2)+1] = {0};
-    int i;
-    if(buf[0]==0) {
-        // init
-        for( i=0; i<(MAXINDENT*2); ++i) {
-            buf[i] = ' ';
-        }
-    }
-    if (n>MAXINDENT) {
-        n=MAXINDENT;
-    }
-
-    return buf + (MAXINDENT-n)*2;
-}
-
-
-
-#if 0
-int dump_chunk( int nest, im_in *rdr )
-{
-
-    uint8_t kind[4];
-    uint32_t len;
-    int consumed = 0;
-    if( im_read(rdr, kind, 4)!=4) {
-        //printf("ERR reading fourCC (eof=%d)\n", im_eof(rdr));
-        return -1;
-    }
-    len = im_read_u32be(rdr);
-    if (im_error(rdr)) {
-        return -1;
-    }
-    consumed += 8;
-
-    printf("%s%c%c%c%c (%d bytes)\n", indent(nest), kind[0], kind[1], kind[2], kind[3], len);
-    if(chkcc(kind,"FORM")) {
-        char ft[4];
-        int remaining = len;
-        if( !im_read(rdr, ft, 4)) {
-            printf("ERR reading form type\n");
-            return -1;
-        }
-        printf("%sformtype=%c%c%c%c\n", indent(nest+1), ft[0], ft[1], ft[2], ft[3]);
-        consumed += 4;
-        remaining -= 4;
-        while(remaining>0) {
-            int n = dump_chunk(nest+1,rdr);
-            if( n<0) {
-                printf("ERR dump_failed (%d remaining)\n", remaining);
-                return -1;
-            }
-            remaining -= n;
-            consumed += n;
+        bits = transpose8x8(bits);
+        // leftmost pixel is the top bit, so ends up in the top byte
+        if (n == 8 && dest_step == 1) {
+            dest[0] = (uint8_t)(bits >> 56);
+            dest[1] = (uint8_t)(bits >> 48);
+            dest[2] = (uint8_t)(bits >> 40);
+            dest[3] = (uint8_t)(bits >> 32);
+            dest[4] = (uint8_t)(bits >> 24);
+            dest[5] = (uint8_t)(bits >> 16);
+            dest[6] = (uint8_t)(bits >> 8);
+            dest[7] = (uint8_t)bits;
+            dest += 8;
+            continue;
         }
-    } else {
-        if( im_seek(rdr, len, SEEK_CUR) != 0 ) {
-            printf("ERR skipping chunk\n");
-            return -1;
+        for (i = 0; i < n; ++i) {
+            *dest = (uint8_t)(bits >> (56 - 8 * i));
+            dest += dest_step;
         }
-        consumed += len;
     }
-
-    // handle even-padding rule
-    if( len&1) {
-        if( im_seek(rdr, 1, SEEK_CUR) != 0 ) {
-            printf("ERR skipping padbyte\n");
-            return false;
-        }
-        printf("%spad\n", indent(nest));
-        consumed += 1;
-    }
-    return consumed;
 }
-#endif
-
-
-#endif // IFF disabled for now.
- 
@@ -12,6 +12,12 @@ void i_read_init(im_read* rdr)
     rdr->err = IM_ERR_NONE;
     rdr->state = READSTATE_READY;
     rdr->external_fmt = IM_FMT_NONE;
+    rdr->curr.disposal = IM_DISPOSE_UNSPECIFIED;
+    rdr->curr.transparent_index = -1;
+    rdr->curr.loop_count = -1;
+    rdr->max_pixels = 0x10000000;
+    rdr->max_metadata_bytes = 8 * 1024 * 1024;
+    rdr->coalesce = true;
     i_kvstore_init(&rdr->kv);
 }
 
@@ -23,6 +29,7 @@ static const i_read_handler* read_handlers[] = {
     &i_jpeg_read_handler,
     &i_pcx_read_handler,
     &i_targa_read_handler,
+    &i_iff_read_handler,
     NULL
 };
 
@@ -113,7 +120,27 @@ bool im_read_img(im_read* rdr, im_imginfo* info)
         return false;
     }
 
+    rdr->changed_set = false;
+    // Scaling and transforms only apply to a single frame.
+    rdr->out_w = 0;
+    rdr->out_h = 0;
+    rdr->transform = IM_TRANSFORM_NONE;
     got = rdr->handler->get_img(rdr);
+    if (got) {
+        // Handlers should have checked already, but make sure.
+        unsigned int bpp = im_fmt_bytesperpixel(rdr->curr.fmt);
+        if (i_read_check_size(rdr, rdr->curr.w, rdr->curr.h, bpp)) {
+            rdr->decoded_bytes += (uint64_t)rdr->curr.w * rdr->curr.h * bpp;
+        } else {
+            got = false;
+        }
+    }
+    if (!rdr->changed_set) {
+        rdr->curr.changed_x = 0;
+        rdr->curr.changed_y = 0;
+        rdr->curr.changed_w = rdr->curr.w;
+        rdr->curr.changed_h = rdr->curr.h;
+    }
     memcpy(info, &rdr->curr, sizeof(im_imginfo));
 
     rdr->state = READSTATE_HEADER;
@@ -134,6 +161,162 @@ void im_read_set_fmt(im_read* rdr, ImFmt fmt)
     rdr->external_fmt = fmt;
 }
 
+void im_read_set_output_size(im_read* rdr, unsigned int w, unsigned int h, ImFilter filter)
+{
+    if (rdr->err != IM_ERR_NONE) {
+        return;
+    }
+
+    // make sure im_get_img() was called first.
+    if (rdr->state != READSTATE_HEADER) {
+        rdr->err = IM_ERR_BAD_STATE;
+        return;
+    }
+    if (w == 0 || h == 0 || filter > IM_FILTER_LANCZOS3) {
+        rdr->err = IM_ERR_BADPARAM;
+        return;
+    }
+    rdr->out_w = w;
+    rdr->out_h = h;
+    rdr->out_filter = filter;
+}
+
+void im_read_set_transform(im_read* rdr, ImTransform transform)
+{
+    if (rdr->err != IM_ERR_NONE) {
+        return;
+    }
+
+    // make sure im_get_img() was called first.
+    if (rdr->state != READSTATE_HEADER) {
+        rdr->err = IM_ERR_BAD_STATE;
+        return;
+    }
+    if (transform < IM_TRANSFORM_NONE || transform > IM_TRANSFORM_ROTATE_270) {
+        rdr->err = IM_ERR_BADPARAM;
+        return;
+    }
+    rdr->transform = transform;
+}
+
+void im_read_set_progress_fn(im_read* rdr, im_progress_fn fn, void* user)
+{
+    rdr->progress_fn = fn;
+    rdr->progress_user = user;
+}
+
+void im_read_set_limit(im_read* rdr, ImReadLimit limit, uint64_t value)
+{
+    if (rdr->err != IM_ERR_NONE) {
+        return;
+    }
+    switch (limit) {
+        case IM_LIMIT_PIXELS:
+            rdr->max_pixels = value;
+            break;
+        case IM_LIMIT_FRAMES:
+            rdr->max_frames = value;
+            break;
+        case IM_LIMIT_DECODED_BYTES:
+            rdr->max_decoded_bytes = value;
+            break;
+        case IM_LIMIT_METADATA_BYTES:
+            rdr->max_metadata_bytes = value;
+            break;
+        default:
+            rdr->err = IM_ERR_BADPARAM;
+            break;
+    }
+}
+
+void im_read_set_option(im_read* rdr, ImReadOption opt, int value)
+{
+    if (rdr->err != IM_ERR_NONE) {
+        return;
+    }
+    // Too late once the first frame has been read.
+    if (rdr->frame_num > 0 || rdr->state != READSTATE_READY) {
+        rdr->err = IM_ERR_BAD_STATE;
+        return;
+    }
+    switch (opt) {
+        case IM_READ_OPT_COALESCE:
+            rdr->coalesce = (value != 0);
+            break;
+        default:
+            rdr->err = IM_ERR_BADPARAM;
+            break;
+    }
+}
+
+bool i_read_check_size(im_read* rdr, unsigned int w, unsigned int h, unsigned int bytes_per_pixel)
+{
+    uint64_t npixels = (uint64_t)w * h;
+
+    // frame_num is the number of frames already read, so this one
+    // would make frame_num + 1.
+    if (rdr->max_frames && (uint64_t)rdr->frame_num >= rdr->max_frames) {
+        rdr->err = IM_ERR_LIMIT;
+        return false;
+    }
+    if (rdr->max_pixels && npixels > rdr->max_pixels) {
+        rdr->err = IM_ERR_LIMIT;
+        return false;
+    }
+    // (Dividing, as npixels * bytes_per_pixel could overflow.)
+    if (rdr->max_decoded_bytes && bytes_per_pixel > 0 &&
+        (rdr->decoded_bytes > rdr->max_decoded_bytes ||
+        npixels > (rdr->max_decoded_bytes - rdr->decoded_bytes) / bytes_per_pixel)) {
+        rdr->err = IM_ERR_LIMIT;
+        return false;
+    }
+    return true;
+}
+
+bool i_read_check_metadata(im_read* rdr, size_t nbytes)
+{
+    rdr->metadata_bytes += nbytes;
+    if (rdr->max_metadata_bytes && rdr->metadata_bytes > rdr->max_metadata_bytes) {
+        rdr->err = IM_ERR_LIMIT;
+        return false;
+    }
+    return true;
+}
+
+// For handlers to call with a (whole image) preview in the internal format.
+void i_read_progress(im_read* rdr, unsigned int pass, unsigned int num_passes, const uint8_t* pixels, int stride)
+{
+    unsigned int y;
+    size_t out_bytes_per_row;
+    size_t nbytes;
+    uint8_t* dest;
+
+    if (!rdr->progress_fn || rdr->resampler || rdr->transform != IM_TRANSFORM_NONE) {
+        return;
+    }
+    if (!rdr->row_cvt_fn) {
+        rdr->progress_fn(rdr->progress_user, pass, num_passes, pixels, stride);
+        return;
+    }
+
+    // Convert to the format the user asked for.
+    out_bytes_per_row = im_fmt_bytesperpixel(rdr->external_fmt) * rdr->curr.w;
+    if (!i_size_mul(out_bytes_per_row, rdr->curr.h, &nbytes)) {
+        return;
+    }
+    rdr->progress_buf = irealloc(rdr->progress_buf, nbytes);
+    if (!rdr->progress_buf) {
+        return;     // no preview, but not fatal
+    }
+    dest = rdr->progress_buf;
+    for (y = 0; y < rdr->curr.h; ++y) {
+        rdr->row_cvt_fn(pixels, dest, rdr->curr.w, rdr->curr.pal_num_colours, rdr->pal_data);
+        pixels += stride;
+        dest += out_bytes_per_row;
+    }
+    rdr->progress_fn(rdr->progress_user, pass, num_passes, rdr->progress_buf, (int)out_bytes_per_row);
+}
+
 ImErr im_read_finish(im_read* rdr)
 {
     ImErr err;
@@ -144,6 +327,26 @@ ImErr im_read_finish(im_read* rdr)
         ifree(rdr->rowbuf);
         rdr->rowbuf = NULL;
     }
+    if (rdr->resampler) {
+        i_resampler_free(rdr->resampler);
+        rdr->resampler = NULL;
+    }
+    if (rdr->workbuf) {
+        ifree(rdr->workbuf);
+        rdr->workbuf = NULL;
+    }
+    if (rdr->tilebuf) {
+        ifree(rdr->tilebuf);
+        rdr->tilebuf = NULL;
+    }
+    if (rdr->progress_buf) {
+        ifree(rdr->progress_buf);
+        rdr->progress_buf = NULL;
+    }
+    if (rdr->pal_data) {
+        ifree(rdr->pal_data);
+        rdr->pal_data = NULL;
+    }
 
     if (rdr->in && rdr->in_owned) {
         // Close and free `in`.
@@ -167,16 +370,109 @@ ImErr im_read_err(im_read* rdr)
 
 
 
+// The size of the frame before any transform - ie what comes out of the
+// resampler (or straight from the handler if not scaling).
+static void pre_transform_size(const im_read* rdr, unsigned int* w, unsigned int* h)
+{
+    if (i_transform_swaps_axes(rdr->transform)) {
+        *w = rdr->out_h;
+        *h = rdr->out_w;
+    } else {
+        *w = rdr->out_w;
+        *h = rdr->out_h;
+    }
+}
+
+// Set up to scale the frame to w x h as it's read.
+static void start_resampling(im_read* rdr, unsigned int w, unsigned int h)
+{
+    size_t src_bytes_per_row;
+    size_t work_bytes_per_row;
+
+    // Source rows go into the resampler's working format...
+    if (rdr->curr.fmt == I_RESAMPLE_FMT) {
+        rdr->row_cvt_fn = NULL;
+    } else {
+        rdr->row_cvt_fn = i_pick_convert_fn(rdr->curr.fmt, I_RESAMPLE_FMT);
+        if (rdr->row_cvt_fn == NULL) {
+            rdr->err = IM_ERR_NOCONV;
+            return;
+        }
+        src_bytes_per_row = im_fmt_bytesperpixel(rdr->curr.fmt) * rdr->curr.w;
+        rdr->rowbuf = irealloc(rdr->rowbuf, src_bytes_per_row);
+        if (!rdr->rowbuf) {
+            rdr->err = IM_ERR_NOMEM;
+            return;
+        }
+    }
+
+    // ...and the output comes back out in the requested format.
+    if (rdr->external_fmt == I_RESAMPLE_FMT) {
+        rdr->out_cvt_fn = NULL;
+    } else {
+        rdr->out_cvt_fn = i_pick_convert_fn(I_RESAMPLE_FMT, rdr->external_fmt);
+        if (rdr->out_cvt_fn == NULL) {
+            rdr->err = IM_ERR_NOCONV;
+            return;
+        }
+    }
+
+    // workbuf holds a source or output row in the working format.
+    work_bytes_per_row = im_fmt_bytesperpixel(I_RESAMPLE_FMT) *
+        (size_t)(rdr->curr.w > w ? rdr->curr.w : w);
+    rdr->workbuf = irealloc(rdr->workbuf, work_bytes_per_row);
+    rdr->resampler = i_resampler_new(rdr->curr.w, rdr->curr.h, w, h, rdr->out_filter);
+    if (!rdr->workbuf || !rdr->resampler) {
+        rdr->err = IM_ERR_NOMEM;
+        return;
+    }
+}
+
 static void enter_READSTATE_BODY(im_read* rdr)
 {
+    unsigned int w;
+    unsigned int h;
+
     rdr->state = READSTATE_BODY;
     rdr->rows_read = 0;
+    rdr->out_rows_read = 0;
+
+    if (rdr->resampler) {
+        i_resampler_free(rdr->resampler);
+        rdr->resampler = NULL;
+    }
 
     // If no pixelformat was requested, serve up whatever the backend provides.
     if (rdr->external_fmt == IM_FMT_NONE) {
         rdr->external_fmt = rdr->curr.fmt;
     }
 
+    // Work out the size the caller will get.
+    if (rdr->out_w == 0) {
+        rdr->out_w = rdr->curr.w;
+        rdr->out_h = rdr->curr.h;
+        if (i_transform_swaps_axes(rdr->transform)) {
+            rdr->out_w = rdr->curr.h;
+            rdr->out_h = rdr->curr.w;
+        }
+    }
+    pre_transform_size(rdr, &w, &h);
+
+    // Need a strip of rows to transform?
+    if (rdr->transform != IM_TRANSFORM_NONE && rdr->transform != IM_TRANSFORM_FLIP_V) {
+        rdr->tilebuf = irealloc(rdr->tilebuf, (size_t)I_TRANSFORM_TILE * w * im_fmt_bytesperpixel(rdr->external_fmt));
+        if (!rdr->tilebuf) {
+            rdr->err = IM_ERR_NOMEM;
+            return;
+        }
+    }
+
+    // Scaling?
+    if (w != rdr->curr.w || h != rdr->curr.h) {
+        start_resampling(rdr, w, h);
+        return;
+    }
+
     // Nice and simple if no conversion required.
     if (rdr->external_fmt == rdr->curr.fmt) {
         rdr->row_cvt_fn = NULL;
@@ -199,29 +495,58 @@ static void enter_READSTATE_BODY(im_read* rdr)
     }
 }
 
-void im_read_rows(im_read *rdr, unsigned int num_rows, void *buf, int stride)
+// Read the next source row from the handler into workbuf, in the
+// resampler's working format.
+static void read_work_row(im_read* rdr)
 {
-    int i;
+    size_t src_bytes_per_row = im_fmt_bytesperpixel(rdr->curr.fmt) * rdr->curr.w;
 
-    if (rdr->err != IM_ERR_NONE) {
-        return;
-    }
-    if (rdr->state == READSTATE_READY) {
-        rdr->err = IM_ERR_BAD_STATE;
-        return;
-    } else if (rdr->state == READSTATE_HEADER) {
-        // start reading.
-        enter_READSTATE_BODY(rdr);
+    if (rdr->row_cvt_fn) {
+        rdr->handler->read_rows(rdr, 1, rdr->rowbuf, src_bytes_per_row);
+        if (rdr->err == IM_ERR_NONE) {
+            rdr->row_cvt_fn(rdr->rowbuf, rdr->workbuf, rdr->curr.w, rdr->curr.pal_num_colours, rdr->pal_data);
+        }
+    } else {
+        rdr->handler->read_rows(rdr, 1, rdr->workbuf, src_bytes_per_row);
     }
+    rdr->rows_read++;
+}
 
-    // Are there enough rows left?
-    if (rdr->rows_read + num_rows > rdr->curr.h) {
-        rdr->err = IM_ERR_TOO_MANY_ROWS;
-        return;
+// Read rows when scaling. Source rows are pulled from the handler only as
+// the resampler needs them.
+static void read_resampled_rows(im_read* rdr, unsigned int num_rows, uint8_t* buf, int stride)
+{
+    unsigned int w;
+    unsigned int h;
+    unsigned int i;
+
+    pre_transform_size(rdr, &w, &h);
+    for (i = 0; i < num_rows; ++i) {
+        while (i_resampler_need_row(rdr->resampler)) {
+            read_work_row(rdr);
+            if (rdr->err != IM_ERR_NONE) {
+                return;
+            }
+            i_resampler_push_row(rdr->resampler, rdr->workbuf);
+        }
+        if (rdr->out_cvt_fn) {
+            i_resampler_pull_row(rdr->resampler, rdr->workbuf);
+            rdr->out_cvt_fn(rdr->workbuf, buf, w, 0, NULL);
+        } else {
+            i_resampler_pull_row(rdr->resampler, buf);
+        }
+        buf += stride;
     }
+}
 
+// Read the next rows, untransformed, in the external format.
+static void read_plain_rows(im_read* rdr, unsigned int num_rows, uint8_t* buf, int stride)
+{
+    unsigned int i;
 
-    if(rdr->curr.fmt == rdr->external_fmt) {
+    if (rdr->resampler) {
+        read_resampled_rows(rdr, num_rows, buf, stride);
+    } else if(rdr->curr.fmt == rdr->external_fmt) {
         // No conversion required.
         rdr->handler->read_rows(rdr, num_rows, buf, stride);
         rdr->rows_read += num_rows;
@@ -231,14 +556,96 @@ void im_read_rows(im_read *rdr, unsigned int num_rows, void *buf, int stride)
         assert(rdr->row_cvt_fn != NULL);
         for (i=0; i<num_rows; ++i) {
             rdr->handler->read_rows(rdr, 1, rdr->rowbuf, src_bytes_per_row);
+            if (rdr->err != IM_ERR_NONE) {
+                return;
+            }
             rdr->row_cvt_fn(rdr->rowbuf, buf, rdr->curr.w, rdr->curr.pal_num_colours, rdr->pal_data);
             buf += stride;
             rdr->rows_read++;
         }
     }
+}
+
+// Read rows, placing each pixel where the transform puts it.
+static void read_transformed_rows(im_read* rdr, unsigned int num_rows, uint8_t* buf, int stride)
+{
+    unsigned int bpp = im_fmt_bytesperpixel(rdr->external_fmt);
+    unsigned int w;
+    unsigned int h;
+    unsigned int y;
+    ptrdiff_t offset, xstep, ystep;
+
+    pre_transform_size(rdr, &w, &h);
+    if (rdr->transform == IM_TRANSFORM_FLIP_H) {
+        // Rows stay where they are, so they can be read a few at a time.
+        h = num_rows;
+    } else if (rdr->out_rows_read != 0 || num_rows != rdr->out_h) {
+        // Anything else moves pixels between rows, so needs the whole frame.
+        rdr->err = IM_ERR_BADPARAM;
+        return;
+    }
+
+    i_transform_layout(rdr->transform, w, h, bpp, stride, &offset, &xstep, &ystep);
+    buf += offset;
+    if (xstep == (ptrdiff_t)bpp) {
+        // Whole rows, so just a matter of stride.
+        read_plain_rows(rdr, h, buf, (int)ystep);
+        return;
+    }
+    for (y = 0; y < h; y += I_TRANSFORM_TILE) {
+        unsigned int n = (h - y < I_TRANSFORM_TILE) ? h - y : I_TRANSFORM_TILE;
+        size_t tile_stride = (size_t)w * bpp;
+        read_plain_rows(rdr, n, rdr->tilebuf, (int)tile_stride);
+        if (rdr->err != IM_ERR_NONE) {
+            return;
+        }
+        i_transform_scatter(rdr->tilebuf, tile_stride, buf + (ptrdiff_t)y * ystep, xstep, ystep, w, n, bpp);
+    }
+}
+
+void im_read_rows(im_read *rdr, unsigned int num_rows, void *buf, int stride)
+{
+    if (rdr->err != IM_ERR_NONE) {
+        return;
+    }
+    if (rdr->state == READSTATE_READY) {
+        rdr->err = IM_ERR_BAD_STATE;
+        return;
+    } else if (rdr->state == READSTATE_HEADER) {
+        // start reading.
+        enter_READSTATE_BODY(rdr);
+        if (rdr->err != IM_ERR_NONE) {
+            return;
+        }
+    }
+
+    // Are there enough rows left?
+    if (rdr->out_rows_read + num_rows > rdr->out_h) {
+        rdr->err = IM_ERR_TOO_MANY_ROWS;
+        return;
+    }
+
+    if (rdr->transform == IM_TRANSFORM_NONE) {
+        read_plain_rows(rdr, num_rows, buf, stride);
+    } else {
+        read_transformed_rows(rdr, num_rows, buf, stride);
+    }
+    if (rdr->err != IM_ERR_NONE) {
+        return;
+    }
+    rdr->out_rows_read += num_rows;
 
     // Read them all?
-    if (rdr->rows_read == rdr->curr.h) {
+    if (rdr->out_rows_read == rdr->out_h) {
+        // When scaling, the filter might not have needed the last few
+        // source rows, but the handler still expects to see the whole frame
+        // read out.
+        while (rdr->resampler && rdr->rows_read < rdr->curr.h) {
+            read_work_row(rdr);
+            if (rdr->err != IM_ERR_NONE) {
+                return;
+            }
+        }
         rdr->state = READSTATE_READY;
         rdr->frame_num++;
     }
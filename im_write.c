@@ -11,6 +11,8 @@
 extern im_write* ibmp_new_writer(im_out* out, ImErr *err); // bmp_write.c
 extern im_write* igif_new_writer(im_out* out, ImErr *err); // gif_write.c
 extern im_write* ipng_new_writer(im_out* out, ImErr* err); // png_write.c
+extern im_write* ipcx_new_writer(im_out* out, ImErr* err); // pcx_write.c
+extern im_write* itarga_new_writer(im_out* out, ImErr* err); // targa_write.c
 
 void i_write_init(im_write* writer)
 {
@@ -18,6 +20,11 @@ void i_write_init(im_write* writer)
     writer->err = IM_ERR_NONE;
     writer->state = WRITESTATE_READY;
 
+    writer->delay_ms = 100;
+    writer->disposal = IM_DISPOSE_UNSPECIFIED;
+    writer->transparent_index = -1;
+    writer->loop_count = 0;
+
     i_kvstore_init(&writer->kv);
 }
 
@@ -31,6 +38,10 @@ im_write* im_write_new(ImFiletype file_fmt, im_out* out, ImErr* err)
             return igif_new_writer(out, err);
         case IM_FILETYPE_BMP:
             return ibmp_new_writer(out, err);
+        case IM_FILETYPE_PCX:
+            return ipcx_new_writer(out, err);
+        case IM_FILETYPE_TARGA:
+            return itarga_new_writer(out, err);
         default:
            *err = IM_ERR_UNSUPPORTED;
           return NULL; 
@@ -42,6 +53,11 @@ ImErr im_write_finish(im_write* writer)
     ImErr err;
 
     // TODO - check for unfinished images and set error!
+    if (writer->err == IM_ERR_NONE && writer->expected_frames > 0 &&
+        writer->num_frames < writer->expected_frames) {
+        // Fewer frames than promised.
+        writer->err = IM_ERR_UNFINISHED_IMG;
+    }
 
     writer->handler->finish(writer);
     if (writer->out && writer->out_owned) {
@@ -62,6 +78,14 @@ ImErr im_write_finish(im_write* writer)
         ifree(writer->pal_data);
         writer->pal_data = NULL;
     }
+    if (writer->quant_buf) {
+        ifree(writer->quant_buf);
+        writer->quant_buf = NULL;
+    }
+    if (writer->tilebuf) {
+        ifree(writer->tilebuf);
+        writer->tilebuf = NULL;
+    }
 
     i_kvstore_cleanup(&writer->kv);
 
@@ -109,17 +133,29 @@ void im_write_img(im_write* writer, unsigned int w, unsigned int h, ImFmt fmt)
         writer->err = IM_ERR_UNFINISHED_IMG;   // hmm...
         return;
     }
+    if (writer->expected_frames > 0 &&
+        writer->num_frames >= writer->expected_frames) {
+        // More frames than promised (see IM_WRITE_OPT_NUM_FRAMES).
+        writer->err = IM_ERR_BAD_STATE;
+        return;
+    }
 
     writer->x_offset = 0;
     writer->y_offset = 0;
     writer->w = w;
     writer->h = h;
     writer->fmt = fmt;
+    // From here on, w and h describe the image as it'll be written out.
+    if (i_transform_swaps_axes(writer->transform)) {
+        writer->w = h;
+        writer->h = w;
+    }
 
     // Assume internal format is same (but backend can call
     // i_write_set_internal_fmt() to change this).
     writer->internal_fmt = fmt;
     writer->row_cvt_fn = NULL;
+    writer->quantising = false;
 
     // if backend has a pre_img hook, call it now
     if (writer->handler->pre_img) {
@@ -131,6 +167,78 @@ void im_write_img(im_write* writer, unsigned int w, unsigned int h, ImFmt fmt)
 }
 
 
+// Truecolour in, but backend wants INDEX8. Rows are converted to RGBA and
+// collected in quant_buf until the frame is complete.
+static void start_quantising(im_write* writer)
+{
+    size_t nbytes;
+
+    writer->row_cvt_fn = NULL;
+    if (writer->fmt != IM_FMT_RGBA) {
+        writer->row_cvt_fn = i_pick_convert_fn(writer->fmt, IM_FMT_RGBA);
+        if (writer->row_cvt_fn == NULL) {
+            writer->err = IM_ERR_NOCONV;
+            return;
+        }
+    }
+    if (!i_size_img(writer->w, writer->h, 4, &nbytes)) {
+        writer->err = IM_ERR_NOMEM;
+        return;
+    }
+    writer->quant_buf = irealloc(writer->quant_buf, nbytes);
+    if (!writer->quant_buf) {
+        writer->err = IM_ERR_NOMEM;
+        return;
+    }
+    writer->internal_fmt = IM_FMT_INDEX8;
+    writer->quantising = true;
+}
+
+
+// Quantise the collected frame and send it to the backend.
+static void emit_quantised(im_write* writer)
+{
+    unsigned int w = writer->w;
+    unsigned int h = writer->h;
+
+    // Use the existing palette if the caller supplied one, or if we're
+    // sharing the first frame's palette across the whole animation.
+    if (writer->pal_num_colours == 0 ||
+        (writer->pal_generated && !writer->global_palette)) {
+        unsigned int max_colours = writer->quant_colours ? writer->quant_colours : 256;
+        writer->pal_data = irealloc(writer->pal_data, 256 * 4);
+        if (!writer->pal_data) {
+            writer->pal_num_colours = 0;
+            writer->err = IM_ERR_NOMEM;
+            return;
+        }
+        writer->pal_num_colours = i_quant_make_palette(writer->quant_buf,
+            (size_t)w * h, max_colours, writer->pal_data);
+        if (writer->pal_num_colours == 0) {
+            writer->err = IM_ERR_NOMEM;
+            return;
+        }
+        writer->pal_generated = true;
+    }
+
+    // Indices overwrite the RGBA data in place.
+    if (!i_quant_map(writer->quant_buf, w, h, writer->pal_data,
+        writer->pal_num_colours, writer->dither, writer->quant_buf)) {
+        writer->err = IM_ERR_NOMEM;
+        return;
+    }
+
+    writer->handler->emit_header(writer);
+    if (writer->err != IM_ERR_NONE) {
+        return;
+    }
+    // Backends may look at rows_written, so pretend it's all just arriving.
+    writer->rows_written = 0;
+    writer->handler->emit_rows(writer, h, writer->quant_buf, (int)w);
+    writer->rows_written = h;
+}
+
+
 // set internal_fmt and set up pixelformat conversion if required.
 void i_write_set_internal_fmt(im_write* writer, ImFmt internal_fmt)
 {
@@ -145,14 +253,18 @@ void i_write_set_internal_fmt(im_write* writer, ImFmt internal_fmt)
     // to our preferred internal format.
     writer->row_cvt_fn = i_pick_convert_fn(writer->fmt, internal_fmt);
     if (writer->row_cvt_fn == NULL) {
+        if (internal_fmt == IM_FMT_INDEX8 && im_fmt_has_rgb(writer->fmt)) {
+            start_quantising(writer);
+            return;
+        }
         writer->err = IM_ERR_NOCONV;
         return;
     }
 
     writer->internal_fmt = internal_fmt;
-    // (re)allocate the row buffer - enough for the caller to write in a row in
-    // the external pixelformat.
-    writer->rowbuf = irealloc(writer->rowbuf, im_fmt_bytesperpixel(writer->fmt) * writer->w);
+    // (re)allocate the row buffer - enough to hold a row converted to the
+    // internal pixelformat.
+    writer->rowbuf = irealloc(writer->rowbuf, im_fmt_bytesperpixel(internal_fmt) * writer->w);
     if (!writer->rowbuf) {
         writer->err = IM_ERR_NOMEM;
         return;
@@ -160,33 +272,35 @@ void i_write_set_internal_fmt(im_write* writer, ImFmt internal_fmt)
 }
 
 
-void im_write_rows(im_write *writer, unsigned int num_rows, const void *data, int stride)
+// Send rows on to the backend, converting or quantising as required.
+static void write_plain_rows(im_write *writer, unsigned int num_rows, const uint8_t *data, int stride)
 {
-    if (writer->err != IM_ERR_NONE) {
-        return;
-    }
-    if (writer->state == WRITESTATE_READY) {
-        writer->err = IM_ERR_NOT_IN_IMG;   // begin_img wasn't called first.
-        return;
-    }
-
-    if (writer->state == WRITESTATE_HEADER) {
-        // write out everything up to the image data
-        writer->handler->emit_header(writer);
-        if (writer->err != IM_ERR_NONE) {
-            return;
-        }
-        writer->state = WRITESTATE_BODY;
-        writer->rows_written = 0;
-    }
-
     // Write the rows.
     if (writer->rows_written + num_rows > writer->h) {
         writer->err = IM_ERR_TOO_MANY_ROWS;
         return;
     }
 
-    if (writer->fmt == writer->internal_fmt) {
+    if (writer->quantising) {
+        // Just collect the rows for now.
+        uint8_t* dest = writer->quant_buf + (size_t)writer->rows_written * writer->w * 4;
+        for (unsigned int i = 0; i < num_rows; ++i) {
+            if (writer->row_cvt_fn) {
+                writer->row_cvt_fn(data, dest, writer->w, writer->pal_num_colours, writer->pal_data);
+            } else {
+                memcpy(dest, data, writer->w * 4);
+            }
+            data += stride;
+            dest += writer->w * 4;
+        }
+        writer->rows_written += num_rows;
+        if (writer->rows_written >= writer->h) {
+            emit_quantised(writer);
+            if (writer->err != IM_ERR_NONE) {
+                return;
+            }
+        }
+    } else if (writer->fmt == writer->internal_fmt) {
         // No conversion required.
         writer->handler->emit_rows(writer, num_rows, data, stride);
         writer->rows_written += num_rows;
@@ -214,6 +328,82 @@ void im_write_rows(im_write *writer, unsigned int num_rows, const void *data, in
     }
 }
 
+
+// Send rows on to the backend, with each pixel moved to where the
+// transform puts it. Rows are gathered up a strip at a time.
+static void write_transformed_rows(im_write *writer, unsigned int num_rows, const uint8_t *data, int stride)
+{
+    unsigned int bpp = im_fmt_bytesperpixel(writer->fmt);
+    unsigned int w = writer->w;
+    unsigned int h = writer->h;
+    size_t tile_stride = (size_t)w * bpp;
+    unsigned int y;
+    ptrdiff_t offset, xstep, ystep;
+
+    if (writer->transform == IM_TRANSFORM_FLIP_H) {
+        // Rows stay where they are, so they can be sent a few at a time.
+        h = num_rows;
+    } else if (writer->rows_written != 0 ||
+        num_rows != (i_transform_swaps_axes(writer->transform) ? w : h)) {
+        // Anything else moves pixels between rows, so needs the whole frame.
+        writer->err = IM_ERR_BADPARAM;
+        return;
+    }
+
+    // Where each output pixel comes from in the caller's data.
+    i_transform_layout(i_transform_inverse(writer->transform), w, h, bpp, stride, &offset, &xstep, &ystep);
+    data += offset;
+    if (xstep == (ptrdiff_t)bpp) {
+        // Whole rows, so just a matter of stride.
+        write_plain_rows(writer, h, data, (int)ystep);
+        return;
+    }
+
+    writer->tilebuf = irealloc(writer->tilebuf, I_TRANSFORM_TILE * tile_stride);
+    if (!writer->tilebuf) {
+        writer->err = IM_ERR_NOMEM;
+        return;
+    }
+    for (y = 0; y < h; y += I_TRANSFORM_TILE) {
+        unsigned int n = (h - y < I_TRANSFORM_TILE) ? h - y : I_TRANSFORM_TILE;
+        i_transform_gather(data + (ptrdiff_t)y * ystep, xstep, ystep, writer->tilebuf, tile_stride, w, n, bpp);
+        write_plain_rows(writer, n, writer->tilebuf, (int)tile_stride);
+        if (writer->err != IM_ERR_NONE) {
+            return;
+        }
+    }
+}
+
+void im_write_rows(im_write *writer, unsigned int num_rows, const void *data, int stride)
+{
+    if (writer->err != IM_ERR_NONE) {
+        return;
+    }
+    if (writer->state == WRITESTATE_READY) {
+        writer->err = IM_ERR_NOT_IN_IMG;   // begin_img wasn't called first.
+        return;
+    }
+
+    if (writer->state == WRITESTATE_HEADER) {
+        // write out everything up to the image data
+        // (if quantising, this has to wait until we've seen the whole frame)
+        if (!writer->quantising) {
+            writer->handler->emit_header(writer);
+            if (writer->err != IM_ERR_NONE) {
+                return;
+            }
+        }
+        writer->state = WRITESTATE_BODY;
+        writer->rows_written = 0;
+    }
+
+    if (writer->transform == IM_TRANSFORM_NONE) {
+        write_plain_rows(writer, num_rows, data, stride);
+    } else {
+        write_transformed_rows(writer, num_rows, data, stride);
+    }
+}
+
 void im_write_palette(im_write* wr, ImFmt pal_fmt, unsigned int num_colours, const uint8_t *colours)
 {
     if (wr->err != IM_ERR_NONE) {
@@ -245,8 +435,109 @@ void im_write_palette(im_write* wr, ImFmt pal_fmt, unsigned int num_colours, con
     wr->pal_data = irealloc(wr->pal_data, byte_cnt);
     cvt(colours, wr->pal_data, num_colours, 0, NULL);
     wr->pal_num_colours = num_colours;
+    wr->pal_generated = false;
+}
+
+void im_write_frame_info(im_write *wr, unsigned int delay_ms, ImDispose disposal, int transparent_index)
+{
+    if (wr->err != IM_ERR_NONE) {
+        return;
+    }
+    if (wr->state == WRITESTATE_READY) {
+        wr->err = IM_ERR_NOT_IN_IMG;   // begin_img wasn't called first.
+        return;
+    }
+    if (wr->state == WRITESTATE_BODY) {
+        wr->err = IM_ERR_UNFINISHED_IMG;   // should be writing rows.
+        return;
+    }
+    if (transparent_index < -1 || transparent_index > 255) {
+        wr->err = IM_ERR_BADPARAM;
+        return;
+    }
+
+    wr->delay_ms = delay_ms;
+    wr->disposal = disposal;
+    wr->transparent_index = transparent_index;
+}
+
+void im_write_set_option(im_write *wr, ImWriteOption opt, int value)
+{
+    if (wr->err != IM_ERR_NONE) {
+        return;
+    }
+    switch (opt) {
+        case IM_WRITE_OPT_OPTIMISE_FRAMES:
+            wr->optimise_frames = (value != 0);
+            break;
+        case IM_WRITE_OPT_QUANTISE:
+            if (value != 0 && (value < 2 || value > 256)) {
+                wr->err = IM_ERR_BADPARAM;
+                return;
+            }
+            wr->quant_colours = (unsigned int)value;
+            break;
+        case IM_WRITE_OPT_DITHER:
+            if (value < IM_DITHER_NONE || value > IM_DITHER_FLOYD_STEINBERG) {
+                wr->err = IM_ERR_BADPARAM;
+                return;
+            }
+            wr->dither = (ImDither)value;
+            break;
+        case IM_WRITE_OPT_GLOBAL_PALETTE:
+            wr->global_palette = (value != 0);
+            break;
+        case IM_WRITE_OPT_LOSSY:
+            if (value < 0) {
+                wr->err = IM_ERR_BADPARAM;
+                return;
+            }
+            wr->lossy = value;
+            break;
+        case IM_WRITE_OPT_RLE:
+            wr->rle = (value != 0);
+            break;
+        case IM_WRITE_OPT_TRANSFORM:
+            if (value < IM_TRANSFORM_NONE || value > IM_TRANSFORM_ROTATE_270) {
+                wr->err = IM_ERR_BADPARAM;
+                return;
+            }
+            wr->transform = (ImTransform)value;
+            break;
+        case IM_WRITE_OPT_NUM_FRAMES:
+            // Too late if the first frame has already gone out.
+            if (wr->num_frames > 0 || wr->state == WRITESTATE_BODY) {
+                wr->err = IM_ERR_BAD_STATE;
+                return;
+            }
+            if (value < 0) {
+                wr->err = IM_ERR_BADPARAM;
+                return;
+            }
+            wr->expected_frames = (unsigned int)value;
+            break;
+        default:
+            wr->err = IM_ERR_BADPARAM;
+            break;
+    }
 }
 
+void im_write_loop_count(im_write *wr, int loop_count)
+{
+    if (wr->err != IM_ERR_NONE) {
+        return;
+    }
+    // Too late if the first frame has already gone out.
+    if (wr->num_frames > 0 || wr->state == WRITESTATE_BODY) {
+        wr->err = IM_ERR_BAD_STATE;
+        return;
+    }
+    if (loop_count < -1 || loop_count > 0xffff) {
+        wr->err = IM_ERR_BADPARAM;
+        return;
+    }
+    wr->loop_count = loop_count;
+}
 
 void im_write_kv(im_write *wr, const char* key, const char* value)
 {
@@ -99,7 +99,7 @@ im_img* im_img_clone(const im_img* src_img)
     int d = src_img->d;
     ImFmt fmt = src_img->format;
 
-    size_t bytesperline = w * im_fmt_bytesperpixel(fmt);
+    size_t bytesperline = (size_t)w * im_fmt_bytesperpixel(fmt);
     int y,z;
     im_img* dest_img = im_img_new(w,h,d,fmt);
     if (!dest_img) {
@@ -129,7 +129,9 @@ im_img* im_img_clone(const im_img* src_img)
 im_img* im_img_new(int w, int h, int d, ImFmt fmt)
 {
     im_img* foo;
-    int bytesPerPixel;
+    size_t bytesPerPixel;
+    size_t pitch;
+    size_t nbytes;
 
     if( w<1 || h<1 || d<1 ) {
         return NULL;
@@ -139,6 +141,10 @@ im_img* im_img_new(int w, int h, int d, ImFmt fmt)
     if(bytesPerPixel==0) {
         return NULL;
     }
+    if (!i_size_mul((size_t)w, bytesPerPixel, &pitch) ||
+        !i_size_img(pitch, (size_t)h, (size_t)d, &nbytes)) {
+        return NULL;
+    }
 
     foo = imalloc(sizeof(struct im_img));
     if (foo==NULL) {
@@ -150,8 +156,8 @@ im_img* im_img_new(int w, int h, int d, ImFmt fmt)
     foo->d = d;
 
     foo->format = fmt;
-    foo->pitch = bytesPerPixel * foo->w;
-    foo->pixel_data = imalloc(foo->h * foo->pitch * foo->d);
+    foo->pitch = pitch;
+    foo->pixel_data = imalloc(nbytes);
     if (!foo->pixel_data) {
         ifree(foo);
         return NULL;
@@ -15,7 +15,7 @@ typedef struct im_img {
 
     ImFmt format;     // IM_FMT_*
 
-    int pitch;  // bytes per line
+    size_t pitch;  // bytes per line
     void* pixel_data;
 
     // palette
@@ -31,6 +31,7 @@ typedef struct im_img {
 
 
 // creates a new image (no palette, even if indexed)
+// Returns NULL if out of memory, or if the size overflows a size_t.
 extern im_img* im_img_new(int w, int h, int d, ImFmt fmt);
 
 // Free an image (and its content and palette)
@@ -41,7 +42,7 @@ extern im_img* im_img_clone(const im_img* src_img);
 
 // Fetch a pointer to a specific pixel
 static inline void* im_img_pos(const im_img *img, int x, int y)
-    { return ((uint8_t*)(img->pixel_data)) + (y*img->pitch) + (x*im_fmt_bytesperpixel(img->format)); }
+    { return ((uint8_t*)(img->pixel_data)) + ((size_t)y*img->pitch) + ((size_t)x*im_fmt_bytesperpixel(img->format)); }
 
 // Fetch a pointer to the start of a specific row
 static inline void* im_img_row(const im_img *img, int row)
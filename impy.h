@@ -18,27 +18,56 @@ extern "C" {
 
 #define IMPY_VERSION_STRING "0.2"
 // Increment this any time API changes.
-#define IMPY_API_VERSION 2
+#define IMPY_API_VERSION 17
 
 // The pixelformats we support.
 // X = pad byte
 // A = alpha byte
 // R,G,B = colour components (bytes)
+// The *16 formats have 16 bit channels instead, stored as native-endian
+// uint16_t values (so rows should be 2-byte aligned).
+//
+// The values are bit-encoded, so the im_fmt_*() helpers below can just
+// pick out the details. The low two bits hold the number of channels,
+// minus one, and the rest are flags:
+#define IM_FMTBIT_16BIT         0x004   // 16 bit channels
+#define IM_FMTBIT_INDEXED       0x008   // index into a palette
+#define IM_FMTBIT_LUMINANCE     0x010   // greyscale
+#define IM_FMTBIT_RGB           0x020   // RGB colour
+#define IM_FMTBIT_ALPHA         0x040   // has an alpha channel
+#define IM_FMTBIT_PAD           0x080   // has a pad channel (where alpha would be)
+#define IM_FMTBIT_BGR           0x100   // colour channels are in BGR order
+#define IM_FMTBIT_ALPHA_FIRST   0x200   // alpha/pad comes before the colour
+#define IM_FMTBIT_PREMULTIPLIED 0x400   // colour is premultiplied by alpha
+#define IM_FMT_ENCODE(nchannels, bits) (((nchannels) - 1) | (bits))
+
 typedef enum ImFmt {
     IM_FMT_NONE = 0,
-    IM_FMT_INDEX8,  // Bytes indexing a palette.
-    IM_FMT_RGB,
-    IM_FMT_RGBA,
-    IM_FMT_RGBX,
-    IM_FMT_ARGB,
-    IM_FMT_XRGB,
-    IM_FMT_BGR,
-    IM_FMT_BGRA,
-    IM_FMT_BGRX,
-    IM_FMT_ABGR,
-    IM_FMT_XBGR,
-    IM_FMT_ALPHA,
-    IM_FMT_LUMINANCE    // Not really supported yet.
+    IM_FMT_INDEX8 = IM_FMT_ENCODE(1, IM_FMTBIT_INDEXED),  // Bytes indexing a palette.
+    IM_FMT_RGB = IM_FMT_ENCODE(3, IM_FMTBIT_RGB),
+    IM_FMT_RGBA = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_ALPHA),
+    IM_FMT_RGBX = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_PAD),
+    IM_FMT_ARGB = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_ALPHA | IM_FMTBIT_ALPHA_FIRST),
+    IM_FMT_XRGB = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_PAD | IM_FMTBIT_ALPHA_FIRST),
+    IM_FMT_BGR = IM_FMT_ENCODE(3, IM_FMTBIT_RGB | IM_FMTBIT_BGR),
+    IM_FMT_BGRA = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_BGR | IM_FMTBIT_ALPHA),
+    IM_FMT_BGRX = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_BGR | IM_FMTBIT_PAD),
+    IM_FMT_ABGR = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_BGR | IM_FMTBIT_ALPHA | IM_FMTBIT_ALPHA_FIRST),
+    IM_FMT_XBGR = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_BGR | IM_FMTBIT_PAD | IM_FMTBIT_ALPHA_FIRST),
+    IM_FMT_ALPHA = IM_FMT_ENCODE(1, IM_FMTBIT_ALPHA),
+    IM_FMT_LUMINANCE = IM_FMT_ENCODE(1, IM_FMTBIT_LUMINANCE),     // Greyscale.
+    IM_FMT_LUMINANCE_ALPHA = IM_FMT_ENCODE(2, IM_FMTBIT_LUMINANCE | IM_FMTBIT_ALPHA),  // Greyscale, then alpha.
+    IM_FMT_RGB16 = IM_FMT_ENCODE(3, IM_FMTBIT_RGB | IM_FMTBIT_16BIT),
+    IM_FMT_RGBA16 = IM_FMT_ENCODE(4, IM_FMTBIT_RGB | IM_FMTBIT_ALPHA | IM_FMTBIT_16BIT),
+    IM_FMT_LUMINANCE16 = IM_FMT_ENCODE(1, IM_FMTBIT_LUMINANCE | IM_FMTBIT_16BIT),
+    IM_FMT_LUMINANCE_ALPHA16 = IM_FMT_ENCODE(2, IM_FMTBIT_LUMINANCE | IM_FMTBIT_ALPHA | IM_FMTBIT_16BIT),
+    // Premultiplied alpha versions (colour components already multiplied
+    // by alpha).
+    IM_FMT_RGBA_PREMUL = IM_FMT_RGBA | IM_FMTBIT_PREMULTIPLIED,
+    IM_FMT_ARGB_PREMUL = IM_FMT_ARGB | IM_FMTBIT_PREMULTIPLIED,
+    IM_FMT_BGRA_PREMUL = IM_FMT_BGRA | IM_FMTBIT_PREMULTIPLIED,
+    IM_FMT_ABGR_PREMUL = IM_FMT_ABGR | IM_FMTBIT_PREMULTIPLIED,
+    IM_FMT_RGBA16_PREMUL = IM_FMT_RGBA16 | IM_FMTBIT_PREMULTIPLIED
 } ImFmt;
 
 // Supported file types.
@@ -67,6 +96,7 @@ typedef enum ImErr {
     IM_ERR_FILE,           // general IO/file error
     IM_ERR_UNKNOWN_FILE_TYPE,
     IM_ERR_EXTLIB,         // any unspecified error in external lib
+    IM_ERR_LIMIT,          // file goes over one of the reader's limits
 
     IM_ERR_UNSUPPORTED_FMT,    // format doesn't support img format
     IM_ERR_PALETTE_TOO_BIG,    // format doesn't support palette with that many colours
@@ -79,6 +109,112 @@ typedef enum ImErr {
                            // non-existent palette.
 } ImErr;
 
+// How a frame should be disposed of before the next frame is drawn.
+// (Follows the GIF disposal modes).
+typedef enum ImDispose {
+    IM_DISPOSE_UNSPECIFIED = 0,
+    IM_DISPOSE_NONE,        // Leave the frame in place.
+    IM_DISPOSE_BACKGROUND,  // Clear the frame area to the background.
+    IM_DISPOSE_PREVIOUS     // Restore the frame area to what was there before.
+} ImDispose;
+
+// Optional writer settings, for im_write_set_option().
+// Formats which don't support an option just ignore it.
+typedef enum ImWriteOption {
+    // Non-zero: only write out the parts of each animation frame which have
+    // changed since the previous one (GIF, PNG).
+    IM_WRITE_OPT_OPTIMISE_FRAMES = 0,
+    // Quantise truecolour images down to a palette of at most this many
+    // colours (2-256), for formats which could store either (PNG, PCX,
+    // Targa).
+    // 0 (the default) means don't. Formats which can only store paletted
+    // images (GIF) always quantise truecolour input, to 256 colours if
+    // this isn't set.
+    IM_WRITE_OPT_QUANTISE,
+    // Dithering to use when quantising (one of IM_DITHER_*).
+    IM_WRITE_OPT_DITHER,
+    // Non-zero: reuse the palette generated when quantising the first frame
+    // for all the subsequent ones, rather than picking a new palette for
+    // each frame.
+    IM_WRITE_OPT_GLOBAL_PALETTE,
+    // Lossy compression: allow colours within this distance (in RGB units)
+    // to be swapped for each other if it helps compression (GIF).
+    // 0 (the default) means lossless.
+    IM_WRITE_OPT_LOSSY,
+    // Non-zero: use run-length encoding, for formats where it's optional
+    // (BMP - paletted images only, Targa).
+    IM_WRITE_OPT_RLE,
+    // Flip or rotate images as they're written (one of IM_TRANSFORM_*).
+    // im_write_img() takes the size of the untransformed image, as sent to
+    // im_write_rows(). Unless it's IM_TRANSFORM_NONE or
+    // IM_TRANSFORM_FLIP_H, each frame has to be sent in a single
+    // im_write_rows() call (IM_ERR_BADPARAM otherwise).
+    IM_WRITE_OPT_TRANSFORM,
+    // The number of frames which will be written, if known in advance.
+    // Must be set before the first frame. Lets formats which need to
+    // know up front (PNG) write animations out as they go, instead of
+    // holding them in memory until im_write_finish(). Writing more frames
+    // than this is IM_ERR_BAD_STATE, fewer is IM_ERR_UNFINISHED_IMG.
+    // 0 (the default) means unknown.
+    IM_WRITE_OPT_NUM_FRAMES,
+} ImWriteOption;
+
+// Dithering modes for IM_WRITE_OPT_DITHER.
+typedef enum ImDither {
+    IM_DITHER_NONE = 0,
+    IM_DITHER_ORDERED,          // 4x4 Bayer matrix.
+    IM_DITHER_FLOYD_STEINBERG   // Error diffusion.
+} ImDither;
+
+// Flips and rotations (see im_read_set_transform() and
+// IM_WRITE_OPT_TRANSFORM). Rotations are clockwise.
+// They're in the same order as the EXIF orientation tag, so a tag value n
+// is fixed up by transform n-1.
+typedef enum ImTransform {
+    IM_TRANSFORM_NONE = 0,
+    IM_TRANSFORM_FLIP_H,        // Mirror left-right.
+    IM_TRANSFORM_ROTATE_180,
+    IM_TRANSFORM_FLIP_V,        // Mirror top-bottom.
+    IM_TRANSFORM_TRANSPOSE,     // Swap x and y (flip about top-left diagonal).
+    IM_TRANSFORM_ROTATE_90,
+    IM_TRANSFORM_TRANSVERSE,    // Flip about the top-right diagonal.
+    IM_TRANSFORM_ROTATE_270
+} ImTransform;
+
+// Filters for scaling images as they're read (see im_read_set_output_size()).
+typedef enum ImFilter {
+    IM_FILTER_BOX = 0,      // Area average. Fastest, fine for thumbnails.
+    IM_FILTER_BILINEAR,     // Triangle filter.
+    IM_FILTER_LANCZOS3      // Windowed sinc. Sharpest, but slowest.
+} ImFilter;
+
+// Reader limits, for im_read_set_limit(). A limit of 0 means unlimited.
+typedef enum ImReadLimit {
+    // Maximum width*height of a frame, or of the canvas an animation is
+    // drawn on. Default 0x10000000 (256M pixels).
+    IM_LIMIT_PIXELS = 0,
+    // Maximum number of frames. Default unlimited.
+    IM_LIMIT_FRAMES,
+    // Maximum total size of all the decoded frames, in bytes (in the
+    // formats reported by im_read_img()). Default unlimited.
+    IM_LIMIT_DECODED_BYTES,
+    // Maximum size of the metadata (text chunks and the like) held in
+    // memory, in bytes. Default 8MB.
+    IM_LIMIT_METADATA_BYTES
+} ImReadLimit;
+
+// Optional reader settings, for im_read_set_option().
+typedef enum ImReadOption {
+    // Non-zero (the default): draw animation frames onto a canvas as
+    // they're read, so each one comes out complete and the size of the
+    // whole animation.
+    // Zero: return GIF frames as they're stored in the file, with their
+    // own size and offsets, disposal and transparent index, for callers
+    // which composite them themselves or pass them on without
+    // re-encoding. PNG and IFF animations are always composited.
+    IM_READ_OPT_COALESCE = 0
+} ImReadOption;
+
 
 
 typedef struct im_in im_in;
@@ -92,7 +228,8 @@ typedef struct im_write im_write;
  * General steps:
  * 1. Create an im_read object (eg using im_read_open_file()).
  * 2. Call im_read_img to get the image details.
- * 3. (optional) call im_read_set_fmt(), im_read_palette() etc...
+ * 3. (optional) call im_read_set_fmt(), im_read_set_output_size(),
+ *    im_read_set_transform(), im_read_palette() etc...
  * 4. Read the image data out using im_read_rows().
  * 5. If reading an animation, loop back to step 2.
  * 5. Call im_read_finish().
@@ -113,6 +250,25 @@ typedef struct im_imginfo {
     int x_offset;
     int y_offset;
     unsigned int pal_num_colours;   // Palette size.
+
+    // Animation details (only meaningful for formats which support them).
+    unsigned int delay_ms;          // Frame duration, in milliseconds.
+    // Readers which composite animations into complete frames (PNG, IFF,
+    // and GIF unless IM_READ_OPT_COALESCE is turned off) report
+    // IM_DISPOSE_NONE and no transparent index for them.
+    ImDispose disposal;             // What to do after frame is displayed.
+    int transparent_index;          // Transparent palette index, -1 = none.
+    int loop_count;                 // Repeats after the first play (see
+                                    // im_write_loop_count()). 0 = loop
+                                    // forever, -1 = not specified.
+
+    // The area which differs from the previous frame. Formats which don't
+    // track this report the whole frame. Can be empty (w and h 0) if the
+    // frame is the same as the previous one.
+    int changed_x;
+    int changed_y;
+    unsigned int changed_w;
+    unsigned int changed_h;
 } im_imginfo;
 
 /* Create a read object by opening a file.
@@ -145,6 +301,70 @@ bool im_read_img(im_read *reader, im_imginfo *info);
  */
 void im_read_set_fmt(im_read* rdr, ImFmt fmt);
 
+/* Scale the current image to w by h pixels as it is read.
+ *
+ * im_read_rows() will then return w-pixel rows, h of them in total. The
+ * scaling is done a row at a time as the image is decoded, so only a few
+ * rows of working memory are needed, not the whole image.
+ * Unlike im_read_set_fmt(), it only applies to the current frame. Setting
+ * w and h to the image's own size turns scaling off.
+ *
+ * If im_read_set_transform() is also used, w and h are the size after the
+ * transform.
+ *
+ * Scaling can't produce IM_FMT_INDEX8 data (IM_ERR_NOCONV). A zero w or h
+ * gives IM_ERR_BADPARAM. Progress previews (im_read_set_progress_fn())
+ * are not provided for scaled images.
+ */
+void im_read_set_output_size(im_read* rdr, unsigned int w, unsigned int h, ImFilter filter);
+
+/* Flip or rotate the current image as it is read.
+ *
+ * Pixels are written straight to their final place in the buffer passed
+ * to im_read_rows(), so there's no separate pass over the image. Rotating
+ * by 90 or 270 degrees (or transposing) swaps the width and height.
+ * Unless it's IM_TRANSFORM_NONE or IM_TRANSFORM_FLIP_H, the whole frame
+ * must be read with a single im_read_rows() call (IM_ERR_BADPARAM
+ * otherwise).
+ * Like im_read_set_output_size(), it only applies to the current frame,
+ * and progress previews are not provided. Frame offsets and changed areas
+ * in im_imginfo are not transformed.
+ */
+void im_read_set_transform(im_read* rdr, ImTransform transform);
+
+/* Callback for displaying an image as it loads.
+ * `pixels` holds a preview of the whole image, in the format im_read_rows()
+ * will return, `stride` bytes per row. It is only valid for the duration of
+ * the call. `pass` counts up from 1 to `num_passes`. After the final pass,
+ * the preview is the full image.
+ */
+typedef void (*im_progress_fn)(void *user, unsigned int pass, unsigned int num_passes, const void *pixels, int stride);
+
+/* Set a function to be called with previews of progressive (interlaced)
+ * images as they are decoded.
+ * For such images, the first im_read_rows() call decodes the whole image,
+ * calling `fn` after each pass. Formats which can't provide previews just
+ * ignore it.
+ * Currently only PNG (Adam7 interlacing) supports this.
+ */
+void im_read_set_progress_fn(im_read *reader, im_progress_fn fn, void *user);
+
+/* Set one of the reader's limits (see ImReadLimit), so that broken or
+ * malicious files can't claim huge amounts of memory.
+ * Limits are checked as soon as the relevant headers are read, before
+ * anything is allocated or decoded for them. Going over one gives
+ * IM_ERR_LIMIT.
+ * Call it before the first im_read_img(), so the limits also cover the
+ * file header.
+ */
+void im_read_set_limit(im_read *reader, ImReadLimit limit, uint64_t value);
+
+/* Set an optional reader setting (one of IM_READ_OPT_*).
+ * It must be called before the first im_read_img() (IM_ERR_BAD_STATE
+ * otherwise), and applies to the whole file.
+ */
+void im_read_set_option(im_read *reader, ImReadOption opt, int value);
+
 /* Read out some (or all) of the image data.
  * It can be called multiple times.
  * `buf` must point to a buffer large enough to contain the resultant rows of
@@ -154,7 +374,9 @@ void im_read_set_fmt(im_read* rdr, ImFmt fmt);
  * A negative `stride` is allowed, so buffers can be filled from the bottom
  * up.
  * The pixel format of the image data will be whatever im_read_img() returned,
- * unless it was successfully overridden by im_read_set_fmt().
+ * unless it was successfully overridden by im_read_set_fmt(). Likewise the
+ * size, unless im_read_set_output_size() or im_read_set_transform() were
+ * used.
  */
 void im_read_rows(im_read *reader, unsigned int num_rows, void *buf, int stride);
 
@@ -211,9 +433,38 @@ void im_write_img(im_write *writer, unsigned int w, unsigned int h, ImFmt fmt);
  * For multiple-image writes, the palette stays in effect for subsequent
  * frames. So if you're writing out an animation which uses a single global
  * palette, it's sufficient to just write it out once, for the first frame.
+ * PNG animations can only have the one palette, so every frame must use the
+ * first frame's.
  */
 void im_write_palette(im_write *writer, ImFmt pal_fmt, unsigned int num_colours, const uint8_t *colours);
 
+/* Set the animation details for the current frame, after a im_write_img()
+ * call.
+ * `delay_ms` is the frame duration in milliseconds, `disposal` says what
+ * should happen to the frame before the next one is drawn and
+ * `transparent_index` gives a palette index to treat as transparent (-1 for
+ * none).
+ * As with the palette, these stay in effect for subsequent frames.
+ * The defaults are 100ms, IM_DISPOSE_UNSPECIFIED and no transparent index.
+ * Formats without animation support just ignore them.
+ */
+void im_write_frame_info(im_write *writer, unsigned int delay_ms, ImDispose disposal, int transparent_index);
+
+/* Set an optional writer setting (one of IM_WRITE_OPT_*).
+ * Options are best set before the first im_write_img() call, and stay in
+ * effect until changed.
+ */
+void im_write_set_option(im_write *writer, ImWriteOption opt, int value);
+
+/* Set the number of times an animation should repeat after it's first
+ * played through (0 = loop forever, -1 = don't specify, which usually means
+ * play once). This is the GIF NETSCAPE loop count. Formats which count
+ * plays instead (APNG) are converted.
+ * Must be called before the first frame is written out.
+ * The default is 0.
+ */
+void im_write_loop_count(im_write *writer, int loop_count);
+
 /* Write the image data.
  * Can be called multiple times until the whole image is complete.
  * `data` is expected contain `num_rows` worth of source in the pixel format
@@ -256,45 +507,41 @@ ImFiletype im_sniff_filetype(im_in *in);
  * Pixelformat helpers
  */
 
-// TODO: bit encode details into the IM_FMT_ values, to simplify these
-// functions.
-
 /* Return true if fmt is intended to index into a palette. */
 static inline bool im_fmt_is_indexed(ImFmt fmt)
-    {return fmt == IM_FMT_INDEX8; }
+    { return (fmt & IM_FMTBIT_INDEXED) != 0; }
+
+/* Return true if fmt is greyscale (with or without alpha). */
+static inline bool im_fmt_is_luminance(ImFmt fmt)
+    { return (fmt & IM_FMTBIT_LUMINANCE) != 0; }
+
+/* Return true if fmt has 16 bit channels. */
+static inline bool im_fmt_is_16bit(ImFmt fmt)
+    { return (fmt & IM_FMTBIT_16BIT) != 0; }
 
 /* Return true if fmt has RGB components (in any order). */
 static inline bool im_fmt_has_rgb(ImFmt fmt)
-{
-    return fmt != IM_FMT_INDEX8 &&
-        fmt != IM_FMT_ALPHA &&
-        fmt != IM_FMT_LUMINANCE;
-}
+    { return (fmt & IM_FMTBIT_RGB) != 0; }
 
 /* Return true if fmt has an alpha channel. */
 static inline bool im_fmt_has_alpha(ImFmt fmt)
-{
-    return fmt == IM_FMT_RGBA ||
-        fmt == IM_FMT_BGRA ||
-        fmt == IM_FMT_ARGB ||
-        fmt == IM_FMT_ABGR ||
-        fmt == IM_FMT_ALPHA;
-}
+    { return (fmt & IM_FMTBIT_ALPHA) != 0; }
+
+/* Return true if fmt has colour premultiplied by alpha. */
+static inline bool im_fmt_is_premultiplied(ImFmt fmt)
+    { return (fmt & IM_FMTBIT_PREMULTIPLIED) != 0; }
+
+/* Return true if fmt has a pad channel. */
+static inline bool im_fmt_has_pad(ImFmt fmt)
+    { return (fmt & IM_FMTBIT_PAD) != 0; }
+
+/* Return the number of channels (including alpha and pad) in fmt. */
+static inline unsigned int im_fmt_num_channels(ImFmt fmt)
+    { return (fmt == IM_FMT_NONE) ? 0 : (fmt & 3) + 1; }
 
 /* Return the number of bytes for each pixel in this format. */
 static inline size_t im_fmt_bytesperpixel(ImFmt fmt)
-{
-    size_t s = 0;
-    if (im_fmt_is_indexed(fmt)) {
-        s += 1;
-    } else if (im_fmt_has_rgb(fmt)) {
-        s += 3;
-    }
-    if (im_fmt_has_alpha(fmt)) {
-        s += 1;
-    }
-    return s;
-}
+    { return im_fmt_num_channels(fmt) * (im_fmt_is_16bit(fmt) ? 2 : 1); }
 
 /**********
  * IO stuff
@@ -307,10 +554,11 @@ static inline size_t im_fmt_bytesperpixel(ImFmt fmt)
 
 
 // abstracted interface for reading
+// Offsets are 64 bit, so files over 2GB work even where long is 32 bit.
 typedef struct im_in {
     size_t (*read)(im_in *, void * , size_t );
-    int (*seek)(im_in *, long , int);
-    int (*tell)(im_in *);
+    int (*seek)(im_in *, int64_t , int);
+    int64_t (*tell)(im_in *);
     int (*eof)(im_in *);
     int (*error)(im_in *);
     int (*close)(im_in *);
@@ -334,11 +582,11 @@ static inline size_t im_in_read(im_in *in, void *buf, size_t nbytes)
     { return in->read(in, buf, nbytes); }
 
 // returns 0 for success, non-zero for error
-static inline int im_in_seek(im_in *in, long pos, int whence)
+static inline int im_in_seek(im_in *in, int64_t pos, int whence)
     { return in->seek(in, pos, whence); }
  
 // returns current position, -1 for error
-static inline int im_in_tell(im_in *in)
+static inline int64_t im_in_tell(im_in *in)
     { return in->tell(in); }
 
 
@@ -1,6 +1,26 @@
+// Ask for 64 bit file offsets (fseeko()/ftello() on a 32 bit off_t
+// system). This has to come before any system header.
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "impy.h"
 #include "private.h"
 #include <stdio.h>
+#include <sys/types.h>
+
+#if defined(_WIN32)
+typedef __int64 i_off_t;
+#define i_fseek64 _fseeki64
+#define i_ftell64 _ftelli64
+#else
+typedef off_t i_off_t;
+#define i_fseek64 fseeko
+#define i_ftell64 ftello
+#endif
 
 
 struct file_in {
@@ -18,16 +38,11 @@ struct file_out {
 static size_t file_in_read(im_in* r, void* buf, size_t nbytes)
 {
     struct file_in *frdr = (struct file_in*)r;
-    int ret = fread(buf,1,nbytes,frdr->fp);
-    if (ret<0) {
-        // TODO: translate errno
-        //im_err(IM_ERR_FILE);
-    }
-    return ret;
+    return fread(buf,1,nbytes,frdr->fp);
 }
 
 
-static int file_in_seek(im_in* r, long pos, int whence)
+static int file_in_seek(im_in* r, int64_t pos, int whence)
 {
     struct file_in *fr = (struct file_in*)r;
     int w;
@@ -40,7 +55,11 @@ static int file_in_seek(im_in* r, long pos, int whence)
             //im_err(IM_ERR_BADPARAM);
             return -1;
     }
-    ret = fseek(fr->fp,pos,w);
+    // off_t could still be 32 bit, if large file support is missing.
+    if ((int64_t)(i_off_t)pos != pos) {
+        return -1;
+    }
+    ret = i_fseek64(fr->fp, (i_off_t)pos, w);
     if (ret<0) {
         // TODO: translate errno
         // im_err(IM_ERR_FILE);
@@ -48,10 +67,10 @@ static int file_in_seek(im_in* r, long pos, int whence)
     return ret;
 }
 
-static int file_in_tell(im_in* r)
+static int64_t file_in_tell(im_in* r)
 {
     struct file_in *fr = (struct file_in*)r;
-    return ftell(fr->fp);
+    return (int64_t)i_ftell64(fr->fp);
 }
 
 
@@ -117,11 +136,7 @@ int im_in_close(im_in* in) {
 static size_t file_out_write(im_out* w, const void* buf, size_t nbytes)
 {
     struct file_out *fw = (struct file_out*)w;
-    int ret = fwrite(buf,1,nbytes,fw->fp);
-    if (ret<0) {
-        //*err = IM_ERR_FILE;    // TODO: translate errno
-    }
-    return ret;
+    return fwrite(buf,1,nbytes,fw->fp);
 }
 
 static int file_out_close(im_out* w)
@@ -9,7 +9,7 @@
 
 static bool jpeg_match_cookie(const uint8_t* buf, int nbytes);
 static im_read* jpeg_read_create(im_in *in, ImErr *err);
-static im_img* iread_jpeg_image(im_in* in, kvstore *kv, ImErr* err);
+static im_img* iread_jpeg_image(im_read* rdr);
 
 i_read_handler i_jpeg_read_handler = {
     IM_FILETYPE_JPEG,
@@ -137,8 +137,10 @@ void my_error_exit(j_common_ptr cinfo)
 //------------------------------------------------------
 //
 
-static im_img* iread_jpeg_image(im_in* in, kvstore *kv, ImErr* err)
+static im_img* iread_jpeg_image(im_read* rdr)
 {
+    im_in* in = rdr->in;
+    ImErr* err = &rdr->err;
     struct jpeg_decompress_struct cinfo;
     my_error_mgr jerr;
     imreader_src* src = 0;
@@ -160,6 +162,10 @@ static im_img* iread_jpeg_image(im_in* in, kvstore *kv, ImErr* err)
     }
 
     jpeg_read_header(&cinfo, TRUE);
+    // Output is always RGB (see below).
+    if (!i_read_check_size(rdr, cinfo.image_width, cinfo.image_height, 3)) {
+        goto cleanup;
+    }
     jpeg_start_decompress(&cinfo);
 
     int w = cinfo.output_width;
@@ -171,6 +177,10 @@ static im_img* iread_jpeg_image(im_in* in, kvstore *kv, ImErr* err)
         goto cleanup;
     }
     image = im_img_new( w, h, 1, IM_FMT_RGB);
+    if (!image) {
+        *err = IM_ERR_NOMEM;
+        goto cleanup;
+    }
 
     int y;
     for (y=0; y<h; ++y) {
@@ -10,15 +10,17 @@
 
 static bool pcx_match_cookie(const uint8_t* buf, int nbytes);
 static im_read* pcx_read_create(im_in *in, ImErr *err);
-static im_img* iread_pcx_image(im_in* in, kvstore *kv, ImErr* err);
+static bool pcx_get_img(im_read* rdr);
+static void pcx_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride);
+static void pcx_read_finish(im_read* rdr);
 
 i_read_handler i_pcx_read_handler = {
     IM_FILETYPE_PCX,
     pcx_match_cookie,
     pcx_read_create,
-    i_generic_read_img,
-    i_generic_read_rows,
-    i_generic_read_finish
+    pcx_get_img,
+    pcx_read_rows,
+    pcx_read_finish
 };
 
 static bool pcx_match_cookie(const uint8_t* buf, int nbytes)
@@ -47,108 +49,179 @@ static bool pcx_match_cookie(const uint8_t* buf, int nbytes)
     return true;
 }
 
-static im_read* pcx_read_create(im_in *in, ImErr *err)
-{
-    return i_new_generic_reader(iread_pcx_image, &i_pcx_read_handler, in ,err);
-}
-
 typedef struct header {
     int version, enc, depth, w, h, xmin, xmax, ymin, ymax, planes, xdpi, ydpi;
     size_t bytesperline;
     int paltype;
-    uint8_t *scanbuf;
+    uint8_t egapal[16*3];   // 16-colour palette from the header
 } header;
 
-static bool read_header( header* pcx, im_in* in, ImErr *err);
-static void decode_scanline( header* pcx, im_in* in);
+// Compressed data is read in chunks of this size.
+#define PCX_CHUNK_SIZE (16*1024)
 
+typedef struct pcx_reader {
+    im_read base;
 
-static im_img* iread_pcx_image( im_in* in, kvstore *kv, ImErr* err )
-{
-    im_img* img = NULL;
-    header pcx = {0};
-    *err = IM_ERR_NONE;
+    header pcx;
+    uint8_t* scanbuf;   // one decoded scanline (all planes)
+    // Converts a decoded scanline into the output format.
+    void (*convert_row)(struct pcx_reader* pr, uint8_t* dest);
 
-    if (!read_header( &pcx, in, err)) {
-        goto cleanup;
-    }
+    // buffered input
+    uint8_t* inbuf;
+    size_t inpos;
+    size_t inlen;
 
-    // TODO: handle depth<8
+    // For 1-bit pixels: each byte expanded into 8 bytes of 0 or 1.
+    uint8_t spread[256][8];
+} pcx_reader;
 
-    if (pcx.depth==8 && pcx.planes==1) {
-        int y;
-        uint8_t cmap[1 + (256*3)] = {0};
 
-        img = im_img_new( pcx.w, pcx.h, 1, IM_FMT_INDEX8);
-        if (!img) {
-            *err = IM_ERR_NOMEM;
-            goto cleanup;
-        }
+static bool read_header( header* pcx, im_in* in, ImErr *err);
+static bool read_vga_palette(pcx_reader* pr);
+static void set_header_palette(pcx_reader* pr, int ncolours);
+static bool fill_inbuf(pcx_reader* pr);
+static void decode_scanline(pcx_reader* pr, uint8_t* dest);
+static void convert_row_index8(pcx_reader* pr, uint8_t* dest);
+static void convert_row_planes8(pcx_reader* pr, uint8_t* dest);
+static void convert_row_1bit(pcx_reader* pr, uint8_t* dest);
+static void convert_row_2bit(pcx_reader* pr, uint8_t* dest);
+static void convert_row_4bit(pcx_reader* pr, uint8_t* dest);
 
-        for (y=0; y<pcx.h; ++y) {
-            decode_scanline(&pcx, in);
-            memcpy( im_img_row(img,y), pcx.scanbuf, pcx.w);
-        }
 
-        // need to seek back from end of file to get to palette. ugh.
-        // some files have dodgy RLE, so you can't always tell where the image data ends.
-        im_in_seek(in, -(1+(256*3)), IM_SEEK_END);
-        if (im_in_read(in, cmap, 1+(256*3)) != 1+(256*3)) {
-            *err = IM_ERR_MALFORMED;
-            goto cleanup;
-        }
-        // cmap is preceeded by marker byte 0x0c;
-        if( cmap[0] != 0x0c ) {
-            *err = IM_ERR_MALFORMED;
-            goto cleanup;
-        }
-        im_img_pal_set(img, IM_FMT_RGB, 256, cmap+1);
+static im_read* pcx_read_create(im_in *in, ImErr *err)
+{
+    pcx_reader* pr = imalloc(sizeof(pcx_reader));
+    if (!pr) {
+        *err = IM_ERR_NOMEM;
+        return NULL;
+    }
+    i_read_init(&pr->base);
+    pr->base.handler = &i_pcx_read_handler;
+    pr->base.in = in;
+
+    memset(&pr->pcx, 0, sizeof(header));
+    pr->scanbuf = NULL;
+    pr->convert_row = NULL;
+    pr->inbuf = NULL;
+    pr->inpos = 0;
+    pr->inlen = 0;
+    return (im_read*)pr;
+}
 
-    } else if (pcx.depth==8 && pcx.planes==3) {
-        int y;
 
-        img = im_img_new( pcx.w, pcx.h, 1, IM_FMT_RGB);
-        if (!img) {
-            *err = IM_ERR_NOMEM;
-            goto cleanup;
-        }
+static bool pcx_get_img(im_read* rdr)
+{
+    pcx_reader* pr = (pcx_reader*)rdr;
+    header* pcx = &pr->pcx;
+    im_imginfo* info = &rdr->curr;
+    int ncolours = 0;
 
-        for (y=0; y<pcx.h; ++y) {
-            uint8_t* r = pcx.scanbuf;
-            uint8_t* g = pcx.scanbuf + pcx.bytesperline;
-            uint8_t* b = pcx.scanbuf + (pcx.bytesperline*2);
-            uint8_t* dest = im_img_row(img,y);
-            int x;
-            decode_scanline(&pcx, in);
-            for(x=0;x<pcx.w; ++x) {
-                *dest++ = *r++;
-                *dest++ = *g++;
-                *dest++ = *b++;
-            }
-        }
-    } else {
-        *err = IM_ERR_UNSUPPORTED;
-        goto cleanup;
+    if (rdr->frame_num > 0) {
+        return false;   // PCX files only have the one image.
     }
 
+    if (!read_header(pcx, rdr->in, &rdr->err)) {
+        return false;
+    }
 
-cleanup:
-
-    if (pcx.scanbuf) {
-        ifree(pcx.scanbuf);
+    info->w = pcx->w;
+    info->h = pcx->h;
+    info->x_offset = 0;
+    info->y_offset = 0;
+    info->fmt = IM_FMT_INDEX8;
+
+    if (pcx->depth == 8 && pcx->planes == 1) {
+        // 256 colours, palette at the end of the file.
+        pr->convert_row = convert_row_index8;
+        if (!read_vga_palette(pr)) {
+            return false;
+        }
+        ncolours = 256;
+    } else if (pcx->depth == 8 && (pcx->planes == 3 || pcx->planes == 4)) {
+        // 24 or 32 bit, one plane per channel.
+        pr->convert_row = convert_row_planes8;
+        info->fmt = (pcx->planes == 4) ? IM_FMT_RGBA : IM_FMT_RGB;
+    } else if (pcx->depth == 1) {
+        // 2, 4, 8 or 16 colours, one bit per plane.
+        pr->convert_row = convert_row_1bit;
+        ncolours = 1 << pcx->planes;
+    } else if (pcx->depth == 2 && pcx->planes == 1) {
+        // 4 colours (CGA).
+        pr->convert_row = convert_row_2bit;
+        ncolours = 4;
+    } else if (pcx->depth == 4 && pcx->planes == 1) {
+        // 16 colours, packed.
+        pr->convert_row = convert_row_4bit;
+        ncolours = 16;
+    } else {
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
+    }
+    if (!i_read_check_size(rdr, (unsigned int)pcx->w, (unsigned int)pcx->h, im_fmt_bytesperpixel(info->fmt))) {
+        return false;
     }
 
-    if( img && *err != IM_ERR_NONE) {
-        im_img_free(img);
-        img = NULL;
+    if (pcx->depth < 8) {
+        set_header_palette(pr, ncolours);
+        if (rdr->err != IM_ERR_NONE) {
+            return false;
+        }
+    }
+    if (pr->convert_row == convert_row_1bit) {
+        int v, k;
+        for (v = 0; v < 256; ++v) {
+            for (k = 0; k < 8; ++k) {
+                pr->spread[v][k] = (v >> (7 - k)) & 1;
+            }
+        }
     }
+    info->pal_num_colours = ncolours;
 
-    return img;
+    pr->scanbuf = irealloc(pr->scanbuf, pcx->bytesperline * pcx->planes);
+    pr->inbuf = irealloc(pr->inbuf, PCX_CHUNK_SIZE);
+    if (!pr->scanbuf || !pr->inbuf) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    pr->inpos = 0;
+    pr->inlen = 0;
+    return true;
+}
 
 
+static void pcx_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride)
+{
+    pcx_reader* pr = (pcx_reader*)rdr;
+    uint8_t* dest = buf;
+    unsigned int i;
+
+    for (i = 0; i < num_rows; ++i) {
+        if (pr->convert_row == convert_row_index8 &&
+            pr->pcx.bytesperline == (size_t)pr->pcx.w) {
+            // No padding, so can decode straight into the output.
+            decode_scanline(pr, dest);
+        } else {
+            decode_scanline(pr, pr->scanbuf);
+            pr->convert_row(pr, dest);
+        }
+        dest += stride;
+    }
 }
 
 
+static void pcx_read_finish(im_read* rdr)
+{
+    pcx_reader* pr = (pcx_reader*)rdr;
+    if (pr->scanbuf) {
+        ifree(pr->scanbuf);
+        pr->scanbuf = NULL;
+    }
+    if (pr->inbuf) {
+        ifree(pr->inbuf);
+        pr->inbuf = NULL;
+    }
+}
 
 
 static bool read_header( header* pcx, im_in* in, ImErr *err)
@@ -174,6 +247,7 @@ static bool read_header( header* pcx, im_in* in, ImErr *err)
     pcx->h = (pcx->ymax-pcx->ymin)+1;
     pcx->xdpi = decode_u16le(&p); // xdpi or width
     pcx->ydpi = decode_u16le(&p); // ydpi or height
+    memcpy(pcx->egapal, p, 48);
     p += 48;     // 16-colour palette
     ++p;        // reserved
     pcx->planes = (int)*p++;
@@ -193,55 +267,277 @@ static bool read_header( header* pcx, im_in* in, ImErr *err)
         *err = IM_ERR_MALFORMED;
         return false;
     }
+    if (pcx->w < 1 || pcx->h < 1) {
+        *err = IM_ERR_MALFORMED;
+        return false;
+    }
+    // each plane needs room for a full row of pixels
+    if (pcx->bytesperline * 8 < (size_t)pcx->w * pcx->depth) {
+        *err = IM_ERR_MALFORMED;
+        return false;
+    }
 
-    pcx->scanbuf = imalloc(pcx->bytesperline * pcx->planes);
-    if (!pcx->scanbuf) {
-        *err = IM_ERR_NOMEM;
+    return true;
+}
+
+
+// Read the 256-colour palette from the end of the file, then return to
+// the start of the image data.
+static bool read_vga_palette(pcx_reader* pr)
+{
+    im_read* rdr = &pr->base;
+    uint8_t cmap[1 + (256*3)];
+    uint8_t* dest;
+    int i;
+
+    // need to seek back from end of file to get to palette. ugh.
+    // some files have dodgy RLE, so you can't always tell where the image data ends.
+    if (im_in_seek(rdr->in, -(1+(256*3)), IM_SEEK_END) != 0 ||
+        im_in_read(rdr->in, cmap, 1+(256*3)) != 1+(256*3)) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    // cmap is preceeded by marker byte 0x0c;
+    if( cmap[0] != 0x0c ) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+
+    rdr->pal_data = irealloc(rdr->pal_data, 256 * 4);
+    if (!rdr->pal_data) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    dest = rdr->pal_data;
+    for (i = 0; i < 256; ++i) {
+        *dest++ = cmap[1 + i*3 + 0];
+        *dest++ = cmap[1 + i*3 + 1];
+        *dest++ = cmap[1 + i*3 + 2];
+        *dest++ = 255;
     }
 
+    if (im_in_seek(rdr->in, 128, IM_SEEK_SET) != 0) {
+        rdr->err = IM_ERR_FILE;
+        return false;
+    }
     return true;
 }
 
 
+// Set up the palette for images with 16 colours or fewer.
+static void set_header_palette(pcx_reader* pr, int ncolours)
+{
+    // Used by version 3 files, which don't carry a palette.
+    static const uint8_t default_ega[16*3] = {
+        0x00,0x00,0x00, 0x00,0x00,0xaa, 0x00,0xaa,0x00, 0x00,0xaa,0xaa,
+        0xaa,0x00,0x00, 0xaa,0x00,0xaa, 0xaa,0x55,0x00, 0xaa,0xaa,0xaa,
+        0x55,0x55,0x55, 0x55,0x55,0xff, 0x55,0xff,0x55, 0x55,0xff,0xff,
+        0xff,0x55,0x55, 0xff,0x55,0xff, 0xff,0xff,0x55, 0xff,0xff,0xff
+    };
+    static const uint8_t mono[2*3] = { 0,0,0, 255,255,255 };
+    im_read* rdr = &pr->base;
+    const uint8_t* src = pr->pcx.egapal;
+    uint8_t* dest;
+    int i;
+
+    if (ncolours == 2) {
+        // Monochrome files usually leave the palette empty, and most
+        // readers just assume black and white.
+        src = mono;
+    } else if (pr->pcx.version == 3) {
+        src = default_ega;
+    }
+
+    rdr->pal_data = irealloc(rdr->pal_data, ncolours * 4);
+    if (!rdr->pal_data) {
+        rdr->err = IM_ERR_NOMEM;
+        return;
+    }
+    dest = rdr->pal_data;
+    for (i = 0; i < ncolours; ++i) {
+        *dest++ = *src++;
+        *dest++ = *src++;
+        *dest++ = *src++;
+        *dest++ = 255;
+    }
+}
+
+
+// Read the next chunk of file data into inbuf.
+// Returns false if there's no more.
+static bool fill_inbuf(pcx_reader* pr)
+{
+    pr->inpos = 0;
+    pr->inlen = im_in_read(pr->base.in, pr->inbuf, PCX_CHUNK_SIZE);
+    return pr->inlen > 0;
+}
+
+
 // decode a line (can be multiple planes, as rle can span planes)
-// we're pretty tolerant of dodgy data.
-static void decode_scanline( header* pcx, im_in* in)
+// we're pretty tolerant of dodgy data - anything missing is left as zero.
+static void decode_scanline(pcx_reader* pr, uint8_t* dest)
 {
-    int outcnt = (pcx->bytesperline * pcx->planes);
-    uint8_t val,reps;
-    uint8_t* dest = pcx->scanbuf;
-
-    reps = 0;
-    while (outcnt>0) {
-        if (reps==0) {
-            if (im_in_read(in,&val,1) != 1) {
-                //printf("ERROR: BADBYTE\n");
-                /**err = im_eof(in)? IM_ERR_MALFORMED:IM_ERR_FILE;
-                return false;
-                */
-                val=0;
+    size_t outcnt = pr->pcx.bytesperline * pr->pcx.planes;
+
+    if (pr->pcx.enc == 0) {
+        // Uncompressed.
+        while (outcnt > 0) {
+            size_t n;
+            if (pr->inpos == pr->inlen && !fill_inbuf(pr)) {
+                memset(dest, 0, outcnt);
+                return;
             }
-            if (val >= 0xc0) {
-                reps = (val - 0xc0);
-                if (im_in_read(in,&val,1) != 1) {
-                    //*err = im_eof(in)? IM_ERR_MALFORMED:IM_ERR_FILE;
-                    //printf("ERROR: BADREP\n");
-                    val=0;
-                }
-                //printf("0x%02x x%d (%d left)\n",val, reps, outcnt);
-            } else {
-                reps = 1;
-                //printf("0x%02x (%d left)\n",val, outcnt);
+            n = pr->inlen - pr->inpos;
+            if (n > outcnt) {
+                n = outcnt;
             }
+            memcpy(dest, pr->inbuf + pr->inpos, n);
+            pr->inpos += n;
+            dest += n;
+            outcnt -= n;
+        }
+        return;
+    }
+
+    while (outcnt > 0) {
+        const uint8_t* src;
+        const uint8_t* end;
+        uint8_t val;
+        size_t reps;
+
+        if (pr->inpos == pr->inlen && !fill_inbuf(pr)) {
+            memset(dest, 0, outcnt);
+            return;
+        }
+        // Plain bytes can be copied straight out of the buffer.
+        src = pr->inbuf + pr->inpos;
+        end = pr->inbuf + pr->inlen;
+        while (src < end && outcnt > 0 && *src < 0xc0) {
+            *dest++ = *src++;
+            --outcnt;
+        }
+        pr->inpos = src - pr->inbuf;
+        if (src == end || outcnt == 0) {
+            continue;
+        }
+
+        // Run. Any leftover reps at the end of the line are dropped.
+        reps = *src - 0xc0;
+        ++pr->inpos;
+        if (pr->inpos == pr->inlen && !fill_inbuf(pr)) {
+            val = 0;
+        } else {
+            val = pr->inbuf[pr->inpos++];
+        }
+        if (reps > outcnt) {
+            reps = outcnt;
         }
-        *dest++ = val;
-        --reps;
-        --outcnt;
+        memset(dest, val, reps);
+        dest += reps;
+        outcnt -= reps;
     }
-    //if( reps>0) {
-    //    printf("WARN: leftover %d reps\n",(int)reps);
-    //}
 }
 
 
+// 256 colours - just strip off the padding.
+static void convert_row_index8(pcx_reader* pr, uint8_t* dest)
+{
+    memcpy(dest, pr->scanbuf, pr->pcx.w);
+}
+
+
+// Interleave separate 8-bit R,G,B(,A) planes into RGB or RGBA.
+static void convert_row_planes8(pcx_reader* pr, uint8_t* dest)
+{
+    const uint8_t* r = pr->scanbuf;
+    const uint8_t* g = r + pr->pcx.bytesperline;
+    const uint8_t* b = g + pr->pcx.bytesperline;
+    int w = pr->pcx.w;
+    int x;
+
+    if (pr->pcx.planes == 3) {
+        for (x = 0; x < w; ++x) {
+            dest[0] = r[x];
+            dest[1] = g[x];
+            dest[2] = b[x];
+            dest += 3;
+        }
+    } else {
+        const uint8_t* a = b + pr->pcx.bytesperline;
+        for (x = 0; x < w; ++x) {
+            dest[0] = r[x];
+            dest[1] = g[x];
+            dest[2] = b[x];
+            dest[3] = a[x];
+            dest += 4;
+        }
+    }
+}
+
+
+// 1 bit per plane, 1-4 planes. Plane n holds bit n of each pixel.
+// Works on 8 pixels at a time, using the spread table to expand each
+// plane byte to 8 bytes and OR-ing them together as a uint64_t.
+static void convert_row_1bit(pcx_reader* pr, uint8_t* dest)
+{
+    const uint8_t* src = pr->scanbuf;
+    size_t bpl = pr->pcx.bytesperline;
+    int planes = pr->pcx.planes;
+    int w = pr->pcx.w;
+    int x;
+    size_t i;
+
+    for (x = 0, i = 0; x < w; x += 8, ++i) {
+        uint64_t out = 0;
+        int p;
+        for (p = 0; p < planes; ++p) {
+            uint64_t bits;
+            memcpy(&bits, pr->spread[src[p * bpl + i]], 8);
+            out |= bits << p;
+        }
+        if (w - x >= 8) {
+            memcpy(dest + x, &out, 8);
+        } else {
+            memcpy(dest + x, &out, w - x);
+        }
+    }
+}
+
+
+// 2 bits per pixel, packed.
+static void convert_row_2bit(pcx_reader* pr, uint8_t* dest)
+{
+    const uint8_t* src = pr->scanbuf;
+    int w = pr->pcx.w;
+    int x;
+
+    for (x = 0; x + 4 <= w; x += 4) {
+        uint8_t c = *src++;
+        dest[x] = c >> 6;
+        dest[x + 1] = (c >> 4) & 3;
+        dest[x + 2] = (c >> 2) & 3;
+        dest[x + 3] = c & 3;
+    }
+    for (; x < w; ++x) {
+        dest[x] = (src[0] >> (6 - 2 * (x & 3))) & 3;
+    }
+}
+
+
+// 4 bits per pixel, packed.
+static void convert_row_4bit(pcx_reader* pr, uint8_t* dest)
+{
+    const uint8_t* src = pr->scanbuf;
+    int w = pr->pcx.w;
+    int x;
+
+    for (x = 0; x + 2 <= w; x += 2) {
+        uint8_t c = *src++;
+        dest[x] = c >> 4;
+        dest[x + 1] = c & 0x0f;
+    }
+    if (x < w) {
+        dest[x] = *src >> 4;
+    }
+}
 
@@ -0,0 +1,255 @@
+#include "impy.h"
+#include "private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+// PCX writer.
+//
+// Paletted images are written as 256-colour (8 bit, 1 plane), with the
+// palette appended after the image data. Truecolour images are written as
+// 24 bit (8 bit, 3 planes). Each scanline is RLE-encoded and written out
+// as soon as it arrives.
+
+im_write* ipcx_new_writer(im_out* out, ImErr *err);
+
+static void ipcx_pre_img(im_write* wr);
+static void ipcx_emit_header(im_write* wr);
+static void ipcx_emit_rows(im_write *wr, unsigned int num_rows, const void *data, int stride);
+static void ipcx_post_img(im_write* wr);
+static void ipcx_finish(im_write* wr);
+
+static struct write_handler pcx_write_handler = {
+    IM_FILETYPE_PCX,
+    ipcx_pre_img,
+    ipcx_emit_header,
+    ipcx_emit_rows,
+    ipcx_post_img,
+    ipcx_finish
+};
+
+typedef struct ipcx_writer {
+    im_write writer;
+
+    int planes;             // 1 (paletted) or 3 (RGB)
+    size_t bytesperline;    // per plane, always even
+    uint8_t* planebuf;      // one scanline, split into planes
+    uint8_t* encbuf;        // the encoded scanline
+} ipcx_writer;
+
+
+static size_t encode_plane(const uint8_t* src, size_t n, uint8_t* dest);
+
+
+im_write* ipcx_new_writer(im_out* out, ImErr* err)
+{
+    ipcx_writer* pcxwriter = imalloc(sizeof(ipcx_writer));
+    if (!pcxwriter) {
+        *err = IM_ERR_NOMEM;
+        return NULL;
+    }
+    im_write* writer = (im_write*)pcxwriter;
+
+    i_write_init(writer);
+
+    writer->handler = &pcx_write_handler;
+    writer->out = out;
+
+    pcxwriter->planes = 0;
+    pcxwriter->bytesperline = 0;
+    pcxwriter->planebuf = NULL;
+    pcxwriter->encbuf = NULL;
+
+    *err = IM_ERR_NONE;
+    return writer;
+}
+
+
+static void ipcx_pre_img(im_write* wr)
+{
+    ipcx_writer* pw = (ipcx_writer*)wr;
+
+    if (wr->num_frames > 0) {
+        wr->err = IM_ERR_ANIM_UNSUPPORTED;
+        return;
+    }
+    // (Rows are padded to an even length, which has to fit in the 16 bit
+    // bytesperline field.)
+    if (wr->w > 65534 || wr->h > 65535) {
+        wr->err = IM_ERR_UNSUPPORTED;
+        return;
+    }
+
+    // work out which format we'll be writing (and also which format
+    // we'd like to receive from im_write_rows()).
+    if (im_fmt_is_indexed(wr->fmt) ||
+        (im_fmt_has_rgb(wr->fmt) && wr->quant_colours > 0)) {
+        pw->planes = 1;
+        i_write_set_internal_fmt(wr, IM_FMT_INDEX8);
+    } else if (im_fmt_has_rgb(wr->fmt)) {
+        // No alpha in PCX - it'll just be dropped.
+        pw->planes = 3;
+        i_write_set_internal_fmt(wr, IM_FMT_RGB);
+    } else {
+        wr->err = IM_ERR_UNSUPPORTED;
+        return;
+    }
+}
+
+
+static void ipcx_emit_header(im_write* wr)
+{
+    ipcx_writer* pw = (ipcx_writer*)wr;
+    uint8_t buf[128] = {0};
+    uint8_t* p = buf;
+
+    if (pw->planes == 1 && wr->pal_num_colours == 0) {
+        wr->err = IM_ERR_NO_PALETTE;
+        return;
+    }
+    if (wr->pal_num_colours > 256) {
+        wr->err = IM_ERR_PALETTE_TOO_BIG;
+        return;
+    }
+
+    pw->bytesperline = (wr->w + 1) & ~1u;
+    pw->planebuf = irealloc(pw->planebuf, pw->bytesperline * pw->planes);
+    // Worst case, every byte needs a count.
+    pw->encbuf = irealloc(pw->encbuf, pw->bytesperline * pw->planes * 2);
+    if (!pw->planebuf || !pw->encbuf) {
+        wr->err = IM_ERR_NOMEM;
+        return;
+    }
+    // The padding byte (if any) stays zero.
+    memset(pw->planebuf, 0, pw->bytesperline * pw->planes);
+
+    *p++ = 0x0a;    // magic
+    *p++ = 5;       // version 3.0+, with 256-colour palette
+    *p++ = 1;       // RLE
+    *p++ = 8;       // bits per pixel per plane
+    encode_u16le(&p, 0);            // xmin
+    encode_u16le(&p, 0);            // ymin
+    encode_u16le(&p, wr->w - 1);    // xmax
+    encode_u16le(&p, wr->h - 1);    // ymax
+    encode_u16le(&p, 72);           // xdpi
+    encode_u16le(&p, 72);           // ydpi
+    p += 48;        // 16-colour palette (unused)
+    ++p;            // reserved
+    *p++ = (uint8_t)pw->planes;
+    encode_u16le(&p, (uint16_t)pw->bytesperline);
+    encode_u16le(&p, 1);            // palette type: colour
+    // rest is filler
+
+    if (im_out_write(wr->out, buf, 128) != 128) {
+        wr->err = IM_ERR_FILE;
+    }
+}
+
+
+static void ipcx_emit_rows(im_write *wr, unsigned int num_rows, const void *data, int stride)
+{
+    ipcx_writer* pw = (ipcx_writer*)wr;
+    unsigned int i;
+
+    for (i = 0; i < num_rows; ++i) {
+        const uint8_t* src = data;
+        size_t enclen = 0;
+        int p;
+
+        // Split the row out into separate planes.
+        if (pw->planes == 1) {
+            memcpy(pw->planebuf, src, wr->w);
+        } else {
+            uint8_t* r = pw->planebuf;
+            uint8_t* g = r + pw->bytesperline;
+            uint8_t* b = g + pw->bytesperline;
+            unsigned int x;
+            for (x = 0; x < wr->w; ++x) {
+                r[x] = src[0];
+                g[x] = src[1];
+                b[x] = src[2];
+                src += 3;
+            }
+        }
+
+        // Runs don't cross planes - some readers don't cope with that.
+        for (p = 0; p < pw->planes; ++p) {
+            enclen += encode_plane(pw->planebuf + p * pw->bytesperline,
+                pw->bytesperline, pw->encbuf + enclen);
+        }
+        if (im_out_write(wr->out, pw->encbuf, enclen) != enclen) {
+            wr->err = IM_ERR_FILE;
+            return;
+        }
+        data += stride;
+    }
+}
+
+
+// Paletted images have the palette tacked onto the end.
+static void ipcx_post_img(im_write* wr)
+{
+    ipcx_writer* pw = (ipcx_writer*)wr;
+    uint8_t buf[1 + 256*3] = {0};
+    const uint8_t* src = wr->pal_data;
+    uint8_t* dest = buf;
+    unsigned int i;
+
+    if (pw->planes != 1) {
+        return;
+    }
+
+    *dest++ = 0x0c;
+    for (i = 0; i < wr->pal_num_colours; ++i) {
+        *dest++ = src[0];
+        *dest++ = src[1];
+        *dest++ = src[2];
+        src += 4;
+    }
+    if (im_out_write(wr->out, buf, sizeof(buf)) != sizeof(buf)) {
+        wr->err = IM_ERR_FILE;
+    }
+}
+
+
+static void ipcx_finish(im_write* wr)
+{
+    ipcx_writer* pw = (ipcx_writer*)wr;
+    if (pw->planebuf) {
+        ifree(pw->planebuf);
+        pw->planebuf = NULL;
+    }
+    if (pw->encbuf) {
+        ifree(pw->encbuf);
+        pw->encbuf = NULL;
+    }
+}
+
+
+// RLE-encode n bytes. Returns the number of bytes written to dest.
+// Runs are up to 63 bytes. Single bytes go out as-is, unless they'd be
+// mistaken for a count (top two bits set).
+static size_t encode_plane(const uint8_t* src, size_t n, uint8_t* dest)
+{
+    const uint8_t* end = src + n;
+    uint8_t* out = dest;
+
+    while (src < end) {
+        uint8_t v = *src;
+        const uint8_t* run = src + 1;
+        size_t cnt;
+        while (run < end && *run == v && run - src < 63) {
+            ++run;
+        }
+        cnt = run - src;
+        if (cnt > 1 || v >= 0xc0) {
+            *out++ = (uint8_t)(0xc0 | cnt);
+        }
+        *out++ = v;
+        src = run;
+    }
+    return out - dest;
+}
+
@@ -2,27 +2,145 @@
 #include "private.h"
 
 #include <png.h>
-#include <stdio.h>
+#include <zlib.h>
+#include <assert.h>
+#include <limits.h>
 #include <stdint.h>
+#include <string.h>
+
+// PNG reader, including APNG animations.
+//
+// We walk through the file chunks ourselves, and use libpng just to decode
+// the image data. Each frame gets a fresh libpng reader, which is fed a
+// made-up PNG stream:
+//   - the signature
+//   - an IHDR, sized to the frame
+//   - the other chunks from the file header (PLTE, tRNS, gAMA etc)
+//   - the frame's image data, straight from the file. APNG fdAT chunks are
+//     turned into IDAT chunks on the fly.
+//
+// Non-interlaced stills are streamed out a row at a time, as they are
+// requested. Interlaced ones have to be decoded in full first (calling any
+// progress callback after each pass).
+// Animation frames are composited onto an RGBA canvas, so every frame
+// returned is complete.
+
+// APNG dispose_op and blend_op values
+#define APNG_DISPOSE_OP_NONE 0
+#define APNG_DISPOSE_OP_BACKGROUND 1
+#define APNG_DISPOSE_OP_PREVIOUS 2
+#define APNG_BLEND_OP_SOURCE 0
+#define APNG_BLEND_OP_OVER 1
+
+// An APNG fcTL chunk.
+typedef struct apng_fctl {
+    uint32_t w, h;
+    uint32_t x, y;
+    uint16_t delay_num, delay_den;
+    uint8_t dispose_op;
+    uint8_t blend_op;
+} apng_fctl;
+
+// Where the bytes going into libpng are coming from.
+enum feed_stage {
+    FEED_PRELUDE,   // signature and IHDR
+    FEED_HDR,       // saved header chunks
+    FEED_DATA,      // image data chunks from the file
+    FEED_TAIL,      // rest of the file, as-is
+    FEED_END
+};
+
+typedef struct png_reader {
+    im_read base;
+
+    png_structp png;
+    png_infop info;
+
+    // From the file header.
+    bool started;
+    uint8_t ihdr[13];
+    uint32_t width, height;
+    uint8_t* hdr_chunks;    // other chunks libpng needs, verbatim
+    size_t hdr_len;
+    bool animated;          // APNG with more than one frame?
+    uint32_t num_plays;
+
+    // Chunk parsing.
+    uint8_t pending[8];     // chunk header read but not yet dealt with
+    bool got_pending;
+    bool seen_idat;
+    bool got_fctl;          // fcTL waiting for its image data
+    apng_fctl fctl;
+    bool done;
+
+    // Feeding libpng.
+    enum feed_stage stage;
+    bool fdat;              // current frame data comes from fdAT chunks
+    uint8_t prelude[8 + 8 + 13 + 4];
+    uint8_t scratch[12];    // made-up chunk headers and CRCs
+    const uint8_t* feed;
+    size_t feed_len;
+    size_t feed_pos;
+    uint32_t data_left;     // bytes to pass straight through from the file
+    bool converting;        // passing through an fdAT as IDAT?
+    uLong crc_in;           // CRC of the fdAT chunk
+    uLong crc_out;          // CRC of the IDAT chunk we're making
+
+    // Stills
+    bool interlaced;
+    int num_passes;
+    uint8_t* framebuf;      // whole image, for interlaced images
+    size_t rowbytes;
+
+    // Animations
+    uint8_t* canvas;        // RGBA
+    uint8_t* backup;        // canvas to restore for APNG_DISPOSE_OP_PREVIOUS
+    apng_fctl prev;         // the last frame drawn
+} png_reader;
+
 
 static bool png_match_cookie(const uint8_t* buf, int nbytes);
 static im_read* png_read_create(im_in *in, ImErr *err);
-static im_img* iread_png_image(im_in* in, kvstore *kv, ImErr *err);
-static void info_callback(png_structp png_ptr, png_infop info_ptr);
-static void row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass);
-static void end_callback(png_structp png_ptr, png_infop info);
-static bool apply_palette(png_structp png_ptr, png_infop info, im_img* img);
-
+static bool ipng_get_img(im_read* rdr);
+static void ipng_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride);
+static void ipng_read_finish(im_read* rdr);
 
 i_read_handler i_png_read_handler = {
     IM_FILETYPE_PNG,
     png_match_cookie,
     png_read_create,
-    i_generic_read_img,
-    i_generic_read_rows,
-    i_generic_read_finish
+    ipng_get_img,
+    ipng_read_rows,
+    ipng_read_finish
 };
 
+static bool read_header(png_reader* pr);
+static bool scan_to_frame(png_reader* pr);
+static bool start_frame(png_reader* pr, uint32_t w, uint32_t h);
+static bool setup_still(png_reader* pr);
+static bool decode_anim_frame(png_reader* pr);
+static bool decode_interlaced(png_reader* pr);
+static void finish_still(png_reader* pr);
+static void end_frame(png_reader* pr);
+static void add_text(png_reader* pr);
+static void read_fn(png_structp png_ptr, png_bytep out, size_t len);
+
+
+static inline uint32_t get_u32be(const uint8_t* p)
+    { return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint32_t)p[2]<<8) | p[3]; }
+
+static inline void put_u32be(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline bool chunk_is(const uint8_t* hdr, const char* type)
+    { return memcmp(hdr + 4, type, 4) == 0; }
+
+
 static bool png_match_cookie(const uint8_t* buf, int nbytes)
 {
     if( png_sig_cmp((png_bytep)buf,0,nbytes) == 0 ) {
@@ -32,109 +150,440 @@ static bool png_match_cookie(const uint8_t* buf, int nbytes)
     }
 }
 
+
 static im_read* png_read_create(im_in *in, ImErr *err)
 {
-    return i_new_generic_reader(iread_png_image, &i_png_read_handler, in, err);
+    png_reader* pr = imalloc(sizeof(png_reader));
+    if (!pr) {
+        *err = IM_ERR_NOMEM;
+        return NULL;
+    }
+    // Lots of fields - start with everything zeroed.
+    memset(pr, 0, sizeof(png_reader));
+    i_read_init(&pr->base);
+    pr->base.handler = &i_png_read_handler;
+    pr->base.in = in;
+    return (im_read*)pr;
 }
 
 
-// struct to track stuff needed during png progressive reading
-struct cbdat {
-    ImErr err;
-    int num_passes;
-    im_img* image;
-};
-
-static im_img* iread_png_image(im_in* in, kvstore *kv, ImErr *err)
+static bool ipng_get_img(im_read* rdr)
 {
-    struct cbdat cbDat = {IM_ERR_NONE,0,NULL};
-    png_structp png_ptr;
-    png_infop info_ptr;
+    png_reader* pr = (png_reader*)rdr;
+    im_imginfo* info = &rdr->curr;
+    uint32_t w;
+    uint32_t h;
 
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,NULL,NULL);
-    if (!png_ptr) {
-        *err = IM_ERR_NOMEM;
-        return NULL;
+    if (!pr->started) {
+        if (!read_header(pr)) {
+            return false;
+        }
+        pr->started = true;
+    }
+    end_frame(pr);
+    if (pr->done) {
+        return false;
+    }
+    if (!scan_to_frame(pr)) {
+        return false;
     }
 
+    w = pr->width;
+    h = pr->height;
+    if (pr->animated) {
+        apng_fctl* f = &pr->fctl;
+        if (f->w == 0 || f->h == 0 || f->x > pr->width || f->y > pr->height ||
+            f->w > pr->width - f->x || f->h > pr->height - f->y) {
+            rdr->err = IM_ERR_MALFORMED;
+            return false;
+        }
+        w = f->w;
+        h = f->h;
+    }
+    pr->got_fctl = false;
+
+    if (!start_frame(pr, w, h)) {
+        return false;
+    }
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+    info->w = pr->width;
+    info->h = pr->height;
+    info->x_offset = 0;
+    info->y_offset = 0;
+    if (!pr->animated) {
+        return setup_still(pr);
+    }
+
+    // Check before compositing anything onto the (RGBA) canvas.
+    if (!i_read_check_size(rdr, pr->width, pr->height, 4)) {
+        return false;
+    }
+    if (!decode_anim_frame(pr)) {
+        return false;
+    }
+    info->fmt = IM_FMT_RGBA;
+    info->pal_num_colours = 0;
+    info->transparent_index = -1;
+    info->disposal = IM_DISPOSE_NONE;   // we deliver complete frames
+    // APNG counts plays, impy counts repeats (see im_write_loop_count()).
+    if (pr->num_plays == 0) {
+        info->loop_count = 0;   // forever
+    } else if (pr->num_plays == 1) {
+        info->loop_count = -1;  // just the once
+    } else if (pr->num_plays - 1 > INT_MAX) {
+        info->loop_count = INT_MAX;
+    } else {
+        info->loop_count = (int)(pr->num_plays - 1);
+    }
     {
-       png_destroy_read_struct(&png_ptr, NULL, NULL);
-       *err = IM_ERR_NOMEM;
-       return NULL;
+        unsigned int den = pr->fctl.delay_den ? pr->fctl.delay_den : 100;
+        info->delay_ms = (unsigned int)pr->fctl.delay_num * 1000 / den;
     }
+    return true;
+}
 
 
-    //png_set_read_fn( png_ptr, fp, readFunc);
+static void ipng_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride)
+{
+    png_reader* pr = (png_reader*)rdr;
+    uint8_t* dest = buf;
+    unsigned int i;
 
-    if (setjmp(png_jmpbuf(png_ptr)))
-    {
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        if (cbDat.image) {
-            im_img_free(cbDat.image);
+    if (pr->animated) {
+        size_t bytes_per_row = (size_t)pr->width * 4;
+        for (i = 0; i < num_rows; ++i) {
+            memcpy(dest, pr->canvas + bytes_per_row * (rdr->rows_read + i), bytes_per_row);
+            dest += stride;
         }
-        *err = cbDat.err;
-        if (*err == IM_ERR_NONE) {
-            *err = IM_ERR_EXTLIB;
+        return;
+    }
+
+    if (pr->interlaced) {
+        if (rdr->rows_read == 0 && !decode_interlaced(pr)) {
+            return;
         }
-        return NULL;
+        for (i = 0; i < num_rows; ++i) {
+            memcpy(dest, pr->framebuf + pr->rowbytes * (rdr->rows_read + i), pr->rowbytes);
+            dest += stride;
+        }
+    } else {
+        if (setjmp(png_jmpbuf(pr->png))) {
+            if (rdr->err == IM_ERR_NONE) {
+                rdr->err = IM_ERR_EXTLIB;
+            }
+            return;
+        }
+        for (i = 0; i < num_rows; ++i) {
+            png_read_row(pr->png, dest, NULL);
+            dest += stride;
+        }
+    }
+
+    if (rdr->rows_read + num_rows == pr->height) {
+        finish_still(pr);
+    }
+}
+
+
+static void ipng_read_finish(im_read* rdr)
+{
+    png_reader* pr = (png_reader*)rdr;
+    end_frame(pr);
+    if (pr->hdr_chunks) {
+        ifree(pr->hdr_chunks);
+        pr->hdr_chunks = NULL;
+    }
+    if (pr->framebuf) {
+        ifree(pr->framebuf);
+        pr->framebuf = NULL;
+    }
+    if (pr->canvas) {
+        ifree(pr->canvas);
+        pr->canvas = NULL;
+    }
+    if (pr->backup) {
+        ifree(pr->backup);
+        pr->backup = NULL;
     }
+}
 
-//   png_set_sig_bytes(png_ptr, cookieRead);
 
-    // use the progressive read mechanism - we'll pump the data into
-    // libpng with png_process_data()
-    png_set_progressive_read_fn(png_ptr, (void*)&cbDat, info_callback, row_callback, end_callback);
+// Read the next chunk header (or the one we put back).
+static bool read_chunk_header(png_reader* pr, uint8_t* hdr)
+{
+    im_read* rdr = &pr->base;
+    if (pr->got_pending) {
+        memcpy(hdr, pr->pending, 8);
+        pr->got_pending = false;
+        return true;
+    }
+    if (im_in_read(rdr->in, hdr, 8) != 8) {
+        rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+        return false;
+    }
+    if (get_u32be(hdr) > 0x7fffffff) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    return true;
+}
 
-    while(1) {
-        uint8_t buf[4096];
+static void unread_chunk_header(png_reader* pr, const uint8_t* hdr)
+{
+    memcpy(pr->pending, hdr, 8);
+    pr->got_pending = true;
+}
 
-        size_t n;
-        n = im_in_read(in, buf, sizeof(buf));
-        if (n>0) {
-            png_process_data(png_ptr, info_ptr, buf, n);
-        } else {
-            if (im_in_eof(in) ) {
-                break;
+// Read the data of a (small) chunk into buf, and check its CRC.
+static bool read_chunk_data(png_reader* pr, const uint8_t* hdr, uint8_t* buf, uint32_t len)
+{
+    im_read* rdr = &pr->base;
+    uint8_t crcbuf[4];
+    uLong crc;
+    if (im_in_read(rdr->in, buf, len) != len ||
+        im_in_read(rdr->in, crcbuf, 4) != 4) {
+        rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+        return false;
+    }
+    crc = crc32(0, hdr + 4, 4);
+    crc = crc32(crc, buf, len);
+    if (crc != get_u32be(crcbuf)) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    return true;
+}
+
+static bool skip_chunk_data(png_reader* pr, uint32_t len)
+{
+    if (im_in_seek(pr->base.in, (int64_t)len + 4, IM_SEEK_CUR) != 0) {
+        pr->base.err = IM_ERR_FILE;
+        return false;
+    }
+    return true;
+}
+
+
+// Check the signature and read the IHDR.
+static bool read_header(png_reader* pr)
+{
+    im_read* rdr = &pr->base;
+    uint8_t sig[8];
+    uint8_t hdr[8];
+
+    if (im_in_read(rdr->in, sig, 8) != 8 || png_sig_cmp(sig, 0, 8) != 0) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    if (!read_chunk_header(pr, hdr)) {
+        return false;
+    }
+    if (!chunk_is(hdr, "IHDR") || get_u32be(hdr) != 13) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    if (!read_chunk_data(pr, hdr, pr->ihdr, 13)) {
+        return false;
+    }
+    pr->width = get_u32be(pr->ihdr);
+    pr->height = get_u32be(pr->ihdr + 4);
+    if (pr->width == 0 || pr->height == 0) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    return i_read_check_size(rdr, pr->width, pr->height, 0);
+}
+
+
+// Append a whole chunk to the saved header chunks.
+static bool save_chunk(png_reader* pr, const uint8_t* hdr, uint32_t len)
+{
+    im_read* rdr = &pr->base;
+    size_t total = 8 + (size_t)len + 4;
+    uint8_t* p;
+    if (!i_read_check_metadata(rdr, total)) {
+        return false;
+    }
+    p = irealloc(pr->hdr_chunks, pr->hdr_len + total);
+    if (!p) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    pr->hdr_chunks = p;
+    p += pr->hdr_len;
+    memcpy(p, hdr, 8);
+    if (im_in_read(rdr->in, p + 8, len + 4) != len + 4) {
+        rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+        return false;
+    }
+    pr->hdr_len += total;
+    return true;
+}
+
+
+// Walk through the chunks until we reach the image data for the next frame.
+// Returns false if there are no more frames (or upon error).
+static bool scan_to_frame(png_reader* pr)
+{
+    im_read* rdr = &pr->base;
+
+    while (true) {
+        uint8_t hdr[8];
+        uint8_t buf[26];
+        uint32_t len;
+
+        if (!read_chunk_header(pr, hdr)) {
+            return false;
+        }
+        len = get_u32be(hdr);
+
+        if (chunk_is(hdr, "IDAT")) {
+            if (!pr->seen_idat) {
+                pr->seen_idat = true;
+                // For APNG, the default image may not be part of the
+                // animation.
+                if (!pr->animated || pr->got_fctl) {
+                    unread_chunk_header(pr, hdr);
+                    pr->fdat = false;
+                    return true;
+                }
+            }
+            // Leftovers.
+            if (!skip_chunk_data(pr, len)) {
+                return false;
+            }
+        } else if (chunk_is(hdr, "fdAT")) {
+            if (pr->animated && pr->got_fctl && pr->seen_idat) {
+                unread_chunk_header(pr, hdr);
+                pr->fdat = true;
+                return true;
+            }
+            if (!skip_chunk_data(pr, len)) {
+                return false;
             }
-            // an error has occurred
-            // TODO: set error from in
-            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-            if (cbDat.image) {
-               im_img_free(cbDat.image);
+        } else if (chunk_is(hdr, "fcTL")) {
+            if (len != 26) {
+                rdr->err = IM_ERR_MALFORMED;
+                return false;
+            }
+            if (!read_chunk_data(pr, hdr, buf, len)) {
+                return false;
+            }
+            // (skip the sequence number)
+            pr->fctl.w = get_u32be(buf + 4);
+            pr->fctl.h = get_u32be(buf + 8);
+            pr->fctl.x = get_u32be(buf + 12);
+            pr->fctl.y = get_u32be(buf + 16);
+            pr->fctl.delay_num = (uint16_t)((buf[20] << 8) | buf[21]);
+            pr->fctl.delay_den = (uint16_t)((buf[22] << 8) | buf[23]);
+            pr->fctl.dispose_op = buf[24];
+            pr->fctl.blend_op = buf[25];
+            pr->got_fctl = true;
+        } else if (chunk_is(hdr, "acTL") && !pr->seen_idat) {
+            uint32_t num_frames;
+            if (len != 8) {
+                rdr->err = IM_ERR_MALFORMED;
+                return false;
+            }
+            if (!read_chunk_data(pr, hdr, buf, len)) {
+                return false;
+            }
+            num_frames = get_u32be(buf);
+            pr->num_plays = get_u32be(buf + 4);
+            // A single frame is just treated as a normal PNG.
+            pr->animated = num_frames > 1;
+        } else if (chunk_is(hdr, "IEND")) {
+            pr->done = true;
+            return false;
+        } else if (!pr->seen_idat) {
+            // Header chunks - libpng will want to see these.
+            if (!save_chunk(pr, hdr, len)) {
+                return false;
+            }
+        } else {
+            if (!skip_chunk_data(pr, len)) {
+                return false;
             }
-            return NULL;
         }
     }
+}
 
 
-    // Add any text blocks we find to the kvstore.
-    {
-        png_textp txt;
-        int ntxt = 0;
-        int i;
-        png_get_text(png_ptr, info_ptr, &txt, &ntxt);
-        for (i = 0; i < ntxt; ++i) {
-            i_kvstore_add(kv, txt[i].key, txt[i].text);
+// Set up a libpng reader for the frame data we're positioned at, and read
+// in the (made-up) header.
+static bool start_frame(png_reader* pr, uint32_t w, uint32_t h)
+{
+    im_read* rdr = &pr->base;
+    uint8_t* p = pr->prelude;
+    uLong crc;
+
+    pr->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!pr->png) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    pr->info = png_create_info_struct(pr->png);
+    if (!pr->info) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    if (setjmp(png_jmpbuf(pr->png))) {
+        if (rdr->err == IM_ERR_NONE) {
+            rdr->err = IM_ERR_EXTLIB;
         }
+        return false;
     }
 
+    // signature and IHDR
+    memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+    p += 8;
+    put_u32be(p, 13);
+    memcpy(p + 4, "IHDR", 4);
+    memcpy(p + 8, pr->ihdr, 13);
+    put_u32be(p + 8, w);
+    put_u32be(p + 12, h);
+    crc = crc32(0, p + 4, 4 + 13);
+    put_u32be(p + 8 + 13, (uint32_t)crc);
+
+    pr->stage = FEED_PRELUDE;
+    pr->feed = pr->prelude;
+    pr->feed_len = sizeof(pr->prelude);
+    pr->feed_pos = 0;
+    pr->data_left = 0;
+    pr->converting = false;
+    png_set_read_fn(pr->png, pr, read_fn);
+#ifdef PNG_SET_USER_LIMITS_SUPPORTED
+    // Stop libpng inflating compressed text chunks past the metadata
+    // limit too.
+    if (rdr->max_metadata_bytes && rdr->max_metadata_bytes < SIZE_MAX) {
+        png_set_chunk_malloc_max(pr->png, (png_alloc_size_t)rdr->max_metadata_bytes);
+    }
+#endif
 
-    // success - clean up and exit
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-    return cbDat.image;
+    png_read_info(pr->png, pr->info);
+    if (rdr->frame_num == 0) {
+        add_text(pr);
+    }
+    return true;
 }
 
-//
-static void info_callback(png_structp png_ptr, png_infop info_ptr)
-{
-    struct cbdat* cbDat = (struct cbdat*)png_get_progressive_ptr(png_ptr);
 
+// Set up the transformations for a still image, and work out the format.
+static bool setup_still(png_reader* pr)
+{
+    im_read* rdr = &pr->base;
+    im_imginfo* info = &rdr->curr;
+    png_structp png_ptr = pr->png;
+    png_infop info_ptr = pr->info;
     png_uint_32 width, height;
     int bitDepth, colourType, interlaceType, compressionType, filterMethod;
-    //int number_passes;
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        if (rdr->err == IM_ERR_NONE) {
+            rdr->err = IM_ERR_EXTLIB;
+        }
+        return false;
+    }
 
     png_get_IHDR(png_ptr, info_ptr, &width, &height,
         &bitDepth, &colourType, &interlaceType,
@@ -144,7 +593,7 @@ static void info_callback(png_structp png_ptr, png_infop info_ptr)
 
     // if there's a transparency chunk but no palette, transform into proper alpha channel
 	if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
-        if (!png_get_valid(png_ptr, info_ptr, PNG_INFO_PLTE)) {
+        if (colourType != PNG_COLOR_TYPE_PALETTE) {
             png_set_tRNS_to_alpha(png_ptr);
         }
     }
@@ -158,124 +607,492 @@ static void info_callback(png_structp png_ptr, png_infop info_ptr)
     		png_set_packing(png_ptr);
         }
     } else if (bitDepth == 16) {
-        // Scale down to 8 bits/channel.
-        png_set_scale_16(png_ptr);
+        // Keep all 16 bits, but we hand out native-endian values.
+        if (host_is_little_endian()) {
+            png_set_swap(png_ptr);
+        }
     } else if (bitDepth != 8) {
-        cbDat->err = IM_ERR_UNSUPPORTED;
-        png_error(png_ptr, "unsupported color type");
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
     }
 
     // TODO: gamma handling?
 
-    //
-    cbDat->num_passes = png_set_interlace_handling(png_ptr);
+    switch (colourType) {
+        case PNG_COLOR_TYPE_RGB:        info->fmt = IM_FMT_RGB; break;
+        case PNG_COLOR_TYPE_RGB_ALPHA:  info->fmt = IM_FMT_RGBA; break;
+        case PNG_COLOR_TYPE_PALETTE:    info->fmt = IM_FMT_INDEX8; break;
+        case PNG_COLOR_TYPE_GRAY:       info->fmt = IM_FMT_LUMINANCE; break;
+        case PNG_COLOR_TYPE_GRAY_ALPHA: info->fmt = IM_FMT_LUMINANCE_ALPHA; break;
+        default:
+            rdr->err = IM_ERR_UNSUPPORTED;
+            return false;
+    }
+    // tRNS might have added alpha.
+    if (colourType != PNG_COLOR_TYPE_PALETTE && png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+        if (info->fmt == IM_FMT_RGB) {
+            info->fmt = IM_FMT_RGBA;
+        } else if (info->fmt == IM_FMT_LUMINANCE) {
+            info->fmt = IM_FMT_LUMINANCE_ALPHA;
+        }
+    }
+    if (bitDepth == 16) {
+        switch (info->fmt) {
+            case IM_FMT_RGB: info->fmt = IM_FMT_RGB16; break;
+            case IM_FMT_RGBA: info->fmt = IM_FMT_RGBA16; break;
+            case IM_FMT_LUMINANCE: info->fmt = IM_FMT_LUMINANCE16; break;
+            case IM_FMT_LUMINANCE_ALPHA: info->fmt = IM_FMT_LUMINANCE_ALPHA16; break;
+            default: break;
+        }
+    }
 
+    // Check the decoded size now the format is known, before libpng
+    // allocates anything for it.
+    if (!i_read_check_size(rdr, pr->width, pr->height, im_fmt_bytesperpixel(info->fmt))) {
+        return false;
+    }
+
+    pr->interlaced = (interlaceType != PNG_INTERLACE_NONE);
+    pr->num_passes = png_set_interlace_handling(png_ptr);
     png_read_update_info(png_ptr, info_ptr);
+    pr->rowbytes = png_get_rowbytes(png_ptr, info_ptr);
 
+    // Palette (with any alpha values from the tRNS chunk).
+    info->pal_num_colours = 0;
+    if (colourType == PNG_COLOR_TYPE_PALETTE) {
+        png_colorp colours;
+        int num_colours = 0;
+        png_bytep trans = NULL;
+        int num_trans = 0;
+        uint8_t* dest;
+        int i;
 
-    /*********** create image *************/
-    {
-        ImFmt fmt;
-        switch (colourType) {
-            case PNG_COLOR_TYPE_RGB:        fmt = IM_FMT_RGB; break;
-            case PNG_COLOR_TYPE_RGB_ALPHA:  fmt = IM_FMT_RGBA; break;
-            case PNG_COLOR_TYPE_PALETTE:    fmt = IM_FMT_INDEX8; break;
-            // TODO:
-            case PNG_COLOR_TYPE_GRAY:
-            case PNG_COLOR_TYPE_GRAY_ALPHA:
-            default:
-                cbDat->err = IM_ERR_UNSUPPORTED;
-                png_error(png_ptr, "unsupported color type");
+        if (png_get_PLTE(png_ptr, info_ptr, &colours, &num_colours) != PNG_INFO_PLTE) {
+            rdr->err = IM_ERR_MALFORMED;
+            return false;
+        }
+        if (png_get_tRNS(png_ptr, info_ptr, &trans, &num_trans, NULL) != PNG_INFO_tRNS) {
+            num_trans = 0;
+        }
+        // Room for all 256 entries, in case the image uses indices beyond
+        // the end of the PLTE (extras are opaque black).
+        rdr->pal_data = irealloc(rdr->pal_data, 256 * 4);
+        if (!rdr->pal_data) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        dest = rdr->pal_data;
+        for (i = 0; i < 256; ++i) {
+            if (i < num_colours) {
+                *dest++ = colours[i].red;
+                *dest++ = colours[i].green;
+                *dest++ = colours[i].blue;
+            } else {
+                *dest++ = 0;
+                *dest++ = 0;
+                *dest++ = 0;
+            }
+            *dest++ = (i < num_trans) ? trans[i] : 255;
+        }
+        info->pal_num_colours = num_colours;
+    }
+    return true;
+}
+
+
+// Decode a whole interlaced image into framebuf.
+static bool decode_interlaced(png_reader* pr)
+{
+    im_read* rdr = &pr->base;
+    png_bytep* rows;
+    int pass;
+    uint32_t y;
+    size_t nbytes;
+
+    if (!i_size_mul(pr->rowbytes, pr->height, &nbytes)) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    pr->framebuf = irealloc(pr->framebuf, nbytes);
+    rows = imalloc(pr->height * sizeof(png_bytep));
+    if (!pr->framebuf || !rows) {
+        if (rows) {
+            ifree(rows);
         }
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    for (y = 0; y < pr->height; ++y) {
+        rows[y] = pr->framebuf + pr->rowbytes * y;
+    }
 
-        cbDat->image = im_img_new(width,height,1,fmt);
-        if (cbDat->image == NULL) {
-            cbDat->err = IM_ERR_NOMEM;
-            png_error(png_ptr, "im_img_new() failed");
+    if (setjmp(png_jmpbuf(pr->png))) {
+        ifree(rows);
+        if (rdr->err == IM_ERR_NONE) {
+            rdr->err = IM_ERR_EXTLIB;
         }
+        return false;
+    }
 
-        // if there's a palette, install it
-        if (!apply_palette(png_ptr, info_ptr, cbDat->image)) {
-            cbDat->err = IM_ERR_NOMEM;
-            png_error(png_ptr, "failed while installing palette");
+    if (!rdr->progress_fn) {
+        png_read_image(pr->png, rows);
+    } else {
+        // Read each pass with libpng's "rectangle" effect, so the pixels
+        // fill in the gaps. Gives a blocky preview after each pass.
+        memset(pr->framebuf, 0, pr->rowbytes * pr->height);
+        for (pass = 0; pass < pr->num_passes; ++pass) {
+            for (y = 0; y < pr->height; ++y) {
+                png_read_row(pr->png, NULL, rows[y]);
+            }
+            i_read_progress(rdr, pass + 1, pr->num_passes, pr->framebuf, (int)pr->rowbytes);
         }
     }
+    ifree(rows);
+    return true;
 }
 
 
-static void row_callback(png_structp png_ptr, png_bytep new_row,
-    png_uint_32 row_num, int pass)
+// Read whatever follows the image data (to pick up any text chunks).
+static void finish_still(png_reader* pr)
 {
-    struct cbdat* cbDat = (struct cbdat*)png_get_progressive_ptr(png_ptr);
-    void* destpixels = im_img_row(cbDat->image, row_num);
-    //printf("row %d (pass %d of %d, ptr=%p)\n", row_num, pass, cbDat->num_passes, new_row);
-    png_progressive_combine_row(png_ptr, destpixels, new_row);
-} 
+    im_read* rdr = &pr->base;
+    // The image is all in - don't count any problems from here on.
+    ImErr err = rdr->err;
+
+    if (setjmp(png_jmpbuf(pr->png))) {
+        rdr->err = err;
+        pr->done = true;
+        return;
+    }
+    // Let libpng see the rest of the file as-is (unless we've already
+    // fobbed it off with an IEND).
+    if (pr->stage == FEED_DATA) {
+        pr->stage = FEED_TAIL;
+    }
+    png_read_end(pr->png, pr->info);
+    add_text(pr);
+    pr->done = true;
+}
+
 
-static void end_callback(png_structp png_ptr, png_infop info)
+static void blend_row(uint8_t* dest, const uint8_t* src, uint32_t w)
 {
+    uint32_t x;
+    for (x = 0; x < w; ++x) {
+        unsigned int sa = src[3];
+        if (sa == 255) {
+            memcpy(dest, src, 4);
+        } else if (sa != 0) {
+            // Weights, times 255.
+            unsigned int u = sa * 255;
+            unsigned int v = (255 - sa) * dest[3];
+            unsigned int a = u + v;
+            dest[0] = (uint8_t)((src[0] * u + dest[0] * v + a/2) / a);
+            dest[1] = (uint8_t)((src[1] * u + dest[1] * v + a/2) / a);
+            dest[2] = (uint8_t)((src[2] * u + dest[2] * v + a/2) / a);
+            dest[3] = (uint8_t)((a + 127) / 255);
+        }
+        dest += 4;
+        src += 4;
+    }
 }
 
 
-static bool apply_palette(png_structp png_ptr, png_infop info_ptr, im_img* img) {
-    png_colorp colours;
-    int num_colours;
-    int i;
-    png_bytep trans = NULL;
-    int  num_trans;
-    ImFmt palfmt;
+// Decode an animation frame and draw it onto the canvas.
+static bool decode_anim_frame(png_reader* pr)
+{
+    im_read* rdr = &pr->base;
+    im_imginfo* info = &rdr->curr;
+    apng_fctl* f = &pr->fctl;
+    size_t canvas_pitch = (size_t)pr->width * 4;
+    size_t canvas_size;
+    size_t frame_size;
+    png_bytep* rows = NULL;
+    uint8_t* dest;
+    uint32_t y;
 
-    if (png_get_PLTE(png_ptr, info_ptr, &colours, &num_colours) != PNG_INFO_PLTE) {
-        // no PLTE chunk, so our work here is done
-        return true;
+    if (!i_size_mul(canvas_pitch, pr->height, &canvas_size) ||
+        !i_size_img(f->w, f->h, 4, &frame_size)) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
     }
 
-    // png palettes are RGB only, so if there is a tRNS chunk, we'll
-    // use it to provide alpha values
-    
-    // get any tRNS data
-    if (png_get_tRNS(png_ptr, info_ptr, &trans, &num_trans, NULL) == PNG_INFO_tRNS) {
-    } else {
-        num_trans = 0;
+    // Frames are decoded into framebuf first.
+    pr->rowbytes = (size_t)f->w * 4;
+    pr->framebuf = irealloc(pr->framebuf, frame_size);
+    rows = imalloc(f->h * sizeof(png_bytep));
+    if (!pr->framebuf || !rows) {
+        if (rows) {
+            ifree(rows);
+        }
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    for (y = 0; y < f->h; ++y) {
+        rows[y] = pr->framebuf + pr->rowbytes * y;
+    }
+
+    if (setjmp(png_jmpbuf(pr->png))) {
+        ifree(rows);
+        if (rdr->err == IM_ERR_NONE) {
+            rdr->err = IM_ERR_EXTLIB;
+        }
+        return false;
+    }
+    // Everything to 8 bit RGBA.
+    png_set_expand(pr->png);
+    png_set_scale_16(pr->png);
+    png_set_gray_to_rgb(pr->png);
+    png_set_add_alpha(pr->png, 0xff, PNG_FILLER_AFTER);
+    png_set_interlace_handling(pr->png);
+    png_read_update_info(pr->png, pr->info);
+    if (png_get_rowbytes(pr->png, pr->info) != pr->rowbytes) {
+        ifree(rows);
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
     }
+    png_read_image(pr->png, rows);
+    ifree(rows);
 
-    // alloc our palette
-    if (num_trans>0) {
-        palfmt = IM_FMT_RGBA;
+    // Set up the canvas (starts out fully transparent).
+    if (!pr->canvas) {
+        pr->canvas = imalloc(canvas_size);
+        if (!pr->canvas) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        memset(pr->canvas, 0, canvas_size);
+        // Nothing to go back to for the first frame.
+        if (f->dispose_op == APNG_DISPOSE_OP_PREVIOUS) {
+            f->dispose_op = APNG_DISPOSE_OP_BACKGROUND;
+        }
+        info->changed_x = 0;
+        info->changed_y = 0;
+        info->changed_w = pr->width;
+        info->changed_h = pr->height;
     } else {
-        palfmt = IM_FMT_RGB;
+        // Get rid of the last frame.
+        apng_fctl* p = &pr->prev;
+        uint32_t x0 = f->x, y0 = f->y, x1 = f->x + f->w, y1 = f->y + f->h;
+        if (p->dispose_op == APNG_DISPOSE_OP_BACKGROUND) {
+            for (y = p->y; y < p->y + p->h; ++y) {
+                memset(pr->canvas + canvas_pitch * y + (size_t)p->x * 4, 0, (size_t)p->w * 4);
+            }
+        } else if (p->dispose_op == APNG_DISPOSE_OP_PREVIOUS) {
+            for (y = p->y; y < p->y + p->h; ++y) {
+                size_t off = canvas_pitch * y + (size_t)p->x * 4;
+                memcpy(pr->canvas + off, pr->backup + off, (size_t)p->w * 4);
+            }
+        }
+        if (p->dispose_op != APNG_DISPOSE_OP_NONE) {
+            if (p->x < x0) x0 = p->x;
+            if (p->y < y0) y0 = p->y;
+            if (p->x + p->w > x1) x1 = p->x + p->w;
+            if (p->y + p->h > y1) y1 = p->y + p->h;
+        }
+        info->changed_x = (int)x0;
+        info->changed_y = (int)y0;
+        info->changed_w = x1 - x0;
+        info->changed_h = y1 - y0;
     }
+    rdr->changed_set = true;
 
-    if (!im_img_pal_set( img, palfmt, num_colours,NULL)) {
-        return false;
+    if (f->dispose_op == APNG_DISPOSE_OP_PREVIOUS) {
+        if (!pr->backup) {
+            pr->backup = imalloc(canvas_size);
+            if (!pr->backup) {
+                rdr->err = IM_ERR_NOMEM;
+                return false;
+            }
+        }
+        memcpy(pr->backup, pr->canvas, canvas_size);
     }
-    //
-    switch (palfmt) {
-        case IM_FMT_RGB:
-            {
-                uint8_t* colp = img->pal_data;
-                for (i = 0; i < num_colours; ++i) {
-                    *colp++ = colours[i].red;
-                    *colp++ = colours[i].green;
-                    *colp++ = colours[i].blue;
-                }
+
+    // Draw the new frame.
+    dest = pr->canvas + canvas_pitch * f->y + (size_t)f->x * 4;
+    for (y = 0; y < f->h; ++y) {
+        const uint8_t* src = pr->framebuf + pr->rowbytes * y;
+        if (f->blend_op == APNG_BLEND_OP_OVER) {
+            blend_row(dest, src, f->w);
+        } else {
+            memcpy(dest, src, pr->rowbytes);
+        }
+        dest += canvas_pitch;
+    }
+    pr->prev = *f;
+    return true;
+}
+
+
+// Done with the libpng reader for the current frame.
+static void end_frame(png_reader* pr)
+{
+    if (pr->png) {
+        png_destroy_read_struct(&pr->png, pr->info ? &pr->info : NULL, NULL);
+        pr->png = NULL;
+        pr->info = NULL;
+    }
+    // Skip any of the frame's image data libpng didn't get to.
+    if (pr->data_left > 0) {
+        skip_chunk_data(pr, pr->data_left - (pr->converting ? 0 : 4));
+        pr->data_left = 0;
+    }
+}
+
+
+// Add any text chunks libpng has seen to the kvstore.
+static void add_text(png_reader* pr)
+{
+    png_textp txt;
+    int ntxt = 0;
+    int i;
+    png_get_text(pr->png, pr->info, &txt, &ntxt);
+    for (i = 0; i < ntxt; ++i) {
+        i_kvstore_add(&pr->base.kv, txt[i].key, txt[i].text);
+    }
+    // Don't add them again.
+    png_free_data(pr->png, pr->info, PNG_FREE_TEXT, -1);
+}
+
+
+// Set up the next lot of bytes to go to libpng.
+static void next_feed(png_reader* pr)
+{
+    im_read* rdr = &pr->base;
+    uint8_t hdr[8];
+    uint32_t len;
+
+    switch (pr->stage) {
+        case FEED_PRELUDE:
+            pr->stage = FEED_HDR;
+            pr->feed = pr->hdr_chunks;
+            pr->feed_len = pr->hdr_len;
+            pr->feed_pos = 0;
+            return;
+        case FEED_HDR:
+            pr->stage = FEED_DATA;
+            // fall through
+        case FEED_DATA:
+            if (!read_chunk_header(pr, hdr)) {
+                png_error(pr->png, "read error");
             }
-            break;
-        case IM_FMT_RGBA:
-            {
-                uint8_t* colp = img->pal_data;
-                for (i = 0; i < num_colours; ++i) {
-                    *colp++ = colours[i].red;
-                    *colp++ = colours[i].green;
-                    *colp++ = colours[i].blue;
-                    *colp++ = (i<num_trans) ? trans[i] : 255;
+            len = get_u32be(hdr);
+            pr->feed = pr->scratch;
+            pr->feed_pos = 0;
+            pr->feed_len = 8;
+            if (!pr->fdat && chunk_is(hdr, "IDAT")) {
+                // pass it straight through
+                memcpy(pr->scratch, hdr, 8);
+                pr->data_left = len + 4;
+                pr->converting = false;
+            } else if (pr->fdat && chunk_is(hdr, "fdAT") && len >= 4) {
+                // Turn it into an IDAT (dropping the sequence number).
+                uint8_t seq[4];
+                if (im_in_read(rdr->in, seq, 4) != 4) {
+                    rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+                    png_error(pr->png, "read error");
                 }
+                put_u32be(pr->scratch, len - 4);
+                memcpy(pr->scratch + 4, "IDAT", 4);
+                pr->crc_in = crc32(crc32(0, hdr + 4, 4), seq, 4);
+                pr->crc_out = crc32(0, pr->scratch + 4, 4);
+                pr->data_left = len - 4;
+                pr->converting = true;
+            } else {
+                // Out of image data for this frame. Leave the chunk for
+                // later and give libpng an IEND (it'll complain if it
+                // wanted more).
+                unread_chunk_header(pr, hdr);
+                memcpy(pr->scratch, "\0\0\0\0IEND\xae\x42\x60\x82", 12);
+                pr->feed_len = 12;
+                pr->stage = FEED_END;
+            }
+            return;
+        case FEED_TAIL:
+            // The rest of the file, as-is.
+            if (!read_chunk_header(pr, hdr)) {
+                png_error(pr->png, "read error");
+            }
+            memcpy(pr->scratch, hdr, 8);
+            pr->feed = pr->scratch;
+            pr->feed_pos = 0;
+            pr->feed_len = 8;
+            pr->data_left = get_u32be(hdr) + 4;
+            pr->converting = false;
+            if (chunk_is(hdr, "IEND")) {
+                pr->stage = FEED_END;
             }
-            break;
+            return;
+        case FEED_END:
         default:
-            break;
+            png_error(pr->png, "read past end");
     }
+}
 
-    return true;
+
+// The fdAT we've been passing through is done. Check its CRC and send on
+// the one for the IDAT.
+static void finish_conversion(png_reader* pr)
+{
+    im_read* rdr = &pr->base;
+    uint8_t crcbuf[4];
+    if (im_in_read(rdr->in, crcbuf, 4) != 4) {
+        rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+        png_error(pr->png, "read error");
+    }
+    if (pr->crc_in != get_u32be(crcbuf)) {
+        rdr->err = IM_ERR_MALFORMED;
+        png_error(pr->png, "fdAT: CRC error");
+    }
+    put_u32be(pr->scratch, (uint32_t)pr->crc_out);
+    pr->feed = pr->scratch;
+    pr->feed_pos = 0;
+    pr->feed_len = 4;
+    pr->converting = false;
+}
+
+
+// libpng calls this to get data.
+static void read_fn(png_structp png_ptr, png_bytep out, size_t len)
+{
+    png_reader* pr = (png_reader*)png_get_io_ptr(png_ptr);
+    im_read* rdr = &pr->base;
+
+    while (len > 0) {
+        size_t n;
+        if (pr->feed_pos < pr->feed_len) {
+            n = pr->feed_len - pr->feed_pos;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(out, pr->feed + pr->feed_pos, n);
+            pr->feed_pos += n;
+        } else if (pr->data_left > 0) {
+            n = pr->data_left;
+            if (n > len) {
+                n = len;
+            }
+            if (im_in_read(rdr->in, out, n) != n) {
+                rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+                png_error(png_ptr, "read error");
+            }
+            pr->data_left -= (uint32_t)n;
+            if (pr->converting) {
+                pr->crc_in = crc32(pr->crc_in, out, (uInt)n);
+                pr->crc_out = crc32(pr->crc_out, out, (uInt)n);
+                if (pr->data_left == 0) {
+                    finish_conversion(pr);
+                }
+            }
+        } else {
+            next_feed(pr);
+            if (pr->converting && pr->data_left == 0) {
+                finish_conversion(pr);  // empty fdAT
+            }
+            continue;
+        }
+        out += n;
+        len -= n;
+    }
 }
 
@@ -2,11 +2,31 @@
 #include "private.h"
 #include <assert.h>
 #include <png.h>
+#include <zlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 
+// PNG writer, including APNG animations.
+//
+// Each frame is encoded by libpng, and we pick out the chunks we want as
+// they come out of it. For the first frame, the header chunks (IHDR, PLTE
+// etc) go straight out. Later frames have their IDAT chunks rewritten as
+// fdAT.
+// If there's more than one frame, an acTL chunk has to go in ahead of the
+// first IDAT. So unless the caller has said how many frames to expect
+// (IM_WRITE_OPT_NUM_FRAMES), everything from the first IDAT onward is held
+// back in memory until finish().
+// The first frame sets the size, colour type and palette for the whole
+// animation.
+
+// APNG dispose_op and blend_op values
+#define APNG_DISPOSE_OP_NONE 0
+#define APNG_DISPOSE_OP_BACKGROUND 1
+#define APNG_DISPOSE_OP_PREVIOUS 2
+#define APNG_BLEND_OP_SOURCE 0
+#define APNG_BLEND_OP_OVER 1
 
 static void pre_img(im_write* wr);
 static void emit_header(im_write* wr);
@@ -19,6 +39,12 @@ static void custom_write(png_structp png_ptr,
     png_bytep data, png_size_t length);
 static void custom_flush(png_structp png_ptr);
 
+// A growable lump of memory.
+typedef struct membuf {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+} membuf;
 
 typedef struct ipng_writer {
     // embedded im_write
@@ -26,6 +52,49 @@ typedef struct ipng_writer {
     // png-specific
     png_structp png_ptr;
     png_infop info_ptr;
+    ImFmt fmt;              // what we're writing (set by first frame)
+    int color_type;
+    int bit_depth;
+    int bpp;                // bytes per pixel (of fmt)
+
+    // Set by the first frame.
+    unsigned int canvas_w;
+    unsigned int canvas_h;
+    unsigned int canvas_pal_num_colours;
+    uint8_t canvas_pal[256*4];
+
+    // Everything from the first IDAT onward. If streaming, it's passed
+    // on to the output a chunk at a time instead of being held back.
+    membuf body;
+    bool streaming;
+    uint32_t seq;           // next APNG sequence number
+    uint8_t first_fctl[26]; // fcTL data for the first frame
+
+    // Picking apart the libpng output for the current frame (see
+    // collect_output()).
+    size_t sig_left;        // bytes of PNG signature still to come
+    uint8_t chunk_hdr[8];   // header of the incoming chunk
+    size_t hdr_got;
+    uint32_t data_left;     // bytes of its data still to come
+    size_t crc_left;        // bytes of its CRC still to come
+    enum {ROUTE_OUT, ROUTE_BODY, ROUTE_FDAT, ROUTE_DROP} route;
+    uLong fdat_crc;         // CRC of the fdAT chunk being built
+    bool seen_idat;
+
+    // The current frame: area to write, and how.
+    bool first;
+    unsigned int fx, fy, fw, fh;
+    uint8_t dispose_op;
+    uint8_t blend_op;
+
+    // Frame optimisation (IM_WRITE_OPT_OPTIMISE_FRAMES).
+    // As with GIF, the whole frame is collected in framebuf, then compared
+    // against canvas (what a viewer will be showing after the previous
+    // frame), so only the changed area needs to be written.
+    bool buffering;
+    uint8_t* framebuf;
+    uint8_t* canvas;
+    bool canvas_valid;
 } ipng_writer;
 
 static struct write_handler ipng_write_handler = {
@@ -37,6 +106,16 @@ static struct write_handler ipng_write_handler = {
     finish
 };
 
+static bool start_encoder(im_write* wr, unsigned int w, unsigned int h);
+static void make_fctl(im_write* wr, uint32_t seq, uint8_t* buf);
+static void choose_area(im_write* wr);
+static void update_canvas(im_write* wr);
+static bool collect_output(im_write* wr, const uint8_t* data, size_t len);
+static bool flush_body(im_write* wr);
+static bool add_actl(im_write* wr, membuf* b, unsigned int num_frames);
+static bool membuf_append(membuf* b, const void* data, size_t n);
+static bool add_chunk(membuf* b, const char* type, const uint8_t* data, size_t len);
+
 
 im_write* ipng_new_writer(im_out* out, ImErr* err)
 {
@@ -45,6 +124,8 @@ im_write* ipng_new_writer(im_out* out, ImErr* err)
         *err = IM_ERR_NOMEM;
         return NULL;
     }
+    // Lots of fields - start with everything zeroed.
+    memset(pw, 0, sizeof(ipng_writer));
 
     i_write_init(&pw->base);
 
@@ -62,10 +143,47 @@ im_write* ipng_new_writer(im_out* out, ImErr* err)
 
 static void pre_img(im_write* wr)
 {
+    ipng_writer* pw = (ipng_writer*)wr;
+
     if (wr->num_frames>0) {
-        wr->err = IM_ERR_ANIM_UNSUPPORTED;  // animation not supported.
+        // Subsequent frames have to match the first.
+        if (wr->w > pw->canvas_w || wr->h > pw->canvas_h) {
+            wr->err = IM_ERR_UNSUPPORTED;
+            return;
+        }
+        i_write_set_internal_fmt(wr, pw->fmt);
+        return;
+    }
+
+    // work out which format we'll be writing (and also which format
+    // we'd like to receive from im_write_rows()).
+    // Greyscale and 16 bit data is written as-is.
+    if (im_fmt_is_indexed(wr->fmt) ||
+        (im_fmt_has_rgb(wr->fmt) && wr->quant_colours > 0)) {
+        // Paletted (quantising down to PNG8 if need be).
+        pw->fmt = IM_FMT_INDEX8;
+        pw->color_type = PNG_COLOR_TYPE_PALETTE;
+    } else if (im_fmt_is_luminance(wr->fmt)) {
+        pw->fmt = wr->fmt;
+        pw->color_type = im_fmt_has_alpha(wr->fmt) ? PNG_COLOR_TYPE_GRAY_ALPHA : PNG_COLOR_TYPE_GRAY;
+    } else if (im_fmt_has_rgb(wr->fmt)) {
+        if (im_fmt_has_alpha(wr->fmt)) {
+            pw->fmt = im_fmt_is_16bit(wr->fmt) ? IM_FMT_RGBA16 : IM_FMT_RGBA;
+            pw->color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+        } else {
+            pw->fmt = im_fmt_is_16bit(wr->fmt) ? IM_FMT_RGB16 : IM_FMT_RGB;
+            pw->color_type = PNG_COLOR_TYPE_RGB;
+        }
+    } else {
+        wr->err = IM_ERR_UNSUPPORTED;  // unsupported fmt
         return;
     }
+    pw->bit_depth = im_fmt_is_16bit(pw->fmt) ? 16 : 8;
+    pw->bpp = (int)im_fmt_bytesperpixel(pw->fmt);
+    i_write_set_internal_fmt(wr, pw->fmt);
+    pw->canvas_w = wr->w;
+    pw->canvas_h = wr->h;
+    pw->streaming = (wr->expected_frames > 0);
 }
 
 static void emit_header(im_write* wr)
@@ -75,55 +193,118 @@ static void emit_header(im_write* wr)
     assert(pw->png_ptr == NULL);
     assert(pw->info_ptr == NULL);
 
+    pw->first = (wr->num_frames == 0);
+    if (pw->color_type == PNG_COLOR_TYPE_PALETTE) {
+        if (pw->first) {
+            if (wr->pal_num_colours > 256) {
+                wr->err = IM_ERR_PALETTE_TOO_BIG;
+                return;
+            }
+            pw->canvas_pal_num_colours = wr->pal_num_colours;
+            memcpy(pw->canvas_pal, wr->pal_data, wr->pal_num_colours * 4);
+        } else if (wr->pal_num_colours != pw->canvas_pal_num_colours ||
+            memcmp(wr->pal_data, pw->canvas_pal, wr->pal_num_colours * 4) != 0) {
+            // APNG frames all share the one PLTE.
+            wr->err = IM_ERR_UNSUPPORTED;
+            return;
+        }
+    }
+
+    // Default to writing the whole frame.
+    pw->fx = 0;
+    pw->fy = 0;
+    pw->fw = wr->w;
+    pw->fh = wr->h;
+    pw->blend_op = APNG_BLEND_OP_SOURCE;
+    switch (wr->disposal) {
+        case IM_DISPOSE_BACKGROUND:
+            pw->dispose_op = APNG_DISPOSE_OP_BACKGROUND;
+            break;
+        case IM_DISPOSE_PREVIOUS:
+            // Nothing to go back to for the first frame.
+            pw->dispose_op = pw->first ? APNG_DISPOSE_OP_BACKGROUND : APNG_DISPOSE_OP_PREVIOUS;
+            break;
+        default:
+            pw->dispose_op = APNG_DISPOSE_OP_NONE;
+            break;
+    }
+
+    if (wr->optimise_frames) {
+        // Collect the whole frame first - post_img() will write it out.
+        size_t nbytes;
+        if (!i_size_img(wr->w, wr->h, pw->bpp, &nbytes)) {
+            wr->err = IM_ERR_NOMEM;
+            return;
+        }
+        pw->framebuf = irealloc(pw->framebuf, nbytes);
+        if (!pw->framebuf) {
+            wr->err = IM_ERR_NOMEM;
+            return;
+        }
+        pw->buffering = true;
+        return;
+    }
+
+    // We're not tracking what's on screen.
+    pw->canvas_valid = false;
+    start_encoder(wr, wr->w, wr->h);
+}
+
+
+// Set up libpng to encode a w*h image (see collect_output() for where
+// it goes).
+static bool start_encoder(im_write* wr, unsigned int w, unsigned int h)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+
+    pw->sig_left = 8;
+    pw->hdr_got = 0;
+    pw->data_left = 0;
+    pw->crc_left = 0;
+    pw->seen_idat = false;
+    if (pw->first) {
+        make_fctl(wr, pw->seq++, pw->first_fctl);
+    } else {
+        uint8_t fctl[26];
+        make_fctl(wr, pw->seq++, fctl);
+        if (!add_chunk(&pw->body, "fcTL", fctl, sizeof(fctl))) {
+            wr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        if (!flush_body(wr)) {
+            return false;
+        }
+    }
+
     pw->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,NULL,NULL);
     if (!pw->png_ptr) {
         wr->err = IM_ERR_NOMEM;
-        return;
+        return false;
     }
 
     pw->info_ptr = png_create_info_struct(pw->png_ptr);
     if (!pw->info_ptr)
     {
         wr->err = IM_ERR_NOMEM;
-        return;
+        return false;
     }
 
-    // TODO - cover other functions which call png_* routines!
     if (setjmp(png_jmpbuf(pw->png_ptr)))
     {
-       png_destroy_write_struct(&pw->png_ptr, &pw->info_ptr);
-       // TODO: check error in im_out?
-       wr->err = IM_ERR_EXTLIB;
-       return;
+       if (wr->err == IM_ERR_NONE) {
+           wr->err = IM_ERR_EXTLIB;
+       }
+       return false;
     }
 
     png_set_write_fn(pw->png_ptr,
-        (png_voidp)wr->out, custom_write, custom_flush);
-
-    // work out which format we'll be writing (and also which format
-    // we'd like to receive from im_write_rows()).
-    int color_type;
-    if (im_fmt_is_indexed(wr->fmt)) {
-        color_type = PNG_COLOR_TYPE_PALETTE;
-        i_write_set_internal_fmt(wr, IM_FMT_INDEX8);
-    } else if (im_fmt_has_rgb(wr->fmt)) {
-        if (im_fmt_has_alpha(wr->fmt)) {
-            color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-            i_write_set_internal_fmt(wr, IM_FMT_RGBA);
-        } else {
-            color_type = PNG_COLOR_TYPE_RGB;
-            i_write_set_internal_fmt(wr, IM_FMT_RGB);
-        }
-    } else {
-        wr->err = IM_ERR_UNSUPPORTED;  // unsupported fmt
-        return;
-    }
+        (png_voidp)pw, custom_write, custom_flush);
 
     png_set_IHDR(pw->png_ptr, pw->info_ptr,
-        (png_uint_32)wr->w,
-        (png_uint_32)wr->h,
-        8,  //bit_depth
-        color_type,
+        (png_uint_32)w,
+        (png_uint_32)h,
+        pw->bit_depth,
+        pw->color_type,
         PNG_INTERLACE_NONE,
         PNG_COMPRESSION_TYPE_DEFAULT,
         PNG_FILTER_TYPE_DEFAULT);
@@ -133,10 +314,14 @@ static void emit_header(im_write* wr)
     }
 
     // If there are any string key-value pairs lined up, write them out as
-    // text chunks.
-    if (wr->kv.num_entries > 0) {
+    // text chunks (only needed once).
+    if (pw->first && wr->kv.num_entries > 0) {
         png_text *tmp = imalloc(sizeof(png_text) * wr->kv.num_entries);
         size_t i;
+        if (!tmp) {
+            wr->err = IM_ERR_NOMEM;
+            return false;
+        }
         for (i = 0; i < wr->kv.num_entries; ++i) {
             tmp[i].compression = PNG_TEXT_COMPRESSION_NONE;
             tmp[i].key = (char*)wr->kv.entries[i].key;
@@ -152,6 +337,12 @@ static void emit_header(im_write* wr)
 
     // write the header chunks
     png_write_info(pw->png_ptr, pw->info_ptr);
+
+    // 16 bit rows come to us native-endian, but PNG is big-endian.
+    if (pw->bit_depth == 16 && host_is_little_endian()) {
+        png_set_swap(pw->png_ptr);
+    }
+    return true;
 }
 
 
@@ -159,6 +350,24 @@ static void emit_rows(im_write *wr, unsigned int num_rows, const void *data, int
 {
     ipng_writer* pw = (ipng_writer*)wr;
     unsigned int i;
+
+    if (pw->buffering) {
+        size_t bytes_per_row = (size_t)wr->w * pw->bpp;
+        uint8_t* dest = pw->framebuf + bytes_per_row * wr->rows_written;
+        for (i = 0; i < num_rows; ++i) {
+            memcpy(dest, data, bytes_per_row);
+            dest += bytes_per_row;
+            data += stride;
+        }
+        return;
+    }
+
+    if (setjmp(png_jmpbuf(pw->png_ptr))) {
+        if (wr->err == IM_ERR_NONE) {
+            wr->err = IM_ERR_EXTLIB;
+        }
+        return;
+    }
     for (i = 0; i < num_rows; ++i) {
         png_write_row(pw->png_ptr, (png_const_bytep)data);
         data += stride;
@@ -197,7 +406,416 @@ static void emit_palette(im_write* wr)
 static void post_img(im_write* wr)
 {
     ipng_writer* pw = (ipng_writer*)wr;
+
+    if (pw->buffering) {
+        // Work out what to write, then encode it.
+        size_t bytes_per_row = (size_t)wr->w * pw->bpp;
+        const uint8_t* src;
+        unsigned int y;
+
+        pw->buffering = false;
+        choose_area(wr);
+        if (wr->err != IM_ERR_NONE) {
+            return;
+        }
+        if (!start_encoder(wr, pw->fw, pw->fh)) {
+            return;
+        }
+        if (setjmp(png_jmpbuf(pw->png_ptr))) {
+            if (wr->err == IM_ERR_NONE) {
+                wr->err = IM_ERR_EXTLIB;
+            }
+            return;
+        }
+        src = pw->framebuf + bytes_per_row * pw->fy + (size_t)pw->fx * pw->bpp;
+        for (y = 0; y < pw->fh; ++y) {
+            png_write_row(pw->png_ptr, (png_const_bytep)src);
+            src += bytes_per_row;
+        }
+    }
+
+    if (setjmp(png_jmpbuf(pw->png_ptr))) {
+        if (wr->err == IM_ERR_NONE) {
+            wr->err = IM_ERR_EXTLIB;
+        }
+        return;
+    }
     png_write_end(pw->png_ptr, pw->info_ptr);
+    png_destroy_write_struct(&pw->png_ptr, &pw->info_ptr);
+    // Should have ended on a chunk boundary.
+    assert(pw->hdr_got == 0);
+}
+
+
+// Can the canvas be used to work out the changes in the current frame?
+static inline bool full_frame(im_write* wr)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+    return wr->w == pw->canvas_w && wr->h == pw->canvas_h;
+}
+
+// Palette index for a fully-transparent colour, or -1 if none.
+static int find_clear_index(ipng_writer* pw)
+{
+    unsigned int i;
+    for (i = 0; i < pw->canvas_pal_num_colours; ++i) {
+        if (pw->canvas_pal[i * 4 + 3] == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Is the pixel at p fully opaque?
+static inline bool is_opaque(ipng_writer* pw, const uint8_t* p)
+{
+    switch (pw->fmt) {
+        case IM_FMT_INDEX8: return pw->canvas_pal[p[0] * 4 + 3] == 255;
+        case IM_FMT_RGBA: return p[3] == 255;
+        case IM_FMT_LUMINANCE_ALPHA: return p[1] == 255;
+        // (0xffff is the same in either byte order)
+        case IM_FMT_RGBA16: return p[6] == 255 && p[7] == 255;
+        case IM_FMT_LUMINANCE_ALPHA16: return p[2] == 255 && p[3] == 255;
+        default: return true;
+    }
+}
+
+
+// Decide how to write out the frame collected in framebuf.
+// If the canvas is known, just the area which differs from it is written.
+// Where all the changed pixels are opaque, the unchanged ones are cleared
+// and the frame is blended over the canvas instead, which usually
+// compresses better.
+static void choose_area(im_write* wr)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+    int bpp = pw->bpp;
+    size_t bytes_per_row = (size_t)wr->w * bpp;
+    unsigned int xmin = wr->w;
+    unsigned int xmax = 0;
+    unsigned int ymin = wr->h;
+    unsigned int ymax = 0;
+    bool opaque = true;
+    int clear = -1;
+    unsigned int x, y;
+
+    // Frames which get cleared to background afterward are written out in
+    // full, so the whole area gets cleared.
+    if (pw->first || !full_frame(wr) || !pw->canvas_valid ||
+        pw->dispose_op == APNG_DISPOSE_OP_BACKGROUND) {
+        update_canvas(wr);
+        return;
+    }
+
+    for (y = 0; y < wr->h; ++y) {
+        const uint8_t* p = pw->framebuf + bytes_per_row * y;
+        const uint8_t* c = pw->canvas + bytes_per_row * y;
+        bool changed = false;
+        for (x = 0; x < wr->w; ++x) {
+            if (memcmp(p, c, bpp) != 0) {
+                if (x < xmin) {
+                    xmin = x;
+                }
+                if (x > xmax) {
+                    xmax = x;
+                }
+                if (!is_opaque(pw, p)) {
+                    opaque = false;
+                }
+                changed = true;
+            }
+            p += bpp;
+            c += bpp;
+        }
+        if (changed) {
+            if (y < ymin) {
+                ymin = y;
+            }
+            ymax = y;
+        }
+    }
+    if (ymin > ymax) {
+        // No change at all, but still need a frame to hold the delay.
+        xmin = xmax = 0;
+        ymin = ymax = 0;
+    }
+    pw->fx = xmin;
+    pw->fy = ymin;
+    pw->fw = (xmax - xmin) + 1;
+    pw->fh = (ymax - ymin) + 1;
+
+    if (pw->fmt == IM_FMT_INDEX8) {
+        clear = find_clear_index(pw);
+    }
+    if (opaque && (im_fmt_has_alpha(pw->fmt) || clear >= 0)) {
+        pw->blend_op = APNG_BLEND_OP_OVER;
+    }
+
+    // Track what will be on screen for the next frame (only the changed
+    // area can differ), and blank out the unchanged pixels if blending.
+    for (y = pw->fy; y < pw->fy + pw->fh; ++y) {
+        uint8_t* p = pw->framebuf + bytes_per_row * y + (size_t)pw->fx * bpp;
+        uint8_t* c = pw->canvas + bytes_per_row * y + (size_t)pw->fx * bpp;
+        for (x = 0; x < pw->fw; ++x) {
+            if (memcmp(p, c, bpp) != 0) {
+                if (pw->dispose_op == APNG_DISPOSE_OP_NONE) {
+                    memcpy(c, p, bpp);
+                }
+            } else if (pw->blend_op == APNG_BLEND_OP_OVER) {
+                if (pw->fmt == IM_FMT_INDEX8) {
+                    *p = (uint8_t)clear;
+                } else {
+                    memset(p, 0, bpp);
+                }
+            }
+            p += bpp;
+            c += bpp;
+        }
+    }
+}
+
+
+// Update the canvas to reflect what'll be on screen once the current frame
+// (written out in full, from framebuf) has been shown and disposed of.
+static void update_canvas(im_write* wr)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+    size_t n = (size_t)wr->w * wr->h * pw->bpp;
+
+    if (!full_frame(wr)) {
+        pw->canvas_valid = false;
+        return;
+    }
+    if (!pw->canvas) {
+        pw->canvas = imalloc(n);
+        if (!pw->canvas) {
+            wr->err = IM_ERR_NOMEM;
+            return;
+        }
+        pw->canvas_valid = false;
+    }
+
+    switch (pw->dispose_op) {
+        case APNG_DISPOSE_OP_NONE:
+            memcpy(pw->canvas, pw->framebuf, n);
+            pw->canvas_valid = true;
+            break;
+        case APNG_DISPOSE_OP_BACKGROUND:
+            // Cleared to transparent black. Can only represent that if
+            // we've got alpha.
+            if (im_fmt_has_alpha(pw->fmt)) {
+                memset(pw->canvas, 0, n);
+                pw->canvas_valid = true;
+            } else {
+                pw->canvas_valid = false;
+            }
+            break;
+        case APNG_DISPOSE_OP_PREVIOUS:
+            // The screen goes back to how it was.
+            break;
+    }
+}
+
+
+// Fill out the fcTL data for the current frame.
+static void make_fctl(im_write* wr, uint32_t seq, uint8_t* buf)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+    uint8_t* p = buf;
+    unsigned int num = wr->delay_ms;
+    unsigned int den = 1000;
+
+    if (num > 65535) {
+        // Too long to give in milliseconds.
+        num = wr->delay_ms / 10;
+        den = 100;
+        if (num > 65535) {
+            num = 65535;
+        }
+    }
+    encode_u32be(&p, seq);
+    encode_u32be(&p, pw->fw);
+    encode_u32be(&p, pw->fh);
+    encode_u32be(&p, pw->fx);
+    encode_u32be(&p, pw->fy);
+    encode_u16be(&p, (uint16_t)num);
+    encode_u16be(&p, (uint16_t)den);
+    *p++ = pw->dispose_op;
+    *p++ = pw->blend_op;
+}
+
+
+// Image data (and the APNG chunks which go with it) is gathered in body.
+// If we're streaming, pass it on now.
+static bool flush_body(im_write* wr)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+    if (!pw->streaming || pw->body.len == 0) {
+        return true;
+    }
+    if (im_out_write(wr->out, pw->body.data, pw->body.len) != pw->body.len) {
+        wr->err = IM_ERR_FILE;
+        return false;
+    }
+    pw->body.len = 0;
+    return true;
+}
+
+static bool put_out(im_write* wr, const uint8_t* data, size_t len)
+{
+    if (im_out_write(wr->out, data, len) != len) {
+        wr->err = IM_ERR_FILE;
+        return false;
+    }
+    return true;
+}
+
+static bool put_body(im_write* wr, const uint8_t* data, size_t len)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+    if (!membuf_append(&pw->body, data, len)) {
+        wr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    return true;
+}
+
+// Decide what to do with a chunk, now we've got its header.
+static bool start_chunk(im_write* wr)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+    uint8_t* cursor = pw->chunk_hdr;
+    uint32_t len = decode_u32be(&cursor);
+
+    pw->data_left = len;
+    pw->crc_left = 4;
+    if (memcmp(pw->chunk_hdr + 4, "IDAT", 4) == 0) {
+        if (pw->first) {
+            if (!pw->seen_idat && pw->streaming && wr->expected_frames > 1) {
+                // Animation control has to come before the image data.
+                if (!add_actl(wr, &pw->body, wr->expected_frames) ||
+                    !add_chunk(&pw->body, "fcTL", pw->first_fctl, sizeof(pw->first_fctl))) {
+                    wr->err = IM_ERR_NOMEM;
+                    return false;
+                }
+            }
+            // As-is.
+            pw->route = ROUTE_BODY;
+            pw->seen_idat = true;
+            return put_body(wr, pw->chunk_hdr, 8);
+        } else {
+            // Rewritten as fdAT, with a sequence number in front.
+            uint8_t hdr[12];
+            uint8_t* p = hdr;
+            encode_u32be(&p, len + 4);
+            memcpy(p, "fdAT", 4);
+            p += 4;
+            encode_u32be(&p, pw->seq++);
+            pw->fdat_crc = crc32(0, hdr + 4, 8);
+            pw->route = ROUTE_FDAT;
+            pw->seen_idat = true;
+            return put_body(wr, hdr, sizeof(hdr));
+        }
+    }
+    if (pw->first && !pw->seen_idat) {
+        // Header chunks can go out now.
+        pw->route = ROUTE_OUT;
+        return put_out(wr, pw->chunk_hdr, 8);
+    }
+    // Anything else (IEND, or header chunks for later frames) is dropped.
+    pw->route = ROUTE_DROP;
+    return true;
+}
+
+// Sort out the chunks libpng produces for the current frame, as they
+// arrive. The data can be split up any old way.
+static bool collect_output(im_write* wr, const uint8_t* data, size_t len)
+{
+    ipng_writer* pw = (ipng_writer*)wr;
+
+    while (len > 0) {
+        size_t n;
+        if (pw->sig_left > 0) {
+            // Only the first frame's signature is wanted.
+            n = (len < pw->sig_left) ? len : pw->sig_left;
+            if (pw->first && !put_out(wr, data, n)) {
+                return false;
+            }
+            pw->sig_left -= n;
+        } else if (pw->hdr_got < 8) {
+            n = (len < 8 - pw->hdr_got) ? len : 8 - pw->hdr_got;
+            memcpy(pw->chunk_hdr + pw->hdr_got, data, n);
+            pw->hdr_got += n;
+            if (pw->hdr_got == 8 && !start_chunk(wr)) {
+                return false;
+            }
+        } else if (pw->data_left > 0) {
+            n = (len < pw->data_left) ? len : pw->data_left;
+            switch (pw->route) {
+                case ROUTE_OUT:
+                    if (!put_out(wr, data, n)) {
+                        return false;
+                    }
+                    break;
+                case ROUTE_FDAT:
+                    pw->fdat_crc = crc32(pw->fdat_crc, data, (uInt)n);
+                    if (!put_body(wr, data, n)) {
+                        return false;
+                    }
+                    break;
+                case ROUTE_BODY:
+                    if (!put_body(wr, data, n)) {
+                        return false;
+                    }
+                    break;
+                case ROUTE_DROP:
+                    break;
+            }
+            pw->data_left -= (uint32_t)n;
+        } else {
+            n = (len < pw->crc_left) ? len : pw->crc_left;
+            if ((pw->route == ROUTE_OUT && !put_out(wr, data, n)) ||
+                (pw->route == ROUTE_BODY && !put_body(wr, data, n))) {
+                return false;
+            }
+            pw->crc_left -= n;
+            if (pw->crc_left == 0) {
+                // End of the chunk.
+                pw->hdr_got = 0;
+                if (pw->route == ROUTE_FDAT) {
+                    uint8_t crcbuf[4];
+                    uint8_t* p = crcbuf;
+                    encode_u32be(&p, (uint32_t)pw->fdat_crc);
+                    if (!put_body(wr, crcbuf, sizeof(crcbuf))) {
+                        return false;
+                    }
+                }
+                if (!flush_body(wr)) {
+                    return false;
+                }
+            }
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+static bool add_actl(im_write* wr, membuf* b, unsigned int num_frames)
+{
+    uint8_t actl[8];
+    uint8_t* p = actl;
+    // APNG counts plays, not repeats. Unspecified means play once.
+    uint32_t num_plays = 1;
+    if (wr->loop_count == 0) {
+        num_plays = 0;  // forever
+    } else if (wr->loop_count > 0) {
+        num_plays = (uint32_t)wr->loop_count + 1;
+    }
+    encode_u32be(&p, num_frames);
+    encode_u32be(&p, num_plays);
+    return add_chunk(b, "acTL", actl, sizeof(actl));
 }
 
 
@@ -208,21 +826,110 @@ static void finish(im_write* wr)
     if (pw->png_ptr) {
        png_destroy_write_struct(&pw->png_ptr, &pw->info_ptr);
     }
+
+    if (wr->err == IM_ERR_NONE && wr->num_frames > 0 && pw->streaming) {
+        // Everything else has gone out already.
+        if (!add_chunk(&pw->body, "IEND", NULL, 0)) {
+            wr->err = IM_ERR_NOMEM;
+        } else {
+            flush_body(wr);
+        }
+    } else if (wr->err == IM_ERR_NONE && wr->num_frames > 0) {
+        // Now we know how many frames there are, we can write out the rest.
+        membuf tail = {NULL, 0, 0};
+        if (wr->num_frames > 1) {
+            if (!add_actl(wr, &tail, wr->num_frames) ||
+                !add_chunk(&tail, "fcTL", pw->first_fctl, sizeof(pw->first_fctl))) {
+                wr->err = IM_ERR_NOMEM;
+            }
+        }
+        if (wr->err == IM_ERR_NONE &&
+            !add_chunk(&pw->body, "IEND", NULL, 0)) {
+            wr->err = IM_ERR_NOMEM;
+        }
+        if (wr->err == IM_ERR_NONE) {
+            if ((tail.len > 0 && im_out_write(wr->out, tail.data, tail.len) != tail.len) ||
+                im_out_write(wr->out, pw->body.data, pw->body.len) != pw->body.len) {
+                wr->err = IM_ERR_FILE;
+            }
+        }
+        if (tail.data) {
+            ifree(tail.data);
+        }
+    }
+
+    if (pw->body.data) {
+        ifree(pw->body.data);
+        pw->body.data = NULL;
+    }
+    if (pw->framebuf) {
+        ifree(pw->framebuf);
+        pw->framebuf = NULL;
+    }
+    if (pw->canvas) {
+        ifree(pw->canvas);
+        pw->canvas = NULL;
+    }
+}
+
+
+static bool membuf_append(membuf* b, const void* data, size_t n)
+{
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + n) {
+            cap *= 2;
+        }
+        uint8_t* p = irealloc(b->data, cap);
+        if (!p) {
+            return false;
+        }
+        b->data = p;
+        b->cap = cap;
+    }
+    if (n > 0) {
+        memcpy(b->data + b->len, data, n);
+    }
+    b->len += n;
+    return true;
+}
+
+
+// Append a chunk.
+static bool add_chunk(membuf* b, const char* type, const uint8_t* data, size_t len)
+{
+    uint8_t buf[8];
+    uint8_t* p = buf;
+    uLong crc;
+
+    encode_u32be(&p, (uint32_t)len);
+    memcpy(p, type, 4);
+    crc = crc32(0, (const Bytef*)type, 4);
+    if (len > 0) {
+        crc = crc32(crc, data, (uInt)len);
+    }
+    if (!membuf_append(b, buf, 8) ||
+        !membuf_append(b, data, len)) {
+        return false;
+    }
+    p = buf;
+    encode_u32be(&p, (uint32_t)crc);
+    return membuf_append(b, buf, 4);
 }
 
 
+// libpng output is sorted out as it arrives.
 static void custom_write(png_structp png_ptr,
     png_bytep data, png_size_t length)
 {
-    im_out* w = (im_out*)png_get_io_ptr(png_ptr);
-    size_t n = im_out_write(w, data, length);
-    if (n!=length) {
-        png_error(png_ptr, "write error");
+    ipng_writer* pw = (ipng_writer*)png_get_io_ptr(png_ptr);
+    if (!collect_output(&pw->base, data, length)) {
+        png_error(png_ptr, "write failed");
     }
 }
 
 static void custom_flush(png_structp png_ptr)
 {
-    // TODO
+    // Nothing to do - output is passed on a chunk at a time.
 }
 
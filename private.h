@@ -18,6 +18,42 @@ typedef void (*im_convert_fn)( const uint8_t* src, uint8_t* dest, unsigned int w
 // pick a conversion fn
 extern im_convert_fn i_pick_convert_fn(ImFmt srcFmt, ImFmt destFmt);
 
+/***********
+ * flips and rotations (transform.c)
+ */
+
+// Pixels are transformed this many rows at a time.
+#define I_TRANSFORM_TILE 16
+
+extern bool i_transform_swaps_axes(ImTransform t);
+extern ImTransform i_transform_inverse(ImTransform t);
+// Pixel (x,y) of a w x h image ends up at offset + x*xstep + y*ystep in
+// the transformed image, with stride bytes per row.
+extern void i_transform_layout(ImTransform t, unsigned int w, unsigned int h, unsigned int bpp, int stride, ptrdiff_t* offset, ptrdiff_t* xstep, ptrdiff_t* ystep);
+// Copy a w x h strip of pixels out to a transformed layout...
+extern void i_transform_scatter(const uint8_t* strip, size_t strip_stride, uint8_t* dest, ptrdiff_t xstep, ptrdiff_t ystep, unsigned int w, unsigned int h, unsigned int bpp);
+// ...or in from one.
+extern void i_transform_gather(const uint8_t* src, ptrdiff_t xstep, ptrdiff_t ystep, uint8_t* strip, size_t strip_stride, unsigned int w, unsigned int h, unsigned int bpp);
+
+/***********
+ * streaming resampler (resample.c)
+ */
+
+// The pixel format the resampler works in.
+#define I_RESAMPLE_FMT IM_FMT_RGBA16_PREMUL
+
+typedef struct i_resampler i_resampler;
+
+// Returns NULL if out of memory.
+extern i_resampler* i_resampler_new(unsigned int src_w, unsigned int src_h, unsigned int dst_w, unsigned int dst_h, ImFilter filter);
+extern void i_resampler_free(i_resampler* rs);
+// Does the next output row need more source rows pushed in first?
+extern bool i_resampler_need_row(const i_resampler* rs);
+// Push in the next source row (src_w pixels of I_RESAMPLE_FMT).
+extern void i_resampler_push_row(i_resampler* rs, const uint8_t* src);
+// Pull out the next output row (dst_w pixels of I_RESAMPLE_FMT).
+extern void i_resampler_pull_row(i_resampler* rs, uint8_t* dest);
+
 
 // Growable set of key-value string pairs.
 typedef struct kvstore {
@@ -76,6 +112,35 @@ typedef struct im_write {
     unsigned int pal_num_colours;
     uint8_t* pal_data;
 
+    // Animation details - set by im_write_frame_info(), persist between
+    // frames.
+    unsigned int delay_ms;
+    ImDispose disposal;
+    int transparent_index;
+    // Set by im_write_loop_count().
+    int loop_count;
+
+    // Options, set by im_write_set_option().
+    bool optimise_frames;
+    unsigned int quant_colours;
+    ImDither dither;
+    bool global_palette;
+    int lossy;
+    bool rle;
+    ImTransform transform;
+    unsigned int expected_frames;   // 0 = unknown
+    // Holds a strip of transformed rows.
+    uint8_t* tilebuf;
+
+    // Set if the caller is sending truecolour but the backend wants
+    // IM_FMT_INDEX8. The whole frame is collected (as RGBA) in quant_buf,
+    // and quantised once it's complete.
+    bool quantising;
+    uint8_t* quant_buf;
+    // Was the current palette generated by the quantiser (rather than
+    // supplied by the caller)?
+    bool pal_generated;
+
     // Key/Value string pairs to write into image.
     kvstore kv;
 } im_write;
@@ -85,6 +150,10 @@ typedef struct im_write {
 void i_write_init(im_write* writer);
 void i_write_set_internal_fmt(im_write* writer, ImFmt internal_fmt);
 
+// quantise.c
+unsigned int i_quant_make_palette(const uint8_t* rgba, size_t npixels, unsigned int max_colours, uint8_t* pal);
+bool i_quant_map(const uint8_t* rgba, unsigned int w, unsigned int h, const uint8_t* pal, unsigned int ncolours, ImDither dither, uint8_t* dest);
+
 // kv.c
 void i_kvstore_init(kvstore *store);
 void i_kvstore_cleanup(kvstore *store);
@@ -115,6 +184,9 @@ typedef struct im_read {
     int frame_num;
 
     im_imginfo curr;
+    // Set by handlers which fill in curr.changed_*. Otherwise the whole
+    // frame is reported as changed.
+    bool changed_set;
     unsigned int rows_read;
 
     // Internal palette fmt is IM_FMT_RGBA.
@@ -127,18 +199,93 @@ typedef struct im_read {
     uint8_t* rowbuf;
     im_convert_fn row_cvt_fn;
 
+    // Output size set by im_read_set_output_size() (0 = not set). Once
+    // reading starts, it's always the size the caller will get.
+    // If scaling, row_cvt_fn converts into I_RESAMPLE_FMT (in workbuf)
+    // and out_cvt_fn converts the resampler output on to external_fmt.
+    // rows_read still counts source rows, for the handlers' benefit, and
+    // out_rows_read counts the rows returned to the caller.
+    unsigned int out_w;
+    unsigned int out_h;
+    ImFilter out_filter;
+    i_resampler* resampler;
+    uint8_t* workbuf;
+    im_convert_fn out_cvt_fn;
+    unsigned int out_rows_read;
+
+    // Set by im_read_set_transform(). tilebuf holds a strip of rows
+    // waiting to be transformed.
+    ImTransform transform;
+    uint8_t* tilebuf;
+
+    // Options, set by im_read_set_option().
+    bool coalesce;
+
+    // Limits set by im_read_set_limit() (0 = unlimited), and the running
+    // totals they're checked against.
+    uint64_t max_pixels;
+    uint64_t max_frames;
+    uint64_t max_decoded_bytes;
+    uint64_t max_metadata_bytes;
+    uint64_t decoded_bytes;
+    uint64_t metadata_bytes;
+
+    // Optional progressive display callback (see im_read_set_progress_fn()).
+    im_progress_fn progress_fn;
+    void* progress_user;
+    uint8_t* progress_buf;
+
     // Storage for any key-value metadata we need to collect.
     kvstore kv;
 } im_read;
 
 // From im_read.c
 void i_read_init(im_read* rdr);
+void i_read_progress(im_read* rdr, unsigned int pass, unsigned int num_passes, const uint8_t* pixels, int stride);
+// Handlers call these as soon as they've parsed a frame's size (or a
+// chunk of metadata), before allocating or decoding anything for it.
+// bytes_per_pixel can be 0 if the format isn't known yet.
+// Both set IM_ERR_LIMIT and return false if a limit is exceeded.
+bool i_read_check_size(im_read* rdr, unsigned int w, unsigned int h, unsigned int bytes_per_pixel);
+bool i_read_check_metadata(im_read* rdr, size_t nbytes);
+
+// From gif_lzw.c
+#define GIF_LZW_HASH_BITS 13
+#define GIF_LZW_HASH_SIZE (1 << GIF_LZW_HASH_BITS)
+typedef struct gif_lzw {
+    im_out* out;
+    bool err;
+    int min_code_size;
+    int mask;
+    int clear_code;
+    int eof_code;
+    int next_code;
+    int code_size;
+    int prefix;     // code for the string matched so far (-1 = none)
+    // Bits waiting to be written out, and the current sub-block
+    // (block[0] is the length byte).
+    uint32_t bitbuf;
+    int nbits;
+    int block_len;
+    uint8_t block[256];
+    // Dictionary - hash of (prefix << 8) | pixel.
+    uint32_t hash_keys[GIF_LZW_HASH_SIZE];
+    uint16_t hash_codes[GIF_LZW_HASH_SIZE];
+    // For lossy mode, substitute colours for each palette entry.
+    bool lossy;
+    uint16_t near_count[256];
+    uint8_t near[256][256];
+} gif_lzw;
+void i_gif_lzw_start(gif_lzw* lzw, im_out* out, int min_code_size, int lossy, const uint8_t* pal, unsigned int ncolours, int trans);
+void i_gif_lzw_encode(gif_lzw* lzw, const uint8_t* pixels, size_t n);
+bool i_gif_lzw_finish(gif_lzw* lzw);
 
 // From gif_read.c
 //extern im_read* i_new_gif_reader(im_in * in, ImErr *err);
 
 // From generic_read.c
-im_read* i_new_generic_reader(im_img* (*load_single)(im_in *, kvstore *kv, ImErr *), i_read_handler* handler, im_in* in, ImErr* err );
+// load_single reads from rdr->in, setting rdr->err upon failure.
+im_read* i_new_generic_reader(im_img* (*load_single)(im_read *rdr), i_read_handler* handler, im_in* in, ImErr* err );
 bool i_generic_read_img(im_read* rdr);
 void i_generic_read_rows(im_read *rdr, unsigned int num_rows, void* buf, int stride);
 void i_generic_read_finish(im_read* rdr);
@@ -150,12 +297,31 @@ extern i_read_handler i_bmp_read_handler;
 extern i_read_handler i_jpeg_read_handler;
 extern i_read_handler i_pcx_read_handler;
 extern i_read_handler i_targa_read_handler;
+extern i_read_handler i_iff_read_handler;
 
 // From im.c
 extern void* imalloc(size_t size);
 extern void* irealloc(void *ptr, size_t size);
 extern void ifree(void* ptr);
 
+// Multiply sizes for an allocation. Returns false if the result won't fit
+// in a size_t.
+static inline bool i_size_mul(size_t a, size_t b, size_t* out)
+{
+    if (b != 0 && a > SIZE_MAX / b) {
+        return false;
+    }
+    *out = a * b;
+    return true;
+}
+
+// Same, for w x h pixels of bpp bytes each.
+static inline bool i_size_img(size_t w, size_t h, size_t bpp, size_t* out)
+{
+    size_t row;
+    return i_size_mul(w, bpp, &row) && i_size_mul(row, h, out);
+}
+
 // From util.c
 extern int istricmp(const char* a, const char* b);
 extern bool is_path_sep(char c);
@@ -166,7 +332,7 @@ static inline uint32_t decode_u32le(uint8_t** cursor)
 {
     uint8_t* p = *cursor;
     *cursor += 4;
-    return (p[3]<<24) | (p[2]<<16) | (p[1]<<8) | p[0];
+    return ((uint32_t)p[3]<<24) | (p[2]<<16) | (p[1]<<8) | p[0];
 }
 
 static inline uint16_t decode_u16le(uint8_t** cursor) {
@@ -181,6 +347,22 @@ static inline int32_t decode_s32le(uint8_t** cursor)
 static inline int16_t decode_s16le(uint8_t** cursor)
     { return (int16_t)decode_u16le(cursor); } 
 
+static inline uint32_t decode_u32be(uint8_t** cursor)
+{
+    uint8_t* p = *cursor;
+    *cursor += 4;
+    return ((uint32_t)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+static inline uint16_t decode_u16be(uint8_t** cursor) {
+    uint8_t* p = *cursor;
+    *cursor += 2;
+    return (p[0]<<8) | p[1];
+}
+
+static inline int16_t decode_s16be(uint8_t** cursor)
+    { return (int16_t)decode_u16be(cursor); }
+
 
 static inline void encode_u32le(uint8_t** cursor, uint32_t val)
 {
@@ -206,6 +388,30 @@ static inline void encode_s32le(uint8_t** cursor, int32_t val)
 static inline void encode_s16le(uint8_t** cursor, int16_t val)
     { encode_u16le(cursor, (int16_t)val); }
 
+static inline void encode_u32be(uint8_t** cursor, uint32_t val)
+{
+    uint8_t* p = *cursor;
+    *cursor += 4;
+    p[0] = (val >> 24) & 0xff;
+    p[1] = (val >> 16) & 0xff;
+    p[2] = (val >> 8) & 0xff;
+    p[3] = val & 0xff;
+}
+
+static inline void encode_u16be(uint8_t** cursor, uint16_t val)
+{
+    uint8_t* p = *cursor;
+    *cursor += 2;
+    p[0] = (val >> 8) & 0xff;
+    p[1] = val & 0xff;
+}
+
+// For formats storing 16 bit samples in a fixed byte order.
+static inline bool host_is_little_endian(void)
+{
+    const uint16_t one = 1;
+    return *(const uint8_t*)&one == 1;
+}
 
 
 
@@ -0,0 +1,504 @@
+#include "impy.h"
+#include "private.h"
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Colour quantisation, used by the write pipeline to turn truecolour
+// images into paletted ones.
+//
+// If there are few enough distinct colours, they're used as the palette
+// directly. Otherwise, palettes are picked using median-cut on a 15-bit
+// (RGB555) histogram.
+// Pixels which are exactly in the palette map straight to that entry.
+// Others go to the nearest palette entry (via a cache keyed by their real
+// RGB value), with optional ordered or Floyd-Steinberg dithering.
+
+#define HIST_BITS 5
+#define HIST_SIZE (1 << (HIST_BITS * 3))
+#define HIST_IDX(r,g,b) ((((r) >> 3) << 10) | (((g) >> 3) << 5) | ((b) >> 3))
+
+// Alpha values below this are treated as fully transparent.
+#define ALPHA_THRESHOLD 128
+
+// Slots in a colour_set (at least twice the most colours it'll hold).
+#define SET_BITS 10
+#define SET_SIZE (1 << SET_BITS)
+
+// Slots in the nearest-colour cache used by i_quant_map().
+#define CACHE_BITS 16
+#define CACHE_SIZE (1 << CACHE_BITS)
+
+// A small hash set of RGBA colours (see colour_key()), each with a
+// palette index.
+typedef struct colour_set {
+    uint32_t key[SET_SIZE];
+    int16_t idx[SET_SIZE];  // -1 = empty slot
+} colour_set;
+
+typedef struct histogram {
+    uint32_t count[HIST_SIZE];
+    // Sums of the real colour values in each cell, so the palette colours
+    // can use full precision.
+    uint64_t sum[HIST_SIZE][3];
+} histogram;
+
+// A box in RGB555 space (inclusive bounds).
+typedef struct box {
+    uint8_t min[3];
+    uint8_t max[3];
+    uint64_t count;
+} box;
+
+static void shrink_box(const histogram* hist, box* b);
+static bool split_box(const histogram* hist, box* b, box* out);
+static void box_colour(const histogram* hist, const box* b, uint8_t* rgba);
+static int nearest_colour(const uint8_t* pal, unsigned int ncolours, int r, int g, int b);
+static unsigned int exact_palette(const uint8_t* rgba, size_t npixels, unsigned int max_colours, uint8_t* pal);
+
+// Fully-transparent pixels all count as the same colour.
+static inline uint32_t colour_key(const uint8_t* p)
+{
+    if (p[3] == 0) {
+        return 0;
+    }
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline unsigned int hash_key(uint32_t key, int bits)
+    { return (unsigned int)((key * 2654435761u) >> (32 - bits)); }
+
+static void set_init(colour_set* set)
+{
+    memset(set->idx, 0xff, sizeof(set->idx));
+}
+
+// Returns the slot holding key, or the empty slot where it would go.
+static unsigned int set_find(const colour_set* set, uint32_t key)
+{
+    unsigned int slot = hash_key(key, SET_BITS);
+    while (set->idx[slot] >= 0 && set->key[slot] != key) {
+        slot = (slot + 1) & (SET_SIZE - 1);
+    }
+    return slot;
+}
+
+// Pick a palette of up to max_colours colours for the given RGBA pixels.
+// If there are no more than max_colours distinct colours, the palette
+// holds exactly those. Otherwise, if any pixels are transparent, the last
+// entry will be a transparent one.
+// pal must have room for max_colours RGBA entries.
+// Returns the number of colours used (0 upon out-of-memory).
+unsigned int i_quant_make_palette(const uint8_t* rgba, size_t npixels, unsigned int max_colours, uint8_t* pal)
+{
+    histogram* hist;
+    box boxes[256];
+    unsigned int nboxes;
+    unsigned int i;
+    size_t n;
+    bool any_trans = false;
+    uint64_t total = 0;
+
+    assert(max_colours >= 2 && max_colours <= 256);
+
+    nboxes = exact_palette(rgba, npixels, max_colours, pal);
+    if (nboxes > 0) {
+        return nboxes;
+    }
+
+    hist = imalloc(sizeof(histogram));
+    if (!hist) {
+        return 0;
+    }
+    memset(hist, 0, sizeof(histogram));
+
+    for (n = 0; n < npixels; ++n) {
+        const uint8_t* p = rgba + (n * 4);
+        unsigned int idx;
+        if (p[3] < ALPHA_THRESHOLD) {
+            any_trans = true;
+            continue;
+        }
+        idx = HIST_IDX(p[0], p[1], p[2]);
+        ++hist->count[idx];
+        hist->sum[idx][0] += p[0];
+        hist->sum[idx][1] += p[1];
+        hist->sum[idx][2] += p[2];
+        ++total;
+    }
+
+    if (any_trans) {
+        --max_colours;  // Reserve an entry for transparent pixels.
+    }
+
+    nboxes = 0;
+    if (total > 0) {
+        boxes[0].min[0] = boxes[0].min[1] = boxes[0].min[2] = 0;
+        boxes[0].max[0] = boxes[0].max[1] = boxes[0].max[2] = (1 << HIST_BITS) - 1;
+        shrink_box(hist, &boxes[0]);
+        nboxes = 1;
+    }
+
+    // Keep splitting the most populous box until we run out of colours
+    // (or boxes which can be split).
+    while (nboxes < max_colours) {
+        int best = -1;
+        for (i = 0; i < nboxes; ++i) {
+            const box* b = &boxes[i];
+            if (b->min[0] == b->max[0] && b->min[1] == b->max[1] && b->min[2] == b->max[2]) {
+                continue;   // A single cell. Can't split.
+            }
+            if (best < 0 || b->count > boxes[best].count) {
+                best = (int)i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        if (!split_box(hist, &boxes[best], &boxes[nboxes])) {
+            break;
+        }
+        ++nboxes;
+    }
+
+    for (i = 0; i < nboxes; ++i) {
+        box_colour(hist, &boxes[i], pal + (i * 4));
+    }
+    if (any_trans || nboxes == 0) {
+        uint8_t* p = pal + (nboxes * 4);
+        p[0] = p[1] = p[2] = p[3] = 0;
+        ++nboxes;
+    }
+
+    ifree(hist);
+    return nboxes;
+}
+
+
+// If the pixels have no more than max_colours distinct colours, put them
+// in pal and return how many there are. Otherwise returns 0.
+static unsigned int exact_palette(const uint8_t* rgba, size_t npixels, unsigned int max_colours, uint8_t* pal)
+{
+    colour_set set;
+    unsigned int ncolours = 0;
+    uint32_t prev = 0;
+    size_t n;
+
+    set_init(&set);
+    for (n = 0; n < npixels; ++n) {
+        const uint8_t* p = rgba + (n * 4);
+        uint32_t key = colour_key(p);
+        unsigned int slot;
+        if (n > 0 && key == prev) {
+            continue;   // Runs of the same colour are common.
+        }
+        prev = key;
+        slot = set_find(&set, key);
+        if (set.idx[slot] >= 0) {
+            continue;
+        }
+        if (ncolours == max_colours) {
+            return 0;   // Too many.
+        }
+        set.key[slot] = key;
+        set.idx[slot] = (int16_t)ncolours;
+        pal[ncolours * 4 + 0] = (uint8_t)(key >> 24);
+        pal[ncolours * 4 + 1] = (uint8_t)(key >> 16);
+        pal[ncolours * 4 + 2] = (uint8_t)(key >> 8);
+        pal[ncolours * 4 + 3] = (uint8_t)key;
+        ++ncolours;
+    }
+    return ncolours;
+}
+
+
+// Shrink a box to fit the occupied cells within it, and count them.
+static void shrink_box(const histogram* hist, box* b)
+{
+    uint8_t lo[3] = {31, 31, 31};
+    uint8_t hi[3] = {0, 0, 0};
+    uint64_t count = 0;
+    int r, g, bl;
+
+    for (r = b->min[0]; r <= b->max[0]; ++r) {
+        for (g = b->min[1]; g <= b->max[1]; ++g) {
+            for (bl = b->min[2]; bl <= b->max[2]; ++bl) {
+                uint32_t n = hist->count[(r << 10) | (g << 5) | bl];
+                if (n == 0) {
+                    continue;
+                }
+                count += n;
+                if (r < lo[0]) lo[0] = r;
+                if (r > hi[0]) hi[0] = r;
+                if (g < lo[1]) lo[1] = g;
+                if (g > hi[1]) hi[1] = g;
+                if (bl < lo[2]) lo[2] = bl;
+                if (bl > hi[2]) hi[2] = bl;
+            }
+        }
+    }
+    memcpy(b->min, lo, 3);
+    memcpy(b->max, hi, 3);
+    b->count = count;
+}
+
+
+// Split a box at the median of its longest axis. The upper half goes
+// into out.
+static bool split_box(const histogram* hist, box* b, box* out)
+{
+    uint64_t slices[1 << HIST_BITS] = {0};
+    uint64_t acc;
+    int axis = 0;
+    int i, cut;
+    int r, g, bl;
+
+    for (i = 1; i < 3; ++i) {
+        if (b->max[i] - b->min[i] > b->max[axis] - b->min[axis]) {
+            axis = i;
+        }
+    }
+
+    // Population of each slice along the axis.
+    for (r = b->min[0]; r <= b->max[0]; ++r) {
+        for (g = b->min[1]; g <= b->max[1]; ++g) {
+            for (bl = b->min[2]; bl <= b->max[2]; ++bl) {
+                int pos = (axis == 0) ? r : (axis == 1) ? g : bl;
+                slices[pos] += hist->count[(r << 10) | (g << 5) | bl];
+            }
+        }
+    }
+
+    // Find the median, but always leave at least one slice on each side.
+    acc = 0;
+    cut = b->min[axis];
+    for (i = b->min[axis]; i < b->max[axis]; ++i) {
+        acc += slices[i];
+        cut = i;
+        if (acc * 2 >= b->count) {
+            break;
+        }
+    }
+
+    *out = *b;
+    b->max[axis] = (uint8_t)cut;
+    out->min[axis] = (uint8_t)(cut + 1);
+    shrink_box(hist, b);
+    shrink_box(hist, out);
+    return b->count > 0 && out->count > 0;
+}
+
+
+// Average colour of all the pixels in a box.
+static void box_colour(const histogram* hist, const box* b, uint8_t* rgba)
+{
+    uint64_t sum[3] = {0, 0, 0};
+    uint64_t count = 0;
+    int r, g, bl;
+
+    for (r = b->min[0]; r <= b->max[0]; ++r) {
+        for (g = b->min[1]; g <= b->max[1]; ++g) {
+            for (bl = b->min[2]; bl <= b->max[2]; ++bl) {
+                unsigned int idx = (r << 10) | (g << 5) | bl;
+                count += hist->count[idx];
+                sum[0] += hist->sum[idx][0];
+                sum[1] += hist->sum[idx][1];
+                sum[2] += hist->sum[idx][2];
+            }
+        }
+    }
+    if (count == 0) {
+        count = 1;
+    }
+    rgba[0] = (uint8_t)((sum[0] + count / 2) / count);
+    rgba[1] = (uint8_t)((sum[1] + count / 2) / count);
+    rgba[2] = (uint8_t)((sum[2] + count / 2) / count);
+    rgba[3] = 255;
+}
+
+
+// Find the closest opaque palette entry to the given colour.
+static int nearest_colour(const uint8_t* pal, unsigned int ncolours, int r, int g, int b)
+{
+    unsigned int i;
+    int best = 0;
+    int best_dist = 0x7fffffff;
+
+    for (i = 0; i < ncolours; ++i) {
+        const uint8_t* p = pal + (i * 4);
+        int dr, dg, db, dist;
+        if (p[3] == 0) {
+            continue;   // Transparent entries don't count.
+        }
+        dr = r - p[0];
+        dg = g - p[1];
+        db = b - p[2];
+        dist = dr * dr + dg * dg + db * db;
+        if (dist < best_dist) {
+            best_dist = dist;
+            best = (int)i;
+            if (dist == 0) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+
+static inline int clamp255(int v)
+    { return v < 0 ? 0 : (v > 255 ? 255 : v); }
+
+// 4x4 Bayer matrix for ordered dithering.
+static const int bayer4[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5}
+};
+
+// Map RGBA pixels onto a palette (RGBA, ncolours entries), writing out one
+// index byte per pixel.
+// Pixels which exactly match a palette entry use it, undithered.
+// dest may be the same buffer as rgba - each index is written out only
+// after the pixel it overwrites has been consumed.
+// Returns false upon out-of-memory.
+bool i_quant_map(const uint8_t* rgba, unsigned int w, unsigned int h, const uint8_t* pal, unsigned int ncolours, ImDither dither, uint8_t* dest)
+{
+    colour_set* exact;
+    uint32_t* cache_key;    // RGB value | 0x01000000 (0 = empty)
+    uint8_t* cache_idx;
+    int* err_buf = NULL;
+    int* err_cur = NULL;
+    int* err_next = NULL;
+    int trans = -1;
+    unsigned int i, x, y;
+
+    // Use the first fully-transparent palette entry for transparent pixels.
+    for (i = 0; i < ncolours; ++i) {
+        if (pal[i * 4 + 3] == 0) {
+            trans = (int)i;
+            break;
+        }
+    }
+
+    // The palette entry for each exact colour (first one wins).
+    exact = imalloc(sizeof(colour_set));
+    // Nearest palette entry for recently-seen RGB values.
+    cache_key = imalloc(sizeof(uint32_t) * CACHE_SIZE);
+    cache_idx = imalloc(CACHE_SIZE);
+    if (!exact || !cache_key || !cache_idx) {
+        goto nomem;
+    }
+    set_init(exact);
+    for (i = 0; i < ncolours; ++i) {
+        uint32_t key = colour_key(pal + i * 4);
+        unsigned int slot = set_find(exact, key);
+        if (exact->idx[slot] < 0) {
+            exact->key[slot] = key;
+            exact->idx[slot] = (int16_t)i;
+        }
+    }
+    memset(cache_key, 0, sizeof(uint32_t) * CACHE_SIZE);
+
+    if (dither == IM_DITHER_FLOYD_STEINBERG) {
+        // Error terms for the current and next row (with a pixel of slack
+        // at either end).
+        err_buf = imalloc(sizeof(int) * (w + 2) * 3 * 2);
+        if (!err_buf) {
+            goto nomem;
+        }
+        memset(err_buf, 0, sizeof(int) * (w + 2) * 3 * 2);
+        err_cur = err_buf;
+        err_next = err_buf + (w + 2) * 3;
+    }
+
+    for (y = 0; y < h; ++y) {
+        for (x = 0; x < w; ++x) {
+            const uint8_t* src = rgba + ((size_t)y * w + x) * 4;
+            int r = src[0];
+            int g = src[1];
+            int b = src[2];
+            unsigned int slot;
+            uint32_t key;
+            const uint8_t* c;
+            uint8_t out;
+
+            slot = set_find(exact, colour_key(src));
+            if (exact->idx[slot] >= 0) {
+                dest[(size_t)y * w + x] = (uint8_t)exact->idx[slot];
+                continue;
+            }
+            if (src[3] < ALPHA_THRESHOLD && trans >= 0) {
+                dest[(size_t)y * w + x] = (uint8_t)trans;
+                continue;
+            }
+
+            if (dither == IM_DITHER_ORDERED) {
+                // Spread by roughly one RGB555 step.
+                int d = (bayer4[y & 3][x & 3] - 8) / 2;
+                r = clamp255(r + d);
+                g = clamp255(g + d);
+                b = clamp255(b + d);
+            } else if (dither == IM_DITHER_FLOYD_STEINBERG) {
+                int* e = err_cur + (x + 1) * 3;
+                r = clamp255(r + e[0] / 16);
+                g = clamp255(g + e[1] / 16);
+                b = clamp255(b + e[2] / 16);
+            }
+
+            key = ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b | 0x01000000;
+            slot = hash_key(key, CACHE_BITS);
+            if (cache_key[slot] != key) {
+                cache_key[slot] = key;
+                cache_idx[slot] = (uint8_t)nearest_colour(pal, ncolours, r, g, b);
+            }
+            out = cache_idx[slot];
+
+            if (dither == IM_DITHER_FLOYD_STEINBERG) {
+                int er, eg, eb;
+                int* n = err_next + (x + 1) * 3;
+                int* e = err_cur + (x + 1) * 3;
+                c = pal + out * 4;
+                er = r - c[0];
+                eg = g - c[1];
+                eb = b - c[2];
+                // 7/16 right, 3/16 down-left, 5/16 down, 1/16 down-right
+                e[3] += er * 7; e[4] += eg * 7; e[5] += eb * 7;
+                n[-3] += er * 3; n[-2] += eg * 3; n[-1] += eb * 3;
+                n[0] += er * 5; n[1] += eg * 5; n[2] += eb * 5;
+                n[3] += er; n[4] += eg; n[5] += eb;
+            }
+            dest[(size_t)y * w + x] = out;
+        }
+
+        if (dither == IM_DITHER_FLOYD_STEINBERG) {
+            int* tmp = err_cur;
+            err_cur = err_next;
+            err_next = tmp;
+            memset(err_next, 0, sizeof(int) * (w + 2) * 3);
+        }
+    }
+
+    if (err_buf) {
+        ifree(err_buf);
+    }
+    ifree(cache_idx);
+    ifree(cache_key);
+    ifree(exact);
+    return true;
+
+nomem:
+    if (cache_idx) {
+        ifree(cache_idx);
+    }
+    if (cache_key) {
+        ifree(cache_key);
+    }
+    if (exact) {
+        ifree(exact);
+    }
+    return false;
+}
+
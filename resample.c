@@ -0,0 +1,272 @@
+#include "impy.h"
+#include "private.h"
+
+#include <math.h>
+#include <string.h>
+
+// Streaming separable resampler, used by the read pipeline to scale
+// images as they're read (see im_read_set_output_size()).
+//
+// Source rows are pushed in one at a time, top to bottom. Each is scaled
+// horizontally straight away and kept in a ring buffer just big enough
+// to hold the vertical filter window. Output rows are then pulled out by
+// combining the rows in the window. So memory use is proportional to the
+// filter size times the width, rather than to the whole image.
+//
+// Pixels are in IM_FMT_RGBA16_PREMUL (I_RESAMPLE_FMT). Filtering
+// premultiplied colour stops transparent pixels bleeding into their
+// neighbours, and 16 bits keeps the rounding errors down for 8 bit
+// images. The arithmetic is in float, in simple loops the compiler can
+// vectorise.
+
+#define PI 3.14159265358979
+
+// The filter kernels. Each is zero outside [-support, support].
+
+static double filter_box(double x)
+{
+    return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+}
+
+static double filter_bilinear(double x)
+{
+    if (x < 0.0) {
+        x = -x;
+    }
+    return (x < 1.0) ? 1.0 - x : 0.0;
+}
+
+static double sinc(double x)
+{
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x *= PI;
+    return sin(x) / x;
+}
+
+static double filter_lanczos3(double x)
+{
+    if (x > -3.0 && x < 3.0) {
+        return sinc(x) * sinc(x / 3.0);
+    }
+    return 0.0;
+}
+
+static const struct {
+    double (*fn)(double);
+    double support;
+} filters[] = {
+    {filter_box, 0.5},          // IM_FILTER_BOX
+    {filter_bilinear, 1.0},     // IM_FILTER_BILINEAR
+    {filter_lanczos3, 3.0},     // IM_FILTER_LANCZOS3
+};
+
+
+// The weights for scaling one dimension. Output pixel i is made from
+// input pixels start[i] to start[i] + count[i] - 1, using the weights
+// at weights[i * ksize].
+typedef struct coeffs {
+    unsigned int ksize;
+    unsigned int* start;
+    unsigned int* count;
+    float* weights;
+} coeffs;
+
+static void free_coeffs(coeffs* c)
+{
+    ifree(c->start);
+    ifree(c->count);
+    ifree(c->weights);
+}
+
+static bool calc_coeffs(coeffs* c, unsigned int in_size, unsigned int out_size, ImFilter filter)
+{
+    unsigned int i;
+    double (*fn)(double) = filters[filter].fn;
+    double scale = (double)in_size / (double)out_size;
+    // When shrinking, the filter is stretched to cover all the source
+    // pixels.
+    double filter_scale = (scale < 1.0) ? 1.0 : scale;
+    double support = filters[filter].support * filter_scale;
+
+    c->ksize = (unsigned int)ceil(support) * 2 + 1;
+    c->start = imalloc(out_size * sizeof(unsigned int));
+    c->count = imalloc(out_size * sizeof(unsigned int));
+    c->weights = imalloc((size_t)out_size * c->ksize * sizeof(float));
+    if (!c->start || !c->count || !c->weights) {
+        return false;
+    }
+
+    for (i = 0; i < out_size; ++i) {
+        double centre = ((double)i + 0.5) * scale;
+        float* w = c->weights + (size_t)i * c->ksize;
+        double total = 0.0;
+        int lo = (int)(centre - support + 0.5);
+        int hi = (int)(centre + support + 0.5);
+        unsigned int n;
+        unsigned int j;
+
+        if (lo < 0) {
+            lo = 0;
+        }
+        if (hi > (int)in_size) {
+            hi = (int)in_size;
+        }
+        if (hi - lo > (int)c->ksize) {
+            hi = lo + (int)c->ksize;
+        }
+        n = (unsigned int)(hi - lo);
+        for (j = 0; j < n; ++j) {
+            double v = fn(((double)(lo + (int)j) - centre + 0.5) / filter_scale);
+            w[j] = (float)v;
+            total += v;
+        }
+
+        if (total != 0.0) {
+            for (j = 0; j < n; ++j) {
+                w[j] = (float)(w[j] / total);
+            }
+        } else {
+            // Shouldn't happen, but fall back to the nearest pixel.
+            lo = (int)centre;
+            if (lo >= (int)in_size) {
+                lo = (int)in_size - 1;
+            }
+            n = 1;
+            w[0] = 1.0f;
+        }
+        c->start[i] = (unsigned int)lo;
+        c->count[i] = n;
+    }
+    return true;
+}
+
+
+struct i_resampler {
+    unsigned int src_w;
+    unsigned int src_h;
+    unsigned int dst_w;
+    unsigned int dst_h;
+    coeffs horiz;
+    coeffs vert;
+    // Ring buffer of horizontally-scaled rows (vert.ksize rows, each
+    // dst_w*4 floats). Source row y lives in slot y % vert.ksize.
+    float* ring;
+    // Accumulator for the output row being built.
+    float* acc;
+    unsigned int rows_in;
+    unsigned int rows_out;
+};
+
+
+i_resampler* i_resampler_new(unsigned int src_w, unsigned int src_h, unsigned int dst_w, unsigned int dst_h, ImFilter filter)
+{
+    i_resampler* rs;
+    size_t row_floats = (size_t)dst_w * 4;
+
+    rs = imalloc(sizeof(i_resampler));
+    if (!rs) {
+        return NULL;
+    }
+    memset(rs, 0, sizeof(i_resampler));
+    rs->src_w = src_w;
+    rs->src_h = src_h;
+    rs->dst_w = dst_w;
+    rs->dst_h = dst_h;
+
+    if (!calc_coeffs(&rs->horiz, src_w, dst_w, filter) ||
+        !calc_coeffs(&rs->vert, src_h, dst_h, filter)) {
+        i_resampler_free(rs);
+        return NULL;
+    }
+    rs->ring = imalloc(row_floats * rs->vert.ksize * sizeof(float));
+    rs->acc = imalloc(row_floats * sizeof(float));
+    if (!rs->ring || !rs->acc) {
+        i_resampler_free(rs);
+        return NULL;
+    }
+    return rs;
+}
+
+void i_resampler_free(i_resampler* rs)
+{
+    free_coeffs(&rs->horiz);
+    free_coeffs(&rs->vert);
+    ifree(rs->ring);
+    ifree(rs->acc);
+    ifree(rs);
+}
+
+bool i_resampler_need_row(const i_resampler* rs)
+{
+    unsigned int y = rs->rows_out;
+    return rs->rows_in < rs->vert.start[y] + rs->vert.count[y];
+}
+
+void i_resampler_push_row(i_resampler* rs, const uint8_t* src)
+{
+    const uint16_t* in = (const uint16_t*)src;
+    float* out = rs->ring + (size_t)(rs->rows_in % rs->vert.ksize) * rs->dst_w * 4;
+    unsigned int x;
+
+    for (x = 0; x < rs->dst_w; ++x) {
+        const float* w = rs->horiz.weights + (size_t)x * rs->horiz.ksize;
+        const uint16_t* p = in + (size_t)rs->horiz.start[x] * 4;
+        unsigned int n = rs->horiz.count[x];
+        float r = 0.0f, g = 0.0f, b = 0.0f, a = 0.0f;
+        unsigned int j;
+        for (j = 0; j < n; ++j) {
+            r += w[j] * p[0];
+            g += w[j] * p[1];
+            b += w[j] * p[2];
+            a += w[j] * p[3];
+            p += 4;
+        }
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        out[3] = a;
+        out += 4;
+    }
+    rs->rows_in++;
+}
+
+void i_resampler_pull_row(i_resampler* rs, uint8_t* dest)
+{
+    uint16_t* out = (uint16_t*)dest;
+    unsigned int y = rs->rows_out;
+    const float* w = rs->vert.weights + (size_t)y * rs->vert.ksize;
+    unsigned int start = rs->vert.start[y];
+    unsigned int n = rs->vert.count[y];
+    size_t row_floats = (size_t)rs->dst_w * 4;
+    unsigned int x;
+    unsigned int j;
+    size_t i;
+
+    memset(rs->acc, 0, row_floats * sizeof(float));
+    for (j = 0; j < n; ++j) {
+        const float* row = rs->ring + (size_t)((start + j) % rs->vert.ksize) * row_floats;
+        float wj = w[j];
+        for (i = 0; i < row_floats; ++i) {
+            rs->acc[i] += wj * row[i];
+        }
+    }
+
+    // Round and clamp. Lanczos can overshoot, so keep the colour within
+    // the alpha to leave valid premultiplied values.
+    for (x = 0; x < rs->dst_w; ++x) {
+        const float* p = rs->acc + (size_t)x * 4;
+        float a = p[3] + 0.5f;
+        unsigned int c;
+        a = (a < 0.0f) ? 0.0f : (a > 65535.0f) ? 65535.0f : a;
+        for (c = 0; c < 3; ++c) {
+            float v = p[c] + 0.5f;
+            v = (v < 0.0f) ? 0.0f : (v > a) ? a : v;
+            out[c] = (uint16_t)v;
+        }
+        out[3] = (uint16_t)a;
+        out += 4;
+    }
+    rs->rows_out++;
+}
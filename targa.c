@@ -28,15 +28,17 @@
 
 static bool targa_match_cookie(const uint8_t* buf, int nbytes);
 static im_read* targa_read_create(im_in *in, ImErr *err);
-static im_img* iread_targa_image(im_in* in, kvstore * kv, ImErr* err);
+static bool targa_get_img(im_read* rdr);
+static void targa_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride);
+static void targa_read_finish(im_read* rdr);
 
 i_read_handler i_targa_read_handler = {
     IM_FILETYPE_TARGA,
     targa_match_cookie,
     targa_read_create,
-    i_generic_read_img,
-    i_generic_read_rows,
-    i_generic_read_finish
+    targa_get_img,
+    targa_read_rows,
+    targa_read_finish
 };
 
 static bool targa_match_cookie(const uint8_t* buf, int nbytes)
@@ -44,14 +46,9 @@ static bool targa_match_cookie(const uint8_t* buf, int nbytes)
     return false;   // no magic cookie for targa!
 }
 
-static im_read* targa_read_create(im_in *in, ImErr *err)
-{
-    return i_new_generic_reader(iread_targa_image, &i_targa_read_handler, in ,err);
-}
-
 
 /*
- * A TGA loader for the SDL library
+ * Based on the TGA loader for the SDL library
  * Supports: Reading 8, 15, 16, 24 and 32bpp images, with alpha or colourkey,
  *           uncompressed or RLE encoded.
  *
@@ -97,313 +94,545 @@ enum tga_type {
 #define TGA_ORIGIN_LOWER    0x00
 #define TGA_ORIGIN_UPPER    0x20
 
+#define TGA_ATTRIB_MASK     0x0f    /* number of alpha bits */
+
 /* read/write unaligned little-endian 16-bit ints */
 #define LE16(p) ((p)[0] + ((p)[1] << 8))
 #define SETLE16(p, v) ((p)[0] = (v), (p)[1] = (v) >> 8)
 
-/* Load a TGA type image from an im_in */
-static im_img* iread_targa_image( im_in* in, kvstore *kv, ImErr* err )
-{
+// Image data is read in chunks of this size.
+#define TGA_CHUNK_SIZE (64*1024)
+
+typedef struct targa_reader {
+    im_read base;
+
     struct TGAheader hdr;
-    int rle = 0;
-    int alpha = 0;
-    int indexed = 0;
-    int grey = 0;
-    int ncols, w, h;
-    im_img* img = 0;
-    //uint32_t rmask, gmask, bmask, amask;
-    uint8_t *dst;
-    uint8_t *rowStart;
-    int i;
-    int bpp;
-    uint32_t pixel;
-    int count, rep;
-    ImFmt fmt;
+    int w;
+    int h;
+    int bpp;            // bytes per pixel in the file
+    bool rle;
+    bool mirror;        // right-to-left rows?
+    size_t out_bpp;     // bytes per pixel we're delivering
+
+    // Converts a row of file pixels to the output format (NULL if they're
+    // already the same).
+    void (*convert_row)(const uint8_t* src, uint8_t* dest, int w);
+    uint8_t* rowbuf;    // one row of file pixels, if conversion needed
+
+    // buffered input
+    uint8_t* inbuf;
+    size_t inpos;
+    size_t inlen;
+
+    // RLE state. Packets can span rows.
+    int count;          // raw pixels left in current packet
+    int rep;            // repeats left in current packet
+    uint8_t pixel[4];   // the pixel being repeated
+
+    // Bottom-up images are decoded in full up front.
+    im_img* img;
+} targa_reader;
+
+
+static bool read_palette(targa_reader* tr, int ncols);
+static bool tga_read(targa_reader* tr, uint8_t* dest, size_t n);
+static bool decode_rows(targa_reader* tr, unsigned int num_rows, uint8_t* dest, int stride);
+static bool decode_rle_row(targa_reader* tr, uint8_t* dest);
+static void fill_pixels(uint8_t* dest, const uint8_t* pixel, int bpp, int n);
+static void mirror_row(uint8_t* row, int w, size_t bpp);
+static void convert_row_555(const uint8_t* src, uint8_t* dest, int w);
+static void convert_row_1555(const uint8_t* src, uint8_t* dest, int w);
 
-    *err = IM_ERR_NONE;
 
-    if (im_in_read(in, &hdr, sizeof(hdr)) != sizeof(hdr) ) {
-        *err = im_in_eof(in) ? IM_ERR_MALFORMED: IM_ERR_FILE;
-        goto cleanup;
+static im_read* targa_read_create(im_in *in, ImErr *err)
+{
+    targa_reader* tr = imalloc(sizeof(targa_reader));
+    if (!tr) {
+        *err = IM_ERR_NOMEM;
+        return NULL;
     }
+    i_read_init(&tr->base);
+    tr->base.handler = &i_targa_read_handler;
+    tr->base.in = in;
+
+    memset(&tr->hdr, 0, sizeof(tr->hdr));
+    tr->convert_row = NULL;
+    tr->rowbuf = NULL;
+    tr->inbuf = NULL;
+    tr->inpos = 0;
+    tr->inlen = 0;
+    tr->count = 0;
+    tr->rep = 0;
+    tr->img = NULL;
+    return (im_read*)tr;
+}
+
 
-    ncols = LE16(hdr.cmap_len);
-    switch(hdr.type) {
+static bool targa_get_img(im_read* rdr)
+{
+    targa_reader* tr = (targa_reader*)rdr;
+    struct TGAheader* hdr = &tr->hdr;
+    im_imginfo* info = &rdr->curr;
+    im_in* in = rdr->in;
+    bool indexed = false;
+    bool grey = false;
+    int ncols;
+
+    if (rdr->frame_num > 0) {
+        return false;   // Only the one image.
+    }
+
+    if (im_in_read(in, hdr, sizeof(*hdr)) != sizeof(*hdr) ) {
+        rdr->err = im_in_eof(in) ? IM_ERR_MALFORMED: IM_ERR_FILE;
+        return false;
+    }
+
+    ncols = LE16(hdr->cmap_len);
+    tr->rle = false;
+    switch(hdr->type) {
     case TGA_TYPE_RLE_INDEXED:
-        rle = 1;
+        tr->rle = true;
         /* fallthrough */
     case TGA_TYPE_INDEXED:
-        if (!hdr.has_cmap || hdr.pixel_bits != 8 || ncols > 256) {
-            *err = IM_ERR_UNSUPPORTED;
-            goto cleanup;
+        if (!hdr->has_cmap || hdr->pixel_bits != 8) {
+            rdr->err = IM_ERR_UNSUPPORTED;
+            return false;
         }
-        indexed = 1;
+        indexed = true;
         break;
 
     case TGA_TYPE_RLE_RGB:
-        rle = 1;
+        tr->rle = true;
         /* fallthrough */
     case TGA_TYPE_RGB:
-        indexed = 0;
         break;
 
     case TGA_TYPE_RLE_BW:
-        rle = 1;
+        tr->rle = true;
         /* fallthrough */
     case TGA_TYPE_BW:
-        if (hdr.pixel_bits != 8) {
-            *err = IM_ERR_UNSUPPORTED;
-            goto cleanup;
+        if (hdr->pixel_bits != 8) {
+            rdr->err = IM_ERR_UNSUPPORTED;
+            return false;
         }
         /* Treat greyscale as 8bpp indexed images */
-        indexed = grey = 1;
+        indexed = grey = true;
         break;
 
     default:
-        *err = IM_ERR_UNSUPPORTED;
-        goto cleanup;
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
     }
 
-    bpp = (hdr.pixel_bits + 7) >> 3;
-    //rmask = gmask = bmask = amask = 0;
-    switch(hdr.pixel_bits) {
+    tr->bpp = (hdr->pixel_bits + 7) >> 3;
+    tr->convert_row = NULL;
+    switch(hdr->pixel_bits) {
     case 8:
         if (!indexed) {
-            *err = IM_ERR_UNSUPPORTED;
-            goto cleanup;
+            rdr->err = IM_ERR_UNSUPPORTED;
+            return false;
         }
+        info->fmt = IM_FMT_INDEX8;
         break;
-
     case 15:
     case 16:
-        *err = IM_ERR_UNSUPPORTED;
-        goto cleanup;
-        // TODO: Support 15/16 bit formats
-#if 0
-        /* 15 and 16bpp both seem to use 5 bits/plane. The extra alpha bit
-           is ignored for now. */
-        rmask = 0x7c00;
-        gmask = 0x03e0;
-        bmask = 0x001f;
+        /* 15 and 16bpp both use 5 bits/plane. 16bpp may have an alpha bit. */
+        if (indexed) {
+            rdr->err = IM_ERR_UNSUPPORTED;
+            return false;
+        }
+        if (hdr->pixel_bits == 16 && (hdr->flags & TGA_ATTRIB_MASK) == 1) {
+            info->fmt = IM_FMT_RGBA;
+            tr->convert_row = convert_row_1555;
+        } else {
+            info->fmt = IM_FMT_RGB;
+            tr->convert_row = convert_row_555;
+        }
         break;
-#endif
-
-    case 32:
-        alpha = 1;
-        /* fallthrough */
     case 24:
-#if 0
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-        {
-        int s = alpha ? 0 : 8;
-        amask = 0x000000ff >> s;
-        rmask = 0x0000ff00 >> s;
-        gmask = 0x00ff0000 >> s;
-        bmask = 0xff000000 >> s;
-        }
-#else
-        amask = alpha ? 0xff000000 : 0;
-        rmask = 0x00ff0000;
-        gmask = 0x0000ff00;
-        bmask = 0x000000ff;
-#endif
-#endif
+        // Stored as BGR, so no swizzling needed.
+        info->fmt = IM_FMT_BGR;
+        break;
+    case 32:
+        info->fmt = IM_FMT_BGRA;
         break;
-
     default:
-        *err = IM_ERR_UNSUPPORTED;
-        goto cleanup;
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
     }
 
-    if ((hdr.flags & TGA_INTERLEAVE_MASK) != TGA_INTERLEAVE_NONE
-       || hdr.flags & TGA_ORIGIN_RIGHT) {
-        *err = IM_ERR_UNSUPPORTED;
-        goto cleanup;
+    if ((hdr->flags & TGA_INTERLEAVE_MASK) != TGA_INTERLEAVE_NONE) {
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
     }
+    tr->mirror = (hdr->flags & TGA_ORIGIN_RIGHT) != 0;
 
+    tr->w = LE16(hdr->width);
+    tr->h = LE16(hdr->height);
+    if (tr->w == 0 || tr->h == 0) {
+        rdr->err = IM_ERR_MALFORMED;
+        return false;
+    }
+    tr->out_bpp = im_fmt_bytesperpixel(info->fmt);
+    if (!i_read_check_size(rdr, (unsigned int)tr->w, (unsigned int)tr->h, tr->out_bpp)) {
+        return false;
+    }
 
-    //SDL_RWseek(src, hdr.infolen, RW_SEEK_CUR); /* skip info field */
-    im_in_seek(in, hdr.infolen, IM_SEEK_CUR);
+    info->w = tr->w;
+    info->h = tr->h;
+    info->x_offset = 0;
+    info->y_offset = 0;
+    info->pal_num_colours = 0;
 
-    w = LE16(hdr.width);
-    h = LE16(hdr.height);
-    
-    if (indexed) {
-        fmt = IM_FMT_INDEX8;
-    } else if(alpha) {
-        fmt = IM_FMT_RGBA;
-    } else {
-        fmt = IM_FMT_RGB;
-    }
-    img = im_img_new(w, h, 1, fmt);
-    if (!img) {
-        *err = IM_ERR_NOMEM;
-        goto cleanup;
+    /* skip info field */
+    if (im_in_seek(in, hdr->infolen, IM_SEEK_CUR) != 0) {
+        rdr->err = IM_ERR_FILE;
+        return false;
     }
 
-    if (hdr.has_cmap) {
-        int palsiz = ncols * ((hdr.cmap_bits + 7) >> 3);
+    if (hdr->has_cmap) {
+        int palsiz = ncols * ((hdr->cmap_bits + 7) >> 3);
         if (indexed && !grey) {
-            // TODO: read palette!
-            *err = IM_ERR_UNSUPPORTED;
-            goto cleanup;
-#if 0
-            uint8_t *pal = (uint8_t *)imalloc(palsiz), *p = pal;
-            SDL_Color *colors = img->format->palette->colors;
-            img->format->palette->ncolors = ncols;
-            SDL_RWread(src, pal, palsiz, 1);
-            for(i = 0; i < ncols; i++) {
-                switch(hdr.cmap_bits) {
-                case 15:
-                case 16:
-                    {
-                    uint16_t c = p[0] + (p[1] << 8);
-                    p += 2;
-                    colors[i].r = (c >> 7) & 0xf8;
-                    colors[i].g = (c >> 2) & 0xf8;
-                    colors[i].b = c << 3;
-                    }
-                    break;
-                case 24:
-                case 32:
-                    colors[i].b = *p++;
-                    colors[i].g = *p++;
-                    colors[i].r = *p++;
-                    if (hdr.cmap_bits == 32 && *p++ < 128)
-                    ckey = i;
-                    break;
-                }
+            if (!read_palette(tr, ncols)) {
+                return false;
             }
-            ifree(pal);
-//            if (ckey >= 0)
-//                SDL_SetColorKey(img, SDL_TRUE, ckey);
-#endif                
         } else {
             /* skip unneeded colormap */
-            im_in_seek(in, palsiz, IM_SEEK_CUR);
+            if (im_in_seek(in, palsiz, IM_SEEK_CUR) != 0) {
+                rdr->err = IM_ERR_FILE;
+                return false;
+            }
         }
     }
 
     if (grey) {
-        // TODO
-        *err = IM_ERR_UNSUPPORTED;
-        goto cleanup;
-#if 0
-        SDL_Color *colors = img->format->palette->colors;
-        for(i = 0; i < 256; i++)
-            colors[i].r = colors[i].g = colors[i].b = i;
-        img->format->palette->ncolors = 256;
-#endif
-    }
-
-    /* The RLE decoding code is slightly convoluted since we can't rely on
-       spans not to wrap across scan lines */
-    count = rep = 0;
-    for(i = 0; i < h; i++) {
-        if (hdr.flags & TGA_ORIGIN_UPPER) {
-            rowStart = (uint8_t *)im_img_row(img, i);
-        } else {
-            rowStart = (uint8_t *)im_img_row(img, (h-1)-i);
+        int i;
+        uint8_t* dest;
+        rdr->pal_data = irealloc(rdr->pal_data, 256 * 4);
+        if (!rdr->pal_data) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        dest = rdr->pal_data;
+        for (i = 0; i < 256; ++i) {
+            *dest++ = i;
+            *dest++ = i;
+            *dest++ = i;
+            *dest++ = 255;
+        }
+        info->pal_num_colours = 256;
+    }
+
+    tr->inbuf = irealloc(tr->inbuf, TGA_CHUNK_SIZE);
+    if (!tr->inbuf) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    tr->inpos = 0;
+    tr->inlen = 0;
+    tr->count = 0;
+    tr->rep = 0;
+    if (tr->convert_row) {
+        tr->rowbuf = irealloc(tr->rowbuf, (size_t)tr->w * tr->bpp);
+        if (!tr->rowbuf) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+    }
+
+    if (!(hdr->flags & TGA_ORIGIN_UPPER)) {
+        // Bottom-up. Decode the whole thing now, last row first.
+        tr->img = im_img_new(tr->w, tr->h, 1, info->fmt);
+        if (!tr->img) {
+            rdr->err = IM_ERR_NOMEM;
+            return false;
+        }
+        if (!decode_rows(tr, tr->h, im_img_row(tr->img, tr->h - 1), -(int)tr->img->pitch)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void targa_read_rows(im_read* rdr, unsigned int num_rows, void* buf, int stride)
+{
+    targa_reader* tr = (targa_reader*)rdr;
+    uint8_t* dest = buf;
+
+    if (tr->img) {
+        size_t bytes_per_row = tr->out_bpp * tr->w;
+        unsigned int i;
+        for (i = 0; i < num_rows; ++i) {
+            memcpy(dest, im_img_row(tr->img, rdr->rows_read + i), bytes_per_row);
+            dest += stride;
+        }
+        return;
+    }
+    decode_rows(tr, num_rows, dest, stride);
+}
+
+
+static void targa_read_finish(im_read* rdr)
+{
+    targa_reader* tr = (targa_reader*)rdr;
+    if (tr->rowbuf) {
+        ifree(tr->rowbuf);
+        tr->rowbuf = NULL;
+    }
+    if (tr->inbuf) {
+        ifree(tr->inbuf);
+        tr->inbuf = NULL;
+    }
+    if (tr->img) {
+        im_img_free(tr->img);
+        tr->img = NULL;
+    }
+}
+
+
+// Load the colourmap into the reader's RGBA palette.
+// Entries outside the colour map are left opaque black.
+static bool read_palette(targa_reader* tr, int ncols)
+{
+    im_read* rdr = &tr->base;
+    struct TGAheader* hdr = &tr->hdr;
+    int start = LE16(hdr->cmap_start);
+    int entsize = (hdr->cmap_bits + 7) >> 3;
+    uint8_t raw[256*4];
+    const uint8_t* p = raw;
+    uint8_t* dest;
+    bool any_alpha = false;
+    int i;
+
+    if (start + ncols > 256 || ncols == 0 ||
+        !(hdr->cmap_bits == 15 || hdr->cmap_bits == 16 ||
+          hdr->cmap_bits == 24 || hdr->cmap_bits == 32)) {
+        rdr->err = IM_ERR_UNSUPPORTED;
+        return false;
+    }
+    if (im_in_read(rdr->in, raw, ncols * entsize) != (size_t)(ncols * entsize)) {
+        rdr->err = im_in_eof(rdr->in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+        return false;
+    }
+
+    // Room for all 256 entries, as the pixels can index past the end of
+    // the colour map (extras are opaque black).
+    rdr->pal_data = irealloc(rdr->pal_data, 256 * 4);
+    if (!rdr->pal_data) {
+        rdr->err = IM_ERR_NOMEM;
+        return false;
+    }
+    dest = rdr->pal_data;
+    for (i = 0; i < 256; ++i) {
+        *dest++ = 0;
+        *dest++ = 0;
+        *dest++ = 0;
+        *dest++ = 255;
+    }
+    dest = rdr->pal_data + start * 4;
+    for (i = 0; i < ncols; ++i) {
+        switch(hdr->cmap_bits) {
+        case 15:
+        case 16:
+            convert_row_555(p, dest, 1);
+            dest[3] = 255;
+            p += 2;
+            break;
+        case 24:
+        case 32:
+            dest[2] = *p++;
+            dest[1] = *p++;
+            dest[0] = *p++;
+            dest[3] = 255;
+            if (hdr->cmap_bits == 32) {
+                dest[3] = *p++;
+                any_alpha |= (dest[3] != 0);
+            }
+            break;
         }
-        dst = rowStart;
-
-        if (rle) {
-            int x = 0;
-            for(;;) {
-                uint8_t c;
-
-                if (count) {
-                    int n = count;
-                    if (n > w - x)
-                        n = w - x;
-                    if (im_in_read(in, dst + x * bpp, n * bpp) != n*bpp) {
-                        *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-                        goto cleanup;
-                    }
-                    count -= n;
-                    x += n;
-                    if (x == w)
-                        break;
-                } else if (rep) {
-                    int n = rep;
-                    if (n > w - x)
-                        n = w - x;
-                    rep -= n;
-                    while (n--) {
-                        memcpy(dst + x * bpp, &pixel, bpp);
-                        x++;
-                    }
-                    if (x == w)
-                        break;
-                }
-
-                if (im_in_read(in, &c, 1) != 1) {
-                    *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-                    goto cleanup;
-                }
-                if (c & 0x80) {
-                    if (im_in_read(in, &pixel, bpp) != bpp) {
-                        *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-                        goto cleanup;
-                    }
-                    rep = (c & 0x7f) + 1;
-                } else {
-                    count = c + 1;
-                }
+        dest += 4;
+    }
+    if (hdr->cmap_bits == 32 && !any_alpha) {
+        // Alpha all zero - assume it's unused rather than invisible.
+        for (i = start; i < start + ncols; ++i) {
+            rdr->pal_data[i * 4 + 3] = 255;
+        }
+    }
+    rdr->curr.pal_num_colours = start + ncols;
+    return true;
+}
+
+
+// Read n bytes of image data, via inbuf.
+static bool tga_read(targa_reader* tr, uint8_t* dest, size_t n)
+{
+    while (n > 0) {
+        size_t avail = tr->inlen - tr->inpos;
+        if (avail == 0) {
+            tr->inpos = 0;
+            tr->inlen = im_in_read(tr->base.in, tr->inbuf, TGA_CHUNK_SIZE);
+            if (tr->inlen == 0) {
+                tr->base.err = im_in_eof(tr->base.in) ? IM_ERR_MALFORMED : IM_ERR_FILE;
+                return false;
+            }
+            avail = tr->inlen;
+        }
+        if (avail > n) {
+            avail = n;
+        }
+        memcpy(dest, tr->inbuf + tr->inpos, avail);
+        tr->inpos += avail;
+        dest += avail;
+        n -= avail;
+    }
+    return true;
+}
+
+
+// Decode the next num_rows rows (in file order) into dest.
+// stride can be negative, for bottom-up images.
+static bool decode_rows(targa_reader* tr, unsigned int num_rows, uint8_t* dest, int stride)
+{
+    unsigned int i;
+    for (i = 0; i < num_rows; ++i) {
+        uint8_t* raw = tr->convert_row ? tr->rowbuf : dest;
+        if (tr->rle) {
+            if (!decode_rle_row(tr, raw)) {
+                return false;
             }
         } else {
-            if (im_in_read(in, dst, w*bpp) != w*bpp) {
-                *err = im_in_eof(in) ? IM_ERR_MALFORMED:IM_ERR_FILE;
-                goto cleanup;
+            if (!tga_read(tr, raw, (size_t)tr->w * tr->bpp)) {
+                return false;
             }
         }
+        if (tr->convert_row) {
+            tr->convert_row(raw, dest, tr->w);
+        }
+        if (tr->mirror) {
+            mirror_row(dest, tr->w, tr->out_bpp);
+        }
+        dest += stride;
+    }
+    return true;
+}
 
-        if (bpp == 3) {
-            // convert BGR -> RGB
-            uint8_t* p = rowStart;
-            int x;
-            for (x = 0; x < w; ++x) {
-                uint8_t b = p[0];
-                p[0] = p[2];
-                p[2] = b;
-                p += 3;
+
+/* The RLE decoding code is slightly convoluted since we can't rely on
+   spans not to wrap across scan lines */
+static bool decode_rle_row(targa_reader* tr, uint8_t* dest)
+{
+    int bpp = tr->bpp;
+    int w = tr->w;
+    int x = 0;
+
+    while (x < w) {
+        uint8_t c;
+        if (tr->count) {
+            int n = tr->count;
+            if (n > w - x)
+                n = w - x;
+            if (!tga_read(tr, dest + x * bpp, n * bpp)) {
+                return false;
             }
+            tr->count -= n;
+            x += n;
+            continue;
         }
-        if (bpp == 4) {
-            // convert BGRA -> RGBA
-            uint8_t* p = rowStart;
-            int x;
-            for (x = 0; x < w; ++x) {
-                uint8_t b = p[0];
-                p[0] = p[2];
-                p[2] = b;
-                p += 4;
-            }
+        if (tr->rep) {
+            int n = tr->rep;
+            if (n > w - x)
+                n = w - x;
+            fill_pixels(dest + x * bpp, tr->pixel, bpp, n);
+            tr->rep -= n;
+            x += n;
+            continue;
         }
 
-#if 0
-        // TODO: support expanding out 15/16 bit formats?
-#if SDL_BYTEORDER == SDL_LIL_ENDIAN
-        if (bpp == 2) {
-            /* swap byte order */
-            int x;
-            uint16_t *p = (uint16_t *)dst;
-            for(x = 0; x < w; x++)
-            p[x] = SDL_Swap16(p[x]);
+        if (!tga_read(tr, &c, 1)) {
+            return false;
+        }
+        if (c & 0x80) {
+            if (!tga_read(tr, tr->pixel, bpp)) {
+                return false;
+            }
+            tr->rep = (c & 0x7f) + 1;
+        } else {
+            tr->count = c + 1;
         }
-#endif
-#endif
     }
+    return true;
+}
 
-cleanup:
-    if (*err != IM_ERR_NONE) {
-        if (img) {
-            im_img_free(img);
-            img = NULL;
-        }
+
+// Write out n copies of a pixel.
+// Multi-byte pixels are doubled up with memcpy rather than written one
+// at a time.
+static void fill_pixels(uint8_t* dest, const uint8_t* pixel, int bpp, int n)
+{
+    size_t total = (size_t)n * bpp;
+    size_t done;
+
+    if (bpp == 1) {
+        memset(dest, pixel[0], n);
+        return;
     }
+    memcpy(dest, pixel, bpp);
+    done = bpp;
+    while (done < total) {
+        size_t chunk = (done < total - done) ? done : total - done;
+        memcpy(dest + done, dest, chunk);
+        done += chunk;
+    }
+}
+
+
+// Reverse the order of pixels in a row.
+static void mirror_row(uint8_t* row, int w, size_t bpp)
+{
+    uint8_t* l = row;
+    uint8_t* r = row + (w - 1) * bpp;
+    uint8_t tmp[4];
+    while (l < r) {
+        memcpy(tmp, l, bpp);
+        memcpy(l, r, bpp);
+        memcpy(r, tmp, bpp);
+        l += bpp;
+        r -= bpp;
+    }
+}
 
-    return img;
+
+// 5 bits to 8.
+static inline uint8_t expand5(unsigned int v)
+    { return (uint8_t)((v << 3) | (v >> 2)); }
+
+// 15/16 bit (x-R-G-B 1-5-5-5, little endian) to RGB.
+static void convert_row_555(const uint8_t* src, uint8_t* dest, int w)
+{
+    int x;
+    for (x = 0; x < w; ++x) {
+        unsigned int c = src[0] | (src[1] << 8);
+        dest[0] = expand5((c >> 10) & 0x1f);
+        dest[1] = expand5((c >> 5) & 0x1f);
+        dest[2] = expand5(c & 0x1f);
+        src += 2;
+        dest += 3;
+    }
 }
 
+// 16 bit (A-R-G-B 1-5-5-5, little endian) to RGBA.
+static void convert_row_1555(const uint8_t* src, uint8_t* dest, int w)
+{
+    int x;
+    for (x = 0; x < w; ++x) {
+        unsigned int c = src[0] | (src[1] << 8);
+        dest[0] = expand5((c >> 10) & 0x1f);
+        dest[1] = expand5((c >> 5) & 0x1f);
+        dest[2] = expand5(c & 0x1f);
+        dest[3] = (c & 0x8000) ? 255 : 0;
+        src += 2;
+        dest += 4;
+    }
+}
 
@@ -0,0 +1,309 @@
+#include "impy.h"
+#include "private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+// Targa writer.
+//
+// Paletted images are written as 8 bit colourmapped, truecolour as 24 bit
+// BGR or 32 bit BGRA. Rows are written top-down (upper-left origin) as
+// they arrive, optionally RLE-compressed (IM_WRITE_OPT_RLE).
+
+im_write* itarga_new_writer(im_out* out, ImErr *err);
+
+static void itarga_pre_img(im_write* wr);
+static void itarga_emit_header(im_write* wr);
+static void itarga_emit_rows(im_write *wr, unsigned int num_rows, const void *data, int stride);
+static void itarga_post_img(im_write* wr);
+static void itarga_finish(im_write* wr);
+
+static struct write_handler targa_write_handler = {
+    IM_FILETYPE_TARGA,
+    itarga_pre_img,
+    itarga_emit_header,
+    itarga_emit_rows,
+    itarga_post_img,
+    itarga_finish
+};
+
+typedef struct itarga_writer {
+    im_write writer;
+
+    int bpp;            // bytes per pixel: 1, 3 or 4
+    uint8_t* encbuf;    // one RLE-encoded row
+} itarga_writer;
+
+#define TGA_HEADER_SIZE 18
+
+#define TGA_TYPE_INDEXED 1
+#define TGA_TYPE_RGB 2
+#define TGA_TYPE_RLE_INDEXED 9
+#define TGA_TYPE_RLE_RGB 10
+
+#define TGA_ORIGIN_UPPER 0x20
+
+
+static size_t encode_row(const uint8_t* src, int w, int bpp, uint8_t* dest);
+
+
+im_write* itarga_new_writer(im_out* out, ImErr* err)
+{
+    itarga_writer* tgawriter = imalloc(sizeof(itarga_writer));
+    if (!tgawriter) {
+        *err = IM_ERR_NOMEM;
+        return NULL;
+    }
+    im_write* writer = (im_write*)tgawriter;
+
+    i_write_init(writer);
+
+    writer->handler = &targa_write_handler;
+    writer->out = out;
+
+    tgawriter->bpp = 0;
+    tgawriter->encbuf = NULL;
+
+    *err = IM_ERR_NONE;
+    return writer;
+}
+
+
+static void itarga_pre_img(im_write* wr)
+{
+    itarga_writer* tw = (itarga_writer*)wr;
+
+    if (wr->num_frames > 0) {
+        wr->err = IM_ERR_ANIM_UNSUPPORTED;
+        return;
+    }
+    if (wr->w > 65535 || wr->h > 65535) {
+        wr->err = IM_ERR_UNSUPPORTED;
+        return;
+    }
+
+    // work out which format we'll be writing (and also which format
+    // we'd like to receive from im_write_rows()).
+    // Targa stores pixels as BGR(A), so ask for them that way.
+    if (im_fmt_is_indexed(wr->fmt) ||
+        (im_fmt_has_rgb(wr->fmt) && wr->quant_colours > 0)) {
+        tw->bpp = 1;
+        i_write_set_internal_fmt(wr, IM_FMT_INDEX8);
+    } else if (im_fmt_has_rgb(wr->fmt)) {
+        if (im_fmt_has_alpha(wr->fmt)) {
+            tw->bpp = 4;
+            i_write_set_internal_fmt(wr, IM_FMT_BGRA);
+        } else {
+            tw->bpp = 3;
+            i_write_set_internal_fmt(wr, IM_FMT_BGR);
+        }
+    } else {
+        wr->err = IM_ERR_UNSUPPORTED;
+        return;
+    }
+}
+
+
+static void itarga_emit_header(im_write* wr)
+{
+    itarga_writer* tw = (itarga_writer*)wr;
+    uint8_t buf[TGA_HEADER_SIZE] = {0};
+    uint8_t* p = buf;
+    int cmap_bits = 0;
+    unsigned int i;
+
+    if (tw->bpp == 1) {
+        if (wr->pal_num_colours == 0) {
+            wr->err = IM_ERR_NO_PALETTE;
+            return;
+        }
+        if (wr->pal_num_colours > 256) {
+            wr->err = IM_ERR_PALETTE_TOO_BIG;
+            return;
+        }
+        // Only need alpha in the colourmap if it's actually used.
+        cmap_bits = 24;
+        for (i = 0; i < wr->pal_num_colours; ++i) {
+            if (wr->pal_data[i * 4 + 3] != 255) {
+                cmap_bits = 32;
+                break;
+            }
+        }
+    }
+
+    if (wr->rle) {
+        // Worst case, a 1-byte header for every 128 pixels (see encode_row()).
+        tw->encbuf = irealloc(tw->encbuf, (size_t)wr->w * tw->bpp + wr->w / 128 + 2);
+        if (!tw->encbuf) {
+            wr->err = IM_ERR_NOMEM;
+            return;
+        }
+    }
+
+    *p++ = 0;       // no image ID
+    *p++ = (tw->bpp == 1) ? 1 : 0;  // colourmap present?
+    if (tw->bpp == 1) {
+        *p++ = wr->rle ? TGA_TYPE_RLE_INDEXED : TGA_TYPE_INDEXED;
+    } else {
+        *p++ = wr->rle ? TGA_TYPE_RLE_RGB : TGA_TYPE_RGB;
+    }
+    encode_u16le(&p, 0);    // first colourmap entry
+    encode_u16le(&p, (tw->bpp == 1) ? wr->pal_num_colours : 0);
+    *p++ = (uint8_t)cmap_bits;
+    encode_u16le(&p, 0);    // x origin
+    encode_u16le(&p, 0);    // y origin
+    encode_u16le(&p, wr->w);
+    encode_u16le(&p, wr->h);
+    *p++ = (uint8_t)(tw->bpp * 8);
+    // Top-down, and number of alpha bits.
+    *p++ = TGA_ORIGIN_UPPER | ((tw->bpp == 4) ? 8 : 0);
+
+    if (im_out_write(wr->out, buf, TGA_HEADER_SIZE) != TGA_HEADER_SIZE) {
+        wr->err = IM_ERR_FILE;
+        return;
+    }
+
+    // Colourmap, as BGR(A).
+    if (tw->bpp == 1) {
+        uint8_t cmap[256 * 4];
+        const uint8_t* src = wr->pal_data;
+        size_t n;
+        p = cmap;
+        for (i = 0; i < wr->pal_num_colours; ++i) {
+            *p++ = src[2];
+            *p++ = src[1];
+            *p++ = src[0];
+            if (cmap_bits == 32) {
+                *p++ = src[3];
+            }
+            src += 4;
+        }
+        n = p - cmap;
+        if (im_out_write(wr->out, cmap, n) != n) {
+            wr->err = IM_ERR_FILE;
+            return;
+        }
+    }
+}
+
+
+static void itarga_emit_rows(im_write *wr, unsigned int num_rows, const void *data, int stride)
+{
+    itarga_writer* tw = (itarga_writer*)wr;
+    size_t bytes_per_row = (size_t)wr->w * tw->bpp;
+    unsigned int i;
+
+    if (!wr->rle && (stride == (int)bytes_per_row || num_rows == 1)) {
+        // Can dump it all out in one go.
+        size_t cnt = bytes_per_row * num_rows;
+        if (im_out_write(wr->out, data, cnt) != cnt) {
+            wr->err = IM_ERR_FILE;
+        }
+        return;
+    }
+
+    for (i = 0; i < num_rows; ++i) {
+        const uint8_t* src = data;
+        size_t cnt = bytes_per_row;
+        if (wr->rle) {
+            // Packets don't span rows. It's allowed, but some readers
+            // don't like it.
+            cnt = encode_row(data, wr->w, tw->bpp, tw->encbuf);
+            src = tw->encbuf;
+        }
+        if (im_out_write(wr->out, src, cnt) != cnt) {
+            wr->err = IM_ERR_FILE;
+            return;
+        }
+        data += stride;
+    }
+}
+
+
+// Write the TGA 2.0 footer (no extension area or developer directory).
+static void itarga_post_img(im_write* wr)
+{
+    static const uint8_t footer[26] = {
+        0,0,0,0,    // extension area offset
+        0,0,0,0,    // developer directory offset
+        'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.',0
+    };
+    if (im_out_write(wr->out, footer, sizeof(footer)) != sizeof(footer)) {
+        wr->err = IM_ERR_FILE;
+    }
+}
+
+
+static void itarga_finish(im_write* wr)
+{
+    itarga_writer* tw = (itarga_writer*)wr;
+    if (tw->encbuf) {
+        ifree(tw->encbuf);
+        tw->encbuf = NULL;
+    }
+}
+
+
+static inline bool same_pixel(const uint8_t* a, const uint8_t* b, int bpp)
+{
+    switch (bpp) {
+        case 1: return a[0] == b[0];
+        case 3: return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+        case 4: return memcmp(a, b, 4) == 0;
+        default: return memcmp(a, b, bpp) == 0;
+    }
+}
+
+
+// RLE-encode a row of w pixels. Returns the number of bytes written.
+// Runs of identical pixels become repeat packets, everything else goes
+// into raw packets. Packets hold up to 128 pixels.
+// A raw packet is only cut short for a run which saves at least the byte
+// needed to start the next raw packet: 2 pixels, or 3 for 8 bit pixels.
+// So the output is never more than one byte per 128 pixels (plus one)
+// bigger than the input.
+static size_t encode_row(const uint8_t* src, int w, int bpp, uint8_t* dest)
+{
+    uint8_t* out = dest;
+    int minrun = (bpp == 1) ? 3 : 2;
+    int x = 0;
+
+    while (x < w) {
+        const uint8_t* p = src + x * bpp;
+        int run = 1;
+        int raw;
+
+        while (x + run < w && run < 128 && same_pixel(p, p + run * bpp, bpp)) {
+            ++run;
+        }
+        if (run >= 2) {
+            *out++ = (uint8_t)(0x80 | (run - 1));
+            memcpy(out, p, bpp);
+            out += bpp;
+            x += run;
+            continue;
+        }
+
+        // Raw packet - up to the start of the next worthwhile run.
+        raw = 1;
+        while (x + raw < w && raw < 128) {
+            const uint8_t* q = p + raw * bpp;
+            int k = 1;
+            while (k < minrun && x + raw + k < w && same_pixel(q, q + k * bpp, bpp)) {
+                ++k;
+            }
+            if (k >= minrun) {
+                break;
+            }
+            ++raw;
+        }
+        *out++ = (uint8_t)(raw - 1);
+        memcpy(out, p, raw * bpp);
+        out += raw * bpp;
+        x += raw;
+    }
+    return out - dest;
+}
+
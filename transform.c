@@ -0,0 +1,157 @@
+#include "impy.h"
+#include "private.h"
+
+#include <string.h>
+
+// Flips and rotations (see ImTransform), used by the read and write
+// pipelines.
+//
+// Every transform is described as a layout: pixel (x,y) of the
+// untransformed image lands at offset + x*xstep + y*ystep in the
+// transformed one. When xstep is just the pixel size, rows stay intact
+// and the whole thing is a stride trick. Otherwise pixels are copied a
+// strip of rows at a time, in TILE x TILE blocks, so both sides of the
+// copy stay in cache even when one of them is walking down columns.
+
+#define TILE I_TRANSFORM_TILE
+
+#if defined(__GNUC__)
+#define XFORM_INLINE inline __attribute__((always_inline))
+#else
+#define XFORM_INLINE inline
+#endif
+
+
+bool i_transform_swaps_axes(ImTransform t)
+{
+    return t == IM_TRANSFORM_TRANSPOSE || t == IM_TRANSFORM_ROTATE_90 ||
+        t == IM_TRANSFORM_TRANSVERSE || t == IM_TRANSFORM_ROTATE_270;
+}
+
+ImTransform i_transform_inverse(ImTransform t)
+{
+    // All the others undo themselves.
+    if (t == IM_TRANSFORM_ROTATE_90) {
+        return IM_TRANSFORM_ROTATE_270;
+    }
+    if (t == IM_TRANSFORM_ROTATE_270) {
+        return IM_TRANSFORM_ROTATE_90;
+    }
+    return t;
+}
+
+void i_transform_layout(ImTransform t, unsigned int w, unsigned int h, unsigned int bpp, int stride, ptrdiff_t* offset, ptrdiff_t* xstep, ptrdiff_t* ystep)
+{
+    ptrdiff_t last_x = (ptrdiff_t)w - 1;
+    ptrdiff_t last_y = (ptrdiff_t)h - 1;
+    ptrdiff_t px = (ptrdiff_t)bpp;
+    ptrdiff_t row = (ptrdiff_t)stride;
+
+    switch (t) {
+        case IM_TRANSFORM_FLIP_H:
+            *offset = last_x * px;
+            *xstep = -px;
+            *ystep = row;
+            break;
+        case IM_TRANSFORM_ROTATE_180:
+            *offset = last_x * px + last_y * row;
+            *xstep = -px;
+            *ystep = -row;
+            break;
+        case IM_TRANSFORM_FLIP_V:
+            *offset = last_y * row;
+            *xstep = px;
+            *ystep = -row;
+            break;
+        case IM_TRANSFORM_TRANSPOSE:
+            *offset = 0;
+            *xstep = row;
+            *ystep = px;
+            break;
+        case IM_TRANSFORM_ROTATE_90:
+            *offset = last_y * px;
+            *xstep = row;
+            *ystep = -px;
+            break;
+        case IM_TRANSFORM_TRANSVERSE:
+            *offset = last_y * px + last_x * row;
+            *xstep = -row;
+            *ystep = -px;
+            break;
+        case IM_TRANSFORM_ROTATE_270:
+            *offset = last_x * row;
+            *xstep = -row;
+            *ystep = px;
+            break;
+        case IM_TRANSFORM_NONE:
+        default:
+            *offset = 0;
+            *xstep = px;
+            *ystep = row;
+            break;
+    }
+}
+
+
+// Copy pixels between a plain w x h strip and a transformed layout,
+// in either direction.
+static XFORM_INLINE void xform(uint8_t* strip, size_t strip_stride, uint8_t* other, ptrdiff_t xstep, ptrdiff_t ystep, unsigned int w, unsigned int h, unsigned int bpp, bool gather)
+{
+    unsigned int x0, y0, x, y;
+
+    for (y0 = 0; y0 < h; y0 += TILE) {
+        unsigned int y1 = (h - y0 < TILE) ? h : y0 + TILE;
+        for (x0 = 0; x0 < w; x0 += TILE) {
+            unsigned int x1 = (w - x0 < TILE) ? w : x0 + TILE;
+            for (y = y0; y < y1; ++y) {
+                uint8_t* s = strip + y * strip_stride + (size_t)x0 * bpp;
+                uint8_t* o = other + (ptrdiff_t)x0 * xstep + (ptrdiff_t)y * ystep;
+                for (x = x0; x < x1; ++x) {
+                    if (gather) {
+                        memcpy(s, o, bpp);
+                    } else {
+                        memcpy(o, s, bpp);
+                    }
+                    s += bpp;
+                    o += xstep;
+                }
+            }
+        }
+    }
+}
+
+// Versions with the pixel size fixed, so the memcpy()s become plain
+// loads and stores.
+#define DEFINE_XFORM(N) \
+    static void xform##N(uint8_t* strip, size_t strip_stride, uint8_t* other, ptrdiff_t xstep, ptrdiff_t ystep, unsigned int w, unsigned int h, bool gather) \
+        { xform(strip, strip_stride, other, xstep, ystep, w, h, N, gather); }
+
+DEFINE_XFORM(1)
+DEFINE_XFORM(2)
+DEFINE_XFORM(3)
+DEFINE_XFORM(4)
+DEFINE_XFORM(6)
+DEFINE_XFORM(8)
+
+static void xform_any(uint8_t* strip, size_t strip_stride, uint8_t* other, ptrdiff_t xstep, ptrdiff_t ystep, unsigned int w, unsigned int h, unsigned int bpp, bool gather)
+{
+    switch (bpp) {
+        case 1: xform1(strip, strip_stride, other, xstep, ystep, w, h, gather); break;
+        case 2: xform2(strip, strip_stride, other, xstep, ystep, w, h, gather); break;
+        case 3: xform3(strip, strip_stride, other, xstep, ystep, w, h, gather); break;
+        case 4: xform4(strip, strip_stride, other, xstep, ystep, w, h, gather); break;
+        case 6: xform6(strip, strip_stride, other, xstep, ystep, w, h, gather); break;
+        case 8: xform8(strip, strip_stride, other, xstep, ystep, w, h, gather); break;
+        default: xform(strip, strip_stride, other, xstep, ystep, w, h, bpp, gather); break;
+    }
+}
+
+void i_transform_scatter(const uint8_t* strip, size_t strip_stride, uint8_t* dest, ptrdiff_t xstep, ptrdiff_t ystep, unsigned int w, unsigned int h, unsigned int bpp)
+{
+    xform_any((uint8_t*)strip, strip_stride, dest, xstep, ystep, w, h, bpp, false);
+}
+
+void i_transform_gather(const uint8_t* src, ptrdiff_t xstep, ptrdiff_t ystep, uint8_t* strip, size_t strip_stride, unsigned int w, unsigned int h, unsigned int bpp)
+{
+    xform_any(strip, strip_stride, (uint8_t*)src, xstep, ystep, w, h, bpp, true);
+}